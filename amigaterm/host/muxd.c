@@ -0,0 +1,797 @@
+/*
+ * muxd - the host end of amigaterm's Mux Mode.
+ *
+ *   muxd [-b baud] [-d dir] (-l device | -p) [file ...]
+ *
+ * Speaks the framing in ../src/amigaterm_mux.c over a serial port
+ * (-l) or a pseudo terminal (-p), which it makes and prints the
+ * name of, for an emulator's serial port (or a test) to connect to.
+ *
+ * Lines typed on stdin go out on the terminal channel, and what the
+ * Amiga sends on it comes out on stdout.  Files the Amiga sends with
+ * Mux Send are written into dir (the current directory if not
+ * given.)  The files named on the command line are sent to the
+ * Amiga, one after another, once it says hello.
+ *
+ * muxd keeps going until stdin ends and the files have all gone.
+ */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "amigaterm_crc.h"
+#include "amigaterm_mux.h"
+
+/* These have to match amigaterm_mux.c */
+#define MUX_FEND 0x7e
+#define MUX_FESC 0x7d
+#define MUX_FXOR 0x20
+
+#define MUX_T_DATA 0
+#define MUX_T_EOF 1
+#define MUX_T_ACK 2
+#define MUX_T_NAK 3
+
+#define MUX_HDR_LEN 5
+#define MUX_MAX_PAYLOAD 128
+#define MUX_WINDOW 4
+
+#define MUX_CTRL_HELLO 1
+#define MUX_CTRL_CANCEL 2
+#define MUX_VERSION 1
+
+#define TX_RING 4096
+
+struct chan {
+  /* Transmit side; offsets count bytes through the stream */
+  unsigned char tx[TX_RING];
+  unsigned long tx_head, tx_acked, tx_sent;
+  unsigned char seq_acked, seq_next, seq_high;
+  unsigned long frame_start[MUX_WINDOW], frame_end[MUX_WINDOW];
+  unsigned char frame_type[MUX_WINDOW];
+  int peer_window;
+  bool tx_eof, eof_sent;
+  unsigned char eof_seq;
+
+  /* Receive side */
+  unsigned char rx_seq;
+  bool ack_pending, nak_pending, nak_sent;
+
+  /* File transfers */
+  FILE *tx_fp;
+  bool sending;
+  char tx_name[32];
+  FILE *rx_fp;
+  bool receiving, rx_failed;
+  int rx_name_len, rx_name_got;
+  char rx_name[32];
+};
+
+static struct chan chans[MUX_MAX_CHANS];
+static int line_fd = -1;
+static long baud = 9600;
+static const char *dir = ".";
+static char **files;
+static int nfiles;
+static bool connected, stdin_open = true;
+
+static unsigned char rxframe[MUX_HDR_LEN + MUX_MAX_PAYLOAD + 2];
+static int rxlen;
+static bool rx_esc, rx_overrun;
+
+static unsigned char ctrl_msg[2 + 32];
+static int ctrl_len;
+
+static long rto_deadline;       /* 0 when nothing's unacked */
+
+static long
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static speed_t
+baud_speed(long b)
+{
+  switch (b) {
+  case 1200: return B1200;
+  case 2400: return B2400;
+  case 4800: return B4800;
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  default: return 0;
+  }
+}
+
+static int
+line_raw(int fd, long b)
+{
+  struct termios t;
+  speed_t speed = baud_speed(b);
+
+  if (speed == 0) {
+    fprintf(stderr, "muxd: unsupported baud rate %ld\n", b);
+    return -1;
+  }
+  if (tcgetattr(fd, &t) < 0)
+    return -1;
+  cfmakeraw(&t);
+  t.c_cflag |= CLOCAL | CREAD;
+  cfsetispeed(&t, speed);
+  cfsetospeed(&t, speed);
+  return tcsetattr(fd, TCSANOW, &t);
+}
+
+static int
+line_open_pty(void)
+{
+  int fd, slave;
+  char *name;
+
+  if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) < 0 ||
+      unlockpt(fd) < 0 || (name = ptsname(fd)) == NULL)
+    return -1;
+
+  /* As in serfsd: raw, and held open so there's no hangup */
+  if ((slave = open(name, O_RDWR | O_NOCTTY)) < 0)
+    return -1;
+  if (line_raw(slave, 9600) < 0)
+    return -1;
+  printf("%s\n", name);
+  fflush(stdout);
+  return fd;
+}
+
+static void
+line_write(const unsigned char *buf, int len)
+{
+  int n;
+
+  while (len > 0) {
+    n = write(line_fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("muxd: write");
+      exit(1);
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/***************************************/
+/*  Framing                            */
+/***************************************/
+
+static void
+frame_put(unsigned char *f, int *len, unsigned char c)
+{
+  if ((c == MUX_FEND) || (c == MUX_FESC)) {
+    f[(*len)++] = MUX_FESC;
+    c ^= MUX_FXOR;
+  }
+  f[(*len)++] = c;
+}
+
+static void
+frame_send(int chan, int type, unsigned char seq, unsigned long off, int len)
+{
+  struct chan *c = &chans[chan];
+  unsigned char f[2 * (MUX_HDR_LEN + MUX_MAX_PAYLOAD + 2) + 2];
+  unsigned char hdr[MUX_HDR_LEN], b;
+  unsigned short crc;
+  int i, flen = 0;
+
+  hdr[0] = (chan << 4) | type;
+  hdr[1] = seq;
+  hdr[2] = c->rx_seq;
+  hdr[3] = MUX_WINDOW;
+  hdr[4] = len;
+
+  f[flen++] = MUX_FEND;
+  for (i = 0; i < MUX_HDR_LEN; i++)
+    frame_put(f, &flen, hdr[i]);
+  crc = crc16_update(0, hdr, MUX_HDR_LEN);
+  for (i = 0; i < len; i++) {
+    b = c->tx[(off + i) % TX_RING];
+    crc = crc16_update(crc, &b, 1);
+    frame_put(f, &flen, b);
+  }
+  frame_put(f, &flen, (crc >> 8) & 0xff);
+  frame_put(f, &flen, crc & 0xff);
+  f[flen++] = MUX_FEND;
+
+  c->ack_pending = false;
+  line_write(f, flen);
+}
+
+/***************************************/
+/*  Transmit                           */
+/***************************************/
+
+static int
+chan_write(int chan, const unsigned char *buf, int len)
+{
+  struct chan *c = &chans[chan];
+  int n = 0;
+
+  while ((n < len) && (c->tx_head - c->tx_acked < TX_RING))
+    c->tx[c->tx_head++ % TX_RING] = buf[n++];
+  return n;
+}
+
+static void
+ctrl_send(int type, const unsigned char *buf, int len)
+{
+  unsigned char hdr[2];
+
+  hdr[0] = type;
+  hdr[1] = len;
+  chan_write(MUX_CHAN_CTRL, hdr, 2);
+  chan_write(MUX_CHAN_CTRL, buf, len);
+}
+
+static bool
+unacked(void)
+{
+  int i;
+
+  for (i = 0; i < MUX_MAX_CHANS; i++) {
+    if (chans[i].seq_acked != chans[i].seq_high)
+      return true;
+  }
+  return false;
+}
+
+/* As amigaterm's: a window of full frames at the baud rate, plus slack */
+static void
+rto_update(bool restart)
+{
+  if (unacked() == false) {
+    rto_deadline = 0;
+    return;
+  }
+  if ((rto_deadline == 0) || restart)
+    rto_deadline = now_ms() + 500 + (MUX_WINDOW *
+        (2 * (MUX_HDR_LEN + MUX_MAX_PAYLOAD + 2) + 2) * 10 * 1000L) / baud;
+}
+
+static void
+chan_rewind(struct chan *c)
+{
+  c->seq_next = c->seq_acked;
+  c->tx_sent = c->tx_acked;
+}
+
+/* A stream's done; the sequence numbers carry on, as amigaterm's do */
+static void
+chan_tx_reset(struct chan *c)
+{
+  c->tx_head = c->tx_acked = c->tx_sent = 0;
+  c->tx_eof = c->eof_sent = false;
+}
+
+static void
+send_done(int chan)
+{
+  struct chan *c = &chans[chan];
+
+  fprintf(stderr, "muxd: sent %s\n", c->tx_name);
+  c->sending = false;
+  chan_tx_reset(c);
+}
+
+static void
+process_ack(int chan, unsigned char ack, int window)
+{
+  struct chan *c = &chans[chan];
+  unsigned char newly, outstanding;
+
+  c->peer_window = window;
+  newly = ack - c->seq_acked;
+  outstanding = c->seq_high - c->seq_acked;
+  if ((newly == 0) || (newly > outstanding))
+    return;
+
+  c->tx_acked = c->frame_end[(unsigned char) (ack - 1) % MUX_WINDOW];
+  if (c->eof_sent && (unsigned char) (c->eof_seq - c->seq_acked) < newly) {
+    c->seq_acked = ack;
+    send_done(chan);
+  } else {
+    c->seq_acked = ack;
+  }
+  if ((unsigned char) (c->seq_next - c->seq_acked) >
+      (unsigned char) (c->seq_high - c->seq_acked)) {
+    c->seq_next = c->seq_acked;
+    c->tx_sent = c->tx_acked;
+  }
+  rto_update(true);
+}
+
+/* Send the channel's next frame (or resend one) if it may */
+static bool
+send_data(int chan)
+{
+  struct chan *c = &chans[chan];
+  unsigned char in_flight;
+  int window, len, slot;
+
+  in_flight = c->seq_next - c->seq_acked;
+  window = (c->peer_window < MUX_WINDOW) ? c->peer_window : MUX_WINDOW;
+  if (in_flight >= window)
+    return false;
+
+  slot = c->seq_next % MUX_WINDOW;
+  if (in_flight < (unsigned char) (c->seq_high - c->seq_acked)) {
+    frame_send(chan, c->frame_type[slot], c->seq_next, c->frame_start[slot],
+        c->frame_end[slot] - c->frame_start[slot]);
+    c->tx_sent = c->frame_end[slot];
+    c->seq_next++;
+    rto_update(false);
+    return true;
+  }
+
+  c->frame_start[slot] = c->tx_sent;
+  if (c->tx_sent < c->tx_head) {
+    len = c->tx_head - c->tx_sent;
+    if (len > MUX_MAX_PAYLOAD)
+      len = MUX_MAX_PAYLOAD;
+    frame_send(chan, MUX_T_DATA, c->seq_next, c->tx_sent, len);
+    c->tx_sent += len;
+    c->frame_type[slot] = MUX_T_DATA;
+  } else if (c->tx_eof && (c->eof_sent == false)) {
+    frame_send(chan, MUX_T_EOF, c->seq_next, c->tx_head, 0);
+    c->eof_sent = true;
+    c->eof_seq = c->seq_next;
+    c->frame_type[slot] = MUX_T_EOF;
+  } else {
+    return false;
+  }
+  c->frame_end[slot] = c->tx_sent;
+  c->seq_next++;
+  c->seq_high = c->seq_next;
+  rto_update(false);
+  return true;
+}
+
+static bool
+send_ack(int chan)
+{
+  struct chan *c = &chans[chan];
+
+  if (c->nak_pending) {
+    c->nak_pending = false;
+    frame_send(chan, MUX_T_NAK, 0, 0, 0);
+    return true;
+  }
+  if (c->ack_pending) {
+    frame_send(chan, MUX_T_ACK, 0, 0, 0);
+    return true;
+  }
+  return false;
+}
+
+/* Writes don't wait here, so send everything that can go */
+static void
+kick(void)
+{
+  bool sent;
+  int chan;
+
+  if (connected == false)
+    return;
+  do {
+    sent = false;
+    for (chan = 0; chan < MUX_MAX_CHANS; chan++) {
+      if (send_data(chan))
+        sent = true;
+    }
+    for (chan = 0; chan < MUX_MAX_CHANS; chan++) {
+      if (send_ack(chan))
+        sent = true;
+    }
+  } while (sent);
+}
+
+/* Start the next file, and keep the ring topped up from it */
+static void
+refill(void)
+{
+  struct chan *c = &chans[MUX_CHAN_XFER];
+  unsigned char len;
+  const char *base;
+  size_t n, space;
+
+  if (connected && (c->sending == false) && (nfiles > 0)) {
+    base = strrchr(files[0], '/');
+    base = (base == NULL) ? files[0] : base + 1;
+    if (strlen(base) >= sizeof(c->tx_name) ||
+        (c->tx_fp = fopen(files[0], "rb")) == NULL) {
+      fprintf(stderr, "muxd: can't send %s\n", files[0]);
+    } else {
+      strcpy(c->tx_name, base);
+      c->sending = true;
+      len = strlen(base);
+      chan_write(MUX_CHAN_XFER, &len, 1);
+      chan_write(MUX_CHAN_XFER, (const unsigned char *) base, len);
+    }
+    files++;
+    nfiles--;
+  }
+
+  if ((c->tx_fp == NULL) || c->tx_eof)
+    return;
+  space = TX_RING - (c->tx_head - c->tx_acked);
+  while (space > 0) {
+    n = TX_RING - c->tx_head % TX_RING;
+    if (n > space)
+      n = space;
+    n = fread(&c->tx[c->tx_head % TX_RING], 1, n, c->tx_fp);
+    if (n == 0) {
+      fclose(c->tx_fp);
+      c->tx_fp = NULL;
+      c->tx_eof = true;
+      break;
+    }
+    c->tx_head += n;
+    space -= n;
+  }
+}
+
+/***************************************/
+/*  Receive                            */
+/***************************************/
+
+static void
+ctrl_message(const unsigned char *msg, int len)
+{
+  unsigned char version = MUX_VERSION;
+
+  switch (msg[0]) {
+  case MUX_CTRL_HELLO:
+    fprintf(stderr, "muxd: amigaterm connected\n");
+    if (connected == false) {
+      connected = true;
+      ctrl_send(MUX_CTRL_HELLO, &version, 1);
+    }
+    break;
+  case MUX_CTRL_CANCEL:
+    if ((len >= 1) && (msg[2] >= MUX_CHAN_XFER) && (msg[2] < MUX_MAX_CHANS))
+      chans[msg[2]].rx_failed = true;
+    break;
+  default:
+    break;
+  }
+}
+
+static void
+xfer_input(int chan, const unsigned char *buf, int len)
+{
+  struct chan *c = &chans[chan];
+  char path[4096];
+  int n;
+
+  if (c->receiving == false) {
+    if (len == 0)
+      return;
+    c->receiving = true;
+    c->rx_failed = false;
+    c->rx_name_len = *buf++;
+    c->rx_name_got = 0;
+    c->rx_fp = NULL;
+    len--;
+    if (c->rx_name_len >= (int) sizeof(c->rx_name))
+      c->rx_failed = true;
+  }
+
+  if (c->rx_name_got < c->rx_name_len) {
+    n = c->rx_name_len - c->rx_name_got;
+    if (n > len)
+      n = len;
+    if (c->rx_failed == false)
+      memcpy(&c->rx_name[c->rx_name_got], buf, n);
+    c->rx_name_got += n;
+    buf += n;
+    len -= n;
+    if ((c->rx_name_got < c->rx_name_len) || c->rx_failed)
+      return;
+
+    /* Only ever a name in dir */
+    c->rx_name[c->rx_name_len] = '\0';
+    if (strchr(c->rx_name, '/') || strcmp(c->rx_name, ".") == 0 ||
+        strcmp(c->rx_name, "..") == 0 || c->rx_name[0] == '\0' ||
+        snprintf(path, sizeof(path), "%s/%s", dir, c->rx_name) >=
+        (int) sizeof(path) || (c->rx_fp = fopen(path, "wb")) == NULL) {
+      fprintf(stderr, "muxd: can't create %s\n", c->rx_name);
+      c->rx_failed = true;
+      return;
+    }
+  }
+
+  if ((len > 0) && (c->rx_failed == false) &&
+      (fwrite(buf, 1, len, c->rx_fp) != (size_t) len)) {
+    fprintf(stderr, "muxd: error writing %s\n", c->rx_name);
+    c->rx_failed = true;
+  }
+}
+
+static void
+xfer_eof(int chan)
+{
+  struct chan *c = &chans[chan];
+  char path[4096];
+
+  if (c->receiving == false)
+    return;
+  if ((c->rx_fp != NULL) && (fclose(c->rx_fp) != 0))
+    c->rx_failed = true;
+  if (c->rx_failed) {
+    if (c->rx_fp != NULL) {
+      snprintf(path, sizeof(path), "%s/%s", dir, c->rx_name);
+      unlink(path);
+    }
+    fprintf(stderr, "muxd: receive failed\n");
+  } else {
+    fprintf(stderr, "muxd: received %s\n", c->rx_name);
+  }
+  c->rx_fp = NULL;
+  c->receiving = false;
+}
+
+static void
+deliver(int chan, int type, const unsigned char *buf, int len)
+{
+  if (type == MUX_T_EOF) {
+    if (chan >= MUX_CHAN_XFER)
+      xfer_eof(chan);
+    return;
+  }
+
+  switch (chan) {
+  case MUX_CHAN_CTRL:
+    while (len-- > 0) {
+      ctrl_msg[ctrl_len++] = *buf++;
+      if ((ctrl_len >= 2) && (ctrl_len == 2 + ctrl_msg[1] ||
+          ctrl_len == sizeof(ctrl_msg))) {
+        ctrl_message(ctrl_msg, ctrl_msg[1]);
+        ctrl_len = 0;
+      }
+    }
+    break;
+  case MUX_CHAN_TERM:
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+    break;
+  default:
+    xfer_input(chan, buf, len);
+    break;
+  }
+}
+
+static void
+rx_frame(const unsigned char *f, int len)
+{
+  struct chan *c;
+  int chan, type, plen;
+
+  if (len < MUX_HDR_LEN + 2)
+    return;
+  if (crc16_update(0, f, len - 2) != ((f[len - 2] << 8) | f[len - 1]))
+    return;
+
+  chan = f[0] >> 4;
+  type = f[0] & 0x0f;
+  plen = f[4];
+  if ((chan >= MUX_MAX_CHANS) || (plen != len - MUX_HDR_LEN - 2))
+    return;
+  c = &chans[chan];
+
+  process_ack(chan, f[2], f[3]);
+
+  switch (type) {
+  case MUX_T_DATA:
+  case MUX_T_EOF:
+    if (f[1] == c->rx_seq) {
+      c->rx_seq++;
+      c->nak_sent = false;
+      c->ack_pending = true;
+      deliver(chan, type, &f[MUX_HDR_LEN], plen);
+    } else if ((unsigned char) (f[1] - c->rx_seq) < 128) {
+      if (c->nak_sent == false) {
+        c->nak_pending = true;
+        c->nak_sent = true;
+      }
+    } else {
+      c->ack_pending = true;
+    }
+    break;
+  case MUX_T_NAK:
+    chan_rewind(c);
+    break;
+  default:
+    break;
+  }
+}
+
+static void
+line_input(const unsigned char *buf, int len)
+{
+  unsigned char b;
+
+  while (len-- > 0) {
+    b = *buf++;
+    if (b == MUX_FEND) {
+      if ((rxlen > 0) && (rx_overrun == false))
+        rx_frame(rxframe, rxlen);
+      rxlen = 0;
+      rx_esc = rx_overrun = false;
+      continue;
+    }
+    if (b == MUX_FESC) {
+      rx_esc = true;
+      continue;
+    }
+    if (rx_esc) {
+      b ^= MUX_FXOR;
+      rx_esc = false;
+    }
+    if (rxlen == sizeof(rxframe))
+      rx_overrun = true;
+    else
+      rxframe[rxlen++] = b;
+  }
+}
+
+/***************************************/
+/*  Main loop                          */
+/***************************************/
+
+static bool
+finished(void)
+{
+  int i;
+
+  if (stdin_open || (nfiles > 0) || unacked())
+    return false;
+  for (i = 0; i < MUX_MAX_CHANS; i++) {
+    if (chans[i].sending || (chans[i].tx_sent != chans[i].tx_head))
+      return false;
+  }
+  return true;
+}
+
+static void
+serve(void)
+{
+  struct chan *term = &chans[MUX_CHAN_TERM];
+  struct pollfd pfd[2];
+  unsigned char buf[512];
+  long wait;
+  int i, n, nfds;
+
+  while (finished() == false) {
+    pfd[0].fd = line_fd;
+    pfd[0].events = POLLIN;
+    nfds = 1;
+    /* Only take typing on when there's room for it */
+    if (stdin_open && connected && (term->tx_head - term->tx_acked <
+        TX_RING - sizeof(buf))) {
+      pfd[1].fd = STDIN_FILENO;
+      pfd[1].events = POLLIN;
+      nfds = 2;
+    }
+
+    wait = -1;
+    if (rto_deadline != 0) {
+      wait = rto_deadline - now_ms();
+      if (wait < 0)
+        wait = 0;
+    }
+    n = poll(pfd, nfds, wait);
+    if (n < 0 && errno != EINTR) {
+      perror("muxd: poll");
+      exit(1);
+    }
+
+    if ((n > 0) && (pfd[0].revents & (POLLIN | POLLHUP))) {
+      n = read(line_fd, buf, sizeof(buf));
+      if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EIO) {
+        perror("muxd: read");
+        exit(1);
+      }
+      if (n > 0)
+        line_input(buf, n);
+    }
+    if ((nfds == 2) && (pfd[1].revents & (POLLIN | POLLHUP))) {
+      n = read(STDIN_FILENO, buf, sizeof(buf));
+      if (n <= 0)
+        stdin_open = false;
+      else
+        chan_write(MUX_CHAN_TERM, buf, n);
+    }
+
+    if ((rto_deadline != 0) && (now_ms() >= rto_deadline)) {
+      rto_deadline = 0;
+      for (i = 0; i < MUX_MAX_CHANS; i++) {
+        if (chans[i].seq_acked != chans[i].seq_high)
+          chan_rewind(&chans[i]);
+      }
+      rto_update(false);
+    }
+
+    refill();
+    kick();
+  }
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr,
+      "usage: muxd [-b baud] [-d dir] (-l device | -p) [file ...]\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *device = NULL;
+  int pty = 0, c, i;
+
+  while ((c = getopt(argc, argv, "b:d:l:p")) != -1) {
+    switch (c) {
+    case 'b':
+      baud = atol(optarg);
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'l':
+      device = optarg;
+      break;
+    case 'p':
+      pty = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if ((device == NULL) == (pty == 0) || baud_speed(baud) == 0)
+    usage();
+  files = argv + optind;
+  nfiles = argc - optind;
+
+  for (i = 0; i < MUX_MAX_CHANS; i++)
+    chans[i].peer_window = MUX_WINDOW;
+
+  if (pty)
+    line_fd = line_open_pty();
+  else if ((line_fd = open(device, O_RDWR | O_NOCTTY)) >= 0 &&
+      line_raw(line_fd, baud) < 0)
+    line_fd = -1;
+  if (line_fd < 0) {
+    perror("muxd");
+    return 1;
+  }
+
+  serve();
+  return 0;
+}
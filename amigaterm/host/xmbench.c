@@ -0,0 +1,259 @@
+/*
+ * xmbench - time the xmodem engine on the host.
+ *
+ *   xmbench [-v] [-n loops] [-e every] file
+ *
+ * Runs a sender and a receiver engine against each other, with the
+ * file and the line all in memory, so what's timed is the protocol
+ * code (blocks, CRCs, LZ) and nothing else.  The receiver's copy is
+ * checked against the file at the end of each loop.
+ *
+ * -v shows the engines' messages, -n runs the transfer that many
+ * times, and -e flips a bit in every so many bytes going to the
+ * receiver, to see what retries cost.  Timeouts take no time; the
+ * engine that would time out first just does.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "amigaterm_xmodem_engine.h"
+
+/* Bytes on their way to one end */
+struct line {
+  unsigned char buf[16 * 1024];
+  int len;
+};
+
+struct end {
+  const char *name;
+  struct xmodem_engine xe;
+  struct line in;
+  struct line *out;
+  long waited;            /* ms spent waiting so far, for a timeout */
+  bool done;
+};
+
+/* How long one end may wait on its own once the other has finished */
+#define STALL_MS 60000
+
+static unsigned char *src, *dst;
+static long src_len, src_pos, dst_len;
+static int verbose;
+static long every, since_error;
+
+static void
+line_put(struct line *l, const unsigned char *buf, long len, bool noisy)
+{
+  long i;
+
+  if (len > (long) sizeof(l->buf) - l->len) {
+    fprintf(stderr, "line overflow\n");
+    exit(1);
+  }
+  memcpy(l->buf + l->len, buf, len);
+  if (noisy) {
+    for (i = 0; i < len; i++) {
+      if (++since_error == every) {
+        l->buf[l->len + i] ^= 1 << (rand() % 8);
+        since_error = 0;
+      }
+    }
+  }
+  l->len += len;
+}
+
+/*
+ * Carry out what the engine at e wants.  Returns false if it's
+ * waiting on the line and there's nothing there.
+ */
+static bool
+end_step(struct end *e, bool sender)
+{
+  struct xmodem_io io;
+  long n;
+
+  xmodem_engine_next(&e->xe, &io);
+  switch (io.type) {
+  case XMODEM_IO_SEND:
+    line_put(e->out, io.buf, io.len, sender && (every > 0));
+    xmodem_engine_complete(&e->xe, io.len);
+    break;
+  case XMODEM_IO_READ:
+    n = src_len - src_pos;
+    if (n > io.len)
+      n = io.len;
+    memcpy(io.buf, src + src_pos, n);
+    src_pos += n;
+    xmodem_engine_complete(&e->xe, n);
+    break;
+  case XMODEM_IO_WRITE:
+    if (dst_len + io.len > src_len) {
+      fprintf(stderr, "receiver wrote too much\n");
+      exit(1);
+    }
+    memcpy(dst + dst_len, io.buf, io.len);
+    dst_len += io.len;
+    xmodem_engine_complete(&e->xe, io.len);
+    break;
+  case XMODEM_IO_STATUS:
+    if (verbose)
+      printf("%s: %s", e->name, (const char *) io.buf);
+    xmodem_engine_complete(&e->xe, io.len);
+    break;
+  case XMODEM_IO_RECV:
+    if (e->in.len == 0)
+      return false;
+    n = xmodem_engine_input(&e->xe, e->in.buf, e->in.len);
+    e->in.len -= n;
+    memmove(e->in.buf, e->in.buf + n, e->in.len);
+    e->waited = 0;
+    break;
+  case XMODEM_IO_DONE:
+    e->done = true;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Both ends are stuck waiting; time out whichever would go first.
+ * Returns how long that took.
+ */
+static long
+timeout(struct end *a, struct end *b)
+{
+  struct xmodem_io ia, ib;
+  struct end *e;
+  long ms;
+
+  xmodem_engine_next(&a->xe, &ia);
+  xmodem_engine_next(&b->xe, &ib);
+  if (a->done || (ia.type != XMODEM_IO_RECV))
+    e = b;
+  else if (b->done || (ib.type != XMODEM_IO_RECV))
+    e = a;
+  else
+    e = (ia.timeout_ms - a->waited <= ib.timeout_ms - b->waited) ? a : b;
+
+  ms = ((e == a) ? ia : ib).timeout_ms - e->waited;
+  a->waited += ms;
+  b->waited += ms;
+  e->waited = 0;
+  xmodem_engine_timeout(&e->xe);
+  return ms;
+}
+
+static bool
+transfer(long *wire)
+{
+  static struct end s, r;
+  struct end *live;
+  long alone = 0;
+  bool moved;
+
+  memset(&s, 0, sizeof(s));
+  memset(&r, 0, sizeof(r));
+  s.name = "send";
+  s.out = &r.in;
+  r.name = "recv";
+  r.out = &s.in;
+  src_pos = dst_len = 0;
+  xmodem_engine_send_init(&s.xe, 0);
+  xmodem_engine_recv_init(&r.xe, src_len, 0);
+
+  while ((s.done == false) || (r.done == false)) {
+    moved = false;
+    while (end_step(&s, true))
+      moved = true;
+    while (end_step(&r, false))
+      moved = true;
+    if ((moved == false) && ((s.done && r.done) == false)) {
+      /*
+       * Once one end has finished nothing more is coming to the
+       * other, and a receiver still waiting for a block never
+       * gives up on its own.
+       */
+      if (s.done || r.done) {
+        live = s.done ? &r : &s;
+        alone += timeout(&s, &r);
+        if (alone > STALL_MS) {
+          fprintf(stderr, "%s finished; %s still waiting after %lds\n",
+              s.done ? s.name : r.name, live->name, alone / 1000);
+          return false;
+        }
+      } else {
+        timeout(&s, &r);
+      }
+    }
+  }
+
+  *wire = s.xe.wire_bytes;
+  return s.xe.ok && r.xe.ok && (dst_len == src_len) &&
+      (memcmp(src, dst, src_len) == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+  long loops = 1, i, wire = 0;
+  clock_t start;
+  double secs;
+  FILE *fp;
+  int ch;
+
+  while ((ch = getopt(argc, argv, "ve:n:")) != -1) {
+    switch (ch) {
+    case 'v':
+      verbose = 1;
+      break;
+    case 'e':
+      every = atol(optarg);
+      break;
+    case 'n':
+      loops = atol(optarg);
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if ((optind != argc - 1) || (loops < 1))
+    goto usage;
+
+  if ((fp = fopen(argv[optind], "rb")) == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  fseek(fp, 0, SEEK_END);
+  src_len = ftell(fp);
+  rewind(fp);
+  src = malloc(src_len + 1);
+  dst = malloc(src_len + 1);
+  if ((src == NULL) || (dst == NULL) ||
+      (fread(src, 1, src_len, fp) != (size_t) src_len)) {
+    fprintf(stderr, "can't read %s\n", argv[optind]);
+    return 1;
+  }
+  fclose(fp);
+
+  start = clock();
+  for (i = 0; i < loops; i++) {
+    if (transfer(&wire) == false) {
+      fprintf(stderr, "transfer %ld failed\n", i + 1);
+      return 1;
+    }
+  }
+  secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  printf("%ld bytes x %ld in %.3fs, %.0f KB/s; %ld bytes on the wire\n",
+      src_len, loops, secs,
+      (secs > 0) ? (src_len * loops) / secs / 1024 : 0.0, wire);
+  return 0;
+
+usage:
+  fprintf(stderr, "usage: xmbench [-v] [-n loops] [-e every] file\n");
+  return 1;
+}
@@ -22,77 +22,401 @@
 #include "exec/memory.h"          // for MEMF_CLEAR, MEMF_PUBLIC
 #include "exec/ports.h"           // for Message, MsgPort
 #include "proto/exec.h"           // for FreeMem, DoIO, GetMsg, AllocMem
+#include "proto/timer.h"          // for ReadEClock
 #include "clib/alib_protos.h"     // for DeletePort, BeginIO
 #include "devices/timer.h"
 #include "exec/types.h"           // for FALSE, TRUE, UBYTE, CONST_STRPTR
 #include <stdio.h>                // for NULL, puts, fclose, fopen, EOF, getc
 
 #include "timer.h"
+#include "tstamp.h"
 
-static struct Device * TimerBase;
-static struct timerequest *timer_req;
-static int pending_timer = 0;
+/*
+ * Timers are deadlines on a free running clock, kept in a heap by
+ * deadline, rather than timer.device requests of their own.  There's
+ * one request out at a time, for the earliest deadline (or before
+ * it.)  Adding and cancelling timers (which the serial read path
+ * does around every byte) only changes the heap; the request is left
+ * running, and only gets aborted and sent again when the earliest
+ * deadline moves earlier than it.  A request which goes off before
+ * the earliest deadline is just sent again for the rest.  So a
+ * stream of bytes each pushing a timeout out costs one request per
+ * timeout period, not several device calls a byte, and any number of
+ * timers cost the one request.
+ *
+ * The clock is the EClock on 2.0 and up, which is a library call
+ * reading the CIA.  1.3 doesn't have that, so there it's the system
+ * time in microseconds, which is a (quick) TR_GETSYSTIME.  Either
+ * way it's a 32 bit count that wraps, so deadlines are compared by
+ * difference and a timeout can't be longer than half the wrap
+ * (about 50 minutes for the EClock.)
+ *
+ * Anything of TIMER_VBLANK_MS or more goes on UNIT_VBLANK, which is
+ * cheaper to keep running than UNIT_MICROHZ and plenty accurate at
+ * that length; if it comes back a little early the rest goes on
+ * UNIT_MICROHZ.
+ */
+#define TIMER_VBLANK_MS 1000
+
+/* Is clock value a before b? */
+#define TIMER_BEFORE(a, b) ((LONG) ((a) - (b)) < 0)
+
+struct Device *TimerBase;
+static struct timerequest *timer_req;       /* UNIT_MICROHZ */
+static struct timerequest *timer_vbl_req;   /* UNIT_VBLANK */
+static struct timerequest *timer_clock_req; /* TR_GETSYSTIME on 1.3 */
 static struct MsgPort *timer_port;
 
+static int timer_have_eclock = 0;
+static ULONG timer_ticks_per_ms;
+
+static struct timerequest *timer_armed;     /* request out, if any */
+static ULONG timer_armed_at;                /* .. and the clock it's for */
+
+/* Pending timers, a heap on the deadline; timer_heap[0] is the next */
+static struct timer_event *timer_heap[TIMER_MAX_EVENTS];
+static int timer_heap_len = 0;
+static int timer_running = 0;               /* in timer_run() */
+
+/* The single timeout of timer_timeout_set() and friends */
+static struct timer_event timer_timeout_ev;
+static int timer_timeout_expired = 0;
+
+static struct timerequest *
+timer_req_open(ULONG unit)
+{
+    struct timerequest *tr;
+
+    tr = (struct timerequest *) CreateExtIO(timer_port,
+      sizeof(struct timerequest));
+    if (tr == NULL)
+        return (NULL);
+
+    if (OpenDevice((CONST_STRPTR) TIMERNAME, unit, (struct IORequest *) tr,
+      0) != 0) {
+        DeleteExtIO((struct IORequest *) tr);
+        return (NULL);
+    }
+    return (tr);
+}
+
+static void
+timer_req_close(struct timerequest *tr)
+{
+    if (tr == NULL)
+        return;
+    CloseDevice((struct IORequest *) tr);
+    DeleteExtIO((struct IORequest *) tr);
+}
+
+static ULONG
+timer_clock(void)
+{
+    struct EClockVal ev;
+
+    if (timer_have_eclock) {
+        ReadEClock(&ev);
+        return (ev.ev_lo);
+    }
+
+    timer_clock_req->tr_node.io_Command = TR_GETSYSTIME;
+    DoIO((struct IORequest *) timer_clock_req);
+    return (timer_clock_req->tr_time.tv_sec * 1000000 +
+      timer_clock_req->tr_time.tv_usec);
+}
+
+timer_stamp_t
+timer_stamp(void)
+{
+    return (timer_clock());
+}
+
+/*
+ * Clock ticks to microseconds, in two goes so it doesn't overflow
+ * for anything up to the wrap.
+ */
+ULONG
+timer_stamp_us(timer_stamp_t from, timer_stamp_t to)
+{
+    ULONG ticks = to - from;
+
+    return ((ticks / timer_ticks_per_ms) * 1000 +
+      ((ticks % timer_ticks_per_ms) * 1000) / timer_ticks_per_ms);
+}
+
+ULONG
+timer_stamp_ms(timer_stamp_t from, timer_stamp_t to)
+{
+    return ((to - from) / timer_ticks_per_ms);
+}
+
 int
 timer_init(void)
 {
-    int ret;
+    struct EClockVal ev;
 
     timer_port = CreatePort(NULL, 0);
     if (timer_port == NULL)
         return (0);
 
-    timer_req = (struct timerequest *) CreateExtIO(timer_port,
-      sizeof(struct timerequest));
-    if (timer_req == NULL) {
-        DeletePort(timer_port);
-        return (0);
-    }
+    timer_req = timer_req_open(UNIT_MICROHZ);
+    timer_vbl_req = timer_req_open(UNIT_VBLANK);
+    if ((timer_req == NULL) || (timer_vbl_req == NULL))
+        goto fail;
 
-    ret = OpenDevice((CONST_STRPTR) TIMERNAME, 0, (struct IORequest *) timer_req, 0);
+    TimerBase = timer_req->tr_node.io_Device;
 
-    if (ret != 0) {
-        DeleteExtIO((struct IORequest *) timer_req);
-        DeletePort(timer_port);
-        puts("Couldn't open timer device\n");
-        return 0;
+    if (TimerBase->dd_Library.lib_Version >= 36) {
+        timer_have_eclock = 1;
+        timer_ticks_per_ms = ReadEClock(&ev) / 1000;
+    } else {
+        timer_clock_req = timer_req_open(UNIT_MICROHZ);
+        if (timer_clock_req == NULL)
+            goto fail;
+        timer_ticks_per_ms = 1000;
     }
 
-    TimerBase = timer_req->tr_node.io_Device;
+    return 1;
+
+fail:
+    timer_req_close(timer_req);
+    timer_req_close(timer_vbl_req);
+    DeletePort(timer_port);
+    puts("Couldn't open timer device\n");
+    return 0;
+}
 
+/*
+ * Take back the request that's out, if there is one.
+ */
+static void
+timer_disarm(void)
+{
+    if (timer_armed == NULL)
+        return;
+
+    AbortIO((struct IORequest *) timer_armed);
+    WaitIO((struct IORequest *) timer_armed);
+    SetSignal(0, timer_get_signal_bitmask());
+    timer_armed = NULL;
+}
+
+/*
+ * Send a request for deadline.  Round up, so it doesn't come back a
+ * fraction of a millisecond short.  A deadline that's already gone
+ * by (a timer taken in before timer_run() got to it, or a callback
+ * which ran long) gets a request which comes straight back.
+ */
+static void
+timer_arm(ULONG now, ULONG deadline)
+{
+    struct timerequest *tr;
+    ULONG ms;
+
+    if (TIMER_BEFORE(deadline, now))
+        ms = 0;
+    else
+        ms = (deadline - now + timer_ticks_per_ms - 1) / timer_ticks_per_ms;
+    tr = (ms >= TIMER_VBLANK_MS) ? timer_vbl_req : timer_req;
+
+    tr->tr_time.tv_sec = ms / 1000;
+    tr->tr_time.tv_usec = (ms % 1000) * 1000;
+    tr->tr_node.io_Command = TR_ADDREQUEST;
+
+    SendIO((struct IORequest *) tr);
+    timer_armed = tr;
+    timer_armed_at = deadline;
+}
+
+/*
+ * Take in the request if it's gone off; returns 1 if there's none
+ * out any more.
+ */
+static int
+timer_collect(void)
+{
+    if (timer_armed != NULL) {
+        if (CheckIO((struct IORequest *) timer_armed) == NULL)
+            return 0;
+        WaitIO((struct IORequest *) timer_armed);
+        timer_armed = NULL;
+    }
     return 1;
 }
 
+/*
+ * Heap bookkeeping; each timer knows where it is, so taking one out
+ * from the middle is O(log n) too.
+ */
+static void
+timer_heap_set(int i, struct timer_event *te)
+{
+    timer_heap[i] = te;
+    te->index = i;
+}
+
+static void
+timer_heap_up(int i)
+{
+    struct timer_event *te = timer_heap[i];
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (TIMER_BEFORE(te->deadline, timer_heap[parent]->deadline) == 0)
+            break;
+        timer_heap_set(i, timer_heap[parent]);
+        i = parent;
+    }
+    timer_heap_set(i, te);
+}
+
+static void
+timer_heap_down(int i)
+{
+    struct timer_event *te = timer_heap[i];
+    int child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= timer_heap_len)
+            break;
+        if ((child + 1 < timer_heap_len) &&
+          TIMER_BEFORE(timer_heap[child + 1]->deadline,
+          timer_heap[child]->deadline))
+            child++;
+        if (TIMER_BEFORE(timer_heap[child]->deadline, te->deadline) == 0)
+            break;
+        timer_heap_set(i, timer_heap[child]);
+        i = child;
+    }
+    timer_heap_set(i, te);
+}
+
+static void
+timer_heap_remove(struct timer_event *te)
+{
+    int i = te->index;
+    struct timer_event *last;
+
+    te->index = -1;
+    last = timer_heap[--timer_heap_len];
+    if (last == te)
+        return;
+    timer_heap_set(i, last);
+    timer_heap_up(i);
+    timer_heap_down(last->index);
+}
+
 void
 timer_close(void)
 {
-    if (pending_timer) {
-        AbortIO((struct IORequest *) timer_req);
-        WaitIO((struct IORequest *) timer_req);
-        SetSignal(0, timer_get_signal_bitmask());
-    }
+    timer_disarm();
+    timer_heap_len = 0;
 
-    CloseDevice((struct IORequest *) timer_req);
-    DeleteExtIO((struct IORequest *) timer_req);
+    timer_req_close(timer_req);
+    timer_req_close(timer_vbl_req);
+    timer_req_close(timer_clock_req);
     DeletePort(timer_port);
 }
 
 void
-timer_timeout_set(int ms)
+timer_event_init(struct timer_event *te, timer_event_cb_t *cb, void *arg)
 {
-    if (pending_timer) {
-        AbortIO((struct IORequest *) timer_req);
-        WaitIO((struct IORequest *) timer_req);
-        SetSignal(0, timer_get_signal_bitmask());
-    }
+    te->deadline = 0;
+    te->index = -1;
+    te->cb = cb;
+    te->arg = arg;
+}
+
+/*
+ * (Re)start te to go off in ms.  Returns 0 if there are already
+ * TIMER_MAX_EVENTS timers pending.
+ */
+int
+timer_event_add(struct timer_event *te, int ms)
+{
+    ULONG now;
+
+    if (te->index >= 0)
+        timer_heap_remove(te);
+    else if (timer_heap_len == TIMER_MAX_EVENTS)
+        return 0;
+
+    now = timer_clock();
+    te->deadline = now + (ULONG) ms * timer_ticks_per_ms;
+    timer_heap_set(timer_heap_len++, te);
+    timer_heap_up(te->index);
+
+    /* timer_run() sends the request once it's done */
+    if (timer_running)
+        return 1;
+
+    /*
+     * If what's out has already gone off, its signal may have been
+     * and gone; take it in and start again.
+     */
+    timer_collect();
 
-    timer_req->tr_time.tv_sec = ms / 1000;
-    timer_req->tr_time.tv_usec = ms % 1000;
-    timer_req->tr_node.io_Command = TR_ADDREQUEST;
+    /*
+     * If what's out goes off by the earliest deadline, leave it;
+     * it'll be topped up then if need be.
+     */
+    if ((timer_armed != NULL) &&
+      (TIMER_BEFORE(timer_heap[0]->deadline, timer_armed_at) == 0))
+        return 1;
 
-    SendIO((struct IORequest *) timer_req);
-    pending_timer = 1;
+    timer_disarm();
+    timer_arm(now, timer_heap[0]->deadline);
+    return 1;
+}
+
+/*
+ * This only takes te out of the heap; the request can carry on, and
+ * going off early doesn't hurt.
+ */
+void
+timer_event_cancel(struct timer_event *te)
+{
+    if (te->index >= 0)
+        timer_heap_remove(te);
+}
+
+int
+timer_event_pending(const struct timer_event *te)
+{
+    return (te->index >= 0);
+}
+
+/*
+ * Call when the timer signal is set (or whenever); runs the callbacks
+ * of the timers which are due, and sends the request for the next.
+ * A callback can add or cancel timers, itself included.
+ */
+void
+timer_run(void)
+{
+    struct timer_event *te;
+    ULONG now;
+
+    /* The request goes off by the earliest deadline; until then, nothing */
+    if (timer_collect() == 0)
+        return;
+    if (timer_heap_len == 0)
+        return;
+
+    now = timer_clock();
+    timer_running = 1;
+    while ((timer_heap_len > 0) &&
+      (TIMER_BEFORE(now, timer_heap[0]->deadline) == 0)) {
+        te = timer_heap[0];
+        timer_heap_remove(te);
+        te->cb(te->arg);
+    }
+    timer_running = 0;
+
+    if (timer_heap_len > 0)
+        timer_arm(timer_clock(), timer_heap[0]->deadline);
 }
 
 unsigned int
@@ -102,23 +426,39 @@ timer_get_signal_bitmask(void)
     return (1 << timer_port->mp_SigBit);
 }
 
+/*
+ * The single timeout.  These predate the timer events and are kept
+ * as the protocol code's timeout: set arms it, fired says whether
+ * it's gone off yet, complete does that and clears it.
+ */
+static void
+timer_timeout_cb(void *arg)
+{
+    timer_timeout_expired = 1;
+}
+
+void
+timer_timeout_set(int ms)
+{
+    timer_timeout_expired = 0;
+    if (timer_timeout_ev.cb == NULL)
+        timer_event_init(&timer_timeout_ev, timer_timeout_cb, NULL);
+    timer_event_add(&timer_timeout_ev, ms);
+}
+
 void
 timer_timeout_abort(void)
 {
-    if (pending_timer) {
-        AbortIO((struct IORequest *) timer_req);
-        WaitIO((struct IORequest *) timer_req);
-        SetSignal(0, timer_get_signal_bitmask());
-    }
-    pending_timer = 0;
+    timer_event_cancel(&timer_timeout_ev);
+    timer_timeout_expired = 0;
 }
 
 int
 timer_timeout_fired(void)
 {
-    if (pending_timer == 0)
-        return 0;
-    return (CheckIO((struct IORequest *) timer_req) != 0);
+    if (timer_event_pending(&timer_timeout_ev))
+        timer_run();
+    return (timer_timeout_expired);
 }
 
 int
@@ -127,7 +467,6 @@ timer_timeout_complete(void)
     if (timer_timeout_fired() != 1)
         return 0;
 
-    WaitIO((struct IORequest *) timer_req);
-    pending_timer = 0;
+    timer_timeout_expired = 0;
     return 1;
 }
@@ -1,10 +1,40 @@
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
+#include <exec/types.h>           // for ULONG
+
+/*
+ * Timers, any number of which share the one timer.device request.
+ * The caller owns the struct timer_event; set it up once with
+ * timer_event_init(), then add (or re-add) and cancel it as needed.
+ * Its callback is called from timer_run() once it's due, which is
+ * to be called whenever the timer_get_signal_bitmask() signal is
+ * set.
+ */
+#define TIMER_MAX_EVENTS 16
+
+typedef void timer_event_cb_t(void *arg);
+
+struct timer_event {
+    ULONG deadline;             /* on the timer clock */
+    int index;                  /* in the heap, or -1 if not pending */
+    timer_event_cb_t *cb;
+    void *arg;
+};
+
 extern int timer_init(void);
 extern void timer_close(void);
-extern void timer_timeout_set(int ms);
 extern unsigned int timer_get_signal_bitmask(void);
+
+extern void timer_event_init(struct timer_event *te, timer_event_cb_t *cb,
+    void *arg);
+extern int timer_event_add(struct timer_event *te, int ms);
+extern void timer_event_cancel(struct timer_event *te);
+extern int timer_event_pending(const struct timer_event *te);
+extern void timer_run(void);
+
+/* The single timeout the protocol code uses */
+extern void timer_timeout_set(int ms);
 extern void timer_timeout_abort(void);
 extern int timer_timeout_fired(void);
 extern int timer_timeout_complete(void);
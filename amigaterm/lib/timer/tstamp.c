@@ -0,0 +1,45 @@
+/*
+ * Profiling counters; see tstamp.h.  The timestamps themselves live
+ * in timer.c, next to the clock.
+ *
+ * Adrian Chadd <adrian@FreeBSD.org>, 2022-2025.
+ */
+
+#include "exec/types.h"           // for ULONG
+#include <stdio.h>                // for NULL, snprintf
+
+#include "tstamp.h"
+
+static struct timer_prof *timer_prof_list = NULL;
+
+void
+timer_prof_add(struct timer_prof *p, ULONG us)
+{
+    if (p->count == 0) {
+        p->next = timer_prof_list;
+        timer_prof_list = p;
+    }
+    p->count++;
+    p->total_us += us;
+    if (us > p->max_us)
+        p->max_us = us;
+}
+
+/*
+ * Hand out a line per counter that's been used.
+ */
+void
+timer_prof_report(void (*out)(const char *))
+{
+    struct timer_prof *p;
+    char buf[128];
+
+    for (p = timer_prof_list; p != NULL; p = p->next) {
+        snprintf(buf, sizeof(buf),
+          "%s: %lu calls, %lu us total, %lu us avg, %lu us max\n",
+          p->name, (unsigned long) p->count, (unsigned long) p->total_us,
+          (unsigned long) (p->total_us / p->count),
+          (unsigned long) p->max_us);
+        out(buf);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef __TSTAMP_H__
+#define __TSTAMP_H__
+
+#include <exec/types.h>           // for ULONG
+
+/*
+ * Timestamps off the timer clock (the EClock on 2.0 and up, the
+ * system time on 1.3; see timer.c), for timing things.  They're
+ * only good once timer_init() has been done.  A stamp is a 32 bit
+ * count which wraps, so an interval has to be under about 50
+ * minutes; the elapsed time calls take care of the wrap.
+ *
+ * The TIMER_PROF macros add up how often and for how long a piece
+ * of code runs:
+ *
+ *   TIMER_PROF(prof_text, "Text");
+ *   ...
+ *   TIMER_PROF_BEGIN(prof_text);
+ *   Text(rp, buf, len);
+ *   TIMER_PROF_END(prof_text);
+ *
+ * and timer_prof_report() prints them all.  They're only there when
+ * built with -DTIMER_PROFILE; otherwise they compile to nothing.
+ */
+
+typedef ULONG timer_stamp_t;
+
+extern timer_stamp_t timer_stamp(void);
+extern ULONG timer_stamp_us(timer_stamp_t from, timer_stamp_t to);
+extern ULONG timer_stamp_ms(timer_stamp_t from, timer_stamp_t to);
+
+struct timer_prof {
+    const char *name;
+    ULONG count;
+    ULONG total_us;
+    ULONG max_us;
+    struct timer_prof *next;    /* on the report list once used */
+};
+
+extern void timer_prof_add(struct timer_prof *p, ULONG us);
+extern void timer_prof_report(void (*out)(const char *));
+
+#ifdef TIMER_PROFILE
+#define TIMER_PROF(p, name) \
+    static struct timer_prof p = { name, 0, 0, 0, NULL }
+#define TIMER_PROF_BEGIN(p) \
+    { timer_stamp_t p##_start = timer_stamp();
+#define TIMER_PROF_END(p) \
+    timer_prof_add(&p, timer_stamp_us(p##_start, timer_stamp())); }
+#else
+#define TIMER_PROF(p, name)
+#define TIMER_PROF_BEGIN(p) {
+#define TIMER_PROF_END(p) }
+#endif
+
+#endif
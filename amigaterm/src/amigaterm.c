@@ -8,6 +8,7 @@
  *  contributors: Alexander Fritsch (2021)
  ************************************************************************/
 /*  compiler directives to fetch the necessary header files */
+#include "devices/inputevent.h"   // for IEQUALIFIER_LSHIFT, IEQUALIFIER_RSHIFT
 #include "dos/dos.h"              // for BPTR, MODE_NEWFILE, MODE_OLDFILE
 #include "exec/io.h"              // for IOStdReq, CMD_READ, CMD_WRITE
 #include "exec/memory.h"          // for MEMF_CLEAR, MEMF_PUBLIC
@@ -23,15 +24,23 @@
 #include <exec/types.h>           // for FALSE, TRUE, UBYTE, CONST_STRPTR
 #include <intuition/intuition.h>  // for MenuItem, IntuiText, Menu, Window
 #include <intuition/screens.h>    // for RAWKEY, CLOSEWINDOW, MENUPICK
-#include <stdio.h>                // for NULL, puts, fclose, fopen, EOF, getc
+#include <stdio.h>                // for NULL, puts
 #include <stdbool.h>
 
 #include "amigaterm_screen.h"
 #include "amigaterm_serial.h"
 #include "amigaterm_serial_read.h"
 #include "../lib/timer/timer.h"
+#include "../lib/timer/tstamp.h"
 #include "amigaterm_util.h"
 #include "amigaterm_xmodem.h"
+#include "amigaterm_delta.h"
+#include "amigaterm_mux.h"
+#include "amigaterm_disk.h"
+#include "amigaterm_capture.h"
+#include "amigaterm_upload.h"
+#include "amigaterm_clip.h"
+#include "amigaterm_reactor.h"
 
 void filename(char name[], int len); // AF
 long filesize(void);               // Read a file size, or default to -1
@@ -48,7 +57,7 @@ struct IntuiMessage *NewMessage; /* msg structure for GetMsg() */
  *                     File Menu
  *****************************************************/
 /* define maximum number of menu items */
-#define FILEMAX 4
+#define FILEMAX 13
 /*   declare storage space for menu items and
  *   their associated IntuiText structures
  */
@@ -88,6 +97,18 @@ int InitFileItems() {
   FileText[1].IText = (UBYTE *)"Ascii Send";
   FileText[2].IText = (UBYTE *)"Xmodem Receive";
   FileText[3].IText = (UBYTE *)"Xmodem Send";
+  FileText[4].IText = (UBYTE *)"Delta Receive";
+  FileText[5].IText = (UBYTE *)"Delta Send";
+  FileText[6].IText = (UBYTE *)"Mux Mode";
+  FileText[7].IText = (UBYTE *)"Mux Send";
+  FileText[8].IText = (UBYTE *)"Disk Receive";
+  FileText[9].IText = (UBYTE *)"Disk Send";
+  FileText[10].IText = (UBYTE *)"Raw Capture";
+  FileText[11].IText = (UBYTE *)"Paste";
+  FileText[12].IText = (UBYTE *)"Mux Cancel";
+  /* Right Amiga-V */
+  FileItem[11].Flags |= COMMSEQ;
+  FileItem[11].Command = 'V';
   return 0;
 }
 /*****************************************************/
@@ -183,21 +204,366 @@ int InitMenu() {
   return 0;
 }
 
+static int KeepGoing;
+static struct reactor_source serial_source, timer_source, mux_source;
+static struct reactor_source upload_source, window_source, key_source;
+
+static bool
+term_serial_ready(void *arg)
+{
+  return (serial_read_is_ready() != 0);
+}
+
+/*
+ * Serial data for the terminal (or the mux.)
+ */
+static void
+term_serial_input(void *arg)
+{
+  static unsigned char rxbuf[512];
+  unsigned char c;
+  int ret, n;
+
+  /* See if we have a serial read IO ready */
+  ret = serial_get_char(&c);
+  if (ret > 0) {
+    /* Take whatever else has already arrived along with it */
+    rxbuf[0] = c;
+    n = 1 + serial_read_pending((char *) &rxbuf[1], sizeof(rxbuf) - 1);
+
+    /* Start another serial port read */
+    serial_read_start();
+
+    /* In mux mode everything from the peer is framed */
+    if (mux_active()) {
+      mux_input(rxbuf, n);
+    } else {
+      emit_buf(rxbuf, n);
+      capture_input(rxbuf, n);
+      upload_input(rxbuf, n);
+    }
+  } else if (ret < 0) {
+    /* error (eg overflow) - need to re-queue serial read */
+    serial_read_start();
+  }
+}
+
+static void
+term_timer(void *arg)
+{
+  timer_run();
+}
+
+static void
+term_mux(void *arg)
+{
+  mux_poll();
+}
+
+static void
+term_upload(void *arg)
+{
+  upload_poll();
+}
+
+/* Before going to sleep */
+static void
+term_idle(void)
+{
+  screen_update();
+}
+
+/*
+ * Keys, menus and the close gadget.  Transfers started from here run
+ * inside this callback, which keeps the terminal off the serial port
+ * until they're done.
+ */
+static void
+term_idcmp(void *arg)
+{
+  ULONG class;
+  USHORT code, qual, menunum, itemnum;
+  int baud;
+  char name[32], pacing[32];
+  unsigned char c;
+  unsigned char *clip;
+  long file_size, clip_len;
+
+  while ((NewMessage = (struct IntuiMessage *)GetMsg(mywindow->UserPort))) {
+    class = NewMessage->Class;
+    code = NewMessage->Code;
+    qual = NewMessage->Qualifier;
+    ReplyMsg((struct Message *)NewMessage);
+    switch (class) {
+    case CLOSEWINDOW:
+      /*   User is ready to quit, so indicate
+       *   that execution should terminate
+       *   with next iteration of the loop.
+       */
+      KeepGoing = FALSE;
+      break;
+    case RAWKEY:
+      /*  User has touched the keyboard */
+      switch (code) {
+      case 95: /* help key */
+        emits("AMIGA Term Copyright 1985 by Michael Mounier\n");
+        emits("AMIGA Term Enhanced 2018-2021 by Roc Vall\xe8s Dom\xe8nech\n");
+        emits("Contributors: Alexander Fritsch (2021)\n");
+        emits("Contributors: Adrian Chadd (2022)\n");
+        emits("More info: https://github.com/erikarn/amiga-code/amigaterm/\n");
+#if ENABLE_HWFLOW
+        emits("***This program is configured to USE HW flow control\n");
+#else
+        emits("***This program doesn't use flow control\n");
+#endif
+        emits("***ESC Aborts Xmodem Xfer\n");
+        break;
+      case 76: /* cursor up */
+      case 77: /* cursor down */
+        /* Shifted, they page through the scrollback */
+        if (qual & (IEQUALIFIER_LSHIFT | IEQUALIFIER_RSHIFT))
+          screen_page((code == 76) ? 1 : -1);
+        break;
+      default:
+        c = toasc(code); /* get in into ascii */
+        if (c != 0) {
+          screen_page_end();
+          if (mux_active())
+            mux_write(MUX_CHAN_TERM, &c, 1);
+          else {
+            /* Slip it in between pieces of an Ascii Send */
+            upload_sync();
+            serial_write_char(c);
+            upload_poll();
+          }
+        }
+        break;
+      }
+      break;
+    case NEWSIZE:
+      emit(12); // XXX hack, but hey
+      break;
+    case MENUPICK:
+      if (code != MENUNULL) {
+        menunum = MENUNUM(code);
+        itemnum = ITEMNUM(code);
+        switch (menunum) {
+        case 0:
+          /* These all talk to the serial port directly */
+          if (mux_active() && (((itemnum >= 1) && (itemnum <= 5)) ||
+              (itemnum == 8) || (itemnum == 9) || (itemnum == 11))) {
+            emits("\nNot available in mux mode\n");
+            break;
+          }
+          /* .. and the transfers need it to themselves */
+          if (upload_active() && (((itemnum >= 2) && (itemnum <= 9)) ||
+              (itemnum == 11))) {
+            emits("\nNot available during Ascii Send\n");
+            break;
+          }
+          switch (itemnum) {
+          case 0:
+          case 10:
+            if (capture_active()) {
+              if (capture_stop())
+                emits("\nEnd File Capture\n");
+              else
+                emits("\nError Writing Capture File\n");
+            } else {
+              emits((itemnum == 0) ? "\nAscii Capture:" : "\nRaw Capture:");
+              filename(name, 31);
+              if (capture_start(name, itemnum == 10) == false) {
+                emits("\nError Opening File\n");
+                break;
+              }
+            }
+            break;
+          case 1:
+            if (upload_active()) {
+              upload_stop();
+              emits("\nFile Send Cancelled\n");
+            } else {
+              emits("\nAscii Send:");
+              filename(name, 31);
+              emits("\nPacing (c<ms> l<ms> e p<char>, blank for none):");
+              filename(pacing, 31);
+              if (upload_set_pacing(pacing) == false) {
+                emits("\nBad Pacing\n");
+                break;
+              }
+              if (upload_start_file(name) == false) {
+                emits("\nError Opening File\n");
+                break;
+              }
+            }
+            break;
+          case 2:
+            emits("\nXmodem Receive:");
+            filename(name, 31);
+            emits("\nFile size (or leave blank to not truncate):");
+            file_size = filesize();
+
+            if (XMODEM_Read_File(name, file_size)) {
+              emits("Received\n");
+              emit(8);
+            } else {
+              emits("Xmodem Receive Failed\n");
+              emit(8);
+            }
+            break;
+          case 3:
+            emits("\nXmodem Send:");
+            filename(name, 31);
+            if (XMODEM_Send_File(name)) {
+              emits("Sent\n");
+              emit(8);
+            } else {
+              emits("\nXmodem Send Failed\n");
+              emit(8);
+            }
+            break;
+          case 4:
+            emits("\nDelta Receive (updates existing file):");
+            filename(name, 31);
+            if (DELTA_Read_File(name)) {
+              emits("Updated\n");
+              emit(8);
+            } else {
+              emits("\nDelta Receive Failed\n");
+              emit(8);
+            }
+            break;
+          case 5:
+            emits("\nDelta Send:");
+            filename(name, 31);
+            if (DELTA_Send_File(name)) {
+              emits("Sent\n");
+              emit(8);
+            } else {
+              emits("\nDelta Send Failed\n");
+              emit(8);
+            }
+            break;
+          case 6:
+            if (mux_active()) {
+              mux_stop();
+              emits("\nMux mode off\n");
+            } else {
+              mux_start();
+              emits("\nMux mode on\n");
+            }
+            break;
+          case 7:
+            if (mux_active() == false) {
+              emits("\nMux mode is off\n");
+              break;
+            }
+            emits("\nMux Send:");
+            filename(name, 31);
+            mux_send_file(name);
+            emit(8);
+            break;
+          case 8:
+            emits("\nDisk Receive (DF0:-DF3: or image file):");
+            filename(name, 31);
+            if (DISK_Read_Image(name)) {
+              emits("Disk Written\n");
+              emit(8);
+            } else {
+              emits("\nDisk Receive Failed\n");
+              emit(8);
+            }
+            break;
+          case 9:
+            emits("\nDisk Send (DF0:-DF3: or image file):");
+            filename(name, 31);
+            if (DISK_Send_Image(name)) {
+              emits("Sent\n");
+              emit(8);
+            } else {
+              emits("\nDisk Send Failed\n");
+              emit(8);
+            }
+            break;
+          case 11:
+            /* Sent like an Ascii Send, with its pacing */
+            if ((clip = clip_read_text(&clip_len)) != NULL)
+              upload_start_buf(clip, clip_len);
+            break;
+          case 12:
+            if (mux_active() == false) {
+              emits("\nMux mode is off\n");
+              break;
+            }
+            mux_cancel_sends();
+            emits("\nMux sends cancelled\n");
+            break;
+          }
+          break;
+        case 1: /* Set baud rate */
+          /* XXX TODO: why not just make this a table? */
+          switch (itemnum) {
+          case 0:
+            baud = 300;
+            break;
+          case 1:
+            baud = 1200;
+            break;
+          case 2:
+            baud = 2400;
+            break;
+          case 3:
+            baud = 4800;
+            break;
+          case 4:
+            baud = 9600;
+            break;
+          case 5:
+            baud = 19200;
+            break;
+          case 6:
+            baud = 38400;
+            break;
+          case 7:
+            baud = 57600;
+            break;
+          case 8:
+            baud = 115200;
+            break;
+          default:
+            baud = 300; /* XXX */
+            break;
+          }
+
+          /* Abort the pending read IO, then set the serial baud */
+          serial_read_abort();
+          serial_set_baud(baud);
+          current_baud = baud;
+
+          /* Start a new read IO */
+          serial_read_start();
+          break;
+        } /* end of switch ( menunum ) */
+      }   /*  end of if ( not null ) */
+    }     /* end of switch (class) */
+  }       /* end of while ( newmessage )*/
+}
+
+#ifdef TIMER_PROFILE
+/* The profile goes to the CLI, the window having gone by then */
+static void
+prof_out(const char *s)
+{
+  fputs(s, stdout);
+}
+#endif
+
 /******************************************************/
 /*                   Main Program                     */
 /*                                                    */
 /*      This is the main body of the program.         */
 /******************************************************/
 int main() {
-  ULONG class;
-  USHORT code, menunum, itemnum;
-  int KeepGoing, capture, send, baud, ret;
-  char name[32];
-  unsigned char c;
-  long file_size;
-  FILE *tranr = NULL;
-  FILE *trans = NULL;
-
   screen_init();
 
 #if ENABLE_HWFLOW
@@ -223,217 +589,50 @@ int main() {
   InitMenu();
   SetMenuStrip(mywindow, &menu[0]);
   KeepGoing = TRUE;
-  capture = FALSE;
-  send = FALSE;
   SetAPen(mywindow->RPort, 1);
   emit(12);
 
   /* Start a single byte serial read */
   serial_read_start();
 
-  while (KeepGoing) {
-    /*
-     * wait for window message or serial port message
-     *
-     * if we are using QUICK IO then we can be already ready
-     * to read, but we'll get no notification signal.
-     * So skip the Wait().
-     */
-    if (serial_read_is_ready() == 0) {
-      draw_cursor(AMIGATERM_SCREEN_CURSOR_PEN, false); // Note: no XOR here
-      // XXX TODO: we need to track this and blank/XOR the cursor out if
-      // we've drawn it here, or we'll end up with cursor artefacts everywhere!
-      Wait((serial_get_read_signal_bitmask()) |
-           (1 << mywindow->UserPort->mp_SigBit));
-    }
-    if (send) {
-      if ((c = getc(trans)) != EOF)
-        serial_write_char(c);
-      else {
-        fclose(trans);
-        emits("\nFile Sent\n");
-        send = FALSE;
-      }
-    }
-
-    /* See if we have a serial read IO ready */
-    ret = serial_get_char(&c);
-    if (ret > 0) {
-        /* Start another serial port read */
-        serial_read_start();
-
-        c = c & 0x7f;
-        emit(c);
-        if (capture) {
-          if ((c > 31 && c < 127) || c == 10) /* trash them mangy ctl chars */
-            putc(c, tranr);
-        }
-    } else if (ret < 0) {
-        /* error (eg overflow) - need to re-queue serial read */
-        serial_read_start();
-    }
-
-    while ((NewMessage = (struct IntuiMessage *)GetMsg(mywindow->UserPort))) {
-      class = NewMessage->Class;
-      code = NewMessage->Code;
-      ReplyMsg((struct Message *)NewMessage);
-      switch (class) {
-      case CLOSEWINDOW:
-        /*   User is ready to quit, so indicate
-         *   that execution should terminate
-         *   with next iteration of the loop.
-         */
-        KeepGoing = FALSE;
-        break;
-      case RAWKEY:
-        /*  User has touched the keyboard */
-        switch (code) {
-        case 95: /* help key */
-          emits("AMIGA Term Copyright 1985 by Michael Mounier\n");
-          emits("AMIGA Term Enhanced 2018-2021 by Roc Vall\xe8s Dom\xe8nech\n");
-          emits("Contributors: Alexander Fritsch (2021)\n");
-          emits("Contributors: Adrian Chadd (2022)\n");
-          emits("More info: https://github.com/erikarn/amiga-code/amigaterm/\n");
-#if ENABLE_HWFLOW
-          emits("***This program is configured to USE HW flow control\n");
-#else
-          emits("***This program doesn't use flow control\n");
-#endif
-          emits("***ESC Aborts Xmodem Xfer\n");
-          break;
-        default:
-          c = toasc(code); /* get in into ascii */
-          if (c != 0) {
-            serial_write_char(c);
-          }
-          break;
-        }
-        break;
-      case NEWSIZE:
-        emit(12); // XXX hack, but hey
-        break;
-      case MENUPICK:
-        if (code != MENUNULL) {
-          menunum = MENUNUM(code);
-          itemnum = ITEMNUM(code);
-          switch (menunum) {
-          case 0:
-            switch (itemnum) {
-            case 0:
-              if (capture == TRUE) {
-                capture = FALSE;
-                fclose(tranr);
-                emits("\nEnd File Capture\n");
-              } else {
-                emits("\nAscii Capture:");
-                filename(name, 31);
-                if ((tranr = fopen(name, "w")) == 0) {
-                  capture = FALSE;
-                  emits("\nError Opening File\n");
-                  break;
-                }
-                capture = TRUE;
-              }
-              break;
-            case 1:
-              if (send == TRUE) {
-                send = FALSE;
-                fclose(trans);
-                emits("\nFile Send Cancelled\n");
-              } else {
-                emits("\nAscii Send:");
-                filename(name, 31);
-                if ((trans = fopen(name, "r")) == 0) {
-                  send = FALSE;
-                  emits("\nError Opening File\n");
-                  break;
-                }
-                send = TRUE;
-              }
-              break;
-            case 2:
-              emits("\nXmodem Receive:");
-              filename(name, 31);
-              emits("\nFile size (or leave blank to not truncate):");
-              file_size = filesize();
-
-              if (XMODEM_Read_File(name, file_size)) {
-                emits("Received\n");
-                emit(8);
-              } else {
-                emits("Xmodem Receive Failed\n");
-                emit(8);
-              }
-              break;
-            case 3:
-              emits("\nXmodem Send:");
-              filename(name, 31);
-              if (XMODEM_Send_File(name)) {
-                emits("Sent\n");
-                emit(8);
-              } else {
-                emits("\nXmodem Send Failed\n");
-                emit(8);
-              }
-              break;
-            }
-            break;
-          case 1: /* Set baud rate */
-            /* XXX TODO: why not just make this a table? */
-            switch (itemnum) {
-            case 0:
-              baud = 300;
-              break;
-            case 1:
-              baud = 1200;
-              break;
-            case 2:
-              baud = 2400;
-              break;
-            case 3:
-              baud = 4800;
-              break;
-            case 4:
-              baud = 9600;
-              break;
-            case 5:
-              baud = 19200;
-              break;
-            case 6:
-              baud = 38400;
-              break;
-            case 7:
-              baud = 57600;
-              break;
-            case 8:
-              baud = 115200;
-              break;
-            default:
-              baud = 300; /* XXX */
-              break;
-            }
-
-            /* Abort the pending read IO, then set the serial baud */
-            serial_read_abort();
-            serial_set_baud(baud);
-            current_baud = baud;
+  /*
+   * Everything is waited on in reactor_poll().  The serial port
+   * goes first; the menus go last, and anything a menu item starts
+   * only has the nested sources (and its own) while it runs.
+   */
+  reactor_add(&serial_source, serial_get_read_signal_bitmask(),
+      REACTOR_PRI_SERIAL, 0, term_serial_ready, term_serial_input, NULL);
+  reactor_add(&timer_source, timer_get_signal_bitmask(),
+      REACTOR_PRI_TIMER, REACTOR_NESTED, NULL, term_timer, NULL);
+  reactor_add(&mux_source, mux_get_signal_bitmask(),
+      REACTOR_PRI_IO, REACTOR_NESTED, NULL, term_mux, NULL);
+  reactor_add(&upload_source, upload_get_signal_bitmask(),
+      REACTOR_PRI_IO, REACTOR_NESTED, NULL, term_upload, NULL);
+  reactor_add(&window_source, 1UL << mywindow->UserPort->mp_SigBit,
+      REACTOR_PRI_UI, 0, NULL, term_idcmp, NULL);
+  /* filename() waits on the window itself */
+  reactor_add(&key_source, 1UL << mywindow->UserPort->mp_SigBit,
+      REACTOR_PRI_UI, REACTOR_NESTED, NULL, NULL, NULL);
+  reactor_enable(&key_source, false);
+  reactor_set_idle(term_idle);
 
-            /* Start a new read IO */
-            serial_read_start();
-            break;
-          } /* end of switch ( menunum ) */
-        }   /*  end of if ( not null ) */
-      }     /* end of switch (class) */
-    }       /* end of while ( newmessage )*/
-  }         /* end while ( keepgoing ) */
+  while (KeepGoing)
+    reactor_poll();
 
   /*   It must be time to quit, so we have to clean
    *   up and exit.
    */
+  mux_stop();
+  upload_stop();
+  clip_free();
+  capture_stop();
   serial_close();
   timer_close();
   ClearMenuStrip(mywindow);
   screen_cleanup();
+#ifdef TIMER_PROFILE
+  timer_prof_report(prof_out);
+#endif
   exit(FALSE);
 } /* end of main */
 /*************************************************
@@ -446,7 +645,9 @@ void filename(char name[], int len) {
   int keepgoing, i;
   keepgoing = TRUE;
   i = 0;
+  reactor_enable(&key_source, true);
   while (keepgoing) {
+    reactor_poll();
     while ((NewMessage = (struct IntuiMessage *)GetMsg(mywindow->UserPort))) {
       class = NewMessage->Class;
       code = NewMessage->Code;
@@ -476,7 +677,9 @@ void filename(char name[], int len) {
       } /* end of RAWKEY check */
     } /* end of new message loop */
   }   /* end of god knows what */
+  reactor_enable(&key_source, false);
   emit(13);
+  emit(10);
 } /* end of function */
 
 /* Function to get a file size, or -1 if enter is pressed */
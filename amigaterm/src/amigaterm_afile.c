@@ -0,0 +1,330 @@
+/*
+ * AmigaDOS files with asynchronous packet I/O; see amigaterm_afile.h.
+ *
+ * This is the same thing Read() and Write() do underneath, minus
+ * the wait for the reply.  It works back to 1.3: the packet is a
+ * StandardPacket sent to the handler's port (fh_Type) with our own
+ * reply port, and fh_Args is the handler's idea of the file.
+ */
+#include "dos/dos.h"              // for BPTR, MODE_NEWFILE
+#include "dos/dosextens.h"        // for FileHandle, StandardPacket
+#include "exec/memory.h"          // for MEMF_PUBLIC, MEMF_CLEAR
+#include "exec/ports.h"           // for MsgPort, Message
+#include "proto/dos.h"            // for Close, Open, Read, Write, Seek
+#include "proto/exec.h"           // for AllocMem, FreeMem, PutMsg
+#include "clib/alib_protos.h"     // for CreatePort, DeletePort
+#include <exec/types.h>           // for UBYTE, LONG
+#include <stdio.h>                // for NULL
+#include <string.h>               // for memcpy, memset
+#include <stdbool.h>
+
+#include "amigaterm_afile.h"
+
+static void
+afile_free(struct afile *af)
+{
+  int i;
+
+  for (i = 0; i < af->nbufs; i++) {
+    if (af->bufs[i].sp != NULL)
+      FreeMem(af->bufs[i].sp, sizeof(struct StandardPacket) + af->bufsize);
+  }
+  if (af->port != NULL)
+    DeletePort(af->port);
+  if (af->fh != 0)
+    Close(af->fh);
+  af->nbufs = 0;
+  af->port = NULL;
+  af->fh = 0;
+}
+
+/*
+ * Note a failed transfer; the first one is the one worth reporting.
+ */
+static void
+afile_fail(struct afile *af, LONG error)
+{
+  if (af->failed)
+    return;
+  af->failed = true;
+  af->error = (error != 0) ? error : ERROR_DISK_FULL;
+}
+
+/*
+ * Take in the replies which have come back.
+ */
+void
+afile_poll(struct afile *af)
+{
+  struct Message *msg;
+  struct DosPacket *pkt;
+  struct afile_buf *b;
+  int i;
+
+  while ((msg = GetMsg(af->port)) != NULL) {
+    pkt = (struct DosPacket *) msg->mn_Node.ln_Name;
+    for (i = 0; i < af->nbufs; i++) {
+      b = &af->bufs[i];
+      if (&b->sp->sp_Msg != msg)
+        continue;
+      b->busy = false;
+      if (af->reading) {
+        b->len = (pkt->dp_Res1 > 0) ? pkt->dp_Res1 : 0;
+        b->pos = 0;
+        if (pkt->dp_Res1 < 0)
+          afile_fail(af, pkt->dp_Res2);
+        else if (pkt->dp_Res1 < af->bufsize)
+          af->eof = true;
+      } else {
+        if (pkt->dp_Res1 != b->len)
+          afile_fail(af, pkt->dp_Res2);
+        b->len = 0;
+      }
+      break;
+    }
+  }
+}
+
+static void
+afile_wait(struct afile *af, struct afile_buf *b)
+{
+  while (b->busy) {
+    WaitPort(af->port);
+    afile_poll(af);
+  }
+}
+
+/*
+ * The signal the replies come back on, for the main loop to call
+ * afile_poll() on.
+ */
+ULONG
+afile_get_signal_bitmask(struct afile *af)
+{
+  return (1UL << af->port->mp_SigBit);
+}
+
+/*
+ * Hand a buffer to the handler.
+ */
+static void
+afile_send(struct afile *af, struct afile_buf *b, LONG action)
+{
+  struct StandardPacket *sp = b->sp;
+  long n;
+
+  /* NIL: and friends have no handler; do it here */
+  if (af->handle->fh_Type == NULL) {
+    if (action == ACTION_READ) {
+      n = Read(af->fh, b->data, b->len);
+      b->len = (n > 0) ? n : 0;
+      b->pos = 0;
+      if (n < 0)
+        afile_fail(af, IoErr());
+      else if (n < af->bufsize)
+        af->eof = true;
+      return;
+    }
+    n = Write(af->fh, b->data, b->len);
+    if (n != b->len)
+      afile_fail(af, IoErr());
+    b->len = 0;
+    return;
+  }
+
+  sp->sp_Msg.mn_Node.ln_Name = (char *) &sp->sp_Pkt;
+  sp->sp_Msg.mn_ReplyPort = af->port;
+  sp->sp_Pkt.dp_Link = &sp->sp_Msg;
+  sp->sp_Pkt.dp_Port = af->port;
+  sp->sp_Pkt.dp_Type = action;
+  sp->sp_Pkt.dp_Arg1 = af->handle->fh_Args;
+  sp->sp_Pkt.dp_Arg2 = (LONG) b->data;
+  sp->sp_Pkt.dp_Arg3 = b->len;
+  b->busy = true;
+  PutMsg(af->handle->fh_Type, &sp->sp_Msg);
+}
+
+/*
+ * Open name (MODE_NEWFILE etc.) with nbufs buffers of bufsize bytes.
+ */
+bool
+afile_open(struct afile *af, const char *name, LONG mode, int nbufs,
+    long bufsize)
+{
+  int i;
+
+  memset(af, 0, sizeof(*af));
+  if (nbufs < 2)
+    nbufs = 2;
+  if (nbufs > AFILE_MAX_BUFS)
+    nbufs = AFILE_MAX_BUFS;
+  af->bufsize = bufsize;
+
+  if ((af->fh = Open((UBYTE *) name, mode)) == 0)
+    return false;
+  af->handle = BADDR(af->fh);
+
+  if ((af->port = CreatePort(NULL, 0)) == NULL) {
+    afile_free(af);
+    return false;
+  }
+  for (i = 0; i < nbufs; i++) {
+    af->bufs[i].sp = AllocMem(sizeof(struct StandardPacket) + bufsize,
+        MEMF_PUBLIC | MEMF_CLEAR);
+    af->nbufs = i + 1;
+    if (af->bufs[i].sp == NULL) {
+      afile_free(af);
+      return false;
+    }
+    af->bufs[i].data = (unsigned char *) (af->bufs[i].sp + 1);
+  }
+
+  /* Start reading the first nbufs buffers' worth straight away */
+  if (mode == MODE_OLDFILE) {
+    af->reading = true;
+    for (i = 0; (i < nbufs) && (af->eof == false); i++) {
+      af->bufs[i].len = bufsize;
+      afile_send(af, &af->bufs[i], ACTION_READ);
+    }
+  }
+  return true;
+}
+
+/*
+ * Make a new file size bytes long before anything's written to it.
+ * Running out of room shows up now rather than most of the way
+ * through, and on a floppy the writes that follow only have data
+ * blocks to fill in.
+ *
+ * 2.0 and up have SetFileSize().  On 1.3 the file is written out
+ * with zeroes and we seek back to the start, which costs a second
+ * pass but leaves the same layout.  Returns false (with the reason
+ * in af->error) if there's no room.
+ */
+bool
+afile_reserve(struct afile *af, long size)
+{
+  struct afile_buf *b = &af->bufs[0];
+  long n;
+
+  if ((af->reading) || (size <= 0))
+    return true;
+
+  if (DOSBase->dl_lib.lib_Version >= 36) {
+    if (SetFileSize(af->fh, size, OFFSET_BEGINNING) < 0) {
+      afile_fail(af, IoErr());
+      return false;
+    }
+  } else {
+    memset(b->data, 0, af->bufsize);
+    for (af->reserved = 0; af->reserved < size; af->reserved += n) {
+      n = size - af->reserved;
+      if (n > af->bufsize)
+        n = af->bufsize;
+      if (Write(af->fh, b->data, n) != n) {
+        afile_fail(af, IoErr());
+        return false;
+      }
+    }
+  }
+  Seek(af->fh, 0, OFFSET_BEGINNING);
+  af->reserved = size;
+  return true;
+}
+
+/*
+ * Read up to len bytes; returns the count (short only at the end of
+ * the file), or -1 on an error.
+ */
+long
+afile_read(struct afile *af, unsigned char *buf, long len)
+{
+  struct afile_buf *b;
+  long done = 0, n;
+
+  while (done < len) {
+    b = &af->bufs[af->cur];
+    afile_wait(af, b);
+    if (af->failed)
+      return -1;
+
+    n = b->len - b->pos;
+    if (n > len - done)
+      n = len - done;
+    memcpy(buf + done, b->data + b->pos, n);
+    b->pos += n;
+    done += n;
+    if (b->pos < b->len)
+      break;
+
+    /* A short buffer is the end of the file; it stays empty */
+    if (b->len < af->bufsize)
+      break;
+
+    /* Used up; send it off for the next piece, if there is one */
+    b->pos = 0;
+    if (af->eof) {
+      b->len = 0;
+    } else {
+      b->len = af->bufsize;
+      afile_send(af, b, ACTION_READ);
+    }
+    af->cur = (af->cur + 1) % af->nbufs;
+  }
+  return done;
+}
+
+/*
+ * Queue len bytes to be written; returns len, or -1 once a write
+ * has failed.
+ */
+long
+afile_write(struct afile *af, const unsigned char *buf, long len)
+{
+  struct afile_buf *b;
+  long done = 0, n;
+
+  while ((done < len) && (af->failed == false)) {
+    b = &af->bufs[af->cur];
+    n = af->bufsize - b->len;
+    if (n > len - done)
+      n = len - done;
+    memcpy(b->data + b->len, buf + done, n);
+    b->len += n;
+    done += n;
+
+    if (b->len == af->bufsize) {
+      afile_send(af, b, ACTION_WRITE);
+      af->cur = (af->cur + 1) % af->nbufs;
+      afile_wait(af, &af->bufs[af->cur]);
+    }
+  }
+  af->written += done;
+  return af->failed ? -1 : len;
+}
+
+/*
+ * Write out what's left, wait for it all (or any reads still out)
+ * and close the file.  Returns false if any of the writes failed.
+ */
+bool
+afile_close(struct afile *af)
+{
+  struct afile_buf *b = &af->bufs[af->cur];
+  int i;
+
+  if ((af->reading == false) && (af->failed == false) && (b->len > 0))
+    afile_send(af, b, ACTION_WRITE);
+  for (i = 0; i < af->nbufs; i++)
+    afile_wait(af, &af->bufs[i]);
+
+  /*
+   * Give back any of the reservation that wasn't used; 1.3 has no
+   * way to shorten a file, so there it keeps the zeroes.
+   */
+  if ((af->written < af->reserved) && (DOSBase->dl_lib.lib_Version >= 36))
+    SetFileSize(af->fh, af->written, OFFSET_BEGINNING);
+
+  afile_free(af);
+  return (af->failed == false);
+}
@@ -0,0 +1,69 @@
+#ifndef __AMIGATERM_AFILE_H__
+#define __AMIGATERM_AFILE_H__
+
+/*
+ * AmigaDOS files with the I/O done by DOS packets sent straight to
+ * the handler, so the disk can be working while we get on with
+ * something else.
+ *
+ * Writes are copied into one of a few buffers; a full buffer goes
+ * to the handler as an ACTION_WRITE and the caller carries on.  It
+ * only waits when every buffer is still out.  A write which fails
+ * shows up as -1 from a later afile_write(), or false from
+ * afile_close().
+ *
+ * afile_reserve() sets the length up front when it's known, so the
+ * writes go into space the filing system has already allocated;
+ * see amigaterm_afile.c.
+ *
+ * A file opened with MODE_OLDFILE is read ahead instead: every
+ * buffer has an ACTION_READ out from the start, and afile_read()
+ * copies from the oldest, sending it off for more once it's empty.
+ *
+ * Handlers deal with a file's packets in the order they're sent,
+ * so the reads and writes land in order.
+ *
+ * The replies are only looked at when a buffer's needed, unless
+ * afile_poll() is called when afile_get_signal_bitmask() goes off.
+ */
+
+#include <dos/dos.h>              // for BPTR
+#include <dos/dosextens.h>        // for StandardPacket
+#include <exec/types.h>           // for ULONG
+#include <stdbool.h>
+
+#define AFILE_MAX_BUFS 8
+
+struct afile_buf {
+  struct StandardPacket *sp;  /* the packet, followed by the data */
+  unsigned char *data;
+  long len;
+  long pos;                   /* bytes already handed out when reading */
+  bool busy;                  /* out with the handler */
+};
+
+struct afile {
+  BPTR fh;
+  struct FileHandle *handle;
+  struct MsgPort *port;       /* packets come back here */
+  long bufsize;
+  int nbufs;
+  struct afile_buf bufs[AFILE_MAX_BUFS];
+  int cur;                    /* buffer being filled or emptied */
+  bool reading, eof;
+  long reserved, written;     /* bytes reserved by afile_reserve(); queued */
+  LONG error;                 /* IoErr() style code of the first failure */
+  bool failed;
+};
+
+extern bool afile_open(struct afile *af, const char *name, LONG mode,
+    int nbufs, long bufsize);
+extern bool afile_reserve(struct afile *af, long size);
+extern long afile_read(struct afile *af, unsigned char *buf, long len);
+extern long afile_write(struct afile *af, const unsigned char *buf,
+    long len);
+extern bool afile_close(struct afile *af);
+extern ULONG afile_get_signal_bitmask(struct afile *af);
+extern void afile_poll(struct afile *af);
+
+#endif
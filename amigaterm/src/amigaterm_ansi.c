@@ -0,0 +1,163 @@
+/*
+ * ANSI / VT100 escape sequence parser; see amigaterm_ansi.h.
+ *
+ * Every state has a 256 entry table saying, for each character,
+ * what to do with it and which state comes next, so a character
+ * costs a table lookup.  The tables are filled in once from the
+ * rules below, which follow the DEC parser's state diagram.  The
+ * DCS, OSC, SOS, PM and APC strings all share one state that throws
+ * them away until the ST (ESC \) or a CAN or SUB; an OSC may end
+ * with a BEL instead, as in xterm.
+ */
+#include <exec/types.h>           // for UBYTE, UWORD
+#include <stdbool.h>
+
+#include "amigaterm_ansi.h"
+
+/* States */
+#define S_GROUND 0
+#define S_ESC 1
+#define S_ESC_INT 2
+#define S_CSI_ENTRY 3
+#define S_CSI_PARAM 4
+#define S_CSI_INT 5
+#define S_CSI_IGNORE 6
+#define S_STRING 7
+#define S_COUNT 8
+#define S_SAME 0xf
+
+/* Actions; the first few are what ansi_input() hands back */
+#define A_IGNORE ANSI_NONE
+#define A_PRINT ANSI_PRINT
+#define A_EXECUTE ANSI_EXECUTE
+#define A_ESC ANSI_ESC
+#define A_CSI ANSI_CSI
+#define A_CLEAR 5
+#define A_COLLECT 6
+#define A_PARAM 7
+
+#define B(s) (1 << (s))
+#define B_ALL 0xff
+#define B_CSI (B(S_CSI_ENTRY) | B(S_CSI_PARAM) | B(S_CSI_INT))
+
+struct ansi_rule {
+  UBYTE states;                 /* B() of each state it applies in */
+  UBYTE lo, hi;                 /* characters */
+  UBYTE action, next;
+};
+
+/* Later rules win */
+static const struct ansi_rule ansi_rules[] = {
+  /* Control characters are carried out even inside a sequence */
+  { B_ALL & ~B(S_STRING), 0x00, 0x17, A_EXECUTE, S_SAME },
+  { B_ALL & ~B(S_STRING), 0x19, 0x19, A_EXECUTE, S_SAME },
+  { B_ALL & ~B(S_STRING), 0x1c, 0x1f, A_EXECUTE, S_SAME },
+
+  { B(S_GROUND), 0x20, 0x7e, A_PRINT, S_SAME },
+  { B(S_GROUND), 0xa0, 0xff, A_PRINT, S_SAME },
+
+  { B(S_ESC), 0x20, 0x2f, A_COLLECT, S_ESC_INT },
+  { B(S_ESC), 0x30, 0x7e, A_ESC, S_GROUND },
+  { B(S_ESC), '[', '[', A_CLEAR, S_CSI_ENTRY },
+  { B(S_ESC), 'P', 'P', A_IGNORE, S_STRING },       /* DCS */
+  { B(S_ESC), 'X', 'X', A_IGNORE, S_STRING },       /* SOS */
+  { B(S_ESC), ']', ']', A_IGNORE, S_STRING },       /* OSC */
+  { B(S_ESC), '^', '_', A_IGNORE, S_STRING },       /* PM, APC */
+  { B(S_ESC_INT), 0x20, 0x2f, A_COLLECT, S_SAME },
+  { B(S_ESC_INT), 0x30, 0x7e, A_ESC, S_GROUND },
+
+  { B(S_CSI_ENTRY) | B(S_CSI_PARAM), '0', '9', A_PARAM, S_CSI_PARAM },
+  { B(S_CSI_ENTRY) | B(S_CSI_PARAM), ';', ';', A_PARAM, S_CSI_PARAM },
+  { B(S_CSI_ENTRY) | B(S_CSI_PARAM), ':', ':', A_IGNORE, S_CSI_IGNORE },
+  { B(S_CSI_ENTRY), '<', '?', A_COLLECT, S_CSI_PARAM }, /* private */
+  { B(S_CSI_PARAM), '<', '?', A_IGNORE, S_CSI_IGNORE },
+  { B_CSI, 0x20, 0x2f, A_COLLECT, S_CSI_INT },
+  { B(S_CSI_INT), 0x30, 0x3f, A_IGNORE, S_CSI_IGNORE },
+  { B_CSI, 0x40, 0x7e, A_CSI, S_GROUND },
+  { B(S_CSI_IGNORE), 0x40, 0x7e, A_IGNORE, S_GROUND },
+
+  { B(S_STRING), 0x07, 0x07, A_IGNORE, S_GROUND },
+
+  /* From anywhere */
+  { B_ALL, 0x18, 0x18, A_EXECUTE, S_GROUND },       /* CAN */
+  { B_ALL, 0x1a, 0x1a, A_EXECUTE, S_GROUND },       /* SUB */
+  { B_ALL, 0x1b, 0x1b, A_CLEAR, S_ESC },
+};
+
+/* Action in the top four bits, next state in the bottom four */
+static UBYTE ansi_table[S_COUNT][256];
+static bool ansi_table_done;
+
+static void
+ansi_table_init(void)
+{
+  const struct ansi_rule *r;
+  int s, c;
+
+  for (s = 0; s < S_COUNT; s++) {
+    for (c = 0; c < 256; c++)
+      ansi_table[s][c] = (A_IGNORE << 4) | s;
+  }
+
+  for (r = ansi_rules;
+      r < &ansi_rules[sizeof(ansi_rules) / sizeof(ansi_rules[0])]; r++) {
+    for (s = 0; s < S_COUNT; s++) {
+      if ((r->states & B(s)) == 0)
+        continue;
+      for (c = r->lo; c <= r->hi; c++)
+        ansi_table[s][c] = (r->action << 4) |
+            ((r->next == S_SAME) ? s : r->next);
+    }
+  }
+  ansi_table_done = true;
+}
+
+void
+ansi_init(struct ansi_parser *ap)
+{
+  if (ansi_table_done == false)
+    ansi_table_init();
+  ap->state = S_GROUND;
+  ap->nparams = 0;
+  ap->ninter = 0;
+  ap->inter[0] = '\0';
+}
+
+int
+ansi_input(struct ansi_parser *ap, unsigned char c)
+{
+  UBYTE t;
+  ULONG val;
+
+  t = ansi_table[ap->state][c];
+  ap->state = t & 0xf;
+
+  switch (t >> 4) {
+  case A_CLEAR:
+    ap->nparams = 0;
+    ap->ninter = 0;
+    ap->inter[0] = '\0';
+    return ANSI_NONE;
+  case A_COLLECT:
+    /* Past the most a real sequence has; drop the rest */
+    if (ap->ninter < ANSI_MAX_INTER) {
+      ap->inter[ap->ninter++] = c;
+      ap->inter[ap->ninter] = '\0';
+    }
+    return ANSI_NONE;
+  case A_PARAM:
+    if (ap->nparams == 0)
+      ap->params[ap->nparams++] = 0;
+    if (c == ';') {
+      if (ap->nparams < ANSI_MAX_PARAMS)
+        ap->params[ap->nparams++] = 0;
+    } else {
+      val = ap->params[ap->nparams - 1] * 10UL + (c - '0');
+      ap->params[ap->nparams - 1] =
+          (val > ANSI_MAX_PARAM_VAL) ? ANSI_MAX_PARAM_VAL : val;
+    }
+    return ANSI_NONE;
+  default:
+    return (t >> 4);
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef __AMIGATERM_ANSI_H__
+#define __AMIGATERM_ANSI_H__
+
+/*
+ * An ANSI / VT100 escape sequence parser, after the state machine
+ * of the DEC terminals (see vt100.net/emu/dec_ansi_parser), cut down
+ * to 7 bit controls: 0xa0 to 0xff print (as Latin-1) and the 8 bit
+ * controls, 0x80 to 0x9f, are ignored.
+ *
+ * It only splits the input up.  ansi_input() takes a character and
+ * says what the caller has to do with it:
+ *
+ *   ANSI_NONE    - nothing, it's part of a sequence (or ignored)
+ *   ANSI_PRINT   - show it
+ *   ANSI_EXECUTE - it's a control character (CR, LF, BS etc.)
+ *   ANSI_ESC     - it ends an ESC sequence; the intermediates are
+ *                  in inter
+ *   ANSI_CSI     - it ends a CSI (ESC [) sequence; the numbers are
+ *                  in params, and inter has the intermediates and
+ *                  any private marker ('?' etc.)
+ *
+ * A missing parameter is 0, and so is one that isn't there at all
+ * (nparams is how many were given.)  DCS, OSC and the other string
+ * sequences are swallowed.
+ */
+
+#include <exec/types.h>           // for UBYTE, UWORD
+#include <stdbool.h>
+
+#define ANSI_NONE 0
+#define ANSI_PRINT 1
+#define ANSI_EXECUTE 2
+#define ANSI_ESC 3
+#define ANSI_CSI 4
+
+#define ANSI_MAX_PARAMS 16
+#define ANSI_MAX_INTER 2
+#define ANSI_MAX_PARAM_VAL 9999
+
+struct ansi_parser {
+  UBYTE state;
+  UBYTE nparams;
+  UWORD params[ANSI_MAX_PARAMS];
+  UBYTE ninter;
+  char inter[ANSI_MAX_INTER + 1];     /* NUL terminated */
+};
+
+extern void ansi_init(struct ansi_parser *ap);
+extern int ansi_input(struct ansi_parser *ap, unsigned char c);
+
+/* Parameter n, or def if it's missing or 0 */
+#define ANSI_PARAM(ap, n, def) \
+    ((((n) < (ap)->nparams) && ((ap)->params[n] != 0)) ? \
+    (ap)->params[n] : (def))
+
+#endif
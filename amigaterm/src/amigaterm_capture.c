@@ -0,0 +1,106 @@
+/*
+ * Serial capture to a file; see amigaterm_capture.h.
+ *
+ * The original Ascii Capture did a putc() per character from the
+ * main loop.  Here a whole batch is filtered in one pass into a
+ * staging buffer and handed to the file in one go; the file goes
+ * out through a couple of large buffers written asynchronously, so
+ * a slow disk doesn't hold up the screen or the next serial read.
+ */
+#include "dos/dos.h"              // for MODE_NEWFILE
+#include <exec/types.h>           // for UBYTE
+#include <stdio.h>                // for NULL, snprintf
+#include <stdbool.h>
+
+#include "amigaterm_afile.h"
+#include "amigaterm_capture.h"
+#include "amigaterm_reactor.h"
+
+#define CAPTURE_BUFS 2
+#define CAPTURE_BUFSIZE 0x2000
+
+static struct afile capture_file;
+static bool capture_on, capture_raw;
+static struct reactor_source capture_source;
+
+/*
+ * Anything using this will need to define an emits() function to print
+ * a string.
+ */
+extern void emits(const char *);
+
+/* Take the writes back as they finish, so the buffers are free */
+static void
+capture_poll(void *arg)
+{
+  afile_poll(&capture_file);
+}
+
+bool
+capture_start(const char *file, bool raw)
+{
+  if (capture_on)
+    capture_stop();
+  if (afile_open(&capture_file, file, MODE_NEWFILE, CAPTURE_BUFS,
+      CAPTURE_BUFSIZE) == false)
+    return false;
+  capture_raw = raw;
+  capture_on = true;
+  reactor_add(&capture_source, afile_get_signal_bitmask(&capture_file),
+      REACTOR_PRI_FILE, REACTOR_NESTED, NULL, capture_poll, NULL);
+  return true;
+}
+
+void
+capture_input(const unsigned char *buf, int len)
+{
+  unsigned char out[256];
+  unsigned char c;
+  int i, n;
+
+  if (capture_on == false)
+    return;
+
+  if (capture_raw) {
+    if (afile_write(&capture_file, buf, len) >= 0)
+      return;
+  } else {
+    /* Trash them mangy ctl chars */
+    while (len > 0) {
+      n = 0;
+      for (i = 0; (i < len) && (i < (int) sizeof(out)); i++) {
+        c = buf[i] & 0x7f;
+        if (((c > 31) && (c < 127)) || (c == 10))
+          out[n++] = c;
+      }
+      buf += i;
+      len -= i;
+      if ((n > 0) && (afile_write(&capture_file, out, n) < 0))
+        break;
+    }
+    if (len == 0)
+      return;
+  }
+
+  emits("\nCapture file write failed; capture stopped\n");
+  capture_stop();
+}
+
+/*
+ * Returns false if anything failed to make it to the file.
+ */
+bool
+capture_stop(void)
+{
+  if (capture_on == false)
+    return true;
+  capture_on = false;
+  reactor_remove(&capture_source);
+  return afile_close(&capture_file);
+}
+
+bool
+capture_active(void)
+{
+  return capture_on;
+}
@@ -0,0 +1,17 @@
+#ifndef __AMIGATERM_CAPTURE_H__
+#define __AMIGATERM_CAPTURE_H__
+
+/*
+ * Capturing what comes in from the serial port to a file.
+ *
+ * Text capture keeps printable 7 bit characters and newlines, like
+ * the original Ascii Capture; raw capture keeps every byte.  Data
+ * is taken a receive batch at a time and written behind through
+ * amigaterm_afile.
+ */
+extern bool capture_start(const char *file, bool raw);
+extern void capture_input(const unsigned char *buf, int len);
+extern bool capture_stop(void);
+extern bool capture_active(void);
+
+#endif
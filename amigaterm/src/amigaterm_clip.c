@@ -0,0 +1,173 @@
+/*
+ * Reading text off the clipboard.
+ *
+ * This talks to clipboard.device directly rather than through
+ * iffparse.library, which 1.3 doesn't have.  The clip is an IFF
+ * FORM FTXT; the text is in its CHRS chunk(s) and everything else
+ * is skipped over.  The device wants to be read to the end (a read
+ * which returns nothing) before it'll let go of the clip.
+ */
+#include "exec/io.h"              // for CMD_READ
+#include "exec/memory.h"          // for MEMF_PUBLIC
+#include "exec/ports.h"           // for MsgPort
+#include "proto/exec.h"           // for AllocMem, FreeMem, DoIO, OpenDevice
+#include "clib/alib_protos.h"     // for CreatePort, CreateExtIO
+#include "devices/clipboard.h"    // for IOClipReq, PRIMARY_CLIP
+#include <exec/types.h>           // for ULONG, UBYTE
+#include <stdio.h>                // for NULL
+#include <stdbool.h>
+
+#include "amigaterm_clip.h"
+
+#define CLIP_ID(a, b, c, d) \
+  (((ULONG) (a) << 24) | ((ULONG) (b) << 16) | ((ULONG) (c) << 8) | (d))
+#define CLIP_FORM CLIP_ID('F', 'O', 'R', 'M')
+#define CLIP_FTXT CLIP_ID('F', 'T', 'X', 'T')
+#define CLIP_CHRS CLIP_ID('C', 'H', 'R', 'S')
+
+/* Don't try to send more than this in one go */
+#define CLIP_MAX_TEXT (256L * 1024)
+
+static unsigned char *clip_text;
+static ULONG clip_size;
+
+/*
+ * Anything using this will need to define an emits() function to print
+ * a string.
+ */
+extern void emits(const char *);
+
+static ULONG
+clip_read(struct IOClipReq *io, void *buf, ULONG len)
+{
+  io->io_Command = CMD_READ;
+  io->io_Data = (STRPTR) buf;
+  io->io_Length = len;
+  if (DoIO((struct IORequest *) io) != 0)
+    return 0;
+  return io->io_Actual;
+}
+
+static ULONG
+clip_get32(const UBYTE *p)
+{
+  return ((ULONG) p[0] << 24) | ((ULONG) p[1] << 16) |
+      ((ULONG) p[2] << 8) | p[3];
+}
+
+/*
+ * Turn LF and CR LF into CR, in place; returns the new length.
+ */
+static long
+clip_convert(unsigned char *buf, long len)
+{
+  unsigned char c, prev = 0;
+  long i, n = 0;
+
+  for (i = 0; i < len; i++) {
+    c = buf[i];
+    if (c == '\n') {
+      if (prev != '\r')
+        buf[n++] = '\r';
+    } else
+      buf[n++] = c;
+    prev = c;
+  }
+  return n;
+}
+
+/*
+ * Find the (first) CHRS chunk in the clip and read it in.
+ */
+static bool
+clip_fetch(struct IOClipReq *io)
+{
+  UBYTE hdr[12];
+  ULONG form_len, pos, id, len;
+
+  io->io_Offset = 0;
+  io->io_ClipID = 0;
+
+  if ((clip_read(io, hdr, 12) != 12) || (clip_get32(hdr) != CLIP_FORM) ||
+      (clip_get32(hdr + 8) != CLIP_FTXT)) {
+    emits("\nNo text on the clipboard\n");
+    return false;
+  }
+
+  form_len = clip_get32(hdr + 4);
+  for (pos = 4; pos + 8 <= form_len; pos += 8 + len + (len & 1)) {
+    if (clip_read(io, hdr, 8) != 8)
+      break;
+    id = clip_get32(hdr);
+    len = clip_get32(hdr + 4);
+    if ((id == CLIP_CHRS) && (len > 0)) {
+      if (len > CLIP_MAX_TEXT) {
+        emits("\nClipboard text is too big\n");
+        return false;
+      }
+      if ((clip_text = AllocMem(len, MEMF_PUBLIC)) == NULL) {
+        emits("\nNo memory for the clipboard text\n");
+        return false;
+      }
+      clip_size = len;
+      if (clip_read(io, clip_text, len) != len) {
+        emits("\nError reading the clipboard\n");
+        return false;
+      }
+      return true;
+    }
+    /* Skip anything else (and its pad byte) */
+    io->io_Offset += len + (len & 1);
+  }
+
+  emits("\nNo text on the clipboard\n");
+  return false;
+}
+
+unsigned char *
+clip_read_text(long *len)
+{
+  struct MsgPort *port;
+  struct IOClipReq *io;
+  UBYTE scratch[64];
+  bool ok = false;
+
+  clip_free();
+
+  if ((port = CreatePort(NULL, 0)) == NULL)
+    return NULL;
+  io = (struct IOClipReq *) CreateExtIO(port, sizeof(struct IOClipReq));
+  if (io == NULL) {
+    DeletePort(port);
+    return NULL;
+  }
+  if (OpenDevice((CONST_STRPTR) "clipboard.device", PRIMARY_CLIP,
+      (struct IORequest *) io, 0) != 0) {
+    emits("\nCan't open clipboard.device\n");
+  } else {
+    ok = clip_fetch(io);
+
+    /* Read to the end so the device knows we're done with the clip */
+    while (clip_read(io, scratch, sizeof(scratch)) > 0)
+      ;
+    CloseDevice((struct IORequest *) io);
+  }
+  DeleteExtIO((struct IORequest *) io);
+  DeletePort(port);
+
+  if (ok == false) {
+    clip_free();
+    return NULL;
+  }
+  *len = clip_convert(clip_text, clip_size);
+  return clip_text;
+}
+
+void
+clip_free(void)
+{
+  if (clip_text != NULL)
+    FreeMem(clip_text, clip_size);
+  clip_text = NULL;
+  clip_size = 0;
+}
@@ -0,0 +1,13 @@
+#ifndef __AMIGATERM_CLIP_H__
+#define __AMIGATERM_CLIP_H__
+
+/*
+ * Fetch the text on the clipboard with its line endings turned into
+ * CRs, ready to send.  The buffer stays ours; it's good until the
+ * next clip_read_text() or clip_free().  Returns NULL (and says why)
+ * if there's no text to be had.
+ */
+extern unsigned char *clip_read_text(long *len);
+extern void clip_free(void);
+
+#endif
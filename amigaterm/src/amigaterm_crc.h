@@ -0,0 +1,9 @@
+#ifndef __AMIGATERM_CRC_H__
+#define __AMIGATERM_CRC_H__
+
+extern unsigned short crc16_update(unsigned short crc,
+    const unsigned char *buf, int len);
+extern unsigned long crc32_update(unsigned long crc,
+    const unsigned char *buf, int len);
+
+#endif
@@ -0,0 +1,930 @@
+/*
+ * rsync style delta transfers.
+ *
+ * The side with the old copy of a file (the receiver) builds a
+ * signature file describing it block by block - a weak rolling
+ * checksum and a CRC-32 for each block.  The sender slides a
+ * window over its copy, and wherever the weak checksum and then
+ * the CRC match a block the receiver already has, it sends a
+ * reference to that block rather than the data.  The receiver then
+ * rebuilds the file from its old copy plus the literal data.
+ *
+ * The signatures and the delta are plain files moved with the
+ * existing xmodem code.  Both formats are self delimiting, so it
+ * doesn't matter that xmodem pads them out to a whole block.
+ *
+ * Signature file, all values big endian:
+ *   "ATDS", block size (4), file length (4), block count (4),
+ *   then for each block: weak checksum (4), CRC-32 (4)
+ *
+ * Delta file:
+ *   "ATDD", block size (4), then any number of:
+ *   'L', length (2), data        - literal data
+ *   'C', block (4), count (2)    - copy blocks from the old file
+ *   'E', length (4), CRC-32 (4)  - end; the whole new file's CRC
+ */
+#include "dos/dos.h"              // for BPTR, MODE_NEWFILE, ACCESS_READ
+#include "exec/memory.h"          // for MEMF_CLEAR, MEMF_PUBLIC
+#include "proto/dos.h"            // for Close, Open, Lock, Rename
+#include "proto/exec.h"           // for FreeMem, DoIO, GetMsg, AllocMem
+#include <exec/types.h>           // for FALSE, TRUE, UBYTE, CONST_STRPTR
+#include <stdio.h>                // for NULL, snprintf
+#include <string.h>               // for memcpy, memmove
+#include <stdbool.h>
+
+#include "amigaterm_crc.h"
+#include "amigaterm_xmodem.h"
+#include "amigaterm_delta.h"
+
+/* Where the signature and delta live while they're moved about */
+#define DELTA_SIG_TMP "RAM:amigaterm.sig"
+#define DELTA_DELTA_TMP "RAM:amigaterm.delta"
+
+/*
+ * Block size grows from DELTA_MIN_BLKSIZE (in powers of two) until
+ * the file fits in DELTA_TARGET_BLOCKS blocks, which keeps both
+ * the signature file and the sender's lookup table small.
+ */
+#define DELTA_MIN_BLKSIZE 512
+#define DELTA_MAX_BLKSIZE 8192
+#define DELTA_TARGET_BLOCKS 1024
+
+/* The sender's window holds this many blocks */
+#define DELTA_WIN_BLOCKS 4
+
+#define DELTA_IOBUF 1024
+#define DELTA_COPYBUF 4096
+
+/*
+ * Anything using this will need to define an emits() function to print
+ * a string.
+ */
+extern void emits(const char *);
+
+/* Buffered output; only one of these is in use at a time */
+static struct {
+  BPTR fh;
+  int len;
+  bool error;
+  unsigned char buf[DELTA_IOBUF];
+} delta_out;
+
+/* Buffered input, likewise */
+static struct {
+  BPTR fh;
+  int pos, len;
+  bool eof;
+  unsigned char buf[DELTA_IOBUF];
+} delta_in;
+
+/* The sender's copy of the signatures */
+static struct {
+  long blksize, flen, count;
+  int blkshift;
+  unsigned long *weak;
+  unsigned long *strong;
+  long *chain;
+  long *bucket;
+  long nbuckets;
+} delta_sigs;
+
+/* A pending run of copied blocks, merged before it's written */
+static long copy_start, copy_count;
+
+/***************************************/
+/*  Buffered file IO                   */
+/***************************************/
+
+static void
+delta_out_flush(void)
+{
+  if ((delta_out.len > 0) && (delta_out.error == false)) {
+    if (Write(delta_out.fh, delta_out.buf, delta_out.len) != delta_out.len)
+      delta_out.error = true;
+  }
+  delta_out.len = 0;
+}
+
+static void
+delta_out_bytes(const unsigned char *p, long len)
+{
+  int n;
+
+  /* Big runs skip the buffer */
+  if (len >= DELTA_IOBUF) {
+    delta_out_flush();
+    if ((delta_out.error == false) && (Write(delta_out.fh, p, len) != len))
+      delta_out.error = true;
+    return;
+  }
+
+  while (len > 0) {
+    n = DELTA_IOBUF - delta_out.len;
+    if (n > len)
+      n = len;
+    memcpy(&delta_out.buf[delta_out.len], p, n);
+    delta_out.len += n;
+    p += n;
+    len -= n;
+    if (delta_out.len == DELTA_IOBUF)
+      delta_out_flush();
+  }
+}
+
+static void
+delta_out_byte(unsigned char c)
+{
+  delta_out_bytes(&c, 1);
+}
+
+static void
+delta_out_be16(unsigned int v)
+{
+  unsigned char b[2];
+
+  b[0] = (v >> 8) & 0xff;
+  b[1] = v & 0xff;
+  delta_out_bytes(b, 2);
+}
+
+static void
+delta_out_be32(unsigned long v)
+{
+  unsigned char b[4];
+
+  b[0] = (v >> 24) & 0xff;
+  b[1] = (v >> 16) & 0xff;
+  b[2] = (v >> 8) & 0xff;
+  b[3] = v & 0xff;
+  delta_out_bytes(b, 4);
+}
+
+static void
+delta_in_start(BPTR fh)
+{
+  delta_in.fh = fh;
+  delta_in.pos = delta_in.len = 0;
+  delta_in.eof = false;
+}
+
+/*
+ * Read len bytes; returns false on a short read or error.
+ */
+static bool
+delta_in_bytes(unsigned char *p, long len)
+{
+  int n;
+
+  while (len > 0) {
+    if (delta_in.pos == delta_in.len) {
+      if (delta_in.eof)
+        return false;
+      delta_in.pos = 0;
+      delta_in.len = Read(delta_in.fh, delta_in.buf, DELTA_IOBUF);
+      if (delta_in.len <= 0) {
+        delta_in.len = 0;
+        delta_in.eof = true;
+        return false;
+      }
+    }
+    n = delta_in.len - delta_in.pos;
+    if (n > len)
+      n = len;
+    memcpy(p, &delta_in.buf[delta_in.pos], n);
+    delta_in.pos += n;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool
+delta_in_be32(unsigned long *v)
+{
+  unsigned char b[4];
+
+  if (delta_in_bytes(b, 4) == false)
+    return false;
+  *v = ((unsigned long) b[0] << 24) | ((unsigned long) b[1] << 16) |
+      ((unsigned long) b[2] << 8) | b[3];
+  return true;
+}
+
+static bool
+delta_in_be16(unsigned int *v)
+{
+  unsigned char b[2];
+
+  if (delta_in_bytes(b, 2) == false)
+    return false;
+  *v = (b[0] << 8) | b[1];
+  return true;
+}
+
+/***************************************/
+/*  Checksums                          */
+/***************************************/
+
+/*
+ * The rsync rolling checksum: s1 is the sum of the bytes, s2 the
+ * sum of the running s1 values, each kept to 16 bits.
+ */
+static void
+delta_weak_init(const unsigned char *p, long len, unsigned long *s1,
+    unsigned long *s2)
+{
+  unsigned long a = 0, b = 0;
+
+  while (len-- > 0) {
+    a += *p++;
+    b += a;
+  }
+  *s1 = a & 0xffff;
+  *s2 = b & 0xffff;
+}
+
+/*
+ * Roll the window one byte on: drop 'out', add 'in'.  The block
+ * size is a power of two so this is all shifts and adds.
+ */
+static inline void
+delta_weak_roll(unsigned long *s1, unsigned long *s2, unsigned char out,
+    unsigned char in, int blkshift)
+{
+  *s1 = (*s1 - out + in) & 0xffff;
+  *s2 = (*s2 - ((unsigned long) out << blkshift) + *s1) & 0xffff;
+}
+
+static inline unsigned long
+delta_weak(unsigned long s1, unsigned long s2)
+{
+  return (s2 << 16) | s1;
+}
+
+static long
+delta_pick_blksize(long flen, int *shift)
+{
+  long blksize = DELTA_MIN_BLKSIZE;
+
+  *shift = 9;
+  while ((blksize < DELTA_MAX_BLKSIZE) &&
+      (flen / blksize > DELTA_TARGET_BLOCKS)) {
+    blksize <<= 1;
+    (*shift)++;
+  }
+  return blksize;
+}
+
+/***************************************/
+/*  Signatures (receiver)              */
+/***************************************/
+
+/*
+ * Write the signature file for 'basis'.  A missing basis gives an
+ * empty signature, so the delta will just be the whole file.
+ */
+int
+delta_sig_create(const char *basis, const char *sigfile)
+{
+  BPTR in, out;
+  long flen, blksize, count, i;
+  unsigned long s1, s2;
+  unsigned char *blk = NULL;
+  int shift, n;
+  int ret = FALSE;
+
+  flen = 0;
+  if ((in = Open((UBYTE *) basis, MODE_OLDFILE)) != 0) {
+    Seek(in, 0, OFFSET_END);
+    flen = Seek(in, 0, OFFSET_BEGINNING);
+    if (flen < 0)
+      flen = 0;
+  }
+
+  blksize = delta_pick_blksize(flen, &shift);
+  count = (flen + blksize - 1) / blksize;
+
+  if ((out = Open((UBYTE *) sigfile, MODE_NEWFILE)) == 0) {
+    emits("Cannot Open Signature File\n");
+    goto done;
+  }
+
+  blk = AllocMem(blksize, MEMF_PUBLIC);
+  if (blk == NULL) {
+    emits("Out of memory\n");
+    goto done;
+  }
+
+  delta_out.fh = out;
+  delta_out.len = 0;
+  delta_out.error = false;
+
+  delta_out_bytes((const unsigned char *) "ATDS", 4);
+  delta_out_be32(blksize);
+  delta_out_be32(flen);
+  delta_out_be32(count);
+
+  for (i = 0; i < count; i++) {
+    n = Read(in, blk, blksize);
+    if (n <= 0) {
+      emits("Error Reading File\n");
+      goto done;
+    }
+    delta_weak_init(blk, n, &s1, &s2);
+    delta_out_be32(delta_weak(s1, s2));
+    delta_out_be32(crc32_update(0, blk, n));
+  }
+  delta_out_flush();
+  ret = (delta_out.error == false);
+  if (ret == FALSE)
+    emits("Error Writing Signature File\n");
+
+done:
+  if (blk != NULL)
+    FreeMem(blk, blksize);
+  if (out != 0)
+    Close(out);
+  if (in != 0)
+    Close(in);
+  return ret;
+}
+
+/***************************************/
+/*  Delta generation (sender)          */
+/***************************************/
+
+static void
+delta_sigs_free(void)
+{
+  if (delta_sigs.weak != NULL)
+    FreeMem(delta_sigs.weak, delta_sigs.count * sizeof(unsigned long));
+  if (delta_sigs.strong != NULL)
+    FreeMem(delta_sigs.strong, delta_sigs.count * sizeof(unsigned long));
+  if (delta_sigs.chain != NULL)
+    FreeMem(delta_sigs.chain, delta_sigs.count * sizeof(long));
+  if (delta_sigs.bucket != NULL)
+    FreeMem(delta_sigs.bucket, delta_sigs.nbuckets * sizeof(long));
+  delta_sigs.weak = delta_sigs.strong = NULL;
+  delta_sigs.chain = delta_sigs.bucket = NULL;
+}
+
+static inline long
+delta_sigs_hash(unsigned long weak)
+{
+  return (weak ^ (weak >> 16)) & (delta_sigs.nbuckets - 1);
+}
+
+/*
+ * Read the signature file into memory and hash it by weak checksum.
+ */
+static bool
+delta_sigs_load(const char *sigfile)
+{
+  BPTR fh;
+  unsigned char magic[4];
+  unsigned long v;
+  long i, h;
+  bool ret = false;
+
+  memset(&delta_sigs, 0, sizeof(delta_sigs));
+
+  if ((fh = Open((UBYTE *) sigfile, MODE_OLDFILE)) == 0) {
+    emits("Cannot Open Signature File\n");
+    return false;
+  }
+  delta_in_start(fh);
+
+  if ((delta_in_bytes(magic, 4) == false) ||
+      (memcmp(magic, "ATDS", 4) != 0))
+    goto bad;
+  if (delta_in_be32(&v) == false)
+    goto bad;
+  delta_sigs.blksize = v;
+  if (delta_in_be32(&v) == false)
+    goto bad;
+  delta_sigs.flen = v;
+  if (delta_in_be32(&v) == false)
+    goto bad;
+  delta_sigs.count = v;
+
+  /* Block size must be a power of two we'd have picked ourselves */
+  for (delta_sigs.blkshift = 9;
+      (1L << delta_sigs.blkshift) < delta_sigs.blksize;
+      delta_sigs.blkshift++)
+    ;
+  if ((delta_sigs.blksize < DELTA_MIN_BLKSIZE) ||
+      (delta_sigs.blksize > DELTA_MAX_BLKSIZE) ||
+      ((1L << delta_sigs.blkshift) != delta_sigs.blksize) ||
+      (delta_sigs.count !=
+       (delta_sigs.flen + delta_sigs.blksize - 1) / delta_sigs.blksize))
+    goto bad;
+
+  /* Roughly one bucket per block, as a power of two */
+  delta_sigs.nbuckets = 256;
+  while ((delta_sigs.nbuckets < delta_sigs.count) &&
+      (delta_sigs.nbuckets < 16384))
+    delta_sigs.nbuckets <<= 1;
+
+  if (delta_sigs.count > 0) {
+    delta_sigs.weak = AllocMem(delta_sigs.count * sizeof(unsigned long),
+        MEMF_PUBLIC);
+    delta_sigs.strong = AllocMem(delta_sigs.count * sizeof(unsigned long),
+        MEMF_PUBLIC);
+    delta_sigs.chain = AllocMem(delta_sigs.count * sizeof(long),
+        MEMF_PUBLIC);
+  }
+  delta_sigs.bucket = AllocMem(delta_sigs.nbuckets * sizeof(long),
+      MEMF_PUBLIC);
+  if ((delta_sigs.bucket == NULL) || ((delta_sigs.count > 0) &&
+      ((delta_sigs.weak == NULL) || (delta_sigs.strong == NULL) ||
+       (delta_sigs.chain == NULL)))) {
+    emits("Out of memory\n");
+    goto done;
+  }
+
+  for (i = 0; i < delta_sigs.nbuckets; i++)
+    delta_sigs.bucket[i] = -1;
+
+  for (i = 0; i < delta_sigs.count; i++) {
+    if ((delta_in_be32(&delta_sigs.weak[i]) == false) ||
+        (delta_in_be32(&delta_sigs.strong[i]) == false))
+      goto bad;
+  }
+
+  /* Insert backwards so each chain runs in file order */
+  for (i = delta_sigs.count - 1; i >= 0; i--) {
+    h = delta_sigs_hash(delta_sigs.weak[i]);
+    delta_sigs.chain[i] = delta_sigs.bucket[h];
+    delta_sigs.bucket[h] = i;
+  }
+
+  ret = true;
+  goto done;
+
+bad:
+  emits("Invalid Signature File\n");
+done:
+  Close(fh);
+  if (ret == false)
+    delta_sigs_free();
+  return ret;
+}
+
+/* Length of block i in the receiver's copy; only the last can be short */
+static inline long
+delta_sigs_blklen(long i)
+{
+  if (i == delta_sigs.count - 1)
+    return delta_sigs.flen - (i << delta_sigs.blkshift);
+  return delta_sigs.blksize;
+}
+
+/*
+ * Find a block of the receiver's copy matching these len bytes.
+ *
+ * The block following the current copy run is tried first so
+ * unchanged stretches come out as one long copy.  The CRC is only
+ * computed once a weak checksum matches.
+ */
+static long
+delta_sigs_find(unsigned long weak, const unsigned char *p, long len)
+{
+  unsigned long strong = 0;
+  bool have_strong = false;
+  long i, next;
+
+  next = copy_start + copy_count;
+  if ((copy_count > 0) && (next < delta_sigs.count) &&
+      (delta_sigs.weak[next] == weak) &&
+      (delta_sigs_blklen(next) == len)) {
+    strong = crc32_update(0, p, len);
+    have_strong = true;
+    if (delta_sigs.strong[next] == strong)
+      return next;
+  }
+
+  for (i = delta_sigs.bucket[delta_sigs_hash(weak)]; i >= 0;
+      i = delta_sigs.chain[i]) {
+    if ((delta_sigs.weak[i] != weak) || (delta_sigs_blklen(i) != len))
+      continue;
+    if (have_strong == false) {
+      strong = crc32_update(0, p, len);
+      have_strong = true;
+    }
+    if (delta_sigs.strong[i] == strong)
+      return i;
+  }
+  return -1;
+}
+
+static void
+delta_emit_copy_flush(void)
+{
+  if (copy_count == 0)
+    return;
+  delta_out_byte('C');
+  delta_out_be32(copy_start);
+  delta_out_be16(copy_count);
+  copy_count = 0;
+}
+
+static void
+delta_emit_copy(long idx)
+{
+  if ((copy_count > 0) && (idx == copy_start + copy_count) &&
+      (copy_count < 0xffff)) {
+    copy_count++;
+    return;
+  }
+  delta_emit_copy_flush();
+  copy_start = idx;
+  copy_count = 1;
+}
+
+static void
+delta_emit_literal(const unsigned char *p, long len)
+{
+  long n;
+
+  if (len <= 0)
+    return;
+  delta_emit_copy_flush();
+  while (len > 0) {
+    n = (len > 0xffff) ? 0xffff : len;
+    delta_out_byte('L');
+    delta_out_be16(n);
+    delta_out_bytes(p, n);
+    p += n;
+    len -= n;
+  }
+}
+
+/*
+ * Write a delta which turns the receiver's copy (described by
+ * sigfile) into 'file'.
+ */
+int
+delta_generate(const char *file, const char *sigfile, const char *deltafile)
+{
+  BPTR in = 0, out = 0;
+  unsigned char *win = NULL;
+  long winsize = 0, avail, pos, lit, idx, blksize, n;
+  long new_len = 0, lit_bytes = 0;
+  unsigned long s1 = 0, s2 = 0, crc = 0;
+  bool have_weak, eof;
+  int ret = FALSE;
+  char msg[64];
+
+  if (delta_sigs_load(sigfile) == false)
+    return FALSE;
+  blksize = delta_sigs.blksize;
+
+  if ((in = Open((UBYTE *) file, MODE_OLDFILE)) == 0) {
+    emits("Cannot Open Send File\n");
+    goto done;
+  }
+  if ((out = Open((UBYTE *) deltafile, MODE_NEWFILE)) == 0) {
+    emits("Cannot Open Delta File\n");
+    goto done;
+  }
+
+  winsize = blksize * DELTA_WIN_BLOCKS;
+  win = AllocMem(winsize, MEMF_PUBLIC);
+  if (win == NULL) {
+    emits("Out of memory\n");
+    goto done;
+  }
+
+  delta_out.fh = out;
+  delta_out.len = 0;
+  delta_out.error = false;
+  copy_start = copy_count = 0;
+
+  delta_out_bytes((const unsigned char *) "ATDD", 4);
+  delta_out_be32(blksize);
+
+  avail = pos = lit = 0;
+  have_weak = eof = false;
+
+  while (1) {
+    /*
+     * Make sure there's a whole block plus the next byte to roll
+     * in.  Pending literals are written out first so the window
+     * can be slid down over them.
+     */
+    if ((pos + blksize >= avail) && (eof == false)) {
+      delta_emit_literal(&win[lit], pos - lit);
+      crc = crc32_update(crc, &win[lit], pos - lit);
+      lit_bytes += pos - lit;
+      new_len += pos - lit;
+
+      memmove(win, &win[pos], avail - pos);
+      avail -= pos;
+      pos = lit = 0;
+
+      while ((avail < winsize) && (eof == false)) {
+        n = Read(in, &win[avail], winsize - avail);
+        if (n < 0) {
+          emits("Error Reading File\n");
+          goto done;
+        }
+        if (n == 0)
+          eof = true;
+        avail += n;
+      }
+      continue;
+    }
+
+    /* Less than a block left; that's the tail */
+    if (pos + blksize > avail)
+      break;
+
+    if (have_weak == false) {
+      delta_weak_init(&win[pos], blksize, &s1, &s2);
+      have_weak = true;
+    }
+
+    idx = delta_sigs_find(delta_weak(s1, s2), &win[pos], blksize);
+    if (idx >= 0) {
+      delta_emit_literal(&win[lit], pos - lit);
+      crc = crc32_update(crc, &win[lit], pos - lit);
+      lit_bytes += pos - lit;
+      delta_emit_copy(idx);
+      crc = crc32_update(crc, &win[pos], blksize);
+      new_len += (pos - lit) + blksize;
+      pos += blksize;
+      lit = pos;
+      have_weak = false;
+      continue;
+    }
+
+    /* No match; roll on a byte if we can, else it's the tail */
+    if (pos + blksize < avail) {
+      delta_weak_roll(&s1, &s2, win[pos], win[pos + blksize],
+          delta_sigs.blkshift);
+      pos++;
+    } else {
+      pos++;
+      have_weak = false;
+    }
+  }
+
+  /*
+   * The tail may still match the receiver's short last block;
+   * anything else left over is literal.
+   */
+  n = avail - pos;
+  idx = -1;
+  if ((n > 0) && (n < blksize)) {
+    delta_weak_init(&win[pos], n, &s1, &s2);
+    idx = delta_sigs_find(delta_weak(s1, s2), &win[pos], n);
+  }
+  if (idx >= 0) {
+    delta_emit_literal(&win[lit], pos - lit);
+    crc = crc32_update(crc, &win[lit], pos - lit);
+    lit_bytes += pos - lit;
+    delta_emit_copy(idx);
+    crc = crc32_update(crc, &win[pos], n);
+    new_len += (pos - lit) + n;
+  } else {
+    delta_emit_literal(&win[lit], avail - lit);
+    crc = crc32_update(crc, &win[lit], avail - lit);
+    lit_bytes += avail - lit;
+    new_len += avail - lit;
+  }
+  delta_emit_copy_flush();
+
+  delta_out_byte('E');
+  delta_out_be32(new_len);
+  delta_out_be32(crc);
+  delta_out_flush();
+
+  if (delta_out.error) {
+    emits("Error Writing Delta File\n");
+    goto done;
+  }
+
+  snprintf(msg, sizeof(msg), "Delta: %ld of %ld bytes literal\n",
+      lit_bytes, new_len);
+  emits(msg);
+  ret = TRUE;
+
+done:
+  if (win != NULL)
+    FreeMem(win, winsize);
+  if (out != 0)
+    Close(out);
+  if (in != 0)
+    Close(in);
+  delta_sigs_free();
+  return ret;
+}
+
+/***************************************/
+/*  Delta application (receiver)       */
+/***************************************/
+
+/*
+ * Rebuild the new file into outfile from basis plus deltafile.
+ * Only returns TRUE if the result's length and CRC-32 match
+ * what the sender had.
+ */
+int
+delta_apply(const char *basis, const char *deltafile, const char *outfile)
+{
+  BPTR din = 0, bin = 0, out = 0;
+  unsigned char *buf = NULL;
+  unsigned char magic[4], op;
+  unsigned long blksize, v, crc = 0, want_len, want_crc;
+  unsigned int len;
+  long total = 0, n, want;
+  int ret = FALSE;
+
+  if ((din = Open((UBYTE *) deltafile, MODE_OLDFILE)) == 0) {
+    emits("Cannot Open Delta File\n");
+    goto done;
+  }
+  /* No old copy is fine; the delta just mustn't refer to it */
+  bin = Open((UBYTE *) basis, MODE_OLDFILE);
+  if ((out = Open((UBYTE *) outfile, MODE_NEWFILE)) == 0) {
+    emits("Cannot Open File\n");
+    goto done;
+  }
+  buf = AllocMem(DELTA_COPYBUF, MEMF_PUBLIC);
+  if (buf == NULL) {
+    emits("Out of memory\n");
+    goto done;
+  }
+
+  delta_in_start(din);
+  if ((delta_in_bytes(magic, 4) == false) ||
+      (memcmp(magic, "ATDD", 4) != 0) ||
+      (delta_in_be32(&blksize) == false))
+    goto bad;
+
+  while (1) {
+    if (delta_in_bytes(&op, 1) == false)
+      goto bad;
+
+    switch (op) {
+    case 'L':
+      if (delta_in_be16(&len) == false)
+        goto bad;
+      while (len > 0) {
+        n = (len > DELTA_COPYBUF) ? DELTA_COPYBUF : len;
+        if (delta_in_bytes(buf, n) == false)
+          goto bad;
+        if (Write(out, buf, n) != n)
+          goto write_error;
+        crc = crc32_update(crc, buf, n);
+        total += n;
+        len -= n;
+      }
+      break;
+    case 'C':
+      if ((delta_in_be32(&v) == false) || (delta_in_be16(&len) == false))
+        goto bad;
+      if ((bin == 0) || (Seek(bin, v * blksize, OFFSET_BEGINNING) < 0))
+        goto bad;
+      /* The last block may be short; a short read ends the copy */
+      want = (long) len * blksize;
+      while (want > 0) {
+        n = Read(bin, buf, (want > DELTA_COPYBUF) ? DELTA_COPYBUF : want);
+        if (n < 0)
+          goto bad;
+        if (n == 0)
+          break;
+        if (Write(out, buf, n) != n)
+          goto write_error;
+        crc = crc32_update(crc, buf, n);
+        total += n;
+        want -= n;
+      }
+      break;
+    case 'E':
+      if ((delta_in_be32(&want_len) == false) ||
+          (delta_in_be32(&want_crc) == false))
+        goto bad;
+      if ((want_len != total) || (want_crc != crc)) {
+        emits("Delta result doesn't match the sender's file\n");
+        goto done;
+      }
+      ret = TRUE;
+      goto done;
+    default:
+      goto bad;
+    }
+  }
+
+write_error:
+  emits("Error Writing File\n");
+  goto done;
+bad:
+  emits("Invalid Delta File\n");
+done:
+  if (buf != NULL)
+    FreeMem(buf, DELTA_COPYBUF);
+  if (out != 0)
+    Close(out);
+  if (bin != 0)
+    Close(bin);
+  if (din != 0)
+    Close(din);
+  return ret;
+}
+
+/***************************************/
+/*  Delta transfers over xmodem        */
+/***************************************/
+
+/*
+ * Send an updated copy of 'file' to a receiver which already has
+ * an older one.  The receiver goes first with the signatures.
+ */
+int
+DELTA_Send_File(char *file)
+{
+  int ret = FALSE;
+
+  emits("Waiting for signatures...\n");
+  if (XMODEM_Read_File(DELTA_SIG_TMP, -1) == FALSE)
+    goto done;
+
+  emits("Computing delta...\n");
+  if (delta_generate(file, DELTA_SIG_TMP, DELTA_DELTA_TMP) == FALSE)
+    goto done;
+
+  ret = XMODEM_Send_File(DELTA_DELTA_TMP);
+
+done:
+  DeleteFile((UBYTE *) DELTA_SIG_TMP);
+  DeleteFile((UBYTE *) DELTA_DELTA_TMP);
+  return ret;
+}
+
+/*
+ * Update 'file' from a sender using DELTA_Send_File().  The new
+ * copy is built alongside as file.new and only replaces the old
+ * one once it has been verified.
+ */
+int
+DELTA_Read_File(char *file)
+{
+  char newname[40], oldname[40];
+  BPTR lock;
+  int ret = FALSE;
+
+  snprintf(newname, sizeof(newname), "%s.new", file);
+  snprintf(oldname, sizeof(oldname), "%s.old", file);
+
+  emits("Computing signatures...\n");
+  if (delta_sig_create(file, DELTA_SIG_TMP) == FALSE)
+    goto done;
+
+  if (XMODEM_Send_File(DELTA_SIG_TMP) == FALSE)
+    goto done;
+
+  emits("\nWaiting for delta...\n");
+  if (XMODEM_Read_File(DELTA_DELTA_TMP, -1) == FALSE)
+    goto done;
+
+  if (delta_apply(file, DELTA_DELTA_TMP, newname) == FALSE) {
+    DeleteFile((UBYTE *) newname);
+    goto done;
+  }
+
+  /* No original (the delta built it from nothing); just rename */
+  if ((lock = Lock((UBYTE *) file, ACCESS_READ)) == 0) {
+    if (Rename((UBYTE *) newname, (UBYTE *) file) == 0) {
+      emits("Couldn't rename the new file into place\n");
+      goto done;
+    }
+    ret = TRUE;
+    goto done;
+  }
+  UnLock(lock);
+
+  /*
+   * Rename won't replace a file, so move the original aside and
+   * only delete it once the new one is in its place; until then
+   * one or the other is always there under its own name.
+   */
+  DeleteFile((UBYTE *) oldname);
+  if (Rename((UBYTE *) file, (UBYTE *) oldname) == 0) {
+    emits("Couldn't move the original file aside\n");
+    DeleteFile((UBYTE *) newname);
+    goto done;
+  }
+  if (Rename((UBYTE *) newname, (UBYTE *) file) == 0) {
+    emits("Couldn't rename the new file into place\n");
+    Rename((UBYTE *) oldname, (UBYTE *) file);
+    goto done;
+  }
+  DeleteFile((UBYTE *) oldname);
+  ret = TRUE;
+
+done:
+  DeleteFile((UBYTE *) DELTA_SIG_TMP);
+  DeleteFile((UBYTE *) DELTA_DELTA_TMP);
+  return ret;
+}
@@ -0,0 +1,15 @@
+#ifndef __AMIGATERM_DELTA_H__
+#define __AMIGATERM_DELTA_H__
+
+/* Building blocks */
+extern int delta_sig_create(const char *basis, const char *sigfile);
+extern int delta_generate(const char *file, const char *sigfile,
+    const char *deltafile);
+extern int delta_apply(const char *basis, const char *deltafile,
+    const char *outfile);
+
+/* Delta transfers over xmodem */
+extern int DELTA_Send_File(char *file);
+extern int DELTA_Read_File(char *file);
+
+#endif
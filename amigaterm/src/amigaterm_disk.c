@@ -0,0 +1,359 @@
+/*
+ * Whole disk images over xmodem.
+ *
+ * The disk is read or written a track (NUMSECS sectors) at a time
+ * through trackdisk.device, into two chip memory track buffers
+ * used in turn.  When sending, the next track is read with SendIO()
+ * as soon as the current one starts going out, so the drive works
+ * while the serial port does; when receiving, a full track is
+ * written out the same way while the next one fills.
+ *
+ * An image file (eg an ADF) can stand in for the drive; it goes
+ * through the same track buffers, just without the overlap.
+ */
+#include "dos/dos.h"              // for BPTR, MODE_NEWFILE, MODE_OLDFILE
+#include "exec/io.h"              // for IOStdReq, CMD_READ, CMD_WRITE
+#include "exec/memory.h"          // for MEMF_CHIP, MEMF_PUBLIC
+#include "exec/ports.h"           // for MsgPort
+#include "proto/dos.h"            // for Close, Open, Write, Read, Seek
+#include "proto/exec.h"           // for FreeMem, DoIO, SendIO, AllocMem
+#include "clib/alib_protos.h"     // for CreatePort, CreateExtIO
+#include "devices/trackdisk.h"    // for IOExtTD, TD_SECTOR, NUMSECS
+#include <exec/types.h>           // for FALSE, TRUE, UBYTE, CONST_STRPTR
+#include <stdio.h>                // for NULL, snprintf
+#include <string.h>               // for memcpy, memset
+#include <stdbool.h>
+
+#include "amigaterm_xmodem.h"
+#include "amigaterm_disk.h"
+
+#define DISK_TRACK (NUMSECS * TD_SECTOR)
+
+/* An 880K floppy; also the size of a stand-in image being written */
+#define DISK_TRACKS_DEFAULT 160
+
+struct disk {
+  struct MsgPort *port;
+  struct IOExtTD *io;         /* NULL for an image file */
+  bool dev_open;
+  BPTR fh;
+  bool writing, failed;
+  int track, tracks;          /* the next track to start; how many */
+  unsigned char *tbuf[2];
+  int cur;                    /* buffer being emptied or filled */
+  long pos, fill;
+  int pending;                /* buffer with a track under way, or -1 */
+  long pending_len;
+};
+
+static struct disk disk_img;
+
+/*
+ * Anything using this will need to define an emits() function to print
+ * a string.
+ */
+extern void emits(const char *);
+
+/*
+ * "DF0:" to "DF3:" give the unit number; anything else is taken
+ * to be an image file.
+ */
+static int
+disk_unit(const char *dev)
+{
+  if (((dev[0] | 0x20) == 'd') && ((dev[1] | 0x20) == 'f') &&
+      (dev[2] >= '0') && (dev[2] <= '3') && (dev[3] == ':') &&
+      (dev[4] == '\0'))
+    return dev[2] - '0';
+  return -1;
+}
+
+static void
+disk_error(struct disk *d, int track)
+{
+  char msg[48];
+
+  snprintf(msg, sizeof(msg), "Disk error %d on track %d\n",
+      (int) d->io->iotd_Req.io_Error, track);
+  emits(msg);
+}
+
+/*
+ * Start reading or writing the next track into/out of tbuf[i].
+ * With an image file it's all done by the time this returns.
+ */
+static void
+disk_start(struct disk *d, int i, long len)
+{
+  if (d->io != NULL) {
+    d->io->iotd_Req.io_Command = d->writing ? CMD_WRITE : CMD_READ;
+    d->io->iotd_Req.io_Data = (APTR) d->tbuf[i];
+    d->io->iotd_Req.io_Length = len;
+    d->io->iotd_Req.io_Offset = (ULONG) d->track * DISK_TRACK;
+    SendIO((struct IORequest *) d->io);
+  } else {
+    if (d->writing)
+      d->pending_len = Write(d->fh, d->tbuf[i], len);
+    else
+      d->pending_len = Read(d->fh, d->tbuf[i], len);
+    if ((d->pending_len < 0) || (d->writing && (d->pending_len != len))) {
+      emits("Image file error\n");
+      d->failed = true;
+    }
+  }
+  d->pending = i;
+  d->track++;
+}
+
+/*
+ * Wait for the track under way, if there is one.
+ */
+static bool
+disk_wait(struct disk *d)
+{
+  if (d->pending < 0)
+    return (d->failed == false);
+  d->pending = -1;
+
+  if (d->io != NULL) {
+    if (WaitIO((struct IORequest *) d->io) != 0) {
+      disk_error(d, d->track - 1);
+      d->failed = true;
+    } else
+      d->pending_len = d->io->iotd_Req.io_Actual;
+  }
+  return (d->failed == false);
+}
+
+/*
+ * Do an immediate command; true if it went OK.
+ */
+static bool
+disk_cmd(struct disk *d, UWORD cmd, ULONG len)
+{
+  d->io->iotd_Req.io_Command = cmd;
+  d->io->iotd_Req.io_Length = len;
+  return (DoIO((struct IORequest *) d->io) == 0);
+}
+
+static bool
+disk_close(struct disk *d, bool ok);
+
+static bool
+disk_open(struct disk *d, char *dev, bool writing)
+{
+  int unit = disk_unit(dev);
+  long size;
+
+  memset(d, 0, sizeof(*d));
+  d->writing = writing;
+  d->pending = -1;
+  d->tracks = DISK_TRACKS_DEFAULT;
+
+  /* trackdisk.device only does DMA to and from chip memory */
+  d->tbuf[0] = AllocMem(DISK_TRACK * 2, MEMF_CHIP | MEMF_PUBLIC);
+  if (d->tbuf[0] == NULL) {
+    emits("Not enough chip memory\n");
+    return false;
+  }
+  d->tbuf[1] = d->tbuf[0] + DISK_TRACK;
+
+  if (unit < 0) {
+    d->fh = Open((UBYTE *) dev, writing ? MODE_NEWFILE : MODE_OLDFILE);
+    if (d->fh == 0) {
+      emits("Cannot Open Image File\n");
+      goto error;
+    }
+    if (writing == false) {
+      Seek(d->fh, 0, OFFSET_END);
+      size = Seek(d->fh, 0, OFFSET_BEGINNING);
+      d->tracks = (size + DISK_TRACK - 1) / DISK_TRACK;
+    }
+    return true;
+  }
+
+  d->port = CreatePort(NULL, 0);
+  if (d->port == NULL)
+    goto error;
+  d->io = (struct IOExtTD *) CreateExtIO(d->port, sizeof(struct IOExtTD));
+  if (d->io == NULL)
+    goto error;
+  if (OpenDevice((CONST_STRPTR) TD_NAME, unit, (struct IORequest *) d->io,
+      0)) {
+    emits("Can't open trackdisk.device\n");
+    goto error;
+  }
+  d->dev_open = true;
+
+  if ((disk_cmd(d, TD_CHANGESTATE, 0) == false) ||
+      (d->io->iotd_Req.io_Actual != 0)) {
+    emits("No disk in drive\n");
+    goto error;
+  }
+  if (writing && ((disk_cmd(d, TD_PROTSTATUS, 0) == false) ||
+      (d->io->iotd_Req.io_Actual != 0))) {
+    emits("Disk is write protected\n");
+    goto error;
+  }
+  if (disk_cmd(d, TD_GETNUMTRACKS, 0))
+    d->tracks = d->io->iotd_Req.io_Actual;
+  return true;
+
+error:
+  disk_close(d, false);
+  return false;
+}
+
+/*
+ * Send off the track buffer being filled, once the other one is
+ * free again.
+ */
+static bool
+disk_flush(struct disk *d)
+{
+  long len = d->pos;
+
+  if (d->track >= d->tracks) {
+    emits("Image is bigger than the disk\n");
+    d->failed = true;
+    return false;
+  }
+  if (disk_wait(d) == false)
+    return false;
+
+  /* The drive only takes whole tracks */
+  if ((d->io != NULL) && (len < DISK_TRACK)) {
+    memset(d->tbuf[d->cur] + len, 0, DISK_TRACK - len);
+    len = DISK_TRACK;
+  }
+  disk_start(d, d->cur, len);
+  d->cur ^= 1;
+  d->pos = 0;
+  return (d->failed == false);
+}
+
+/*
+ * Finish up; ok says whether to write out what's left of a
+ * received image.
+ */
+static bool
+disk_close(struct disk *d, bool ok)
+{
+  if (d->writing && ok && (d->pos > 0))
+    disk_flush(d);
+  disk_wait(d);
+
+  if (d->dev_open) {
+    /* trackdisk.device holds on to the last track until told */
+    if (d->writing && (disk_cmd(d, CMD_UPDATE, 0) == false)) {
+      disk_error(d, d->track - 1);
+      d->failed = true;
+    }
+    disk_cmd(d, TD_MOTOR, 0);
+    CloseDevice((struct IORequest *) d->io);
+  }
+  if (d->io != NULL)
+    DeleteExtIO((struct IORequest *) d->io);
+  if (d->port != NULL)
+    DeletePort(d->port);
+  if (d->fh != 0)
+    Close(d->fh);
+  if (d->tbuf[0] != NULL)
+    FreeMem(d->tbuf[0], DISK_TRACK * 2);
+  return (d->failed == false);
+}
+
+/*
+ * Fill the whole of buf, across tracks, unless the image ends
+ * first: xmodem starts its LZ dictionary over with each read, so a
+ * short one mid-image would throw its history away.
+ */
+static long
+disk_read(void *arg, unsigned char *buf, long len)
+{
+  struct disk *d = arg;
+  long n, done = 0;
+
+  while (done < len) {
+    if (d->pos == d->fill) {
+      if (d->pending < 0)
+        break;
+      d->cur = d->pending;
+      if (disk_wait(d) == false)
+        return -1;
+      d->fill = d->pending_len;
+      d->pos = 0;
+
+      /* Get the next track off the disk while this one goes out */
+      if (d->track < d->tracks)
+        disk_start(d, d->cur ^ 1, DISK_TRACK);
+      if (d->fill == 0)
+        break;
+    }
+
+    n = len - done;
+    if (n > d->fill - d->pos)
+      n = d->fill - d->pos;
+    memcpy(buf + done, d->tbuf[d->cur] + d->pos, n);
+    d->pos += n;
+    done += n;
+  }
+  return done;
+}
+
+static long
+disk_write(void *arg, const unsigned char *buf, long len)
+{
+  struct disk *d = arg;
+  long n, done = 0;
+
+  while (done < len) {
+    n = len - done;
+    if (n > DISK_TRACK - d->pos)
+      n = DISK_TRACK - d->pos;
+    memcpy(d->tbuf[d->cur] + d->pos, buf + done, n);
+    d->pos += n;
+    done += n;
+    if ((d->pos == DISK_TRACK) && (disk_flush(d) == false))
+      return -1;
+  }
+  return len;
+}
+
+int
+DISK_Send_Image(char *dev)
+{
+  struct xmodem_stream xs;
+  bool ok;
+
+  if (disk_open(&disk_img, dev, false) == false)
+    return FALSE;
+  emits("Sending Disk...\n");
+
+  /* Have the first track coming in before the receiver's ready */
+  disk_start(&disk_img, 0, DISK_TRACK);
+
+  xs.read = disk_read;
+  xs.write = disk_write;
+  xs.arg = &disk_img;
+  ok = XMODEM_Send_Stream(&xs);
+  return (disk_close(&disk_img, ok) && ok) ? TRUE : FALSE;
+}
+
+int
+DISK_Read_Image(char *dev)
+{
+  struct xmodem_stream xs;
+  bool ok;
+
+  if (disk_open(&disk_img, dev, true) == false)
+    return FALSE;
+  emits("Receiving Disk...\n");
+
+  xs.read = disk_read;
+  xs.write = disk_write;
+  xs.arg = &disk_img;
+  /* Anything past the end of the disk is xmodem padding */
+  ok = XMODEM_Read_Stream(&xs, (long) disk_img.tracks * DISK_TRACK);
+  return (disk_close(&disk_img, ok) && ok) ? TRUE : FALSE;
+}
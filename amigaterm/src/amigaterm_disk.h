@@ -0,0 +1,13 @@
+#ifndef __AMIGATERM_DISK_H__
+#define __AMIGATERM_DISK_H__
+
+/*
+ * Whole disk images over xmodem.
+ *
+ * dev is "DF0:" to "DF3:" for a floppy drive, or anything else for
+ * an image file which stands in for one.
+ */
+extern int DISK_Send_Image(char *dev);
+extern int DISK_Read_Image(char *dev);
+
+#endif
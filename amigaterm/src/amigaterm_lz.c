@@ -0,0 +1,169 @@
+/*
+ * A small LZSS compressor for transfer blocks.
+ *
+ * This is sized for a 68000: a 2KB hash table, no dynamic memory,
+ * and a greedy single-candidate match search.
+ *
+ * Matches may reach back into a dictionary - the bytes immediately
+ * before the data being compressed.  The transfer code uses the
+ * blocks already ACKed in the current buffer, which both ends hold
+ * identically, so a retransmit never depends on anything unacked.
+ *
+ * Stream format: a flag byte precedes each group of up to eight
+ * items, least significant bit first.  A 0 bit is a literal byte,
+ * a 1 bit is a two byte match:
+ *
+ *   byte 0: (length - LZ_MIN_MATCH) << 4 | (offset - 1) >> 8
+ *   byte 1: (offset - 1) & 0xff
+ *
+ * giving matches of 3..18 bytes up to 4096 bytes back.
+ */
+
+#include "amigaterm_lz.h"
+
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_MAX_OFFSET 4096
+#define LZ_HASH_BITS 10
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/*
+ * Most recent position for each hash of three bytes.
+ *
+ * This is never cleared.  Stale entries from an earlier block are
+ * harmless; a candidate is only used if it's behind the current
+ * position and the bytes really match.
+ */
+static unsigned short lz_hash[LZ_HASH_SIZE];
+
+static inline int
+lz_hash_bytes(const unsigned char *p)
+{
+  unsigned int h;
+
+  h = p[0];
+  h = (h << 3) ^ p[1];
+  h = (h << 3) ^ p[2];
+  h ^= h >> LZ_HASH_BITS;
+  return h & (LZ_HASH_SIZE - 1);
+}
+
+/*
+ * Compress srclen bytes starting at src + dictlen into dst.
+ * The dictlen bytes before them are available for matches.
+ *
+ * Returns the compressed length, or 0 if it wouldn't fit into
+ * dstmax bytes.  Pass dstmax smaller than srclen to bail out early
+ * on data that isn't worth compressing.
+ */
+int
+lz_compress(const unsigned char *src, int dictlen, int srclen,
+    unsigned char *dst, int dstmax)
+{
+  int ip, op, flag_pos, flag_bit, cand, len, max_len, h, i;
+
+  ip = dictlen;
+  srclen += dictlen;
+  op = 0;
+  flag_pos = 0;
+  flag_bit = 8;
+
+  while (ip < srclen) {
+    /* Start a new group of eight items */
+    if (flag_bit == 8) {
+      if (op >= dstmax)
+        return 0;
+      flag_pos = op++;
+      dst[flag_pos] = 0;
+      flag_bit = 0;
+    }
+
+    len = 0;
+    cand = 0;
+    if (ip + LZ_MIN_MATCH <= srclen) {
+      h = lz_hash_bytes(&src[ip]);
+      cand = lz_hash[h];
+      lz_hash[h] = ip;
+
+      if ((cand < ip) && (ip - cand <= LZ_MAX_OFFSET)) {
+        max_len = srclen - ip;
+        if (max_len > LZ_MAX_MATCH)
+          max_len = LZ_MAX_MATCH;
+        while ((len < max_len) && (src[cand + len] == src[ip + len]))
+          len++;
+      }
+    }
+
+    if (len >= LZ_MIN_MATCH) {
+      if (op + 2 > dstmax)
+        return 0;
+      dst[op++] = ((len - LZ_MIN_MATCH) << 4) | ((ip - cand - 1) >> 8);
+      dst[op++] = (ip - cand - 1) & 0xff;
+      dst[flag_pos] |= 1 << flag_bit;
+
+      /* Hash the bytes we skipped over so later matches can find them */
+      for (i = 1; i < len; i++) {
+        if (ip + i + LZ_MIN_MATCH <= srclen)
+          lz_hash[lz_hash_bytes(&src[ip + i])] = ip + i;
+      }
+      ip += len;
+    } else {
+      if (op >= dstmax)
+        return 0;
+      dst[op++] = src[ip++];
+    }
+    flag_bit++;
+  }
+
+  return op;
+}
+
+/*
+ * Decompress srclen bytes from src into dst + dictlen, producing at
+ * most dstlen bytes.  The dictlen bytes at dst must be the same
+ * dictionary the compressor was given.
+ *
+ * Returns the number of bytes produced, or -1 if the stream is
+ * malformed (eg a match reaching back before the dictionary.)
+ * The caller should check it got the length it expected.
+ */
+int
+lz_decompress(const unsigned char *src, int srclen, unsigned char *dst,
+    int dictlen, int dstlen)
+{
+  int ip, op, flags, flag_bit, len, off;
+
+  ip = 0;
+  op = dictlen;
+  dstlen += dictlen;
+  flags = 0;
+  flag_bit = 8;
+
+  while ((ip < srclen) && (op < dstlen)) {
+    if (flag_bit == 8) {
+      flags = src[ip++];
+      flag_bit = 0;
+      continue;
+    }
+
+    if (flags & (1 << flag_bit)) {
+      if (ip + 2 > srclen)
+        return -1;
+      len = (src[ip] >> 4) + LZ_MIN_MATCH;
+      off = (((src[ip] & 0x0f) << 8) | src[ip + 1]) + 1;
+      ip += 2;
+      if ((off > op) || (op + len > dstlen))
+        return -1;
+      /* Byte at a time; matches are allowed to overlap */
+      while (len-- > 0) {
+        dst[op] = dst[op - off];
+        op++;
+      }
+    } else {
+      dst[op++] = src[ip++];
+    }
+    flag_bit++;
+  }
+
+  return op - dictlen;
+}
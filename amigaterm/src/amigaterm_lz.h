@@ -0,0 +1,9 @@
+#ifndef __AMIGATERM_LZ_H__
+#define __AMIGATERM_LZ_H__
+
+extern int lz_compress(const unsigned char *src, int dictlen, int srclen,
+    unsigned char *dst, int dstmax);
+extern int lz_decompress(const unsigned char *src, int srclen,
+    unsigned char *dst, int dictlen, int dstlen);
+
+#endif
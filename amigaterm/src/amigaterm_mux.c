@@ -0,0 +1,898 @@
+/*
+ * Multiplexed channels over the serial link.
+ *
+ * With a cooperating host at the other end this carries the
+ * terminal, file transfers and a control channel over the one
+ * serial port at the same time, so the terminal stays live while
+ * files move.
+ *
+ * Everything is sent as frames, delimited by MUX_FEND with
+ * MUX_FEND/MUX_FESC inside a frame escaped as MUX_FESC, byte ^ 0x20:
+ *
+ *   chan << 4 | type, seq, ack, window, length, payload, CRC-16 (hi, lo)
+ *
+ * The CRC (as for xmodem CRC) covers everything before it.
+ *
+ * Each channel is an independent reliable byte stream in each
+ * direction.  Data frames are numbered per channel; every frame
+ * carries the sender's next expected sequence number for that
+ * channel (ack) and how many frames past it may be sent (window),
+ * which is the per-channel flow control.  Lost or corrupt frames
+ * are recovered go-back-N: the receiver NAKs the first gap it sees
+ * and the sender also rewinds after a retransmit timeout.  The
+ * sequence numbers start at 0 when mux mode starts and keep running
+ * from one transfer to the next on a channel; nothing resets them
+ * at an EOF.
+ *
+ * Only one frame is on the wire at a time and the scheduler picks
+ * the next one by priority - control, then terminal, then pending
+ * ACKs/NAKs, then file data round robin - so a keystroke waits for
+ * at most one (short) bulk frame.
+ *
+ * Channel 0 carries control messages (type, length, payload.)
+ * Channel 1 is the terminal.  The rest carry files: each transfer
+ * starts with the file name (length byte, then name) and ends with
+ * an EOF frame in-band.
+ */
+#include "dos/dos.h"              // for BPTR, MODE_NEWFILE, MODE_OLDFILE
+#include "exec/types.h"           // for FALSE, TRUE, UBYTE, CONST_STRPTR
+#include "proto/dos.h"            // for Close, Open, Write, Read
+#include <stdio.h>                // for NULL, snprintf
+#include <string.h>               // for memcpy, strlen
+#include <stdbool.h>
+
+#include "amigaterm_serial.h"
+#include "../lib/timer/timer.h"
+#include "amigaterm_crc.h"
+#include "amigaterm_mux.h"
+
+#define MUX_FEND 0x7e
+#define MUX_FESC 0x7d
+#define MUX_FXOR 0x20
+
+#define MUX_T_DATA 0
+#define MUX_T_EOF 1
+#define MUX_T_ACK 2
+#define MUX_T_NAK 3
+
+#define MUX_HDR_LEN 5
+#define MUX_MAX_PAYLOAD 128
+#define MUX_TERM_PAYLOAD 32
+#define MUX_WINDOW 4
+
+/* Only refill a file channel once this much of its ring is free */
+#define MUX_REFILL_MIN 512
+
+#define MUX_CTRL_HELLO 1
+#define MUX_CTRL_CANCEL 2
+#define MUX_VERSION 1
+
+struct mux_chan {
+  int max_payload;
+
+  /* Transmit side; offsets count bytes through the stream */
+  unsigned char *txbuf;
+  unsigned long txmask;            /* ring size - 1 */
+  unsigned long tx_head;           /* next byte to be queued */
+  unsigned long tx_acked;          /* first unacked byte */
+  unsigned long tx_sent;           /* next byte to send */
+  unsigned char seq_acked;         /* oldest unacked frame */
+  unsigned char seq_next;          /* next frame to send */
+  unsigned char seq_high;          /* one past the newest frame sent */
+  /* What each frame in flight carried, so a resend is the same */
+  unsigned long frame_start[MUX_WINDOW], frame_end[MUX_WINDOW];
+  unsigned char frame_type[MUX_WINDOW];
+  int peer_window;
+  bool tx_eof, eof_sent;
+  unsigned char eof_seq;
+
+  /* Receive side */
+  unsigned char rx_seq;            /* next frame expected */
+  bool ack_pending, nak_pending, nak_sent;
+
+  /* File transfers */
+  BPTR tx_fh;
+  bool sending, cancelled;
+  BPTR rx_fh;
+  bool receiving, rx_failed;
+  int rx_name_len, rx_name_got;
+  char rx_name[32];
+  char tx_name[32];
+};
+
+static bool mux_on = false;
+static struct mux_chan mux_chans[MUX_MAX_CHANS];
+
+static unsigned char mux_ring_ctrl[128];
+static unsigned char mux_ring_term[256];
+static unsigned char mux_ring_xfer[MUX_MAX_CHANS - MUX_CHAN_XFER][2048];
+
+/* The frame being written, escaped */
+static unsigned char mux_txframe[2 * (MUX_HDR_LEN + MUX_MAX_PAYLOAD + 2) + 2];
+static int mux_txlen;
+static bool mux_tx_busy;
+
+/* The frame being received, unescaped */
+static unsigned char mux_rxframe[MUX_HDR_LEN + MUX_MAX_PAYLOAD + 2];
+static int mux_rxlen;
+static bool mux_rx_esc, mux_rx_overrun;
+
+/* Control channel message being reassembled */
+static unsigned char mux_ctrl_msg[2 + 32];
+static int mux_ctrl_len;
+
+static struct timer_event mux_rto;
+static bool mux_rto_armed;
+static int mux_xfer_rr;
+
+/*
+ * Anything using this will need to define these.
+ */
+extern void emits(const char *);
+extern void emit(char c);
+extern int current_baud;
+
+/***************************************/
+/*  Framing                            */
+/***************************************/
+
+static inline void
+mux_frame_put(unsigned char c)
+{
+  if ((c == MUX_FEND) || (c == MUX_FESC)) {
+    mux_txframe[mux_txlen++] = MUX_FESC;
+    c ^= MUX_FXOR;
+  }
+  mux_txframe[mux_txlen++] = c;
+}
+
+/*
+ * Build and start writing a frame; the payload is 'len' bytes at
+ * stream offset 'off' in the channel's ring.
+ */
+static void
+mux_frame_send(int chan, int type, unsigned char seq, unsigned long off,
+    int len)
+{
+  struct mux_chan *mc = &mux_chans[chan];
+  unsigned char hdr[MUX_HDR_LEN];
+  unsigned short crc;
+  unsigned char c;
+  int i;
+
+  hdr[0] = (chan << 4) | type;
+  hdr[1] = seq;
+  hdr[2] = mc->rx_seq;
+  hdr[3] = MUX_WINDOW;
+  hdr[4] = len;
+
+  mux_txlen = 0;
+  mux_txframe[mux_txlen++] = MUX_FEND;
+  for (i = 0; i < MUX_HDR_LEN; i++)
+    mux_frame_put(hdr[i]);
+  crc = crc16_update(0, hdr, MUX_HDR_LEN);
+
+  for (i = 0; i < len; i++) {
+    c = mc->txbuf[(off + i) & mc->txmask];
+    crc = crc16_update(crc, &c, 1);
+    mux_frame_put(c);
+  }
+
+  mux_frame_put((crc >> 8) & 0xff);
+  mux_frame_put(crc & 0xff);
+  mux_txframe[mux_txlen++] = MUX_FEND;
+
+  /* Whatever frame this is, it carries this channel's ACK */
+  mc->ack_pending = false;
+
+  serial_write_start_buf((char *) mux_txframe, mux_txlen);
+  mux_tx_busy = true;
+}
+
+/***************************************/
+/*  Retransmission                     */
+/***************************************/
+
+static bool
+mux_unacked(void)
+{
+  int i;
+
+  for (i = 0; i < MUX_MAX_CHANS; i++) {
+    if (mux_chans[i].seq_acked != mux_chans[i].seq_high)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Retransmit timeout: long enough for a full window of maximum
+ * size frames at the current baud rate, plus the peer's turnaround.
+ */
+static int
+mux_rto_ms(void)
+{
+  int baud = (current_baud > 0) ? current_baud : 9600;
+
+  return 500 + (MUX_WINDOW * sizeof(mux_txframe) * 10 * 1000L) / baud;
+}
+
+/*
+ * Keep the retransmit timer running while anything is unacked;
+ * 'restart' pushes it back because something just got ACKed.
+ */
+static void
+mux_rto_update(bool restart)
+{
+  if (mux_unacked() == false) {
+    timer_event_cancel(&mux_rto);
+    mux_rto_armed = false;
+    return;
+  }
+  if ((mux_rto_armed == false) || restart) {
+    timer_event_add(&mux_rto, mux_rto_ms());
+    mux_rto_armed = true;
+  }
+}
+
+/*
+ * Go back to the oldest unacked frame and send everything again;
+ * mux_send_data() resends each frame as it first went out.
+ */
+static void
+mux_rewind(struct mux_chan *mc)
+{
+  mc->seq_next = mc->seq_acked;
+  mc->tx_sent = mc->tx_acked;
+}
+
+/*
+ * The retransmit timeout has a timer of its own; mux_poll() looks
+ * at it after timer_run().
+ */
+static void
+mux_rto_cb(void *arg)
+{
+}
+
+/* Ready for the next stream; the sequence numbers carry on */
+static void
+mux_chan_tx_reset(struct mux_chan *mc)
+{
+  mc->tx_head = mc->tx_acked = mc->tx_sent = 0;
+  mc->tx_eof = mc->eof_sent = false;
+  mc->peer_window = MUX_WINDOW;
+}
+
+static void
+mux_send_done(int chan)
+{
+  struct mux_chan *mc = &mux_chans[chan];
+  char msg[64];
+
+  if (mc->cancelled)
+    snprintf(msg, sizeof(msg), "\n[mux] Send of %s cancelled\n",
+        mc->tx_name);
+  else
+    snprintf(msg, sizeof(msg), "\n[mux] Sent %s\n", mc->tx_name);
+  emits(msg);
+
+  mc->sending = mc->cancelled = false;
+  mux_chan_tx_reset(mc);
+}
+
+static void
+mux_process_ack(int chan, unsigned char ack, int window)
+{
+  struct mux_chan *mc = &mux_chans[chan];
+  unsigned char newly, outstanding;
+
+  mc->peer_window = window;
+
+  newly = ack - mc->seq_acked;
+  outstanding = mc->seq_high - mc->seq_acked;
+  if ((newly == 0) || (newly > outstanding))
+    return;
+
+  mc->tx_acked = mc->frame_end[(unsigned char) (ack - 1) % MUX_WINDOW];
+  if (mc->eof_sent &&
+      (unsigned char) (mc->eof_seq - mc->seq_acked) < newly) {
+    mc->seq_acked = ack;
+    mux_send_done(chan);
+  } else {
+    mc->seq_acked = ack;
+  }
+
+  /* A rewind may have left us behind what's now been ACKed */
+  if ((unsigned char) (mc->seq_next - mc->seq_acked) >
+      (unsigned char) (mc->seq_high - mc->seq_acked)) {
+    mc->seq_next = mc->seq_acked;
+    mc->tx_sent = mc->tx_acked;
+  }
+
+  mux_rto_update(true);
+}
+
+/***************************************/
+/*  Scheduler                          */
+/***************************************/
+
+static bool
+mux_send_data(int chan)
+{
+  struct mux_chan *mc = &mux_chans[chan];
+  unsigned char in_flight;
+  int window, len, slot;
+
+  in_flight = mc->seq_next - mc->seq_acked;
+  window = (mc->peer_window < MUX_WINDOW) ? mc->peer_window : MUX_WINDOW;
+  if (in_flight >= window)
+    return false;
+
+  /*
+   * After a rewind, frames already sent go again exactly as they
+   * were; more data queued since mustn't ride along, or the peer
+   * (which may already have the frame) would never see it.
+   */
+  slot = mc->seq_next % MUX_WINDOW;
+  if (in_flight < (unsigned char) (mc->seq_high - mc->seq_acked)) {
+    mux_frame_send(chan, mc->frame_type[slot], mc->seq_next,
+        mc->frame_start[slot], mc->frame_end[slot] - mc->frame_start[slot]);
+    mc->tx_sent = mc->frame_end[slot];
+    mc->seq_next++;
+    mux_rto_update(false);
+    return true;
+  }
+
+  mc->frame_start[slot] = mc->tx_sent;
+  if (mc->tx_sent < mc->tx_head) {
+    len = mc->tx_head - mc->tx_sent;
+    if (len > mc->max_payload)
+      len = mc->max_payload;
+    mux_frame_send(chan, MUX_T_DATA, mc->seq_next, mc->tx_sent, len);
+    mc->tx_sent += len;
+    mc->frame_type[slot] = MUX_T_DATA;
+  } else if (mc->tx_eof && (mc->eof_sent == false)) {
+    mux_frame_send(chan, MUX_T_EOF, mc->seq_next, mc->tx_head, 0);
+    mc->eof_sent = true;
+    mc->eof_seq = mc->seq_next;
+    mc->frame_type[slot] = MUX_T_EOF;
+  } else {
+    return false;
+  }
+
+  mc->frame_end[slot] = mc->tx_sent;
+  mc->seq_next++;
+  mc->seq_high = mc->seq_next;
+  mux_rto_update(false);
+  return true;
+}
+
+static bool
+mux_send_ack(int chan)
+{
+  struct mux_chan *mc = &mux_chans[chan];
+
+  if (mc->nak_pending) {
+    mc->nak_pending = false;
+    mux_frame_send(chan, MUX_T_NAK, 0, 0, 0);
+    return true;
+  }
+  if (mc->ack_pending) {
+    mux_frame_send(chan, MUX_T_ACK, 0, 0, 0);
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Start the next frame if the line is free.
+ */
+static void
+mux_kick(void)
+{
+  int i, chan;
+
+  if ((mux_on == false) || mux_tx_busy)
+    return;
+
+  for (chan = 0; chan < MUX_CHAN_XFER; chan++) {
+    if (mux_send_data(chan))
+      return;
+  }
+
+  for (chan = 0; chan < MUX_MAX_CHANS; chan++) {
+    if (mux_send_ack(chan))
+      return;
+  }
+
+  for (i = 0; i < MUX_MAX_CHANS - MUX_CHAN_XFER; i++) {
+    chan = MUX_CHAN_XFER + mux_xfer_rr;
+    mux_xfer_rr = (mux_xfer_rr + 1) % (MUX_MAX_CHANS - MUX_CHAN_XFER);
+    if (mux_send_data(chan))
+      return;
+  }
+}
+
+/***************************************/
+/*  Receive                            */
+/***************************************/
+
+static void
+mux_ctrl_message(const unsigned char *msg, int len)
+{
+  struct mux_chan *mc;
+
+  switch (msg[0]) {
+  case MUX_CTRL_HELLO:
+    emits("\n[mux] Peer connected\n");
+    break;
+  case MUX_CTRL_CANCEL:
+    /* The peer's send on this channel is being cut short */
+    if ((len >= 1) && (msg[2] >= MUX_CHAN_XFER) &&
+        (msg[2] < MUX_MAX_CHANS)) {
+      mc = &mux_chans[msg[2]];
+      if (mc->receiving)
+        mc->rx_failed = true;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+/* Control messages are type, length, payload; they can span frames */
+static void
+mux_ctrl_input(const unsigned char *buf, int len)
+{
+  while (len-- > 0) {
+    mux_ctrl_msg[mux_ctrl_len++] = *buf++;
+    if ((mux_ctrl_len >= 2) &&
+        (mux_ctrl_len == 2 + mux_ctrl_msg[1] ||
+         mux_ctrl_len == sizeof(mux_ctrl_msg))) {
+      mux_ctrl_message(mux_ctrl_msg, mux_ctrl_msg[1]);
+      mux_ctrl_len = 0;
+    }
+  }
+}
+
+static void
+mux_xfer_input(int chan, const unsigned char *buf, int len)
+{
+  struct mux_chan *mc = &mux_chans[chan];
+  int n;
+
+  /* A new transfer starts with the length of the name, then the name */
+  if (mc->receiving == false) {
+    if (len == 0)
+      return;
+    mc->receiving = true;
+    mc->rx_failed = false;
+    mc->rx_name_len = *buf++;
+    mc->rx_name_got = 0;
+    mc->rx_fh = 0;
+    len--;
+    if (mc->rx_name_len >= (int) sizeof(mc->rx_name))
+      mc->rx_failed = true;
+  }
+
+  if (mc->rx_name_got < mc->rx_name_len) {
+    n = mc->rx_name_len - mc->rx_name_got;
+    if (n > len)
+      n = len;
+    if (mc->rx_failed == false)
+      memcpy(&mc->rx_name[mc->rx_name_got], buf, n);
+    mc->rx_name_got += n;
+    buf += n;
+    len -= n;
+    if ((mc->rx_name_got < mc->rx_name_len) || mc->rx_failed)
+      return;
+
+    mc->rx_name[mc->rx_name_len] = '\0';
+    mc->rx_fh = Open((UBYTE *) mc->rx_name, MODE_NEWFILE);
+    if (mc->rx_fh == 0) {
+      emits("\n[mux] Cannot Open File\n");
+      mc->rx_failed = true;
+      return;
+    }
+  }
+
+  if ((len > 0) && (mc->rx_failed == false)) {
+    if (Write(mc->rx_fh, buf, len) != len) {
+      emits("\n[mux] Error Writing File\n");
+      mc->rx_failed = true;
+    }
+  }
+}
+
+static void
+mux_xfer_eof(int chan)
+{
+  struct mux_chan *mc = &mux_chans[chan];
+  char msg[64];
+
+  if (mc->receiving == false)
+    return;
+  if (mc->rx_fh != 0)
+    Close(mc->rx_fh);
+  if (mc->rx_failed) {
+    if (mc->rx_fh != 0)
+      DeleteFile((UBYTE *) mc->rx_name);
+    emits("\n[mux] Receive failed\n");
+  } else {
+    snprintf(msg, sizeof(msg), "\n[mux] Received %s\n", mc->rx_name);
+    emits(msg);
+  }
+  mc->rx_fh = 0;
+  mc->receiving = false;
+}
+
+static void
+mux_deliver(int chan, int type, const unsigned char *buf, int len)
+{
+  int i;
+
+  if (type == MUX_T_EOF) {
+    if (chan >= MUX_CHAN_XFER)
+      mux_xfer_eof(chan);
+    return;
+  }
+
+  switch (chan) {
+  case MUX_CHAN_CTRL:
+    mux_ctrl_input(buf, len);
+    break;
+  case MUX_CHAN_TERM:
+    for (i = 0; i < len; i++)
+      emit(buf[i] & 0x7f);
+    break;
+  default:
+    mux_xfer_input(chan, buf, len);
+    break;
+  }
+}
+
+static void
+mux_rx_frame(const unsigned char *f, int len)
+{
+  struct mux_chan *mc;
+  int chan, type, plen;
+
+  if (len < MUX_HDR_LEN + 2)
+    return;
+  if (crc16_update(0, f, len - 2) != ((f[len - 2] << 8) | f[len - 1]))
+    return;
+
+  chan = f[0] >> 4;
+  type = f[0] & 0x0f;
+  plen = f[4];
+  if ((chan >= MUX_MAX_CHANS) || (plen != len - MUX_HDR_LEN - 2))
+    return;
+  mc = &mux_chans[chan];
+
+  mux_process_ack(chan, f[2], f[3]);
+
+  switch (type) {
+  case MUX_T_DATA:
+  case MUX_T_EOF:
+    if (f[1] == mc->rx_seq) {
+      mc->rx_seq++;
+      mc->nak_sent = false;
+      mc->ack_pending = true;
+      mux_deliver(chan, type, &f[MUX_HDR_LEN], plen);
+    } else if ((unsigned char) (f[1] - mc->rx_seq) < 128) {
+      /* A gap; ask for a resend once per missing frame */
+      if (mc->nak_sent == false) {
+        mc->nak_pending = true;
+        mc->nak_sent = true;
+      }
+    } else {
+      /* A duplicate; our ACK must have gone missing */
+      mc->ack_pending = true;
+    }
+    break;
+  case MUX_T_NAK:
+    mux_rewind(mc);
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Feed received serial bytes in.
+ */
+void
+mux_input(const unsigned char *buf, int len)
+{
+  unsigned char c;
+
+  while (len-- > 0) {
+    c = *buf++;
+    if (c == MUX_FEND) {
+      if ((mux_rxlen > 0) && (mux_rx_overrun == false))
+        mux_rx_frame(mux_rxframe, mux_rxlen);
+      mux_rxlen = 0;
+      mux_rx_esc = mux_rx_overrun = false;
+      continue;
+    }
+    if (c == MUX_FESC) {
+      mux_rx_esc = true;
+      continue;
+    }
+    if (mux_rx_esc) {
+      c ^= MUX_FXOR;
+      mux_rx_esc = false;
+    }
+    if (mux_rxlen == sizeof(mux_rxframe))
+      mux_rx_overrun = true;
+    else
+      mux_rxframe[mux_rxlen++] = c;
+  }
+  /* Acks free ring space for the file channels, so top them up too */
+  mux_poll();
+}
+
+/***************************************/
+/*  Transmit                           */
+/***************************************/
+
+/*
+ * Queue bytes on a channel.  Returns how many were taken, which
+ * may be fewer than asked for if the channel's ring is full.
+ */
+int
+mux_write(int chan, const unsigned char *buf, int len)
+{
+  struct mux_chan *mc = &mux_chans[chan];
+  int n = 0;
+
+  if (mux_on == false)
+    return 0;
+
+  while ((n < len) && (mc->tx_head - mc->tx_acked <= mc->txmask)) {
+    mc->txbuf[mc->tx_head & mc->txmask] = buf[n++];
+    mc->tx_head++;
+  }
+  mux_kick();
+  return n;
+}
+
+static void
+mux_ctrl_send(int type, const unsigned char *payload, int len)
+{
+  unsigned char hdr[2];
+
+  hdr[0] = type;
+  hdr[1] = len;
+  mux_write(MUX_CHAN_CTRL, hdr, 2);
+  mux_write(MUX_CHAN_CTRL, payload, len);
+}
+
+/* Top up sending file channels from disk */
+static void
+mux_refill(void)
+{
+  struct mux_chan *mc;
+  unsigned long space, contig;
+  long n;
+  int chan;
+
+  for (chan = MUX_CHAN_XFER; chan < MUX_MAX_CHANS; chan++) {
+    mc = &mux_chans[chan];
+    if ((mc->sending == false) || mc->tx_eof)
+      continue;
+
+    space = (mc->txmask + 1) - (mc->tx_head - mc->tx_acked);
+    if (space < MUX_REFILL_MIN)
+      continue;
+    contig = (mc->txmask + 1) - (mc->tx_head & mc->txmask);
+    if (contig > space)
+      contig = space;
+
+    n = Read(mc->tx_fh, &mc->txbuf[mc->tx_head & mc->txmask], contig);
+    if (n > 0) {
+      mc->tx_head += n;
+    } else {
+      if (n < 0) {
+        emits("\n[mux] Error Reading File\n");
+        mc->cancelled = true;
+      }
+      Close(mc->tx_fh);
+      mc->tx_fh = 0;
+      mc->tx_eof = true;
+    }
+  }
+}
+
+/*
+ * Start sending a file on a free transfer channel.
+ */
+int
+mux_send_file(const char *file)
+{
+  struct mux_chan *mc;
+  const char *base;
+  unsigned char len;
+  int chan;
+
+  if (mux_on == false)
+    return FALSE;
+
+  for (chan = MUX_CHAN_XFER; chan < MUX_MAX_CHANS; chan++) {
+    if (mux_chans[chan].sending == false)
+      break;
+  }
+  if (chan == MUX_MAX_CHANS) {
+    emits("\n[mux] All transfer channels busy\n");
+    return FALSE;
+  }
+  mc = &mux_chans[chan];
+
+  /* The peer only gets the name, not the path */
+  base = strrchr(file, '/');
+  if (base == NULL)
+    base = strrchr(file, ':');
+  base = (base == NULL) ? file : base + 1;
+  if (strlen(base) >= sizeof(mc->tx_name))
+    return FALSE;
+
+  mc->tx_fh = Open((UBYTE *) file, MODE_OLDFILE);
+  if (mc->tx_fh == 0) {
+    emits("\n[mux] Cannot Open Send File\n");
+    return FALSE;
+  }
+  strcpy(mc->tx_name, base);
+
+  mux_chan_tx_reset(mc);
+  mc->sending = true;
+  mc->cancelled = false;
+
+  len = strlen(base);
+  mux_write(chan, &len, 1);
+  mux_write(chan, (const unsigned char *) base, len);
+  mux_refill();
+  mux_kick();
+  return TRUE;
+}
+
+/*
+ * Cancel all of our sends.  Anything not yet sent is dropped and
+ * the EOF goes out straight after what's in flight; the peer is
+ * told first so it throws the partial file away.
+ */
+void
+mux_cancel_sends(void)
+{
+  struct mux_chan *mc;
+  unsigned char chan;
+
+  for (chan = MUX_CHAN_XFER; chan < MUX_MAX_CHANS; chan++) {
+    mc = &mux_chans[chan];
+    if ((mc->sending == false) || mc->cancelled)
+      continue;
+    mux_ctrl_send(MUX_CTRL_CANCEL, &chan, 1);
+    mc->cancelled = true;
+    /* Keep what's in flight (a rewind may be partway through it) */
+    if (mc->seq_high != mc->seq_acked)
+      mc->tx_head = mc->frame_end[(unsigned char) (mc->seq_high - 1) %
+          MUX_WINDOW];
+    else
+      mc->tx_head = mc->tx_sent;
+    if (mc->tx_fh != 0) {
+      Close(mc->tx_fh);
+      mc->tx_fh = 0;
+    }
+    mc->tx_eof = true;
+  }
+  mux_kick();
+}
+
+/***************************************/
+/*  Control                            */
+/***************************************/
+
+unsigned int
+mux_get_signal_bitmask(void)
+{
+  return serial_get_write_signal_bitmask() | timer_get_signal_bitmask();
+}
+
+/*
+ * Call whenever a signal in mux_get_signal_bitmask() fires (or
+ * just every time round the main loop.)
+ */
+void
+mux_poll(void)
+{
+  int i;
+
+  if (mux_on == false)
+    return;
+
+  if (mux_tx_busy && serial_write_ready()) {
+    serial_write_wait();
+    mux_tx_busy = false;
+  }
+
+  /* Timed out; go back to the oldest unacked frame */
+  if (mux_rto_armed && (timer_event_pending(&mux_rto) == false)) {
+    mux_rto_armed = false;
+    for (i = 0; i < MUX_MAX_CHANS; i++) {
+      if (mux_chans[i].seq_acked != mux_chans[i].seq_high)
+        mux_rewind(&mux_chans[i]);
+    }
+    mux_rto_update(false);
+  }
+
+  mux_refill();
+  mux_kick();
+}
+
+bool
+mux_active(void)
+{
+  return mux_on;
+}
+
+void
+mux_start(void)
+{
+  unsigned char version = MUX_VERSION;
+  struct mux_chan *mc;
+  int i;
+
+  memset(mux_chans, 0, sizeof(mux_chans));
+  for (i = 0; i < MUX_MAX_CHANS; i++) {
+    mc = &mux_chans[i];
+    if (i == MUX_CHAN_CTRL) {
+      mc->txbuf = mux_ring_ctrl;
+      mc->txmask = sizeof(mux_ring_ctrl) - 1;
+    } else if (i == MUX_CHAN_TERM) {
+      mc->txbuf = mux_ring_term;
+      mc->txmask = sizeof(mux_ring_term) - 1;
+    } else {
+      mc->txbuf = mux_ring_xfer[i - MUX_CHAN_XFER];
+      mc->txmask = sizeof(mux_ring_xfer[0]) - 1;
+    }
+    mc->max_payload = (i == MUX_CHAN_TERM) ? MUX_TERM_PAYLOAD :
+        MUX_MAX_PAYLOAD;
+    mux_chan_tx_reset(mc);
+  }
+
+  mux_txlen = mux_rxlen = mux_ctrl_len = 0;
+  mux_tx_busy = mux_rx_esc = mux_rx_overrun = false;
+  if (mux_rto.cb == NULL)
+    timer_event_init(&mux_rto, mux_rto_cb, NULL);
+  mux_rto_armed = false;
+  mux_xfer_rr = 0;
+  mux_on = true;
+
+  mux_ctrl_send(MUX_CTRL_HELLO, &version, 1);
+}
+
+void
+mux_stop(void)
+{
+  struct mux_chan *mc;
+  int i;
+
+  if (mux_on == false)
+    return;
+
+  for (i = MUX_CHAN_XFER; i < MUX_MAX_CHANS; i++) {
+    mc = &mux_chans[i];
+    if (mc->tx_fh != 0)
+      Close(mc->tx_fh);
+    if (mc->receiving) {
+      mc->rx_failed = true;
+      mux_xfer_eof(i);
+    }
+  }
+
+  if (mux_tx_busy)
+    serial_write_abort();
+  timer_event_cancel(&mux_rto);
+  mux_tx_busy = mux_rto_armed = false;
+  mux_on = false;
+}
@@ -0,0 +1,22 @@
+#ifndef __AMIGATERM_MUX_H__
+#define __AMIGATERM_MUX_H__
+
+/* Fixed channel assignments */
+#define MUX_CHAN_CTRL 0
+#define MUX_CHAN_TERM 1
+#define MUX_CHAN_XFER 2     /* first file transfer channel */
+#define MUX_MAX_CHANS 4
+
+extern void mux_start(void);
+extern void mux_stop(void);
+extern bool mux_active(void);
+
+extern void mux_input(const unsigned char *buf, int len);
+extern int mux_write(int chan, const unsigned char *buf, int len);
+extern void mux_poll(void);
+extern unsigned int mux_get_signal_bitmask(void);
+
+extern int mux_send_file(const char *file);
+extern void mux_cancel_sends(void);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Signal dispatch; see amigaterm_reactor.h.
+ *
+ * The sources are a short list kept in priority order, so working
+ * out the Wait() mask and who to call is a walk down it.
+ */
+#include "proto/exec.h"           // for Wait, SetSignal
+#include <exec/types.h>           // for ULONG
+#include <stdio.h>                // for NULL
+#include <stdbool.h>
+
+#include "amigaterm_reactor.h"
+
+static struct reactor_source *reactor_list = NULL;
+static int reactor_depth = 0;
+static ULONG reactor_gen = 0;       /* bumped when the list changes */
+static void (*reactor_idle)(void) = NULL;
+
+/*
+ * Add (and enable) rs; it stays put until reactor_remove().
+ */
+void
+reactor_add(struct reactor_source *rs, ULONG mask, int pri, int flags,
+    bool (*ready)(void *), void (*cb)(void *), void *arg)
+{
+  struct reactor_source **p;
+
+  rs->mask = mask;
+  rs->pri = pri;
+  rs->flags = flags;
+  rs->enabled = true;
+  rs->busy = false;
+  rs->ready = ready;
+  rs->cb = cb;
+  rs->arg = arg;
+  rs->seen = 0;
+  reactor_gen++;
+
+  for (p = &reactor_list; *p != NULL; p = &(*p)->next) {
+    if ((*p)->pri > pri)
+      break;
+  }
+  rs->next = *p;
+  *p = rs;
+}
+
+void
+reactor_remove(struct reactor_source *rs)
+{
+  struct reactor_source **p;
+
+  for (p = &reactor_list; *p != NULL; p = &(*p)->next) {
+    if (*p == rs) {
+      reactor_gen++;
+      *p = rs->next;
+      rs->next = NULL;
+      return;
+    }
+  }
+}
+
+void
+reactor_enable(struct reactor_source *rs, bool enable)
+{
+  rs->enabled = enable;
+}
+
+/*
+ * fn is called before the top level goes to sleep (eg to draw the
+ * cursor.)
+ */
+void
+reactor_set_idle(void (*fn)(void))
+{
+  reactor_idle = fn;
+}
+
+/* Can rs be dispatched from here? */
+static bool
+reactor_usable(const struct reactor_source *rs)
+{
+  if ((rs->enabled == false) || (rs->busy))
+    return false;
+  return ((reactor_depth == 0) || (rs->flags & REACTOR_NESTED));
+}
+
+/*
+ * Wait for something to happen, unless it already has, and call
+ * whoever it was for.
+ *
+ * Each nesting level keeps its own bit in the sources' seen masks,
+ * so a poll from inside a callback doesn't lose track of which
+ * sources the one it was called from has already seen to.  The
+ * depth can't pass the number of sources, as a busy one isn't
+ * entered again.
+ */
+void
+reactor_poll(void)
+{
+  struct reactor_source *rs;
+  ULONG mask = 0, sigs, bit, gen;
+  bool quick = false;
+
+  bit = 1UL << reactor_depth;
+  for (rs = reactor_list; rs != NULL; rs = rs->next) {
+    rs->seen &= ~bit;
+    if (reactor_usable(rs) == false)
+      continue;
+    mask |= rs->mask;
+    if ((quick == false) && (rs->ready != NULL) && rs->ready(rs->arg))
+      quick = true;
+  }
+
+  if (quick) {
+    /* Just take whatever else has come in as well */
+    sigs = SetSignal(0, mask) & mask;
+  } else {
+    if ((reactor_depth == 0) && (reactor_idle != NULL))
+      reactor_idle();
+    sigs = Wait(mask);
+  }
+
+  /*
+   * A callback can add and remove sources; if it does, go back to
+   * the start, skipping the ones already seen to.
+   */
+restart:
+  for (rs = reactor_list; rs != NULL; rs = rs->next) {
+    if (rs->seen & bit)
+      continue;
+    rs->seen |= bit;
+    if (reactor_usable(rs) == false)
+      continue;
+    if (((sigs & rs->mask) == 0) &&
+        ((rs->ready == NULL) || (rs->ready(rs->arg) == false)))
+      continue;
+    if (rs->cb == NULL)
+      continue;
+    gen = reactor_gen;
+    rs->busy = true;
+    reactor_depth++;
+    rs->cb(rs->arg);
+    reactor_depth--;
+    rs->busy = false;
+    if (gen != reactor_gen)
+      goto restart;
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef __AMIGATERM_REACTOR_H__
+#define __AMIGATERM_REACTOR_H__
+
+/*
+ * The one place the program waits.
+ *
+ * Anything which gets signalled (the serial port, the timer, the
+ * window, file I/O) registers a source: the signals it's woken by,
+ * a callback, and optionally a ready check for I/O which completed
+ * straight away (IOF_QUICK) and so won't signal.  reactor_poll()
+ * does a single Wait() on everything and calls the callbacks of the
+ * sources which are ready, in priority order (lowest first), so the
+ * serial port is always seen to before the screen or the disk.
+ *
+ * A callback can call reactor_poll() itself, eg a transfer started
+ * from a menu waiting for the next byte.  Only sources added with
+ * REACTOR_NESTED are dispatched then; the others belong to the top
+ * level loop (the terminal taking serial data, the menus) which the
+ * callback has taken over for the moment.  A source's callback is
+ * never entered twice.
+ */
+
+#include <exec/types.h>           // for ULONG
+#include <stdbool.h>
+
+/* Priorities */
+#define REACTOR_PRI_SERIAL 0
+#define REACTOR_PRI_TIMER 10
+#define REACTOR_PRI_IO 20
+#define REACTOR_PRI_FILE 30
+#define REACTOR_PRI_UI 40
+
+/* Flags */
+#define REACTOR_NESTED 0x1
+
+struct reactor_source {
+  struct reactor_source *next;
+  ULONG mask;                   /* signals to wait on */
+  int pri;
+  int flags;
+  bool enabled;
+  bool busy;                    /* in the callback */
+  ULONG seen;                   /* bit n: seen to by the poll n deep */
+  bool (*ready)(void *arg);     /* ready without a signal; may be NULL */
+  void (*cb)(void *arg);        /* may be NULL, to just wake up */
+  void *arg;
+};
+
+extern void reactor_add(struct reactor_source *rs, ULONG mask, int pri,
+    int flags, bool (*ready)(void *), void (*cb)(void *), void *arg);
+extern void reactor_remove(struct reactor_source *rs);
+extern void reactor_enable(struct reactor_source *rs, bool enable);
+extern void reactor_set_idle(void (*fn)(void));
+extern void reactor_poll(void);
+
+#endif
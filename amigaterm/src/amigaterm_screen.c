@@ -13,6 +13,7 @@
 #include "exec/memory.h"          // for MEMF_CLEAR, MEMF_PUBLIC
 #include "exec/ports.h"           // for Message, MsgPort
 #include "graphics/rastport.h"    // for JAM2, COMPLEMENT
+#include "graphics/text.h"        // for FSF_BOLD, FSF_UNDERLINED
 #include "intuition/screens.h"    // for WBENCHSCREEN
 #include "proto/dos.h"            // for Close, Open, Write, Read
 #include "proto/exec.h"           // for FreeMem, DoIO, GetMsg, AllocMem
@@ -24,9 +25,16 @@
 #include <intuition/intuition.h>  // for MenuItem, IntuiText, Menu, Window
 #include <intuition/screens.h>    // for RAWKEY, CLOSEWINDOW, MENUPICK
 #include <stdio.h>                // for NULL, puts, fclose, fopen, EOF, getc
+#include <string.h>               // for memmove
 #include <stdbool.h>
 
+#include "amigaterm_ansi.h"
 #include "amigaterm_screen.h"
+#include "amigaterm_scrollback.h"
+#include "../lib/timer/timer.h"
+#include "../lib/timer/tstamp.h"
+
+TIMER_PROF(prof_text, "Text");
 
 #define INTUITION_REV 1
 #define GRAPHICS_REV 1
@@ -68,6 +76,167 @@ struct amigaterm_screen {
 
 struct amigaterm_screen a_screen;
 
+/*
+ * What's on screen, a character and an attribute per cell.  Writes
+ * only go into the grid and widen their line's dirty span; the
+ * render pass then draws each dirty span, a Text() per run of cells
+ * with the same attribute.  A cell written over again before the
+ * render only gets drawn the once.
+ *
+ * Outside the dirty spans (and the cell the cursor was drawn on)
+ * the window always matches the grid, so a scroll moves both.
+ */
+#define SCREEN_MAX_COLS 128
+#define SCREEN_MAX_ROWS 64
+
+/* Attributes: the foreground and background pens, and the style */
+#define SCREEN_ATTR(fg, bg) ((fg) | ((bg) << 4))
+#define SCREEN_ATTR_FG(a) ((a) & 0xf)
+#define SCREEN_ATTR_BG(a) (((a) >> 4) & 0xf)
+#define SCREEN_ATTR_BOLD 0x100
+#define SCREEN_ATTR_UNDERLINE 0x200
+#define SCREEN_ATTR_DEFAULT \
+    SCREEN_ATTR(AMIGATERM_SCREEN_TEXT_PEN, AMIGATERM_SCREEN_BACKGROUND_PEN)
+
+static char screen_chars[SCREEN_MAX_ROWS][SCREEN_MAX_COLS];
+static UWORD screen_attrs[SCREEN_MAX_ROWS][SCREEN_MAX_COLS];
+static short screen_dirty_lo[SCREEN_MAX_ROWS];  /* dirty cells lo..hi-1 */
+static short screen_dirty_hi[SCREEN_MAX_ROWS];
+static bool screen_dirty;                       /* any line dirty */
+static short screen_scroll_pending;             /* lines the window's behind */
+static UWORD screen_attr = SCREEN_ATTR_DEFAULT; /* for new characters */
+
+/*
+ * The escape sequence parser and the state the sequences set: what
+ * SGR last asked for, the tab stops, the cursor saved by DECSC, and
+ * whether the last character went in the last column.  That only
+ * wraps when the next one comes, as on a VT100.
+ */
+struct screen_sgr {
+  UBYTE fg, bg;                   /* pens */
+  UWORD style;                    /* SCREEN_ATTR_BOLD etc. */
+  bool reverse;
+};
+
+static struct ansi_parser screen_ansi;
+static struct screen_sgr screen_sgr, screen_saved_sgr;
+static short screen_saved_x, screen_saved_y;
+static bool screen_tabs[SCREEN_MAX_COLS];
+static bool screen_wrap_pending;
+
+/*
+ * ANSI's eight colours on the four Workbench pens (blue, white,
+ * black, orange): the warm ones go orange, the cool ones white.
+ */
+#define SCREEN_PEN_BLACK 2
+#define SCREEN_PEN_ORANGE 3
+
+static const UBYTE screen_ansi_pens[8] = {
+	SCREEN_PEN_BLACK,                       /* black */
+	SCREEN_PEN_ORANGE,                      /* red */
+	AMIGATERM_SCREEN_TEXT_PEN,              /* green */
+	SCREEN_PEN_ORANGE,                      /* yellow */
+	AMIGATERM_SCREEN_BACKGROUND_PEN,        /* blue */
+	SCREEN_PEN_ORANGE,                      /* magenta */
+	AMIGATERM_SCREEN_TEXT_PEN,              /* cyan */
+	AMIGATERM_SCREEN_TEXT_PEN,              /* white */
+};
+
+/*
+ * Lines the window's been paged back into the scrollback; 0 when
+ * it's showing the grid.  While it's back, the grid carries on but
+ * the window is left alone until it's paged forward again.
+ */
+static long screen_view;
+
+/* Where the cursor block was drawn, so the render can take it off */
+static bool screen_cursor_drawn;
+static short screen_cursor_x, screen_cursor_y;
+static char screen_cursor_pen;
+
+/*
+ * Serial data only goes into the grid; the window is brought up to
+ * date at most once a frame.  The first change after a quiet spell
+ * is drawn straight away and starts the frame timer; anything that
+ * comes in before it goes off waits for it, however much that is,
+ * so a burst is drawn SCREEN_FRAME_MS apart rather than per read.
+ */
+#define SCREEN_FRAME_MS 40
+
+static struct timer_event screen_frame;
+
+/*
+ * Mark cells x0..x1-1 of line y as needing drawing.
+ */
+static void
+screen_mark_dirty(short y, short x0, short x1)
+{
+	if (screen_dirty_lo[y] >= screen_dirty_hi[y]) {
+		screen_dirty_lo[y] = x0;
+		screen_dirty_hi[y] = x1;
+	} else {
+		if (x0 < screen_dirty_lo[y])
+			screen_dirty_lo[y] = x0;
+		if (x1 > screen_dirty_hi[y])
+			screen_dirty_hi[y] = x1;
+	}
+	screen_dirty = true;
+}
+
+/*
+ * Blank lines y0..y1-1 in the grid; they're already blank on screen.
+ */
+static void
+screen_clear_lines(short y0, short y1)
+{
+	short x, y;
+
+	for (y = y0; y < y1; y++) {
+		for (x = 0; x < SCREEN_MAX_COLS; x++) {
+			screen_chars[y][x] = ' ';
+			screen_attrs[y][x] = SCREEN_ATTR_DEFAULT;
+		}
+		screen_dirty_lo[y] = screen_dirty_hi[y] = 0;
+	}
+}
+
+/*
+ * Line y's length, leaving off the blank cells at the end.
+ */
+static short
+screen_line_len(short y)
+{
+	short x;
+
+	for (x = a_screen.scr_width; x > 0; x--) {
+		if ((screen_chars[y][x - 1] != ' ') ||
+		    (screen_attrs[y][x - 1] != SCREEN_ATTR_DEFAULT))
+			break;
+	}
+	return x;
+}
+
+/*
+ * Back to the power-on tab stops, colours and so on.
+ */
+static void
+screen_reset_modes(void)
+{
+	short x;
+
+	ansi_init(&screen_ansi);
+	for (x = 0; x < SCREEN_MAX_COLS; x++)
+		screen_tabs[x] = ((x % a_screen.tab_width) == 0);
+	screen_sgr.fg = AMIGATERM_SCREEN_TEXT_PEN;
+	screen_sgr.bg = AMIGATERM_SCREEN_BACKGROUND_PEN;
+	screen_sgr.style = 0;
+	screen_sgr.reverse = false;
+	screen_saved_sgr = screen_sgr;
+	screen_saved_x = screen_saved_y = 0;
+	screen_attr = SCREEN_ATTR_DEFAULT;
+	screen_wrap_pending = false;
+}
+
 /*
  * Get the cursor in the window pixel coordinates.
  */
@@ -105,57 +274,6 @@ screen_set_cursor(short x, short y)
 	a_screen.cursor_y = y;
 }
 
-/*
- * Advance the cursor.  Optionally wrap or stay at the end.
- *
- * Returns true if we need to scroll the screen up (ie, we
- * hit the last character on the last line, and we're not
- * wrapping.)
- */
-static bool
-screen_advance_cursor(short num_char, bool do_wrap)
-{
-	bool do_y = false;
-	bool ret = false;
-
-	/* Advance cursor, wrap at x */
-	a_screen.cursor_x += num_char;
-	if (a_screen.cursor_x >= a_screen.scr_width) {
-		if (do_wrap) {
-			a_screen.cursor_x %= a_screen.scr_width;
-			do_y = true;
-		} else {
-			a_screen.cursor_x = a_screen.scr_width - 1;
-		}
-	}
-
-	/* Check if we need to advance y now */
-	if (do_y == true) {
-		a_screen.cursor_y += 1;
-		if (a_screen.cursor_y >= a_screen.scr_height) {
-			a_screen.cursor_y = a_screen.scr_height - 1;
-			ret = true;
-		}
-	}
-	return ret;
-}
-
-/* Advance to next line; code dupe with above */
-static bool
-screen_advance_line(void)
-{
-	bool ret = 0;
-
-	a_screen.cursor_x = 0;
-	a_screen.cursor_y++;
-	if (a_screen.cursor_y >= a_screen.scr_height) {
-		a_screen.cursor_y = a_screen.scr_height - 1;
-		ret = true;
-	}
-
-	return ret;
-}
-
 /*
  * Calculate the maximum screen dimensions for the text area.
  *
@@ -174,6 +292,12 @@ screen_init_dimensions(void)
 	a_screen.scr_width /= a_screen.font_width;
 	a_screen.scr_height /= a_screen.font_height;
 
+	/* .. as many as the grid has room for */
+	if (a_screen.scr_width > SCREEN_MAX_COLS)
+		a_screen.scr_width = SCREEN_MAX_COLS;
+	if (a_screen.scr_height > SCREEN_MAX_ROWS)
+		a_screen.scr_height = SCREEN_MAX_ROWS;
+
 	printf("%s: width=%d, height=%d\n", __func__,
 	    a_screen.scr_width, a_screen.scr_height);
 }
@@ -228,6 +352,11 @@ screen_init(void)
   a_screen.cursor_x = a_screen.cursor_y = 0;
 
   screen_init_dimensions();
+  screen_clear_lines(0, SCREEN_MAX_ROWS);
+  screen_reset_modes();
+
+  /* Without it there's just no scrollback */
+  scrollback_init();
 
   return (1);
 error:
@@ -242,6 +371,7 @@ void
 screen_cleanup(void)
 {
   CloseWindow(mywindow);
+  scrollback_cleanup();
 
   if (GfxBase != NULL)
     CloseLibrary((struct Library *) GfxBase);
@@ -249,6 +379,228 @@ screen_cleanup(void)
     CloseLibrary((struct Library *) IntuitionBase);
 }
 
+/*
+ * Put a character in the grid at the cursor.  Don't advance the
+ * cursor.
+ */
+static void
+screen_put_char(char c)
+{
+	short x = a_screen.cursor_x, y = a_screen.cursor_y;
+
+	if ((screen_chars[y][x] == c) && (screen_attrs[y][x] == screen_attr))
+		return;
+	screen_chars[y][x] = c;
+	screen_attrs[y][x] = screen_attr;
+	screen_mark_dirty(y, x, x + 1);
+}
+
+/*
+ * Draw cells x0..x1-1 of chars and attrs on line y of the window,
+ * one Text() per attribute run.
+ */
+static void
+screen_draw_span(short y, const char *chars, const UWORD *attrs,
+    short x0, short x1)
+{
+	struct RastPort *rp = mywindow->RPort;
+	short x, py;
+	UWORD attr;
+	ULONG style;
+
+	py = y * a_screen.font_height + mywindow->BorderTop +
+	    a_screen.font_baseline;
+
+	while (x0 < x1) {
+		attr = attrs[x0];
+		for (x = x0 + 1; (x < x1) && (attrs[x] == attr); x++)
+			;
+
+		SetAPen(rp, SCREEN_ATTR_FG(attr));
+		SetBPen(rp, SCREEN_ATTR_BG(attr));
+		style = ((attr & SCREEN_ATTR_BOLD) ? FSF_BOLD : 0) |
+		    ((attr & SCREEN_ATTR_UNDERLINE) ? FSF_UNDERLINED : 0);
+		if (style != rp->AlgoStyle)
+			SetSoftStyle(rp, style, FSF_BOLD | FSF_UNDERLINED);
+		Move(rp, x0 * a_screen.font_width + mywindow->BorderLeft, py);
+
+		TIMER_PROF_BEGIN(prof_text);
+		Text(rp, (UBYTE *)&chars[x0], x - x0);
+		TIMER_PROF_END(prof_text);
+
+		x0 = x;
+	}
+}
+
+/*
+ * Put the pens and style back after drawing spans.
+ */
+static void
+screen_draw_done(void)
+{
+	struct RastPort *rp = mywindow->RPort;
+
+	SetAPen(rp, AMIGATERM_SCREEN_TEXT_PEN);
+	SetBPen(rp, AMIGATERM_SCREEN_BACKGROUND_PEN);
+	if (rp->AlgoStyle != FS_NORMAL)
+		SetSoftStyle(rp, FS_NORMAL, FSF_BOLD | FSF_UNDERLINED);
+}
+
+/*
+ * Catch the window up with the lines the grid has scrolled: one
+ * ScrollRaster() for the lot (up, or down for a negative count), or
+ * if that's a whole screen or more, clear it and draw every line
+ * from the grid.
+ */
+static void
+screen_scroll_window(void)
+{
+	short rows = a_screen.scr_height, n = screen_scroll_pending;
+	short x0, y0, x1, y1, y;
+
+	screen_scroll_pending = 0;
+
+	x0 = mywindow->BorderLeft;
+	y0 = mywindow->BorderTop;
+	x1 = x0 + a_screen.scr_width * a_screen.font_width - 1;
+	y1 = y0 + rows * a_screen.font_height - 1;
+
+	if ((n < rows) && (-n < rows)) {
+		SetBPen(mywindow->RPort, AMIGATERM_SCREEN_BACKGROUND_PEN);
+		ScrollRaster(mywindow->RPort, 0, n * a_screen.font_height,
+		    x0, y0, x1, y1);
+		return;
+	}
+
+	SetAPen(mywindow->RPort, AMIGATERM_SCREEN_BACKGROUND_PEN);
+	RectFill(mywindow->RPort, x0, y0, x1, y1);
+	screen_cursor_drawn = false;
+
+	/* Blank cells are already right; stop at the last one that isn't */
+	for (y = 0; y < rows; y++) {
+		screen_dirty_lo[y] = 0;
+		screen_dirty_hi[y] = screen_line_len(y);
+	}
+}
+
+/*
+ * Bring the window up to date with the grid.
+ */
+static void
+screen_render(void)
+{
+	short y;
+
+	if (screen_view > 0)
+		return;
+
+	if (screen_scroll_pending != 0)
+		screen_scroll_window();
+
+	/* The cell under the cursor block wants putting back */
+	if (screen_cursor_drawn) {
+		screen_mark_dirty(screen_cursor_y, screen_cursor_x,
+		    screen_cursor_x + 1);
+		screen_cursor_drawn = false;
+	}
+
+	if (screen_dirty == false)
+		return;
+
+	SetDrMd(mywindow->RPort, JAM2);
+	for (y = 0; y < a_screen.scr_height; y++) {
+		if (screen_dirty_lo[y] >= screen_dirty_hi[y])
+			continue;
+		if (screen_dirty_hi[y] > a_screen.scr_width)
+			screen_dirty_hi[y] = a_screen.scr_width;
+		screen_draw_span(y, screen_chars[y], screen_attrs[y],
+		    screen_dirty_lo[y], screen_dirty_hi[y]);
+		screen_dirty_lo[y] = screen_dirty_hi[y] = 0;
+	}
+	screen_dirty = false;
+
+	screen_draw_done();
+}
+
+/*
+ * Scroll the text area up a line, the top one going to the
+ * scrollback.  Only the grid moves now; the window catches up in
+ * the render, all the lines in one go.  Lines waiting to be drawn
+ * move up with the grid, and any that go off the top never get
+ * drawn at all.
+ */
+static void
+screen_scroll_up(void)
+{
+	short rows = a_screen.scr_height;
+
+	/* The window can only catch up with one direction at a time */
+	if ((screen_scroll_pending < 0) && (screen_view == 0))
+		screen_scroll_window();
+
+	scrollback_add(screen_chars[0], screen_attrs[0], screen_line_len(0));
+
+	/* Keep a paged back window on the same lines */
+	if (screen_view > 0) {
+		screen_view++;
+		if (screen_view > scrollback_lines())
+			screen_view = scrollback_lines();
+	}
+
+	memmove(&screen_chars[0][0], &screen_chars[1][0],
+	    (rows - 1) * sizeof(screen_chars[0]));
+	memmove(&screen_attrs[0][0], &screen_attrs[1][0],
+	    (rows - 1) * sizeof(screen_attrs[0]));
+	memmove(&screen_dirty_lo[0], &screen_dirty_lo[1],
+	    (rows - 1) * sizeof(screen_dirty_lo[0]));
+	memmove(&screen_dirty_hi[0], &screen_dirty_hi[1],
+	    (rows - 1) * sizeof(screen_dirty_hi[0]));
+	screen_clear_lines(rows - 1, rows);
+
+	if (screen_cursor_drawn) {
+		if (screen_cursor_y == 0)
+			screen_cursor_drawn = false;
+		else
+			screen_cursor_y--;
+	}
+
+	screen_scroll_pending++;
+	screen_dirty = true;
+}
+
+/*
+ * Blank the grid and the window (all of it inside the borders, in
+ * case it's just been resized.)
+ */
+static void
+screen_clear(void)
+{
+	screen_clear_lines(0, SCREEN_MAX_ROWS);
+	screen_dirty = false;
+	screen_scroll_pending = 0;
+	screen_cursor_drawn = false;
+	screen_view = 0;
+
+	SetAPen(mywindow->RPort, AMIGATERM_SCREEN_BACKGROUND_PEN);
+	RectFill(mywindow->RPort, mywindow->BorderLeft, mywindow->BorderTop,
+	    mywindow->Width - mywindow->BorderRight - 1,
+	    mywindow->Height - mywindow->BorderBottom - 1);
+	SetAPen(mywindow->RPort, AMIGATERM_SCREEN_TEXT_PEN);
+}
+
+/*
+ * Whether the window already shows the grid, with a pen cursor
+ * block where the cursor is.
+ */
+static bool
+screen_up_to_date(char pen)
+{
+	return ((screen_dirty == false) && screen_cursor_drawn &&
+	    (screen_cursor_x == a_screen.cursor_x) &&
+	    (screen_cursor_y == a_screen.cursor_y) &&
+	    (screen_cursor_pen == pen));
+}
+
 /*
  * Draw the cursor at the current cursor location.
  */
@@ -257,6 +609,13 @@ draw_cursor(char pen, bool do_xor)
 {
 	short cx, cy;
 
+	if (screen_view > 0)
+		return;
+	if (screen_up_to_date(pen) && (do_xor == false))
+		return;
+
+	screen_render();
+
 	screen_get_cursor_xy(&cx, &cy);
 	if (do_xor) {
 		SetDrMd(mywindow->RPort, COMPLEMENT);
@@ -271,26 +630,476 @@ draw_cursor(char pen, bool do_xor)
 		SetDrMd(mywindow->RPort, JAM2);
 	}
 
+	screen_cursor_drawn = true;
+	screen_cursor_x = a_screen.cursor_x;
+	screen_cursor_y = a_screen.cursor_y;
+	screen_cursor_pen = pen;
+}
+
+static void
+screen_frame_cb(void *arg)
+{
+	screen_update();
 }
 
 /*
- * Draw a character at the current location.  Don't advance the
- * cursor.
+ * Bring the window (and the cursor) up to date, unless a frame is
+ * already due; then it's left for that.
+ */
+void
+screen_update(void)
+{
+	if (screen_frame.cb == NULL)
+		timer_event_init(&screen_frame, screen_frame_cb, NULL);
+
+	if ((screen_view > 0) || timer_event_pending(&screen_frame))
+		return;
+	if (screen_up_to_date(AMIGATERM_SCREEN_CURSOR_PEN))
+		return;
+
+	draw_cursor(AMIGATERM_SCREEN_CURSOR_PEN, false);
+
+	/* Hold the next one off for a frame */
+	timer_event_add(&screen_frame, SCREEN_FRAME_MS);
+}
+
+/*
+ * Draw the window from the scrollback and the grid, screen_view
+ * lines back.
  */
 static void
-screen_draw_char(char c)
+screen_draw_view(void)
 {
-	short cx, cy;
+	char chars[SCREEN_MAX_COLS];
+	UWORD attrs[SCREEN_MAX_COLS];
+	short cols = a_screen.scr_width, x, y;
+	long back;
 
-	screen_get_cursor_xy(&cx, &cy);
+	SetDrMd(mywindow->RPort, JAM2);
+	for (y = 0; y < a_screen.scr_height; y++) {
+		back = screen_view - y;
+		if (back <= 0) {
+			screen_draw_span(y, screen_chars[-back],
+			    screen_attrs[-back], 0, cols);
+			continue;
+		}
+		for (x = scrollback_get(back, chars, attrs, cols); x < cols; x++) {
+			chars[x] = ' ';
+			attrs[x] = SCREEN_ATTR_DEFAULT;
+		}
+		screen_draw_span(y, chars, attrs, 0, cols);
+	}
+	screen_draw_done();
+	screen_cursor_drawn = false;
+}
+
+static void
+screen_set_view(long view)
+{
+	if (view > scrollback_lines())
+		view = scrollback_lines();
+	if (view < 0)
+		view = 0;
+	if (view == screen_view)
+		return;
+
+	screen_view = view;
+	if (view > 0) {
+		screen_draw_view();
+		return;
+	}
+
+	/* Back to the grid; draw all of it */
+	screen_scroll_pending = a_screen.scr_height;
+	screen_dirty = true;
+	draw_cursor(AMIGATERM_SCREEN_CURSOR_PEN, false);
+}
+
+/*
+ * Page the window back through the scrollback (or forward, with
+ * pages negative), a screen less a line at a time.
+ */
+void
+screen_page(int pages)
+{
+	screen_set_view(screen_view + (long) pages * (a_screen.scr_height - 1));
+}
+
+/*
+ * Go back to showing the grid, if the window's paged back.
+ */
+void
+screen_page_end(void)
+{
+	screen_set_view(0);
+}
+
+/*
+ * Work out the attribute for new characters from the SGR state.
+ */
+static void
+screen_sgr_attr(void)
+{
+	UBYTE fg = screen_sgr.fg, bg = screen_sgr.bg, t;
+
+	if (screen_sgr.reverse) {
+		t = fg;
+		fg = bg;
+		bg = t;
+	}
+	/* With only four pens colours clash; keep the text readable */
+	if (fg == bg)
+		fg = (bg == AMIGATERM_SCREEN_TEXT_PEN) ?
+		    SCREEN_PEN_BLACK : AMIGATERM_SCREEN_TEXT_PEN;
+
+	screen_attr = SCREEN_ATTR(fg, bg) | screen_sgr.style;
+}
+
+/*
+ * Move the cursor, inside the screen.
+ */
+static void
+screen_move(short x, short y)
+{
+	screen_set_cursor(x, y);
+	screen_wrap_pending = false;
+}
+
+/*
+ * Down a line, scrolling at the bottom.
+ */
+static void
+screen_index(void)
+{
+	screen_wrap_pending = false;
+	if (a_screen.cursor_y < a_screen.scr_height - 1)
+		a_screen.cursor_y++;
+	else
+		screen_scroll_up();
+}
+
+/*
+ * Up a line, scrolling down at the top.  As screen_scroll_up(), only
+ * the grid moves now and the window catches up in the render; the
+ * bottom line goes, and not to the scrollback.
+ */
+static void
+screen_reverse_index(void)
+{
+	short rows = a_screen.scr_height;
+
+	screen_wrap_pending = false;
+	if (a_screen.cursor_y > 0) {
+		a_screen.cursor_y--;
+		return;
+	}
+
+	if ((screen_scroll_pending > 0) && (screen_view == 0))
+		screen_scroll_window();
+
+	memmove(&screen_chars[1][0], &screen_chars[0][0],
+	    (rows - 1) * sizeof(screen_chars[0]));
+	memmove(&screen_attrs[1][0], &screen_attrs[0][0],
+	    (rows - 1) * sizeof(screen_attrs[0]));
+	memmove(&screen_dirty_lo[1], &screen_dirty_lo[0],
+	    (rows - 1) * sizeof(screen_dirty_lo[0]));
+	memmove(&screen_dirty_hi[1], &screen_dirty_hi[0],
+	    (rows - 1) * sizeof(screen_dirty_hi[0]));
+	screen_clear_lines(0, 1);
+
+	if (screen_cursor_drawn) {
+		if (screen_cursor_y == rows - 1)
+			screen_cursor_drawn = false;
+		else
+			screen_cursor_y++;
+	}
+
+	screen_scroll_pending--;
+	screen_dirty = true;
+}
+
+/*
+ * Blank cells x0..x1-1 of line y in the current background.
+ */
+static void
+screen_erase(short y, short x0, short x1)
+{
+	UWORD attr;
+	short x, lo = x1, hi = x0;
+
+	attr = SCREEN_ATTR(AMIGATERM_SCREEN_TEXT_PEN,
+	    SCREEN_ATTR_BG(screen_attr));
+	for (x = x0; x < x1; x++) {
+		if ((screen_chars[y][x] == ' ') && (screen_attrs[y][x] == attr))
+			continue;
+		screen_chars[y][x] = ' ';
+		screen_attrs[y][x] = attr;
+		if (x < lo)
+			lo = x;
+		hi = x + 1;
+	}
+	if (lo < hi)
+		screen_mark_dirty(y, lo, hi);
+}
+
+/* ED: erase in display */
+static void
+screen_erase_display(int how)
+{
+	short cols = a_screen.scr_width, rows = a_screen.scr_height;
+	short x = a_screen.cursor_x, y = a_screen.cursor_y, i;
+
+	switch (how) {
+	case 0: /* the cursor to the end */
+		screen_erase(y, x, cols);
+		for (i = y + 1; i < rows; i++)
+			screen_erase(i, 0, cols);
+		break;
+	case 1: /* the start to the cursor */
+		for (i = 0; i < y; i++)
+			screen_erase(i, 0, cols);
+		screen_erase(y, 0, x + 1);
+		break;
+	case 2: /* all of it */
+	case 3:
+		/* With the plain background a RectFill does it all */
+		if (SCREEN_ATTR_BG(screen_attr) ==
+		    AMIGATERM_SCREEN_BACKGROUND_PEN) {
+			screen_clear();
+			break;
+		}
+		for (i = 0; i < rows; i++)
+			screen_erase(i, 0, cols);
+		break;
+	}
+}
+
+/* SGR: colours and attributes */
+static void
+screen_csi_sgr(void)
+{
+	short i, p;
+
+	for (i = 0; (i < screen_ansi.nparams) || (i == 0); i++) {
+		p = (i < screen_ansi.nparams) ? screen_ansi.params[i] : 0;
+		switch (p) {
+		case 0:
+			screen_sgr.fg = AMIGATERM_SCREEN_TEXT_PEN;
+			screen_sgr.bg = AMIGATERM_SCREEN_BACKGROUND_PEN;
+			screen_sgr.style = 0;
+			screen_sgr.reverse = false;
+			break;
+		case 1:
+			screen_sgr.style |= SCREEN_ATTR_BOLD;
+			break;
+		case 4:
+			screen_sgr.style |= SCREEN_ATTR_UNDERLINE;
+			break;
+		case 7:
+			screen_sgr.reverse = true;
+			break;
+		case 22:
+			screen_sgr.style &= ~SCREEN_ATTR_BOLD;
+			break;
+		case 24:
+			screen_sgr.style &= ~SCREEN_ATTR_UNDERLINE;
+			break;
+		case 27:
+			screen_sgr.reverse = false;
+			break;
+		case 38:
+		case 48:
+			/* 256 colour and RGB; skip the colour */
+			if ((i + 1 < screen_ansi.nparams) &&
+			    (screen_ansi.params[i + 1] == 5))
+				i += 2;
+			else if ((i + 1 < screen_ansi.nparams) &&
+			    (screen_ansi.params[i + 1] == 2))
+				i += 4;
+			break;
+		case 39:
+			screen_sgr.fg = AMIGATERM_SCREEN_TEXT_PEN;
+			break;
+		case 49:
+			screen_sgr.bg = AMIGATERM_SCREEN_BACKGROUND_PEN;
+			break;
+		default:
+			/* The bright ones look the same as the rest */
+			if ((p >= 30) && (p <= 37))
+				screen_sgr.fg = screen_ansi_pens[p - 30];
+			else if ((p >= 90) && (p <= 97))
+				screen_sgr.fg = screen_ansi_pens[p - 90];
+			else if ((p >= 40) && (p <= 47))
+				screen_sgr.bg = screen_ansi_pens[p - 40];
+			else if ((p >= 100) && (p <= 107))
+				screen_sgr.bg = screen_ansi_pens[p - 100];
+			break;
+		}
+	}
+	screen_sgr_attr();
+}
+
+static void
+screen_save_cursor(void)
+{
+	screen_saved_x = a_screen.cursor_x;
+	screen_saved_y = a_screen.cursor_y;
+	screen_saved_sgr = screen_sgr;
+}
+
+static void
+screen_restore_cursor(void)
+{
+	screen_move(screen_saved_x, screen_saved_y);
+	screen_sgr = screen_saved_sgr;
+	screen_sgr_attr();
+}
+
+/*
+ * A CSI sequence ending in c.  Nothing with a private marker or an
+ * intermediate is done.
+ */
+static void
+screen_csi(char c)
+{
+	struct ansi_parser *ap = &screen_ansi;
+	short x = a_screen.cursor_x, y = a_screen.cursor_y, n;
 
-	Move(mywindow->RPort, cx, cy + a_screen.font_baseline);
+	if (ap->ninter != 0)
+		return;
 
-	Text(mywindow->RPort, (UBYTE *)&c, 1);
+	n = ANSI_PARAM(ap, 0, 1);
+	switch (c) {
+	case 'A': /* CUU */
+		screen_move(x, y - n);
+		break;
+	case 'B': /* CUD */
+		screen_move(x, y + n);
+		break;
+	case 'C': /* CUF */
+		screen_move(x + n, y);
+		break;
+	case 'D': /* CUB */
+		screen_move(x - n, y);
+		break;
+	case 'E': /* CNL */
+		screen_move(0, y + n);
+		break;
+	case 'F': /* CPL */
+		screen_move(0, y - n);
+		break;
+	case 'G': /* CHA */
+	case '`': /* HPA */
+		screen_move(n - 1, y);
+		break;
+	case 'd': /* VPA */
+		screen_move(x, n - 1);
+		break;
+	case 'H': /* CUP */
+	case 'f': /* HVP */
+		screen_move(ANSI_PARAM(ap, 1, 1) - 1, n - 1);
+		break;
+	case 'I': /* CHT */
+		while (n-- > 0) {
+			for (x++; (x < a_screen.scr_width - 1) && !screen_tabs[x]; x++)
+				;
+		}
+		screen_move(x, y);
+		break;
+	case 'J': /* ED */
+		screen_erase_display(ANSI_PARAM(ap, 0, 0));
+		break;
+	case 'K': /* EL */
+		switch (ANSI_PARAM(ap, 0, 0)) {
+		case 0:
+			screen_erase(y, x, a_screen.scr_width);
+			break;
+		case 1:
+			screen_erase(y, 0, x + 1);
+			break;
+		case 2:
+			screen_erase(y, 0, a_screen.scr_width);
+			break;
+		}
+		break;
+	case 'X': /* ECH */
+		screen_erase(y, x, (x + n < a_screen.scr_width) ?
+		    x + n : a_screen.scr_width);
+		break;
+	case 'g': /* TBC */
+		if (ANSI_PARAM(ap, 0, 0) == 0)
+			screen_tabs[x] = false;
+		else if (ANSI_PARAM(ap, 0, 0) == 3)
+			memset(screen_tabs, 0, sizeof(screen_tabs));
+		break;
+	case 'm': /* SGR */
+		screen_csi_sgr();
+		break;
+	case 's': /* SCOSC */
+		screen_save_cursor();
+		break;
+	case 'u': /* SCORC */
+		screen_restore_cursor();
+		break;
+	}
 }
 
 /*
- * Display an ASCII character and do basic terminal emulation.
+ * An ESC sequence ending in c.
+ */
+static void
+screen_esc(char c)
+{
+	if (screen_ansi.ninter != 0)
+		return;
+
+	switch (c) {
+	case '7': /* DECSC */
+		screen_save_cursor();
+		break;
+	case '8': /* DECRC */
+		screen_restore_cursor();
+		break;
+	case 'D': /* IND */
+		screen_index();
+		break;
+	case 'E': /* NEL */
+		screen_move(0, a_screen.cursor_y);
+		screen_index();
+		break;
+	case 'H': /* HTS */
+		screen_tabs[a_screen.cursor_x] = true;
+		break;
+	case 'M': /* RI */
+		screen_reverse_index();
+		break;
+	case 'c': /* RIS */
+		screen_reset_modes();
+		screen_move(0, 0);
+		screen_clear();
+		break;
+	}
+}
+
+/*
+ * A character to go on screen, at the cursor.
+ */
+static void
+screen_print(char c)
+{
+	if (screen_wrap_pending) {
+		screen_move(0, a_screen.cursor_y);
+		screen_index();
+	}
+	screen_put_char(c);
+	if (a_screen.cursor_x < a_screen.scr_width - 1)
+		a_screen.cursor_x++;
+	else
+		screen_wrap_pending = true;
+}
+
+/*
+ * Display an ASCII character and do the terminal emulation.
  *
  * This doesn't draw the cursor, but it does update the
  * current cursor position for when it's time to update the
@@ -299,64 +1108,56 @@ screen_draw_char(char c)
 static void
 _emit(char c)
 {
-  short xmax, ymax;
-
-  bool do_scroll = false;
+  short xmax, ymax, x;
 
-  xmax = mywindow->Width;
-  ymax = mywindow->Height;
+  switch (ansi_input(&screen_ansi, c)) {
+  case ANSI_PRINT:
+    screen_print(c);
+    return;
+  case ANSI_ESC:
+    screen_esc(c);
+    return;
+  case ANSI_CSI:
+    screen_csi(c);
+    return;
+  case ANSI_EXECUTE:
+    break;
+  default:
+    return;
+  }
 
   switch (c) {
   case '\t':
-    screen_advance_cursor(8, false); // tabstop 8, don't advance lines */
+    for (x = a_screen.cursor_x + 1;
+        (x < a_screen.scr_width - 1) && !screen_tabs[x]; x++)
+      ;
+    screen_move(x, a_screen.cursor_y);
     break;
-  case '\n':
+  case 10: /* line feed */
+  case 11: /* vertical tab */
+    screen_index();
     break;
-  case 13: /* newline */
-    do_scroll = screen_advance_line();
+  case 13: /* carriage return */
+    screen_move(0, a_screen.cursor_y);
     break;
   case 8: /* backspace */
-    screen_set_cursor(a_screen.cursor_x - 1, a_screen.cursor_y);
+    screen_move(a_screen.cursor_x - 1, a_screen.cursor_y);
     break;
   case 12: /* page, also newsize message, so read the config */
     screen_read_system_font();
     screen_init_dimensions();
-    screen_set_cursor(0, 0);
-
-    /*
-     * Blank the screen; note that I THINK this makes hard-coded assumptions
-     * about the menu and window decoration size!
-     *
-     * XXX TODO: remove hard-coded assumptions!
-     */
-    SetAPen(mywindow->RPort, AMIGATERM_SCREEN_BACKGROUND_PEN);
-    RectFill(mywindow->RPort, 2, 10, xmax - 19, ymax - 7);
-    SetAPen(mywindow->RPort, AMIGATERM_SCREEN_TEXT_PEN);
+    screen_move(0, 0);
+    screen_clear();
 
     break;
   case 7: /* bell - flash the screen */
+    xmax = mywindow->Width;
+    ymax = mywindow->Height;
+    screen_render();
     ClipBlit(mywindow->RPort, 0, 0, mywindow->RPort, 0, 0, xmax, ymax, 0x50);
     ClipBlit(mywindow->RPort, 0, 0, mywindow->RPort, 0, 0, xmax, ymax, 0x50);
     break;
-  default:
-    /* Write the character; advance screen position */
-    screen_draw_char(c);
-    do_scroll = screen_advance_cursor(1, true); /* next line if needed */
-    break;
   } /* end of switch */
-
-  /*
-   * if the cursor is off screen then next line; scroll if needed.
-   *
-   * Note that for some reason it's not wrapping screen_x here
-   * but it IS wrapping the cursor position; the next trip through
-   * _emit() will wrap the screen x/y position and draw the XOR
-   * cursor in the next location.
-   */
-  if (do_scroll) {
-    /* XXX again, hard-coded */
-    ScrollRaster(mywindow->RPort, 0, 8, 2, 10, xmax - 20, ymax - 2);
-  }
 }
 
 /*
@@ -374,11 +1175,29 @@ emit(char c)
   /* Normal plotting - foreground + background */
   SetDrMd(mywindow->RPort, JAM2);
   _emit(c);
+  screen_render();
 
   /* draw cursor */
 //  draw_cursor(AMIGATERM_SCREEN_CURSOR_PEN, false);
 }
 
+/*
+ * Echo a batch of (7 bit) characters, eg from the serial port.
+ *
+ * It all goes into the grid; see screen_update() for when it gets
+ * drawn.
+ */
+void
+emit_buf(const unsigned char *buf, int len)
+{
+  int i;
+
+  SetDrMd(mywindow->RPort, JAM2);
+  for (i = 0; i < len; i++)
+    _emit(buf[i] & 0x7f);
+  screen_update();
+}
+
 /*
  * Echo a string.
  *
@@ -402,7 +1221,7 @@ emits(const char *str)
   while (str[i] != 0) {
     c = str[i];
     if (c == 10)
-      c = 13;
+      _emit(13);
     _emit(c);
     i += 1;
   }
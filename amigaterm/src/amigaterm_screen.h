@@ -12,7 +12,11 @@ extern	void screen_cleanup(void);
 
 extern	void emits(const char *str);
 extern	void emit(char c);
+extern	void emit_buf(const unsigned char *buf, int len);
 
 extern	void draw_cursor(char pen, bool do_xor);
+extern	void screen_update(void);
+extern	void screen_page(int pages);
+extern	void screen_page_end(void);
 
 #endif
@@ -0,0 +1,166 @@
+/*
+ * Scrollback; see amigaterm_scrollback.h.
+ *
+ * The block starts with a ring of line offsets, one per line kept,
+ * and the rest is a byte ring the lines go in, each as
+ *
+ *   UBYTE len, nruns;
+ *   UBYTE chars[len];
+ *   UBYTE runs[nruns][3];       count, attribute (high, low)
+ *
+ * A line never wraps round the end of the ring.  When it won't fit
+ * in what's left at the end it goes at the start instead, and the
+ * oldest lines are dropped until it has the room.
+ */
+#include "exec/memory.h"          // for MEMF_FAST, MEMF_PUBLIC
+#include "proto/exec.h"           // for AllocMem, FreeMem
+#include <exec/types.h>           // for UBYTE, UWORD, ULONG
+#include <stdio.h>                // for NULL
+#include <string.h>               // for memcpy
+#include <stdbool.h>
+
+#include "amigaterm_scrollback.h"
+
+/* Guess at the average line, to size the offset ring */
+#define SCROLLBACK_AVG_LINE 32
+
+static UBYTE *sb_mem;             /* the whole block */
+static ULONG sb_mem_size;
+static ULONG *sb_lines;           /* line offsets into sb_data */
+static long sb_max_lines;
+static long sb_first, sb_count;   /* oldest line's slot; lines kept */
+static UBYTE *sb_data;
+static ULONG sb_size, sb_head;    /* byte ring; where the next line goes */
+
+bool
+scrollback_init(void)
+{
+  ULONG size;
+
+  for (size = SCROLLBACK_BYTES; size >= SCROLLBACK_MIN_BYTES; size /= 2) {
+    if ((sb_mem = AllocMem(size, MEMF_PUBLIC | MEMF_FAST)) != NULL)
+      break;
+  }
+  /* No fast memory; just take a little of what there is */
+  if (sb_mem == NULL) {
+    size = SCROLLBACK_MIN_BYTES;
+    if ((sb_mem = AllocMem(size, MEMF_PUBLIC)) == NULL)
+      return false;
+  }
+
+  sb_mem_size = size;
+  sb_max_lines = size / SCROLLBACK_AVG_LINE;
+  sb_lines = (ULONG *) sb_mem;
+  sb_data = sb_mem + sb_max_lines * sizeof(ULONG);
+  sb_size = size - sb_max_lines * sizeof(ULONG);
+  sb_first = sb_count = 0;
+  sb_head = 0;
+  return true;
+}
+
+void
+scrollback_cleanup(void)
+{
+  if (sb_mem != NULL)
+    FreeMem(sb_mem, sb_mem_size);
+  sb_mem = NULL;
+  sb_count = 0;
+}
+
+static void
+scrollback_drop(void)
+{
+  sb_first = (sb_first + 1) % sb_max_lines;
+  sb_count--;
+}
+
+/*
+ * Keep a line going off the top, len cells of it (the caller leaves
+ * off the blanks at the end.)
+ */
+void
+scrollback_add(const char *chars, const UWORD *attrs, short len)
+{
+  ULONG need;
+  UBYTE *p;
+  short nruns, i, r;
+
+  if (sb_mem == NULL)
+    return;
+  if (len > SCROLLBACK_MAX_COLS)
+    len = SCROLLBACK_MAX_COLS;
+
+  for (i = 0, nruns = 0; i < len; i++) {
+    if ((i == 0) || (attrs[i] != attrs[i - 1]))
+      nruns++;
+  }
+  need = 2 + len + 3 * nruns;
+
+  /*
+   * Anything from here to the end is older than what's at the
+   * start, so it goes first if the line has to go at the start.
+   */
+  if (sb_head + need > sb_size) {
+    while ((sb_count > 0) && (sb_lines[sb_first] >= sb_head))
+      scrollback_drop();
+    sb_head = 0;
+  }
+  while ((sb_count > 0) && (sb_lines[sb_first] >= sb_head) &&
+      (sb_lines[sb_first] < sb_head + need))
+    scrollback_drop();
+  if (sb_count == sb_max_lines)
+    scrollback_drop();
+
+  sb_lines[(sb_first + sb_count) % sb_max_lines] = sb_head;
+  sb_count++;
+
+  p = &sb_data[sb_head];
+  *p++ = len;
+  *p++ = nruns;
+  memcpy(p, chars, len);
+  p += len;
+  for (i = 0; i < len; i = r) {
+    for (r = i + 1; (r < len) && (attrs[r] == attrs[i]); r++)
+      ;
+    *p++ = r - i;
+    *p++ = attrs[i] >> 8;
+    *p++ = attrs[i] & 0xff;
+  }
+  sb_head += need;
+}
+
+long
+scrollback_lines(void)
+{
+  return sb_count;
+}
+
+/*
+ * Fetch line n back (1 is the newest) into chars and attrs, up to
+ * max cells of it.  Returns how many there were; the rest of the
+ * line is blank.
+ */
+short
+scrollback_get(long n, char *chars, UWORD *attrs, short max)
+{
+  const UBYTE *p;
+  short len, nruns, i, r, count;
+  UWORD attr;
+
+  if ((n < 1) || (n > sb_count))
+    return 0;
+
+  p = &sb_data[sb_lines[(sb_first + sb_count - n) % sb_max_lines]];
+  len = p[0];
+  nruns = p[1];
+  p += 2;
+  memcpy(chars, p, (len < max) ? len : max);
+  p += len;
+
+  for (r = 0, i = 0; (r < nruns) && (i < max); r++, p += 3) {
+    attr = (p[1] << 8) | p[2];
+    for (count = p[0]; (count > 0) && (i < max); count--)
+      attrs[i++] = attr;
+  }
+  return i;
+}
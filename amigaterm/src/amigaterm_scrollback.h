@@ -0,0 +1,31 @@
+#ifndef __AMIGATERM_SCROLLBACK_H__
+#define __AMIGATERM_SCROLLBACK_H__
+
+/*
+ * The lines which have scrolled off the top of the terminal.
+ *
+ * They're kept in one block of memory, allocated up front, as
+ * variable length lines: the characters, without the trailing
+ * blanks, and the attributes as runs.  When it's full the oldest
+ * lines go to make room, so the depth depends on how much text
+ * there is.
+ *
+ * SCROLLBACK_BYTES is what's asked for, from fast memory; with less
+ * free it halves down to SCROLLBACK_MIN_BYTES, and a machine with
+ * no fast memory only gets the minimum.
+ */
+#include <exec/types.h>           // for UWORD
+#include <stdbool.h>
+
+#define SCROLLBACK_BYTES (256 * 1024)
+#define SCROLLBACK_MIN_BYTES (16 * 1024)
+#define SCROLLBACK_MAX_COLS 255
+
+extern bool scrollback_init(void);
+extern void scrollback_cleanup(void);
+extern void scrollback_add(const char *chars, const UWORD *attrs,
+    short len);
+extern long scrollback_lines(void);
+extern short scrollback_get(long n, char *chars, UWORD *attrs, short max);
+
+#endif
@@ -32,6 +32,12 @@ static struct MsgPort *serial_write_port = NULL;
 static char rs_in[2];
 static char rs_out[2];
 
+/*
+ * The device's receive buffer; big enough to ride out a slow screen
+ * update at 115200 baud.
+ */
+#define SERIAL_RBUFLEN 8192
+
 static char read_queued = 0;
 static char write_queued = 0;
 
@@ -105,6 +111,7 @@ serial_init(int baud, int enable_hwflow)
   }
 
   Read_Request->io_Baud = baud;
+  Read_Request->io_RBufLen = SERIAL_RBUFLEN;
   Read_Request->io_ReadLen = 8;
   Read_Request->io_WriteLen = 8;
   Read_Request->io_CtlChar = 1L;
@@ -322,6 +329,42 @@ serial_get_char(unsigned char *ch)
     return 1;
 }
 
+/*
+ * Read whatever the device already has buffered, up to len bytes,
+ * without waiting for more.  Only call this with no read queued (eg
+ * straight after serial_get_char() returns a character); it lets
+ * the caller take everything that's arrived in one go rather than
+ * a read IO per character.
+ *
+ * Returns the number of bytes read.
+ */
+int
+serial_read_pending(char *buf, int len)
+{
+    ULONG n;
+
+    if (read_queued == 1)
+        puts("serial_read_pending: called w/ read_queued=1!\n");
+
+    Read_Request->IOSer.io_Command = SDCMD_QUERY;
+    Read_Request->IOSer.io_Flags = 0;
+    if (DoIO((struct IORequest *) Read_Request) != 0)
+        return 0;
+    n = Read_Request->IOSer.io_Actual;
+    if (n > (ULONG) len)
+        n = len;
+    if (n == 0)
+        return 0;
+
+    Read_Request->IOSer.io_Command = CMD_READ;
+    Read_Request->IOSer.io_Length = n;
+    Read_Request->IOSer.io_Data = (APTR) buf;
+    Read_Request->IOSer.io_Flags = 0;
+    if (DoIO((struct IORequest *) Read_Request) != 0)
+        return 0;
+    return Read_Request->IOSer.io_Actual;
+}
+
 /*
  * Call to see if the read is already ready.  This is called
  * as IOF_QUICK transactions won't post a signal.
@@ -22,7 +22,9 @@
 
 #include "amigaterm_serial.h"
 #include "../lib/timer/timer.h"
+#include "../lib/timer/tstamp.h"
 #include "amigaterm_util.h"
+#include "amigaterm_reactor.h"
 
 #include "amigaterm_serial_read.h"
 
@@ -34,6 +36,40 @@ extern unsigned int serial_get_abort_keypress_signal_bitmask(void);
 extern void emits(const char *);
 extern int current_baud;
 
+TIMER_PROF(prof_readbuf, "readchar_buf wait");
+
+/*
+ * While reading, the reactor waits on the serial port and the abort
+ * key for us (the timer is always there.)  The terminal's own serial
+ * source is left alone meanwhile, as we're called from a menu.
+ */
+static struct reactor_source readchar_source;
+static bool readchar_source_added = false;
+
+static bool
+readchar_ready(void *arg)
+{
+  return (serial_read_is_ready() != 0);
+}
+
+static void
+readchar_wait_begin(void)
+{
+  if (readchar_source_added == false) {
+    reactor_add(&readchar_source, serial_get_read_signal_bitmask() |
+        serial_get_abort_keypress_signal_bitmask(), REACTOR_PRI_SERIAL,
+        REACTOR_NESTED, readchar_ready, NULL, NULL);
+    readchar_source_added = true;
+  }
+  reactor_enable(&readchar_source, true);
+}
+
+static void
+readchar_wait_end(void)
+{
+  reactor_enable(&readchar_source, false);
+}
+
 /*
  * Empty the receive buffer until it times out.
  *
@@ -54,20 +90,17 @@ readchar_flush(int timeout_ms)
 
 	/* Set initial timer */
 	timer_timeout_set(timeout_ms);
+	readchar_wait_begin();
 
 	/*
 	 * Loop over and keep reading characters until we hit timeout.
 	 */
 	while (1) {
 		/*
-		 * Don't wait here if the serial port is using QUICK
+		 * This doesn't wait if the serial port is using QUICK
 		 * and is ready.
 		 */
-		if (serial_read_is_ready() == 0) {
-			Wait(serial_get_read_signal_bitmask() |
-			    serial_get_abort_keypress_signal_bitmask() |
-			    timer_get_signal_bitmask());
-		}
+		reactor_poll();
 
 		/* Check if we hit our timeout timer */
 		if (timer_timeout_fired()) {
@@ -96,6 +129,7 @@ readchar_flush(int timeout_ms)
 
 	/* Not sure - do I need to do this in case it fired? */
 	timer_timeout_abort();
+	readchar_wait_end();
 
 	return (retval);
 }
@@ -112,14 +146,11 @@ readchar_sched(int schedule_next, int timeout_ms, unsigned char *ch)
   if (timeout_ms > 0) {
       timer_timeout_set(timeout_ms);
   }
+  readchar_wait_begin();
 
   while (rd == FALSE) {
-    /* Don't wait here if the serial port is using QUICK and is ready */
-    if (serial_read_is_ready() == 0) {
-        Wait(serial_get_read_signal_bitmask() |
-             (serial_get_abort_keypress_signal_bitmask()) |
-             (timer_get_signal_bitmask()));
-    }
+    /* This doesn't wait if the serial port is using QUICK and is ready */
+    reactor_poll();
     ret = serial_get_char(&c);
     if (ret < 0) {
       /* IO error - we need to re-schedule another IO and break here */
@@ -157,6 +188,7 @@ readchar_sched(int schedule_next, int timeout_ms, unsigned char *ch)
 
   // Abort any pending timer
   timer_timeout_abort();
+  readchar_wait_end();
   *ch = c;
 
   return retval;
@@ -246,14 +278,12 @@ readchar_buf(char *buf, int len)
 
     /* Now we wait until it's completed or timeout */
     rd = FALSE;
+    TIMER_PROF_BEGIN(prof_readbuf);
+    readchar_wait_begin();
 
     while (rd == FALSE) {
-      /* Don't wait here if the serial port is using QUICK and is ready */
-      if (serial_read_is_ready() == 0) {
-          Wait(serial_get_read_signal_bitmask() |
-               (serial_get_abort_keypress_signal_bitmask()) |
-               timer_get_signal_bitmask());
-      }
+      /* This doesn't wait if the serial port is using QUICK and is ready */
+      reactor_poll();
 
       /* Check if the serial IO is completed */
       if (serial_read_ready()) {
@@ -294,6 +324,9 @@ readchar_buf(char *buf, int len)
 
     }
 
+    readchar_wait_end();
+    TIMER_PROF_END(prof_readbuf);
+
     /*
      * At this point we've either finished or aborted.
      * So I /hope/ it's safe to schedule the new single byte read.
@@ -301,8 +334,8 @@ readchar_buf(char *buf, int len)
     serial_read_start();
 
     /*
-     * And it's safe to abort this; the timer layer will only do
-     * the IO abort if it was actually scheduled.
+     * And it's safe to abort this; the timer layer only drops the
+     * deadline, whether or not it went off.
      */
     timer_timeout_abort();
 
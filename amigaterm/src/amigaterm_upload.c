@@ -0,0 +1,338 @@
+/*
+ * Bulk text upload (Ascii Send and Paste); see amigaterm_upload.h.
+ *
+ * The original sent one getc() character per trip round the main
+ * loop with a blocking write, and only while something else kept
+ * the loop busy.  Here the file is read ahead through afile and
+ * written to the serial port a chunk at a time with an asynchronous
+ * write, driven from the main loop by upload_poll().  Pacing cuts
+ * the chunks down to a character or a line and puts a timer delay,
+ * or a wait for the echo or a prompt, between them.
+ *
+ * A paste goes the same way, straight from the caller's buffer.
+ */
+#include "dos/dos.h"              // for MODE_OLDFILE
+#include <exec/types.h>           // for UBYTE
+#include <stdio.h>                // for NULL
+#include <stdlib.h>               // for strtol
+#include <stdbool.h>
+
+#include "amigaterm_afile.h"
+#include "amigaterm_serial.h"
+#include "amigaterm_upload.h"
+#include "../lib/timer/timer.h"
+
+#define UPLOAD_CHUNK 1024
+#define UPLOAD_FILE_BUFS 2
+#define UPLOAD_FILE_BUFSIZE 0x1000
+
+/* Where the upload is at */
+#define UP_IDLE 0       /* not running */
+#define UP_READY 1      /* start the next piece */
+#define UP_WRITING 2    /* a piece is going out */
+#define UP_DELAY 3      /* pacing delay */
+#define UP_WAITING 4    /* waiting for the echo or prompt */
+
+#define UPLOAD_WAIT_NONE -1
+#define UPLOAD_WAIT_ECHO -2
+
+static struct afile upload_file;
+static int upload_state = UP_IDLE;
+static unsigned char upload_buf[UPLOAD_CHUNK];
+static const unsigned char *upload_data;  /* upload_buf, or a paste */
+static long upload_len, upload_pos;
+static bool upload_from_file, upload_eof, upload_line_end;
+
+/* Pacing */
+static int upload_char_ms, upload_line_ms;
+static int upload_wait = UPLOAD_WAIT_NONE;
+static struct timer_event upload_timer;
+
+/*
+ * Anything using this will need to define an emits() function to print
+ * a string.
+ */
+extern void emits(const char *);
+
+/*
+ * Parse a pacing string (see amigaterm_upload.h); an empty one means
+ * no pacing.  Returns false if it doesn't make sense.
+ */
+bool
+upload_set_pacing(const char *spec)
+{
+  const char *p = spec;
+  char *end;
+  long val;
+
+  upload_char_ms = upload_line_ms = 0;
+  upload_wait = UPLOAD_WAIT_NONE;
+
+  while (*p != '\0') {
+    switch (*p | 0x20) {
+    case ' ':
+      p++;
+      continue;
+    case 'c':
+    case 'l':
+      val = strtol(p + 1, &end, 10);
+      if ((end == p + 1) || (val < 0) || (val > 10000))
+        return false;
+      if ((*p | 0x20) == 'c')
+        upload_char_ms = val;
+      else
+        upload_line_ms = val;
+      p = end;
+      break;
+    case 'e':
+      upload_wait = UPLOAD_WAIT_ECHO;
+      p++;
+      break;
+    case 'p':
+      if (p[1] == '\0')
+        return false;
+      upload_wait = (unsigned char) p[1];
+      p += 2;
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+static void
+upload_finish(const char *msg)
+{
+  if (upload_from_file)
+    afile_close(&upload_file);
+  upload_state = UP_IDLE;
+  if (upload_from_file)
+    emits(msg);
+}
+
+/*
+ * The pacing delays and waits have a timer of their own; it just
+ * has to be looked at in upload_poll(), after timer_run().
+ */
+static void
+upload_timer_cb(void *arg)
+{
+}
+
+static void
+upload_timer_start(int ms)
+{
+  if (upload_timer.cb == NULL)
+    timer_event_init(&upload_timer, upload_timer_cb, NULL);
+  timer_event_add(&upload_timer, ms);
+}
+
+/* Pause for ms (if any) before the next piece */
+static void
+upload_pause(int ms)
+{
+  if (ms > 0) {
+    upload_timer_start(ms);
+    upload_state = UP_DELAY;
+  } else
+    upload_state = UP_READY;
+}
+
+/*
+ * Start the next piece going out: as much as we have unpaced, one
+ * character or up to the end of a line when paced.
+ */
+static void
+upload_next(void)
+{
+  const unsigned char *p;
+  long n, i;
+
+  if (upload_pos == upload_len) {
+    n = (upload_eof) ? 0 : afile_read(&upload_file, upload_buf,
+        sizeof(upload_buf));
+    if (n < 0) {
+      upload_finish("\nError Reading File\n");
+      return;
+    }
+    if (n == 0) {
+      upload_finish("\nFile Sent\n");
+      return;
+    }
+    upload_eof = (n < (long) sizeof(upload_buf));
+    upload_len = n;
+    upload_pos = 0;
+  }
+
+  p = &upload_data[upload_pos];
+  n = upload_len - upload_pos;
+  if (upload_char_ms > 0)
+    n = 1;
+  else if ((upload_line_ms > 0) || (upload_wait != UPLOAD_WAIT_NONE)) {
+    for (i = 0; i < n; i++) {
+      if ((p[i] == '\n') || (p[i] == '\r')) {
+        /* CR LF is one line end, not two */
+        if ((p[i] == '\r') && (i + 1 < n) && (p[i + 1] == '\n'))
+          i++;
+        n = i + 1;
+        break;
+      }
+    }
+  }
+  /* Files end lines with LF, pastes with CR */
+  upload_line_end = ((p[n - 1] == '\n') || (p[n - 1] == '\r'));
+  upload_pos += n;
+
+  serial_write_start_buf((char *) p, n);
+  upload_state = UP_WRITING;
+}
+
+/* A piece has gone out; decide what comes after it */
+static void
+upload_written(void)
+{
+  serial_write_wait();
+  if (upload_line_end && (upload_wait != UPLOAD_WAIT_NONE)) {
+    upload_timer_start(UPLOAD_WAIT_MS);
+    upload_state = UP_WAITING;
+  } else if (upload_line_end && (upload_line_ms > 0))
+    upload_pause(upload_line_ms);
+  else
+    upload_pause(upload_char_ms);
+}
+
+bool
+upload_start_file(const char *file)
+{
+  upload_stop();
+  if (afile_open(&upload_file, file, MODE_OLDFILE, UPLOAD_FILE_BUFS,
+      UPLOAD_FILE_BUFSIZE) == false)
+    return false;
+  upload_data = upload_buf;
+  upload_len = upload_pos = 0;
+  upload_from_file = true;
+  upload_eof = false;
+  upload_state = UP_READY;
+
+  /* Get it going; the main loop only comes back on a signal */
+  upload_poll();
+  return true;
+}
+
+/*
+ * Send len bytes at buf, which has to stay put until it's done.
+ */
+void
+upload_start_buf(const unsigned char *buf, long len)
+{
+  upload_stop();
+  if (len <= 0)
+    return;
+  upload_data = buf;
+  upload_len = len;
+  upload_pos = 0;
+  upload_from_file = false;
+  upload_eof = true;
+  upload_state = UP_READY;
+  upload_poll();
+}
+
+void
+upload_stop(void)
+{
+  if (upload_state == UP_IDLE)
+    return;
+  if (upload_state == UP_WRITING)
+    serial_write_abort();
+  else if ((upload_state == UP_DELAY) || (upload_state == UP_WAITING))
+    timer_event_cancel(&upload_timer);
+  if (upload_from_file)
+    afile_close(&upload_file);
+  upload_state = UP_IDLE;
+}
+
+bool
+upload_active(void)
+{
+  return (upload_state != UP_IDLE);
+}
+
+unsigned int
+upload_get_signal_bitmask(void)
+{
+  return serial_get_write_signal_bitmask() | timer_get_signal_bitmask();
+}
+
+/*
+ * Call whenever a signal in upload_get_signal_bitmask() fires (or
+ * just every time round the main loop.)  Writes which complete
+ * straight away (IOF_QUICK) don't signal, so keep going until
+ * something is actually under way.
+ */
+void
+upload_poll(void)
+{
+  for (;;) {
+    switch (upload_state) {
+    case UP_READY:
+      upload_next();
+      break;
+    case UP_WRITING:
+      if (serial_write_ready() == 0)
+        return;
+      upload_written();
+      break;
+    case UP_DELAY:
+      if (timer_event_pending(&upload_timer))
+        return;
+      upload_state = UP_READY;
+      break;
+    case UP_WAITING:
+      /* Timed out; carry on regardless */
+      if (timer_event_pending(&upload_timer))
+        return;
+      upload_pause(upload_line_ms);
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+/*
+ * Data from the serial port; this is where the echo or prompt
+ * turns up.
+ */
+void
+upload_input(const unsigned char *buf, int len)
+{
+  int i;
+
+  if (upload_state != UP_WAITING)
+    return;
+
+  for (i = 0; i < len; i++) {
+    if ((upload_wait == UPLOAD_WAIT_ECHO) ?
+        ((buf[i] == '\n') || (buf[i] == '\r')) : (buf[i] == upload_wait))
+      break;
+  }
+  if (i == len)
+    return;
+
+  timer_event_cancel(&upload_timer);
+  upload_pause(upload_line_ms);
+  upload_poll();
+}
+
+/*
+ * Let the write under way finish, so the caller can use the serial
+ * port for a moment (eg to send a key.)  Call upload_poll() after,
+ * as nothing will signal for the upload to carry on.
+ */
+void
+upload_sync(void)
+{
+  if (upload_state == UP_WRITING)
+    upload_written();
+}
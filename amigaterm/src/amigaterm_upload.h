@@ -0,0 +1,33 @@
+#ifndef __AMIGATERM_UPLOAD_H__
+#define __AMIGATERM_UPLOAD_H__
+
+/*
+ * Sending text to the serial port in bulk (Ascii Send and Paste.)
+ *
+ * The data goes out in large asynchronous writes from the main loop.
+ * For hosts without flow control it can be paced instead; the pacing
+ * string is any of
+ *
+ *   c<ms>    wait ms after each character
+ *   l<ms>    wait ms after each line
+ *   e        wait for the end of each line to be echoed
+ *   p<char>  wait for char (eg a shell prompt) after each line
+ *
+ * separated by spaces, eg "l50 p>".  The waits for echo and prompt
+ * give up after UPLOAD_WAIT_MS and carry on.
+ */
+
+#define UPLOAD_WAIT_MS 3000
+
+extern bool upload_set_pacing(const char *spec);
+extern bool upload_start_file(const char *file);
+extern void upload_start_buf(const unsigned char *buf, long len);
+extern void upload_stop(void);
+extern bool upload_active(void);
+
+extern void upload_poll(void);
+extern void upload_input(const unsigned char *buf, int len);
+extern void upload_sync(void);
+extern unsigned int upload_get_signal_bitmask(void);
+
+#endif
@@ -0,0 +1,223 @@
+/************************************************************************
+ *  a terminal program that has ascii and xmodem transfer capability
+ *
+ *  use esc to abort xmodem transfer
+ *
+ *  written by Michael Mounier (1985)
+ *  enhanced by Roc Valles Domenech (2018-2021)
+ *  contributors: Alexander Fritsch (2021)
+ ************************************************************************/
+/*
+ * Blocking xmodem transfers: the xmodem engine driven by the serial
+ * port, the timer and AmigaDOS.
+ */
+#include "dos/dos.h"              // for BPTR, MODE_NEWFILE, MODE_OLDFILE
+#include "proto/dos.h"            // for Close, Open, Write, DeleteFile
+#include <exec/types.h>           // for FALSE, TRUE, UBYTE, CONST_STRPTR
+#include <stdio.h>                // for NULL, snprintf
+#include <stdbool.h>
+
+#include "amigaterm_afile.h"
+#include "amigaterm_serial.h"
+#include "amigaterm_serial_read.h"
+#include "amigaterm_xmodem.h"
+#include "amigaterm_xmodem_engine.h"
+
+/* Only one transfer at a time from here */
+static struct xmodem_engine xmodem_xe;
+
+/*
+ * Anything using this will need to define an emits() function to print
+ * a string.
+ */
+extern void emits(const char *);
+extern int current_baud;
+
+/*
+ * Do what the engine asks until it's finished.
+ */
+static bool
+xmodem_run(struct xmodem_engine *xe, struct xmodem_stream *xs)
+{
+  struct xmodem_io io;
+  serial_retval_t retval;
+  unsigned char c;
+  bool writing = false;
+
+  for (;;) {
+    xmodem_engine_next(xe, &io);
+    switch (io.type) {
+    case XMODEM_IO_SEND:
+      /*
+       * Don't wait for the write; the engine gets on with the
+       * next block (and any file read) while this one goes out.
+       */
+      if (writing)
+        serial_write_wait();
+      serial_write_start_buf((char *) io.buf, io.len);
+      writing = true;
+      xmodem_engine_complete(xe, io.len);
+      break;
+    case XMODEM_IO_READ:
+      xmodem_engine_complete(xe, xs->read(xs->arg, io.buf, io.len));
+      break;
+    case XMODEM_IO_WRITE:
+      xmodem_engine_complete(xe, xs->write(xs->arg, io.buf, io.len));
+      break;
+    case XMODEM_IO_RECV:
+      /*
+       * Blocks are read in one go, straight into place; anything
+       * else a character at a time.
+       */
+      if ((io.len > 1) && (io.buf != NULL)) {
+        retval = readchar_buf((char *) io.buf, io.len);
+        if (retval == SERIAL_RET_OK)
+          xmodem_engine_input(xe, io.buf, io.len);
+      } else {
+        retval = readchar_sched(1, io.timeout_ms, &c);
+        if (retval == SERIAL_RET_OK)
+          xmodem_engine_input(xe, &c, 1);
+      }
+      if (retval == SERIAL_RET_TIMEOUT)
+        xmodem_engine_timeout(xe);
+      else if (retval == SERIAL_RET_ABORT)
+        xmodem_engine_abort(xe);
+      break;
+    case XMODEM_IO_STATUS:
+      emits((const char *) io.buf);
+      xmodem_engine_complete(xe, io.len);
+      break;
+    case XMODEM_IO_DONE:
+      if (writing)
+        serial_write_wait();
+      return xe->ok;
+    }
+  }
+}
+
+static long
+xmodem_file_read(void *arg, unsigned char *buf, long len)
+{
+  return afile_read((struct afile *) arg, buf, len);
+}
+
+static long
+xmodem_file_write(void *arg, const unsigned char *buf, long len)
+{
+  return afile_write((struct afile *) arg, buf, len);
+}
+
+#if XMODEM_CRC_SIDECAR
+/*
+ * Record the digest next to the file as <file>.crc.
+ */
+static void
+xmodem_write_sidecar(const char *file, long file_len, unsigned long crc)
+{
+  char name[40], line[32];
+  BPTR fh;
+  int n;
+
+  snprintf(name, sizeof(name), "%s.crc", file);
+  if ((fh = Open((UBYTE *) name, MODE_NEWFILE)) == 0) {
+    emits("Cannot write CRC file\n");
+    return;
+  }
+  n = snprintf(line, sizeof(line), "%08lx %ld\n", crc, file_len);
+  Write(fh, line, n);
+  Close(fh);
+}
+#endif
+
+/***************************************/
+/*  xmodem send and receive functions */
+/*************************************/
+
+/*
+ * Xmodem receive.
+ */
+int XMODEM_Read_File(char *file, long file_size) {
+  static struct afile af;
+  struct xmodem_stream xs;
+  bool ok;
+
+  /*
+   * The file is written behind the transfer; see amigaterm_afile.h.
+   * The last of it (and any write error) is only known at close.
+   */
+  if (afile_open(&af, file, MODE_NEWFILE, XMODEM_WRITE_BUFS,
+      XMODEM_BUFSIZE) == false) {
+    emits("Cannot Open File\n");
+    return FALSE;
+  }
+
+  /* Claim the space now; a full disk is better found out before */
+  if (afile_reserve(&af, file_size) == false) {
+    afile_close(&af);
+    DeleteFile((UBYTE *) file);
+    emits("Not Enough Room For File\n");
+    return FALSE;
+  }
+  emits("Receiving File...\n");
+
+  xs.read = NULL;
+  xs.write = xmodem_file_write;
+  xs.arg = &af;
+  ok = XMODEM_Read_Stream(&xs, file_size);
+  if ((afile_close(&af) == false) && ok) {
+    emits("Error Writing File\n");
+    ok = false;
+  }
+
+  if (ok == false)
+    return FALSE;
+#if XMODEM_CRC_SIDECAR
+  xmodem_write_sidecar(file, xmodem_xe.file_len, xmodem_xe.file_crc);
+#endif
+  return TRUE;
+}
+
+int
+XMODEM_Send_File(char *file)
+{
+  static struct afile af;
+  struct xmodem_stream xs;
+  bool ok;
+
+  /* The reads start now and keep ahead of the transfer from here */
+  if (afile_open(&af, file, MODE_OLDFILE, XMODEM_READ_BUFS,
+      XMODEM_BUFSIZE) == false) {
+    emits("Cannot Open Send File\n");
+    return FALSE;
+  } else
+    emits("Sending File...");
+
+  xs.read = xmodem_file_read;
+  xs.write = NULL;
+  xs.arg = &af;
+  ok = XMODEM_Send_Stream(&xs);
+  afile_close(&af);
+  return ok ? TRUE : FALSE;
+}
+
+int
+XMODEM_Read_Stream(struct xmodem_stream *xs, long file_size)
+{
+  xmodem_engine_recv_init(&xmodem_xe, file_size, current_baud);
+  if (xmodem_run(&xmodem_xe, xs) == false) {
+    /*
+     * Do a flush here to eat any half-read buffer
+     * before we return.
+     */
+    readchar_flush(500);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+int
+XMODEM_Send_Stream(struct xmodem_stream *xs)
+{
+  xmodem_engine_send_init(&xmodem_xe, current_baud);
+  return xmodem_run(&xmodem_xe, xs) ? TRUE : FALSE;
+}
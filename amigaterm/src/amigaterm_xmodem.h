@@ -4,9 +4,78 @@
 /* xmodem protocol defines */
 
 #define SECSIZ 0x80
+#define SECSIZ_1K 0x400
 #define SOH 1          /* Start of sector char */
+#define STX 2          /* Start of 1K sector char (XMODEM-1K) */
 #define EOT 4          /* end of transmission char */
 #define ACK 6          /* acknowledge sector transmission */
 #define NAK 21         /* error in transmission detected */
 
+/*
+ * amigaterm extension: LZ compressed blocks.
+ *
+ * A receiver which supports it kicks the transfer off with
+ * XMODEM_KICK_LZ rather than NAK, and falls back to NAK if nothing
+ * turns up.  A sender which sees it may send any block as:
+ *
+ *   SOZ, sector, ~sector, block size / 128, ~(block size / 128),
+ *   length (hi, lo), ~length (hi, lo), length bytes of LZ data,
+ *   CRC-16 of the decompressed block (hi, lo)
+ *
+ * The size and length are sent with their complements, like the
+ * sector, as the receiver has to trust them to know how much to read.
+ * The LZ data may refer back to the blocks already sent from the
+ * current 4K buffer.  Blocks which don't compress go out as plain
+ * SOH/STX blocks.
+ */
+#define XMODEM_ENABLE_LZ 1
+#define XMODEM_KICK_LZ 'Z'
+#define SOZ 0x0E       /* Start of LZ compressed sector */
+
+/*
+ * amigaterm extension: file digest.
+ *
+ * Both ends keep a CRC-32 of the file bytes as they go.  When the
+ * LZ kick was answered, the sender follows the ACK of its EOT with:
+ *
+ *   SOD, file length (4 bytes, big endian), CRC-32 (4 bytes, big endian),
+ *   CRC-16 of those 8 bytes (hi, lo)
+ *
+ * which the receiver ACKs (or NAKs to have it resent.)  The length
+ * also lets the receiver trim the padding off the last block.
+ */
+#define SOD 0x0F       /* Start of file digest */
+#define XMODEM_DIGEST_LEN 8
+
+/* Write the receiver's digest to <file>.crc as well */
+#define XMODEM_CRC_SIDECAR 0
+
+/*
+ * Received data is written out behind the transfer through this many
+ * XMODEM_BUFSIZE buffers, so a slow disk doesn't hold up the ACKs.
+ */
+#define XMODEM_WRITE_BUFS 3
+
+/*
+ * .. and a file being sent is read ahead through this many, so the
+ * next 4K is on its way off the disk while the current one goes out.
+ */
+#define XMODEM_READ_BUFS 3
+
+/*
+ * Something other than an AmigaDOS file to move data to or from.
+ * read and write return the byte count (read returns 0 at the end),
+ * or -1 on an error.
+ */
+struct xmodem_stream {
+  long (*read)(void *arg, unsigned char *buf, long len);
+  long (*write)(void *arg, const unsigned char *buf, long len);
+  void *arg;
+};
+
+extern int XMODEM_Read_File(char *file, long file_size);
+extern int XMODEM_Send_File(char *file);
+extern int XMODEM_Read_Stream(struct xmodem_stream *xs, long file_size);
+extern int XMODEM_Send_Stream(struct xmodem_stream *xs);
+
 #endif
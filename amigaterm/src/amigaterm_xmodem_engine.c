@@ -0,0 +1,163 @@
+/*
+ * xmodem engine core: the operation queue and the entry points,
+ * which hand off to the receive (amigaterm_xmodem_recv.c) or send
+ * (amigaterm_xmodem_send.c) half.
+ *
+ * Nothing in here or in the two halves touches the serial port,
+ * the timer or the filesystem; see amigaterm_xmodem.c for the
+ * Amiga side.
+ */
+#include <stddef.h>               // for NULL, offsetof
+#include <string.h>               // for memset, strncpy
+#include <stdbool.h>
+
+#include "amigaterm_xmodem_engine.h"
+
+void
+xmodem_engine_reset(struct xmodem_engine *xe, bool sending, int baud)
+{
+  /* The buffers don't need clearing */
+  memset(xe, 0, offsetof(struct xmodem_engine, buf));
+  xe->sending = sending;
+  xe->baud = baud;
+}
+
+/*
+ * How long to wait for 'len' bytes: their time on the wire plus
+ * 50%, and at least a second.
+ */
+int
+xmodem_engine_rx_timeout(const struct xmodem_engine *xe, int len)
+{
+  int ms;
+
+  if (xe->baud == 0)
+    return 1000;
+  ms = ((long) len * 15 * 1000) / xe->baud;
+  return (ms < 1000) ? 1000 : ms;
+}
+
+void
+xmodem_engine_queue(struct xmodem_engine *xe, int type, unsigned char *buf,
+    long len)
+{
+  struct xmodem_io *io;
+
+  /* The halves never queue more than XMODEM_MAX_OPS at once */
+  if (xe->op_count == XMODEM_MAX_OPS)
+    return;
+
+  io = &xe->ops[(xe->op_head + xe->op_count) % XMODEM_MAX_OPS];
+  io->type = type;
+  io->buf = buf;
+  io->len = len;
+  io->timeout_ms = 0;
+  xe->op_count++;
+}
+
+void
+xmodem_engine_queue_char(struct xmodem_engine *xe, unsigned char c)
+{
+  int slot = (xe->op_head + xe->op_count) % XMODEM_MAX_OPS;
+
+  xe->ctl[slot] = c;
+  xmodem_engine_queue(xe, XMODEM_IO_SEND, &xe->ctl[slot], 1);
+}
+
+/* Queue a message for the user; it's copied, so it can be on the stack */
+void
+xmodem_engine_status(struct xmodem_engine *xe, const char *msg)
+{
+  int slot = (xe->op_head + xe->op_count) % XMODEM_MAX_OPS;
+
+  strncpy(xe->status[slot], msg, XMODEM_STATUS_LEN - 1);
+  xe->status[slot][XMODEM_STATUS_LEN - 1] = '\0';
+  xmodem_engine_queue(xe, XMODEM_IO_STATUS,
+      (unsigned char *) xe->status[slot], strlen(xe->status[slot]));
+}
+
+/*
+ * Mark the transfer finished.  Anything already queued (eg the
+ * final write) is still handed out before XMODEM_IO_DONE.
+ */
+void
+xmodem_engine_finish(struct xmodem_engine *xe, bool ok)
+{
+  xe->done = true;
+  xe->ok = ok;
+}
+
+void
+xmodem_engine_next(struct xmodem_engine *xe, struct xmodem_io *io)
+{
+  if (xe->op_count > 0) {
+    *io = xe->ops[xe->op_head];
+    return;
+  }
+
+  if (xe->done) {
+    io->type = XMODEM_IO_DONE;
+    io->buf = NULL;
+    io->len = 0;
+    io->timeout_ms = 0;
+    return;
+  }
+
+  if (xe->sending)
+    xmodem_send_wants(xe, io);
+  else
+    xmodem_recv_wants(xe, io);
+}
+
+/*
+ * The operation xmodem_engine_next() handed out is done; len is
+ * the byte count (or -1 for an error.)
+ */
+void
+xmodem_engine_complete(struct xmodem_engine *xe, long len)
+{
+  struct xmodem_io op;
+
+  if (xe->op_count == 0)
+    return;
+
+  op = xe->ops[xe->op_head];
+  xe->op_head = (xe->op_head + 1) % XMODEM_MAX_OPS;
+  xe->op_count--;
+
+  if (xe->sending)
+    xmodem_send_complete(xe, &op, len);
+  else
+    xmodem_recv_complete(xe, &op, len);
+}
+
+int
+xmodem_engine_input(struct xmodem_engine *xe, const unsigned char *buf,
+    int len)
+{
+  if (xe->done || (xe->op_count > 0))
+    return 0;
+
+  if (xe->sending)
+    return xmodem_send_input(xe, buf, len);
+  return xmodem_recv_input(xe, buf, len);
+}
+
+void
+xmodem_engine_timeout(struct xmodem_engine *xe)
+{
+  if (xe->done || (xe->op_count > 0))
+    return;
+
+  if (xe->sending)
+    xmodem_send_timeout(xe);
+  else
+    xmodem_recv_timeout(xe);
+}
+
+void
+xmodem_engine_abort(struct xmodem_engine *xe)
+{
+  xe->op_count = 0;
+  xmodem_engine_finish(xe, false);
+}
@@ -0,0 +1,173 @@
+#ifndef __AMIGATERM_XMODEM_ENGINE_H__
+#define __AMIGATERM_XMODEM_ENGINE_H__
+
+/*
+ * The xmodem protocol as an event driven engine.
+ *
+ * The engine does no I/O of its own.  The caller loops on
+ * xmodem_engine_next() and does whatever it asks:
+ *
+ *   XMODEM_IO_SEND  - write len bytes at buf to the line, then
+ *                     call xmodem_engine_complete().  buf is left
+ *                     alone until the next XMODEM_IO_SEND is handed
+ *                     out, so the write can still be going on in
+ *                     the background; the sender uses that time to
+ *                     get the next block ready.
+ *   XMODEM_IO_READ  - read up to len bytes of the file into buf, then
+ *                     call xmodem_engine_complete() with the count
+ *                     (0 at end of file, -1 on error)
+ *   XMODEM_IO_WRITE - write len bytes at buf to the file, then
+ *                     call xmodem_engine_complete() with the count
+ *   XMODEM_IO_RECV  - wait for bytes from the line and pass them to
+ *                     xmodem_engine_input(), or call
+ *                     xmodem_engine_timeout() if none turn up within
+ *                     timeout_ms.  len is how many bytes the engine
+ *                     expects next; if buf isn't NULL they can be
+ *                     read straight into it and handed back from
+ *                     there without a copy.
+ *   XMODEM_IO_STATUS - show the user the NUL terminated message at
+ *                     buf, then call xmodem_engine_complete()
+ *   XMODEM_IO_DONE  - finished; ok says how it went.  Success only
+ *                     means the transfer went through; the caller
+ *                     reports it once the file is closed.
+ *
+ * xmodem_engine_input() returns how many bytes it took; it stops
+ * early once it has queued something for the caller, and the rest
+ * should be passed in again after that's been done.
+ *
+ * All state lives in struct xmodem_engine, so any number of
+ * transfers can run at once.
+ */
+
+#include "amigaterm_xmodem.h"
+
+#define XMODEM_IO_RECV 0
+#define XMODEM_IO_SEND 1
+#define XMODEM_IO_READ 2
+#define XMODEM_IO_WRITE 3
+#define XMODEM_IO_DONE 4
+#define XMODEM_IO_STATUS 5
+
+#define XMODEM_BUFSIZE 0x1000
+#define XMODEM_MAX_OPS 8
+#define XMODEM_STATUS_LEN 64
+
+struct xmodem_io {
+  int type;
+  unsigned char *buf;
+  long len;
+  int timeout_ms;
+};
+
+/* Adaptive send block size; see amigaterm_xmodem_send.c */
+struct xmodem_blk_state {
+  int cur;                 /* index into xmodem_blk_sizes[] */
+  int max;                 /* largest index we'll still try */
+  unsigned int ok, fail;   /* decaying outcome counts at the current size */
+  int upgrade_after;       /* clean samples needed before upgrading */
+  bool cur_acked;          /* has the current size ever been ACKed? */
+  int cur_fail_run;        /* consecutive failures at the current size */
+};
+
+struct xmodem_engine {
+  bool sending;
+  int state;
+  bool done, ok;
+  int baud;
+
+  /* Operations waiting on the caller, oldest first */
+  struct xmodem_io ops[XMODEM_MAX_OPS];
+  int op_head, op_count;
+  unsigned char ctl[XMODEM_MAX_OPS];  /* single character sends */
+  char status[XMODEM_MAX_OPS][XMODEM_STATUS_LEN];
+
+  /* Bytes being collected from the line */
+  unsigned char *rx_dst;
+  int rx_got, rx_want;
+
+  int sectnum, errors, attempts;
+  unsigned int bufptr;
+  long file_len;
+  unsigned long file_crc;
+  bool use_lz;
+
+  /* Receive side */
+  long file_size, file_offset;
+  unsigned char firstchar;
+  unsigned char hdr[8];
+  int blksize, lz_len, kicks, kick_timeouts, holdback;
+  int flush_action, flush_next;
+  int digest_tries, junk;
+  bool peer_ext, have_digest;
+  long peer_len;
+  unsigned long peer_crc;
+  int shift;                /* bytes to drop off buf once written */
+  int dict;                 /* where the sender's buffer starts in buf */
+
+  /* Send side */
+  struct xmodem_blk_state bs;
+  int bytes_to_send, size;
+  int cur_buf;              /* file buffer (buf or alt) being sent */
+  int fill[2];              /* bytes read into each file buffer */
+  bool eof, reading;
+  long wire_bytes;
+  unsigned char frame[1 + XMODEM_DIGEST_LEN + 2];
+
+  /* The block built in each frame slot */
+  int tx_slot;              /* the slot sent last */
+  int pb_sect[2], pb_size[2], pb_len[2];
+  unsigned char *pb_src[2];
+
+  /*
+   * The file buffer has room past XMODEM_BUFSIZE for the receiver
+   * to take a 1K block (and its checksum) when it's nearly full.
+   */
+  unsigned char buf[XMODEM_BUFSIZE + SECSIZ_1K + 2];
+  unsigned char lzbuf[SECSIZ_1K + 2];
+
+  /* The sender reads the file into buf and alt in turn */
+  unsigned char alt[XMODEM_BUFSIZE];
+  /* .. and builds blocks into these in turn */
+  unsigned char blk[2][9 + SECSIZ_1K + 2];
+};
+
+extern void xmodem_engine_recv_init(struct xmodem_engine *xe,
+    long file_size, int baud);
+extern void xmodem_engine_send_init(struct xmodem_engine *xe, int baud);
+
+extern void xmodem_engine_next(struct xmodem_engine *xe,
+    struct xmodem_io *io);
+extern void xmodem_engine_complete(struct xmodem_engine *xe, long len);
+extern int xmodem_engine_input(struct xmodem_engine *xe,
+    const unsigned char *buf, int len);
+extern void xmodem_engine_timeout(struct xmodem_engine *xe);
+extern void xmodem_engine_abort(struct xmodem_engine *xe);
+
+/* For the protocol halves */
+extern void xmodem_engine_reset(struct xmodem_engine *xe, bool sending,
+    int baud);
+extern int xmodem_engine_rx_timeout(const struct xmodem_engine *xe, int len);
+extern void xmodem_engine_queue(struct xmodem_engine *xe, int type,
+    unsigned char *buf, long len);
+extern void xmodem_engine_queue_char(struct xmodem_engine *xe,
+    unsigned char c);
+extern void xmodem_engine_status(struct xmodem_engine *xe, const char *msg);
+extern void xmodem_engine_finish(struct xmodem_engine *xe, bool ok);
+
+extern void xmodem_recv_wants(struct xmodem_engine *xe,
+    struct xmodem_io *io);
+extern int xmodem_recv_input(struct xmodem_engine *xe,
+    const unsigned char *buf, int len);
+extern void xmodem_recv_timeout(struct xmodem_engine *xe);
+extern void xmodem_recv_complete(struct xmodem_engine *xe,
+    const struct xmodem_io *op, long len);
+
+extern void xmodem_send_wants(struct xmodem_engine *xe,
+    struct xmodem_io *io);
+extern int xmodem_send_input(struct xmodem_engine *xe,
+    const unsigned char *buf, int len);
+extern void xmodem_send_timeout(struct xmodem_engine *xe);
+extern void xmodem_send_complete(struct xmodem_engine *xe,
+    const struct xmodem_io *op, long len);
+
+#endif
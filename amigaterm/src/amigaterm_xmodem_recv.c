@@ -7,33 +7,36 @@
  *  enhanced by Roc Valles Domenech (2018-2021)
  *  contributors: Alexander Fritsch (2021)
  ************************************************************************/
-/*  compiler directives to fetch the necessary header files */
-#include "dos/dos.h"              // for BPTR, MODE_NEWFILE, MODE_OLDFILE
-#include "exec/io.h"              // for IOStdReq, CMD_READ, CMD_WRITE
-#include "exec/memory.h"          // for MEMF_CLEAR, MEMF_PUBLIC
-#include "exec/ports.h"           // for Message, MsgPort
-#include "proto/dos.h"            // for Close, Open, Write, Read
-#include "proto/exec.h"           // for FreeMem, DoIO, GetMsg, AllocMem
-#include "stdlib.h"               // for exit
-#include <clib/alib_protos.h>     // for DeletePort, BeginIO
-#include <exec/types.h>           // for FALSE, TRUE, UBYTE, CONST_STRPTR
-#include <stdio.h>                // for NULL, puts, fclose, fopen, EOF, getc
-
-#include "amigaterm_serial.h"
-#include "amigaterm_serial_read.h"
-#include "../lib/timer/timer.h"
-#include "amigaterm_util.h"
+/*
+ * xmodem receive, as the receive half of the xmodem engine
+ * (amigaterm_xmodem_engine.h.)
+ */
+#include <stdio.h>                // for NULL, snprintf
+#include <string.h>               // for memmove, memcpy
+#include <stdbool.h>
+
 #include "amigaterm_xmodem.h"
+#include "amigaterm_xmodem_engine.h"
+#include "amigaterm_crc.h"
+#include "amigaterm_lz.h"
 
-#define BufSize 0x1000
-static char bufr[BufSize];
 #define ERRORMAX 10
 
-/*
- * Anything using this will need to define an emits() function to print
- * a string.
- */
-extern void emits(const char *);
+/* Receive states */
+#define XR_SYNC 0              /* waiting for SOH/STX/SOZ/EOT */
+#define XR_HDR 1               /* reading the block header */
+#define XR_DATA 2              /* reading the block and its check bytes */
+#define XR_FLUSH 3             /* eating the line until it goes quiet */
+#define XR_DIGEST_SYNC 4       /* after EOT, waiting for SOD */
+#define XR_DIGEST 5            /* reading the digest */
+
+/* What to send once a flush is over */
+#define XR_FLUSH_NONE 0
+#define XR_FLUSH_KICK 1
+#define XR_FLUSH_NAK 2
+
+/* How long the line has to be quiet for a flush to finish */
+#define XR_FLUSH_MS 100
 
 /*
  * Figure out how many bytes we need to write for this particular
@@ -55,185 +58,480 @@ get_bytes_for_transfer(long file_size, long file_offset, int block_size)
   return block_size;
 }
 
-/***************************************/
-/*  xmodem send and receive functions */
-/*************************************/
+/*
+ * Number of timeouts between kicks while waiting for the first
+ * block, and how many kicks try the LZ extension before falling
+ * back to a plain NAK.
+ */
+#define KICK_INTERVAL 3
+#define KICK_LZ_TRIES 1
+
+#define DIGEST_TRIES 3
 
 /*
- * Xmodem receive.
- *
- * This doesn't at /all/ handle missing characters from the stream,
- * any form of timeout/resyncing the streams, etc.
+ * Send the character which asks the sender to start (or
+ * restart) the transfer.
  */
-int XMODEM_Read_File(char *file, long file_size) {
-  long file_offset = 0L;
-  long bytes_xferred;
-  int sectnum, errors, errorflag;
-  unsigned int j, bufptr;
-  int bw;
-  serial_retval_t retval;
-  unsigned char firstchar, sectcurr, sectcomp, checksum, checkcmp;
-  BPTR fh;
+static void
+xmodem_recv_kick(struct xmodem_engine *xe)
+{
+#if XMODEM_ENABLE_LZ
+  if (xe->kicks++ < KICK_LZ_TRIES) {
+    xmodem_engine_queue_char(xe, XMODEM_KICK_LZ);
+    return;
+  }
+#else
+  xe->kicks++;
+#endif
+  xmodem_engine_queue_char(xe, NAK);
+}
+
+static void
+xmodem_recv_collect(struct xmodem_engine *xe, int state, unsigned char *dst,
+    int want)
+{
+  xe->state = state;
+  xe->rx_dst = dst;
+  xe->rx_got = 0;
+  xe->rx_want = want;
+}
+
+/*
+ * Eat anything still coming in - the rest of a bad block, say -
+ * until the line goes quiet, then send 'action' and carry on
+ * in state 'next'.
+ */
+static void
+xmodem_recv_flush(struct xmodem_engine *xe, int action, int next)
+{
+  xe->state = XR_FLUSH;
+  xe->flush_action = action;
+  xe->flush_next = next;
+}
 
-  bytes_xferred = 0L;
-  if ((fh = Open((UBYTE *)file, MODE_NEWFILE)) < 0) {
-    emits("Cannot Open File\n");
-    return FALSE;
-  } else {
-    emits("Receiving File...\n");
+static void
+xmodem_recv_error(struct xmodem_engine *xe, const char *why)
+{
+  xmodem_engine_status(xe, why);
+  if (++xe->errors >= ERRORMAX) {
+    xmodem_engine_status(xe, "\nReceive fail\n");
+    xmodem_engine_finish(xe, false);
+    return;
   }
+  xmodem_engine_status(xe, "Sending NAK\n");
+  xmodem_recv_flush(xe, XR_FLUSH_NAK, XR_SYNC);
+}
 
-  sectnum = errors = bufptr = 0;
+/* Drop what's been written off the front of the buffer */
+static void
+xmodem_recv_shift(struct xmodem_engine *xe)
+{
+  xe->bufptr -= xe->shift;
+  if (xe->bufptr > 0)
+    memmove(xe->buf, &xe->buf[xe->shift], xe->bufptr);
+  xe->shift = 0;
+}
 
-  // Flush everything first before we kick the remote side
-  readchar_flush(100);
+/*
+ * All blocks are in (and any digest); write out what's left and
+ * check it against the sender's digest.
+ */
+static void
+xmodem_recv_done(struct xmodem_engine *xe)
+{
+  char msg[64];
+  int bw;
 
-  /* Kick the remote side to start sending */
-  serial_write_char(NAK);
-  firstchar = 0;
+  /* The sender's length, when we have it, trims the padding */
+  if (xe->have_digest && (xe->peer_len >= xe->file_offset) &&
+      (xe->peer_len - xe->file_offset <= xe->bufptr))
+    bw = xe->peer_len - xe->file_offset;
+  else
+    bw = get_bytes_for_transfer(xe->file_size, xe->file_offset, xe->bufptr);
+  if (bw > 0) {
+    xe->file_crc = crc32_update(xe->file_crc, xe->buf, bw);
+    xmodem_engine_queue(xe, XMODEM_IO_WRITE, xe->buf, bw);
+    xe->file_offset += bw;
+  }
+  xe->file_len = xe->file_offset;
 
-  /* Loop until we're done or hit maximum errors */
-  while (firstchar != EOT && errors != ERRORMAX) {
-    errorflag = FALSE;
+  snprintf(msg, sizeof(msg), "\nCRC-32 %08lx, %ld bytes\n", xe->file_crc,
+      xe->file_len);
+  xmodem_engine_status(xe, msg);
+  if (xe->have_digest) {
+    if ((xe->peer_len != xe->file_len) || (xe->peer_crc != xe->file_crc)) {
+      snprintf(msg, sizeof(msg), "Sender has CRC-32 %08lx, %ld bytes\n",
+          xe->peer_crc, xe->peer_len);
+      xmodem_engine_status(xe, msg);
+      xmodem_engine_status(xe, "\nReceive fail: file digest mismatch\n");
+      xmodem_engine_finish(xe, false);
+      return;
+    }
+    xmodem_engine_status(xe, "File digest verified\n");
+  }
+  xmodem_engine_finish(xe, true);
+}
 
-    /* Loop over until we hit sync char or EOT */
-    do {
-      retval = readchar(&firstchar);
+static void
+xmodem_recv_eot(struct xmodem_engine *xe)
+{
+  xmodem_engine_queue_char(xe, ACK);
 
-      /* Only bail out here if we abort, timeout is OK */
-      if (retval == SERIAL_RET_ABORT) {
-        goto error;
-      }
-    } while (firstchar != SOH && firstchar != EOT);
-
-    /* If we're at SOH then start reading the current block */
-    if (firstchar == SOH) {
-      /* Read the current sector and its inverted value */
-      retval = readchar(&sectcurr);
-      switch (retval) {
-      case SERIAL_RET_OK:
-        break;
-      case SERIAL_RET_ABORT:
-        goto error;
-      case SERIAL_RET_TIMEOUT:
-        readchar_flush(100);
-        continue;
-      }
+  /* A sender which took our LZ kick follows up with its digest */
+  if (xe->peer_ext) {
+    xe->digest_tries = 0;
+    xe->junk = 0;
+    xe->state = XR_DIGEST_SYNC;
+    return;
+  }
+  xmodem_recv_done(xe);
+}
 
-      retval = readchar(&sectcomp);
-      switch (retval) {
-      case SERIAL_RET_OK:
-        break;
-      case SERIAL_RET_ABORT:
-        goto error;
-      case SERIAL_RET_TIMEOUT:
-        readchar_flush(100);
-        continue;
-      }
+static void
+xmodem_recv_sync_char(struct xmodem_engine *xe, unsigned char c)
+{
+  switch (c) {
+  case SOH:
+  case STX:
+  case SOZ:
+    xe->firstchar = c;
+    xe->blksize = (c == STX) ? SECSIZ_1K : SECSIZ;
+    /*
+     * Sector and its inverse; LZ blocks add the size and length,
+     * each with its inverse too.
+     */
+    xmodem_recv_collect(xe, XR_HDR, xe->hdr, (c == SOZ) ? 8 : 2);
+    break;
+  case EOT:
+    xmodem_recv_eot(xe);
+    break;
+  default:
+    break;
+  }
+}
 
-      if ((sectcurr + sectcomp) == 255) {
-        /* Check to see if this sector is the next we're expecting */
-        if (sectcurr == ((sectnum + 1) & 0xff)) {
-          checksum = 0;
-          /* Read the 128 byte data block */
-          retval = readchar_buf(&bufr[bufptr], SECSIZ);
-          switch (retval) {
-          case SERIAL_RET_OK:
-            break;
-          case SERIAL_RET_ABORT:
-            goto error;
-          case SERIAL_RET_TIMEOUT:
-            emits("Timeout receiving block\n");
-            readchar_flush(100);
-            serial_write_char(NAK);
-            errors++;
-            continue;
-          }
-
-          /* Calculate the checksum */
-          for (j = bufptr; j < (bufptr + SECSIZ); j++) {
-              checksum = (checksum + bufr[j]) & 0xff;
-          }
-
-          /* Read / check checksum */
-          retval = readchar(&checkcmp);
-          switch (retval) {
-          case SERIAL_RET_OK:
-            break;
-          case SERIAL_RET_ABORT:
-            goto error;
-          case SERIAL_RET_TIMEOUT:
-            emits("Timeout receiving checksum\n");
-            readchar_flush(100);
-            serial_write_char(NAK);
-            errors++;
-            continue;
-          }
-
-          if (checksum == checkcmp) {
-            errors = 0;
-            sectnum++;
-            bufptr += SECSIZ;
-            bytes_xferred += SECSIZ;
-            /* Verified! */
-            if (bufptr == BufSize) {
-              bufptr = 0;
-              bw = get_bytes_for_transfer(file_size, file_offset, BufSize);
-              if ((bw > 0) && (Write(fh, bufr, bw) == EOF)) {
-                emits("Error Writing File\n");
-                goto error;
-              };
-              file_offset += bw;
-            };
-            serial_write_char(ACK);
-          } else {
-            emits("Invalid checksum\n");
-            errorflag = TRUE;
-          }
-        } else {
-          if (sectcurr == (sectnum & 0xff)) {
-            emits("Received Duplicate Sector\n");
-            serial_write_char(ACK);
-          } else {
-            emits("Wrong sector offset\n");
-            errorflag = TRUE;
-          }
-        }
-      } else {
-        emits("Invalid sector bytes\n");
-        errorflag = TRUE;
-      }
-    }
+static void
+xmodem_recv_header(struct xmodem_engine *xe)
+{
+  if ((xe->hdr[0] + xe->hdr[1]) != 255) {
+    xmodem_recv_error(xe, "Invalid sector bytes\n");
+    return;
+  }
 
-    if (errorflag == TRUE) {
-      errors++;
-      emits("Sending NAK\n");
-      readchar_flush(100);
-      serial_write_char(NAK);
+  if (xe->firstchar == SOZ) {
+#if XMODEM_ENABLE_LZ
+    xe->blksize = xe->hdr[2] * SECSIZ;
+    xe->lz_len = (xe->hdr[4] << 8) | xe->hdr[5];
+
+    /*
+     * A corrupt header can't be trusted to tell us how much to read;
+     * NAK it now rather than swallow the sender's retries as data.
+     */
+    if (((xe->hdr[2] + xe->hdr[3]) != 255) ||
+        ((xe->hdr[4] + xe->hdr[6]) != 255) ||
+        ((xe->hdr[5] + xe->hdr[7]) != 255) ||
+        (xe->blksize == 0) || (xe->blksize > SECSIZ_1K) ||
+        (xe->lz_len == 0) || (xe->lz_len > SECSIZ_1K)) {
+      xmodem_recv_error(xe, "Invalid compressed block\n");
+      return;
     }
-  }; /* end while */
+    /* LZ data then the CRC-16 of the decompressed block */
+    xmodem_recv_collect(xe, XR_DATA, xe->lzbuf, xe->lz_len + 2);
+#else
+    xmodem_recv_error(xe, "Unexpected compressed block\n");
+#endif
+    return;
+  }
 
+  /*
+   * The block and its checksum go straight into the file buffer.
+   * Duplicates are read in full as well (and then dropped) so
+   * their data isn't left on the line to be taken as block starts.
+   */
+  xmodem_recv_collect(xe, XR_DATA, &xe->buf[xe->bufptr], xe->blksize + 1);
+}
 
+/* Is the block that's just been read intact? */
+static bool
+xmodem_recv_block_valid(struct xmodem_engine *xe)
+{
+  unsigned char checksum;
+  int j;
 
-  /* XXX TODO: seeing some transfers fail but hit Receive OK; figure out why */
+#if XMODEM_ENABLE_LZ
+  if (xe->firstchar == SOZ) {
+    /*
+     * Decompress against the blocks received so far from the
+     * sender's buffer; anything held back from the one before
+     * isn't part of it.
+     */
+    if (lz_decompress(xe->lzbuf, xe->lz_len, &xe->buf[xe->dict],
+        xe->bufptr - xe->dict, xe->blksize) != xe->blksize)
+      return false;
+    return crc16_update(0, &xe->buf[xe->bufptr], xe->blksize) ==
+        ((xe->lzbuf[xe->lz_len] << 8) | xe->lzbuf[xe->lz_len + 1]);
+  }
+#endif
 
-  if ((firstchar == EOT) && (errors < ERRORMAX)) {
-    serial_write_char(ACK);
-    bw = get_bytes_for_transfer(file_size, file_offset, bufptr);
-    if (bw > 0)
-        Write(fh, bufr, bw);
-    Close(fh);
-    emits("\nReceive OK\n");
-    return TRUE;
+  checksum = 0;
+  for (j = xe->bufptr; j < xe->bufptr + xe->blksize; j++)
+    checksum += xe->buf[j];
+  return checksum == xe->buf[xe->bufptr + xe->blksize];
+}
+
+static void
+xmodem_recv_block(struct xmodem_engine *xe)
+{
+  unsigned char sectcurr = xe->hdr[0];
+  int bw;
+
+  /* Check to see if this sector is the next we're expecting */
+  if (sectcurr != ((xe->sectnum + 1) & 0xff)) {
+    if (sectcurr == (xe->sectnum & 0xff)) {
+      xmodem_engine_status(xe, "Received Duplicate Sector\n");
+      xmodem_engine_queue_char(xe, ACK);
+      xe->state = XR_SYNC;
+    } else {
+      xmodem_recv_error(xe, "Wrong sector offset\n");
+    }
+    return;
+  }
+
+  if (xmodem_recv_block_valid(xe) == false) {
+    xmodem_recv_error(xe, "Invalid checksum\n");
+    return;
+  }
+
+#if XMODEM_ENABLE_LZ
+  /*
+   * A sender which started on our LZ kick will send a digest,
+   * which tells us where the file really ends.  Until then hold
+   * back a block's worth of possible padding rather than write it.
+   */
+  if (xe->sectnum == 0) {
+    xe->peer_ext = (xe->kicks <= KICK_LZ_TRIES);
+    xe->holdback = xe->peer_ext ? SECSIZ : 0;
   }
-  emits("\nReceive fail\n");
+#endif
+
+  /* Verified! */
+  xe->errors = 0;
+  xe->sectnum++;
+  xe->bufptr += xe->blksize;
 
-error:
   /*
-   * Do a flush here to eat any half-read buffer
-   * before we return.
+   * Write out a buffer's worth once it's in.  With a holdback
+   * that's the sender's buffer, since our sender never lets a
+   * block cross one: what's held back stays at the front, and the
+   * next buffer (and its LZ dictionary) starts after it.
    */
-  readchar_flush(500);
-  Close(fh);
-  return FALSE;
+  if (xe->bufptr >= xe->dict + XMODEM_BUFSIZE) {
+    bw = get_bytes_for_transfer(xe->file_size, xe->file_offset,
+        xe->dict + XMODEM_BUFSIZE - xe->holdback);
+    xe->file_offset += bw;
+    /* Anything a large block put past the write is moved down after */
+    xe->shift = xe->dict + XMODEM_BUFSIZE - xe->holdback;
+    xe->dict = xe->holdback;
+    if (bw > 0) {
+      xe->file_crc = crc32_update(xe->file_crc, xe->buf, bw);
+      xmodem_engine_queue(xe, XMODEM_IO_WRITE, xe->buf, bw);
+    } else {
+      xmodem_recv_shift(xe);
+    }
+  }
+  xmodem_engine_queue_char(xe, ACK);
+  xe->state = XR_SYNC;
+}
+
+static void
+xmodem_recv_digest_char(struct xmodem_engine *xe, unsigned char c)
+{
+  if (c == SOD) {
+    xmodem_recv_collect(xe, XR_DIGEST, xe->lzbuf, XMODEM_DIGEST_LEN + 2);
+  } else if (c == EOT) {
+    /* Our ACK of the EOT went missing */
+    xmodem_engine_queue_char(xe, ACK);
+  } else if (++xe->junk > SECSIZ) {
+    xmodem_recv_done(xe);
+  }
+}
+
+/*
+ * The sender's file digest; see amigaterm_xmodem.h.
+ */
+static void
+xmodem_recv_digest(struct xmodem_engine *xe)
+{
+  const unsigned char *d = xe->lzbuf;
+  int i;
+
+  if (crc16_update(0, d, XMODEM_DIGEST_LEN) != ((d[8] << 8) | d[9])) {
+    if (++xe->digest_tries >= DIGEST_TRIES) {
+      xmodem_recv_done(xe);
+      return;
+    }
+    xmodem_recv_flush(xe, XR_FLUSH_NAK, XR_DIGEST_SYNC);
+    return;
+  }
+
+  xmodem_engine_queue_char(xe, ACK);
+  xe->peer_len = 0;
+  xe->peer_crc = 0;
+  for (i = 0; i < 4; i++) {
+    xe->peer_len = (xe->peer_len << 8) | d[i];
+    xe->peer_crc = (xe->peer_crc << 8) | d[4 + i];
+  }
+  xe->have_digest = true;
+  xmodem_recv_done(xe);
+}
+
+static void
+xmodem_recv_collected(struct xmodem_engine *xe)
+{
+  switch (xe->state) {
+  case XR_HDR:
+    xmodem_recv_header(xe);
+    break;
+  case XR_DATA:
+    xmodem_recv_block(xe);
+    break;
+  case XR_DIGEST:
+    xmodem_recv_digest(xe);
+    break;
+  }
+}
+
+/***************************************/
+/*  Engine entry points                */
+/***************************************/
+
+/*
+ * Xmodem receive.
+ *
+ * file_size, if it's > 0, is where to truncate the file.
+ */
+void
+xmodem_engine_recv_init(struct xmodem_engine *xe, long file_size, int baud)
+{
+  xmodem_engine_reset(xe, false, baud);
+  xe->file_size = file_size;
+
+  /* Flush everything first before we kick the remote side */
+  xmodem_recv_flush(xe, XR_FLUSH_KICK, XR_SYNC);
+}
+
+void
+xmodem_recv_wants(struct xmodem_engine *xe, struct xmodem_io *io)
+{
+  io->type = XMODEM_IO_RECV;
+  switch (xe->state) {
+  case XR_HDR:
+  case XR_DATA:
+  case XR_DIGEST:
+    io->buf = xe->rx_dst + xe->rx_got;
+    io->len = xe->rx_want - xe->rx_got;
+    io->timeout_ms = xmodem_engine_rx_timeout(xe, io->len);
+    break;
+  case XR_FLUSH:
+    io->buf = NULL;
+    io->len = 1;
+    io->timeout_ms = XR_FLUSH_MS;
+    break;
+  default:
+    io->buf = NULL;
+    io->len = 1;
+    io->timeout_ms = 1000;
+    break;
+  }
+}
+
+int
+xmodem_recv_input(struct xmodem_engine *xe, const unsigned char *buf,
+    int len)
+{
+  int used = 0, n;
+
+  while ((used < len) && (xe->done == false) && (xe->op_count == 0)) {
+    switch (xe->state) {
+    case XR_FLUSH:
+      used = len;
+      break;
+    case XR_SYNC:
+      xmodem_recv_sync_char(xe, buf[used++]);
+      break;
+    case XR_DIGEST_SYNC:
+      xmodem_recv_digest_char(xe, buf[used++]);
+      break;
+    default:
+      n = xe->rx_want - xe->rx_got;
+      if (n > len - used)
+        n = len - used;
+      if (&buf[used] != &xe->rx_dst[xe->rx_got])
+        memcpy(&xe->rx_dst[xe->rx_got], &buf[used], n);
+      xe->rx_got += n;
+      used += n;
+      if (xe->rx_got == xe->rx_want)
+        xmodem_recv_collected(xe);
+      break;
+    }
+  }
+  return used;
+}
+
+void
+xmodem_recv_timeout(struct xmodem_engine *xe)
+{
+  switch (xe->state) {
+  case XR_FLUSH:
+    if (xe->flush_action == XR_FLUSH_KICK)
+      xmodem_recv_kick(xe);
+    else if (xe->flush_action == XR_FLUSH_NAK)
+      xmodem_engine_queue_char(xe, NAK);
+    xe->junk = 0;
+    xe->state = xe->flush_next;
+    break;
+  case XR_SYNC:
+    /*
+     * Until the first block turns up keep kicking the sender;
+     * it may not have been started yet, or it may not know
+     * about the LZ kick.
+     */
+    if ((xe->sectnum == 0) && (++xe->kick_timeouts >= KICK_INTERVAL)) {
+      if (xe->kicks >= ERRORMAX) {
+        xmodem_engine_status(xe, "Sender not responding\n");
+        xmodem_engine_finish(xe, false);
+        break;
+      }
+      xe->kick_timeouts = 0;
+      xmodem_recv_kick(xe);
+    }
+    break;
+  case XR_HDR:
+    xmodem_recv_flush(xe, XR_FLUSH_NONE, XR_SYNC);
+    break;
+  case XR_DATA:
+    xmodem_recv_error(xe, "Timeout receiving block\n");
+    break;
+  case XR_DIGEST_SYNC:
+  case XR_DIGEST:
+    xmodem_recv_done(xe);
+    break;
+  }
+}
+
+void
+xmodem_recv_complete(struct xmodem_engine *xe, const struct xmodem_io *op,
+    long len)
+{
+  if (op->type != XMODEM_IO_WRITE)
+    return;
+
+  if (len != op->len) {
+    xe->op_count = 0;
+    xmodem_engine_status(xe, "Error Writing File\n");
+    xmodem_engine_finish(xe, false);
+    return;
+  }
+  if (xe->shift > 0)
+    xmodem_recv_shift(xe);
 }
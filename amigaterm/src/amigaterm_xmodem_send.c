@@ -7,171 +7,611 @@
  *  enhanced by Roc Valles Domenech (2018-2021)
  *  contributors: Alexander Fritsch (2021)
  ************************************************************************/
-/*  compiler directives to fetch the necessary header files */
-#include "dos/dos.h"              // for BPTR, MODE_NEWFILE, MODE_OLDFILE
-#include "exec/io.h"              // for IOStdReq, CMD_READ, CMD_WRITE
-#include "exec/memory.h"          // for MEMF_CLEAR, MEMF_PUBLIC
-#include "exec/ports.h"           // for Message, MsgPort
-#include "proto/dos.h"            // for Close, Open, Write, Read
-#include "proto/exec.h"           // for FreeMem, DoIO, GetMsg, AllocMem
-#include "stdlib.h"               // for exit
-#include <clib/alib_protos.h>     // for DeletePort, BeginIO
-#include <exec/types.h>           // for FALSE, TRUE, UBYTE, CONST_STRPTR
-#include <stdio.h>                // for NULL, puts, fclose, fopen, EOF, getc
+/*
+ * xmodem send, as the send half of the xmodem engine
+ * (amigaterm_xmodem_engine.h.)
+ */
+#include <stdio.h>                // for NULL, snprintf
 #include <stdbool.h>
+#include <string.h>               // for memset
 
-#include "amigaterm_serial.h"
-#include "amigaterm_serial_read.h"
-#include "../lib/timer/timer.h"
-#include "amigaterm_util.h"
 #include "amigaterm_xmodem.h"
+#include "amigaterm_xmodem_engine.h"
+#include "amigaterm_crc.h"
+#include "amigaterm_lz.h"
 
-#define BufSize 0x1000
-static char bufr[BufSize];
 #define ERRORMAX 10
 #define RETRYMAX 10
 
 /*
- * Anything using this will need to define an emits() function to print
- * a string.
+ * Block sizes the sender will pick between, smallest first.
+ *
+ * XMODEM-1K tops out at 1024 byte blocks; a protocol which allows
+ * larger blocks only needs to extend this table (and XMODEM_BUFSIZE
+ * must stay a multiple of the largest entry.)
  */
-extern void emits(const char *);
+static const int xmodem_blk_sizes[] = { SECSIZ, SECSIZ_1K };
+#define XMODEM_NUM_BLK_SIZES \
+  ((int) (sizeof(xmodem_blk_sizes) / sizeof(xmodem_blk_sizes[0])))
 
-int
-XMODEM_Send_File(char *file)
-{
-  int sectnum, bytes_to_send, size, attempts;
-  unsigned checksum, j, bufptr;
-  unsigned char c;
-  long bytes_xferred;
-  serial_retval_t retval;
-  BPTR fh;
-
-  bytes_xferred = 0;
-  if ((fh = Open((UBYTE *)file, MODE_OLDFILE)) < 0) {
-    emits("Cannot Open Send File\n");
-    return FALSE;
-  } else
-    emits("Sending File...");
-  attempts = 0;
-  sectnum = 1;
-  /* wait for sync char */
-  j = 1;
-  do {
-    c = 0;
-    retval = readchar(&c);
-    if (retval == SERIAL_RET_ABORT) {
-      emits("\nUser cancelled transfer\n");
-      goto error;
-    }
-  } while ((c != NAK) && (j++ < ERRORMAX));
+/*
+ * Per-block overhead in byte times - SOH/STX, two sector bytes,
+ * the checksum, and a rough allowance for the ACK turnaround.
+ */
+#define XMODEM_BLK_OVERHEAD 24
+
+/* Clean blocks needed before trying a larger size; doubles on fallback */
+#define XMODEM_BLK_UPGRADE_MIN 8
+#define XMODEM_BLK_UPGRADE_MAX 128
+
+/* Halve the outcome counters once they reach this many samples */
+#define XMODEM_BLK_DECAY 32
+
+/*
+ * Give up on a larger block size if it fails this many times
+ * in a row without ever being ACKed; the receiver likely doesn't
+ * understand STX at all.
+ */
+#define XMODEM_BLK_UNSUPPORTED 2
 
-#if 0
-  emits("Got sync char\n");
+#if XMODEM_ENABLE_LZ
+/*
+ * Only send a block compressed if it saves at least this much;
+ * the LZ header is three bytes longer than a plain one.
+ */
+#define XMODEM_LZ_MIN_SAVING 8
 #endif
 
-  if (j >= (ERRORMAX)) {
-    emits("\nReceiver not sending NAKs\n");
-    goto error;
+/* How many times to offer the digest before giving up on it */
+#define DIGEST_TRIES 3
+
+/* Send states */
+#define XS_SYNC 0              /* waiting for the receiver's NAK or kick */
+#define XS_READ 1              /* waiting for the next buffer of the file */
+#define XS_ACK 2               /* waiting for a block's ACK */
+#define XS_EOT 3               /* waiting for the EOT's ACK */
+#define XS_DIGEST 4            /* waiting for the digest's ACK */
+
+static void
+xmodem_blk_init(struct xmodem_blk_state *bs)
+{
+  bs->cur = 0;
+  bs->max = XMODEM_NUM_BLK_SIZES - 1;
+  bs->ok = bs->fail = 0;
+  bs->upgrade_after = XMODEM_BLK_UPGRADE_MIN;
+  bs->cur_acked = false;
+  bs->cur_fail_run = 0;
+}
+
+/*
+ * Estimate the goodput of block size 'idx' given the block error
+ * rate measured at the current size.  Errors are assumed to scale
+ * with the number of bytes on the wire, which holds well enough
+ * for line noise and overruns.
+ *
+ * The result is only useful for comparing against other sizes.
+ */
+static long
+xmodem_blk_goodput(const struct xmodem_blk_state *bs, int idx)
+{
+  long rate, size;
+
+  size = xmodem_blk_sizes[idx];
+
+  /* Block error rate at the current size, out of 256 */
+  if (bs->ok + bs->fail == 0)
+    rate = 0;
+  else
+    rate = ((long) bs->fail * 256) / (bs->ok + bs->fail);
+
+  /* .. and scaled to the candidate size */
+  rate = (rate * size) / xmodem_blk_sizes[bs->cur];
+  if (rate > 256)
+    rate = 256;
+
+  return (size * (256 - rate)) / (size + XMODEM_BLK_OVERHEAD);
+}
+
+static void
+xmodem_blk_set(struct xmodem_blk_state *bs, int idx)
+{
+  if (idx == bs->cur)
+    return;
+
+  bs->cur = idx;
+  bs->ok = bs->fail = 0;
+  bs->cur_acked = false;
+  bs->cur_fail_run = 0;
+}
+
+/*
+ * Record the outcome of a single block attempt and pick the
+ * block size to use for the next one.
+ *
+ * Timeouts count double - they cost a whole readchar() timeout
+ * rather than just a retransmit.
+ */
+static void
+xmodem_blk_update(struct xmodem_blk_state *bs, bool timeout, bool acked)
+{
+  long cur_gp, gp;
+  int i, best;
+
+  if (acked) {
+    bs->ok++;
+    bs->cur_acked = true;
+    bs->cur_fail_run = 0;
+  } else {
+    bs->fail += timeout ? 2 : 1;
+    bs->cur_fail_run++;
   }
-  while ((bytes_to_send = Read(fh, bufr, BufSize)) && attempts != RETRYMAX) {
-    if (bytes_to_send == EOF) {
-      emits("\nError Reading File\n");
-      goto error;
-    };
-    bufptr = 0;
-    /* Blank the rest of the buffer out so we can bulk send */
-    if (bytes_to_send < BufSize) {
-      memset(bufr + bytes_to_send, 0, BufSize - bytes_to_send);
+
+  if (bs->ok + bs->fail >= XMODEM_BLK_DECAY) {
+    bs->ok /= 2;
+    bs->fail /= 2;
+  }
+
+  /*
+   * A larger size that has never been ACKed and keeps failing
+   * is likely unsupported by the receiver; stop trying it.
+   */
+  if ((bs->cur > 0) && (bs->cur_acked == false) &&
+      (bs->cur_fail_run >= XMODEM_BLK_UNSUPPORTED)) {
+    bs->max = bs->cur - 1;
+    xmodem_blk_set(bs, bs->max);
+    return;
+  }
+
+  /* Pick the size with the best estimated goodput */
+  cur_gp = xmodem_blk_goodput(bs, bs->cur);
+  best = bs->cur;
+  for (i = 0; i <= bs->max; i++) {
+    gp = xmodem_blk_goodput(bs, i);
+
+    /*
+     * Going up needs enough clean history to trust the estimate
+     * and a clear (1/8th) improvement, so we don't flap.
+     */
+    if (i > bs->cur) {
+      if (bs->ok + bs->fail < bs->upgrade_after)
+        continue;
+      if (gp <= cur_gp + (cur_gp / 8))
+        continue;
+    } else if (gp <= cur_gp) {
+      continue;
     }
 
-    while (bytes_to_send > 0 && attempts != RETRYMAX) {
-      attempts = 0;
-      do {
-        serial_write_char(SOH);
-        serial_write_char(sectnum);
-        serial_write_char(~sectnum);
-        checksum = 0;
-        size = SECSIZ <= bytes_to_send ? SECSIZ : bytes_to_send;
-        bytes_to_send -= size;
-
-        /* For bulk writes we still need to update the checksum first */
-        for (j = bufptr; j < (bufptr + SECSIZ); j++) {
-            /*
-             * The rest of the buffer above was zeroed, so
-             * we can just write it all out and it'll be
-             * padded for us.
-             */
-            checksum += bufr[j];
-        }
-        /*
-         * Do the write, block for now.  Later on it'd
-         * be good to wait for UI events, timer events and
-         * serial driver events so we can handle an abort, error
-         * and timeout.
-         */
-        serial_write_start_buf(&bufr[bufptr], SECSIZ);
-        serial_write_wait();
-
-        /*
-         * Write out a checksum.
-         */
-        serial_write_char(checksum & 0xff);
-        attempts++;
-        retval = readchar(&c);
-        switch (retval) {
-        case SERIAL_RET_OK:
-          break;
-        case SERIAL_RET_TIMEOUT:
-          emits("\nTimeout waiting for ACK/NACK\n");
-          c = 0;
-          break;
-        case SERIAL_RET_ABORT:
-          goto error;
-        }
-      } while ((c != ACK) && (attempts != RETRYMAX));
-      bufptr += size;
-      bytes_xferred += size;
-      sectnum++;
+    if (gp > xmodem_blk_goodput(bs, best))
+      best = i;
+  }
+
+  if (best == bs->cur)
+    return;
+
+  /*
+   * Each fall back makes us more cautious about the next upgrade;
+   * each upgrade that survives to this point relaxes it again.
+   */
+  if (best < bs->cur) {
+    bs->upgrade_after *= 2;
+    if (bs->upgrade_after > XMODEM_BLK_UPGRADE_MAX)
+      bs->upgrade_after = XMODEM_BLK_UPGRADE_MAX;
+  } else {
+    bs->upgrade_after = XMODEM_BLK_UPGRADE_MIN;
+  }
+  xmodem_blk_set(bs, best);
+}
+
+/*
+ * Return the block size to use for the next block, given how many
+ * bytes are left in the current buffer.
+ *
+ * Only use a larger block if it can be filled, so the tail of the
+ * file goes out in 128 byte blocks rather than being padded out.
+ */
+static int
+xmodem_blk_size(const struct xmodem_blk_state *bs, int bytes_left)
+{
+  int i;
+
+  for (i = bs->cur; i > 0; i--) {
+    if (bytes_left >= xmodem_blk_sizes[i])
+      break;
+  }
+  return xmodem_blk_sizes[i];
+}
+
+static void xmodem_send_eot(struct xmodem_engine *xe);
+
+/* The file buffer blocks are coming from */
+static unsigned char *
+xmodem_send_buf(struct xmodem_engine *xe, int idx)
+{
+  return idx ? xe->alt : xe->buf;
+}
+
+/*
+ * Get the frame for block 'sectnum' - 'size' bytes at 'src', which
+ * is 'dictlen' bytes into its file buffer - and return its slot.
+ *
+ * It's built into the slot that wasn't sent last, since that one
+ * may still be going out; so the next block is built while the
+ * current one is on the wire.
+ */
+static int
+xmodem_send_build(struct xmodem_engine *xe, int sectnum, unsigned char *src,
+    int dictlen, int size)
+{
+  unsigned char *f;
+  unsigned char checksum, c;
+  unsigned short crc;
+  int slot, j, lz_len;
+
+  for (slot = 0; slot < 2; slot++) {
+    if ((xe->pb_len[slot] > 0) && (xe->pb_sect[slot] == sectnum) &&
+        (xe->pb_src[slot] == src) && (xe->pb_size[slot] == size))
+      return slot;
+  }
+  slot = xe->tx_slot ^ 1;
+  f = xe->blk[slot];
+
+#if XMODEM_ENABLE_LZ
+  /*
+   * Compress against the blocks already sent from this buffer;
+   * blocks which don't compress go out as they are.
+   */
+  if (xe->use_lz) {
+    lz_len = lz_compress(src - dictlen, dictlen, size, &f[9],
+        size - XMODEM_LZ_MIN_SAVING);
+    if (lz_len > 0) {
+      crc = crc16_update(0, src, size);
+      f[0] = SOZ;
+      f[1] = sectnum;
+      f[2] = ~sectnum;
+      f[3] = size / SECSIZ;
+      f[4] = ~f[3];
+      f[5] = (lz_len >> 8) & 0xff;
+      f[6] = lz_len & 0xff;
+      f[7] = ~f[5];
+      f[8] = ~f[6];
+      f[9 + lz_len] = (crc >> 8) & 0xff;
+      f[10 + lz_len] = crc & 0xff;
+      xe->pb_len[slot] = lz_len + 11;
+      goto done;
     }
   }
+#endif
+
+  /*
+   * A plain SOH/STX block.  The rest of the buffer was zeroed,
+   * so the last block is padded for us.
+   */
+  f[0] = (size == SECSIZ_1K) ? STX : SOH;
+  f[1] = sectnum;
+  f[2] = ~sectnum;
+  checksum = 0;
+  for (j = 0; j < size; j++) {
+    c = src[j];
+    f[3 + j] = c;
+    checksum += c;
+  }
+  f[3 + size] = checksum;
+  xe->pb_len[slot] = size + 4;
+
+done:
+  xe->pb_sect[slot] = sectnum;
+  xe->pb_src[slot] = src;
+  xe->pb_size[slot] = size;
+  return slot;
+}
+
+/*
+ * (Re)send the current block, then wait for its ACK.
+ */
+static void
+xmodem_send_block(struct xmodem_engine *xe)
+{
+  int slot;
 
   /*
-   * We're done, either because we finished OK or didn't finish
-   * OK.  Either way, close the FH.
-   *
-   * After this point we can't just goto error; that'll double close
-   * the FH.
+   * The block size can change between retries; the receiver
+   * only cares that the sector number is the one it expects.
+   * Usually the block was built while the last one went out.
    */
-  Close(fh);
+  xe->size = xmodem_blk_size(&xe->bs, xe->bytes_to_send);
+  slot = xmodem_send_build(xe, xe->sectnum,
+      &xmodem_send_buf(xe, xe->cur_buf)[xe->bufptr], xe->bufptr, xe->size);
+
+  xmodem_engine_queue(xe, XMODEM_IO_SEND, xe->blk[slot], xe->pb_len[slot]);
+  xe->tx_slot = slot;
+  xe->wire_bytes += xe->pb_len[slot];
+  xe->attempts++;
+  xe->state = XS_ACK;
+}
+
+static void
+xmodem_send_read(struct xmodem_engine *xe, int idx)
+{
+  xmodem_engine_queue(xe, XMODEM_IO_READ, xmodem_send_buf(xe, idx),
+      XMODEM_BUFSIZE);
+  xe->reading = true;
+}
+
+/*
+ * While the current block is going out (and until it's ACKed),
+ * get the next one ready: build it if its data is to hand, or
+ * read the next buffer of the file if not.
+ */
+static void
+xmodem_send_prepare(struct xmodem_engine *xe)
+{
+  int size, left, nxt;
+
+  size = (xe->size < xe->bytes_to_send) ? xe->size : xe->bytes_to_send;
+  left = xe->bytes_to_send - size;
+  if (left > 0) {
+    xmodem_send_build(xe, xe->sectnum + 1,
+        &xmodem_send_buf(xe, xe->cur_buf)[xe->bufptr + size],
+        xe->bufptr + size, xmodem_blk_size(&xe->bs, left));
+    return;
+  }
+
+  nxt = xe->cur_buf ^ 1;
+  if (xe->fill[nxt] > 0) {
+    xmodem_send_build(xe, xe->sectnum + 1, xmodem_send_buf(xe, nxt), 0,
+        xmodem_blk_size(&xe->bs, xe->fill[nxt]));
+  } else if ((xe->eof == false) && (xe->reading == false)) {
+    xmodem_send_read(xe, nxt);
+  }
+}
+
+/* Start sending from a freshly read buffer, or finish */
+static void
+xmodem_send_next_buf(struct xmodem_engine *xe)
+{
+  int nxt = xe->cur_buf ^ 1;
+
+  xe->fill[xe->cur_buf] = 0;
+  if (xe->fill[nxt] > 0) {
+    xe->cur_buf = nxt;
+    xe->bufptr = 0;
+    xe->bytes_to_send = xe->fill[nxt];
+    xe->attempts = 0;
+    xmodem_send_block(xe);
+  } else if (xe->eof) {
+    xe->attempts = 0;
+    xmodem_send_eot(xe);
+  } else {
+    /* Wait for the read to finish */
+    if (xe->reading == false)
+      xmodem_send_read(xe, nxt);
+    xe->state = XS_READ;
+  }
+}
+
+static void
+xmodem_send_eot(struct xmodem_engine *xe)
+{
+  xmodem_engine_queue_char(xe, EOT);
+  xe->attempts++;
+  xe->state = XS_EOT;
+}
+
+/*
+ * Send the file digest after EOT; see amigaterm_xmodem.h.
+ */
+static void
+xmodem_send_digest(struct xmodem_engine *xe)
+{
+  unsigned short dcrc;
+  int i;
+
+  xe->frame[0] = SOD;
+  for (i = 0; i < 4; i++) {
+    xe->frame[1 + i] = (xe->file_len >> (24 - 8 * i)) & 0xff;
+    xe->frame[5 + i] = (xe->file_crc >> (24 - 8 * i)) & 0xff;
+  }
+  dcrc = crc16_update(0, &xe->frame[1], XMODEM_DIGEST_LEN);
+  xe->frame[9] = (dcrc >> 8) & 0xff;
+  xe->frame[10] = dcrc & 0xff;
+
+  xmodem_engine_queue(xe, XMODEM_IO_SEND, xe->frame, sizeof(xe->frame));
+  xe->state = XS_DIGEST;
+}
+
+/*
+ * The EOT was ACKed (or we gave up on it.)
+ */
+static void
+xmodem_send_eot_done(struct xmodem_engine *xe, bool acked)
+{
+  char msg[64];
+
+  snprintf(msg, sizeof(msg), "\nCRC-32 %08lx, %ld bytes\n", xe->file_crc,
+      xe->file_len);
+  xmodem_engine_status(xe, msg);
+#if XMODEM_ENABLE_LZ
+  if (xe->use_lz) {
+    snprintf(msg, sizeof(msg), "\nSent %ld bytes as %ld\n",
+        xe->file_len, xe->wire_bytes);
+    xmodem_engine_status(xe, msg);
+  }
+#endif
+
+  if (xe->use_lz && acked) {
+    xe->digest_tries = 0;
+    xmodem_send_digest(xe);
+    return;
+  }
+  xmodem_engine_finish(xe, true);
+}
+
+static void
+xmodem_send_sync_char(struct xmodem_engine *xe, unsigned char c)
+{
+#if XMODEM_ENABLE_LZ
+  if (c == XMODEM_KICK_LZ) {
+    xe->use_lz = true;
+    xmodem_engine_status(xe, "\nReceiver supports compression\n");
+  }
+#endif
+  if ((c != NAK) && (xe->use_lz == false)) {
+    if (++xe->attempts >= ERRORMAX) {
+      xmodem_engine_status(xe, "\nReceiver not sending NAKs\n");
+      xmodem_engine_finish(xe, false);
+    }
+    return;
+  }
+  xe->attempts = 0;
+  xe->cur_buf = 1;
+  xmodem_send_next_buf(xe);
+}
+
+/*
+ * The receiver's answer to a block, EOT or digest; c is 0 after
+ * a timeout.
+ */
+static void
+xmodem_send_reply(struct xmodem_engine *xe, unsigned char c, bool timeout)
+{
+  int cur;
+
+  switch (xe->state) {
+  case XS_SYNC:
+    xmodem_send_sync_char(xe, c);
+    break;
+
+  case XS_ACK:
+    if (timeout)
+      xmodem_engine_status(xe, "\nTimeout waiting for ACK/NACK\n");
+    cur = xe->bs.cur;
+    xmodem_blk_update(&xe->bs, timeout, c == ACK);
+    if (xe->bs.cur != cur)
+      xmodem_engine_status(xe, (xmodem_blk_sizes[xe->bs.cur] == SECSIZ_1K) ?
+          "\nUsing 1024 byte blocks\n" : "\nUsing 128 byte blocks\n");
+    if (c == ACK) {
+      if (xe->size > xe->bytes_to_send)
+        xe->size = xe->bytes_to_send;
+      xe->bytes_to_send -= xe->size;
+      xe->bufptr += xe->size;
+      xe->sectnum++;
+      xe->attempts = 0;
+      if (xe->bytes_to_send > 0)
+        xmodem_send_block(xe);
+      else
+        xmodem_send_next_buf(xe);
+    } else if (xe->attempts == RETRYMAX) {
+      xmodem_engine_status(xe,
+          "\nNo Acknowledgment Of Sector, Aborting\n");
+      xmodem_engine_finish(xe, false);
+    } else {
+      xmodem_send_block(xe);
+    }
+    break;
+
+  case XS_EOT:
+    if (c == ACK) {
+      xmodem_send_eot_done(xe, true);
+    } else if (timeout) {
+      xmodem_send_eot_done(xe, false);
+    } else if (xe->attempts == RETRYMAX) {
+      xmodem_engine_status(xe, "\nNo Acknowledgment Of End Of File\n");
+      xmodem_send_eot_done(xe, false);
+    } else {
+      xmodem_send_eot(xe);
+    }
+    break;
+
+  case XS_DIGEST:
+    if (c == ACK) {
+      xmodem_engine_finish(xe, true);
+    } else if (++xe->digest_tries >= DIGEST_TRIES) {
+      xmodem_engine_status(xe, "Receiver didn't take the digest\n");
+      xmodem_engine_finish(xe, true);
+    } else {
+      xmodem_send_digest(xe);
+    }
+    break;
+  }
+}
+
+/***************************************/
+/*  Engine entry points                */
+/***************************************/
+
+void
+xmodem_engine_send_init(struct xmodem_engine *xe, int baud)
+{
+  xmodem_engine_reset(xe, true, baud);
+  xe->sectnum = 1;
+  xmodem_blk_init(&xe->bs);
+  xe->state = XS_SYNC;
+}
 
-  if (attempts == RETRYMAX) {
-    emits("\nNo Acknowledgment Of Sector, Aborting\n");
-    goto finish_error;
+void
+xmodem_send_wants(struct xmodem_engine *xe, struct xmodem_io *io)
+{
+  io->type = XMODEM_IO_RECV;
+  io->buf = NULL;
+  io->len = 1;
+  io->timeout_ms = 1000;
+}
+
+int
+xmodem_send_input(struct xmodem_engine *xe, const unsigned char *buf,
+    int len)
+{
+  int used = 0;
+
+  while ((used < len) && (xe->done == false) && (xe->op_count == 0))
+    xmodem_send_reply(xe, buf[used++], false);
+  return used;
+}
+
+void
+xmodem_send_timeout(struct xmodem_engine *xe)
+{
+  xmodem_send_reply(xe, 0, true);
+}
+
+void
+xmodem_send_complete(struct xmodem_engine *xe, const struct xmodem_io *op,
+    long len)
+{
+  int idx;
+
+  /* A block has started going out; use the time to get the next ready */
+  if ((op->type == XMODEM_IO_SEND) && (xe->state == XS_ACK)) {
+    xmodem_send_prepare(xe);
+    return;
+  }
+
+  if (op->type != XMODEM_IO_READ)
+    return;
+
+  xe->reading = false;
+  if (len < 0) {
+    xmodem_engine_status(xe, "\nError Reading File\n");
+    xmodem_engine_finish(xe, false);
+    return;
+  }
+
+  idx = (op->buf == xe->alt) ? 1 : 0;
+  if (len == 0) {
+    xe->eof = true;
   } else {
-    attempts = 0;
-    bool timeout = false;
-    do {
-      serial_write_char(EOT);
-      attempts++;
-      retval = readchar(&c);
-      switch (retval) {
-      case SERIAL_RET_OK:
-        break;
-      case SERIAL_RET_ABORT:
-        goto finish_error;
-      case SERIAL_RET_TIMEOUT:
-        timeout = true;
-        break;
-      }
-    } while ((c != ACK) && (attempts != RETRYMAX) &&
-      (timeout == false));
-    if (attempts == RETRYMAX)
-      emits("\nNo Acknowledgment Of End Of File\n");
-  };
-  return TRUE;
-error:
-  Close(fh);
-finish_error:
-  return FALSE;
+    /* Digest the file as it's read; no second pass needed */
+    xe->file_crc = crc32_update(xe->file_crc, op->buf, len);
+    xe->file_len += len;
+
+    /* Blank the rest of the buffer out so we can bulk send */
+    if (len < XMODEM_BUFSIZE)
+      memset(op->buf + len, 0, XMODEM_BUFSIZE - len);
+    xe->fill[idx] = len;
+  }
+
+  if (xe->state == XS_READ)
+    xmodem_send_next_buf(xe);
+  else
+    xmodem_send_prepare(xe);
 }
@@ -0,0 +1,607 @@
+/*
+ * serfsd - serve a directory to the serfs handler over a serial line.
+ *
+ *   serfsd [-v] [-b baud] (-l device | -p) directory
+ *
+ * -l uses a serial port; -p makes a pseudo terminal and prints its
+ * name, for an emulator's serial port (or a test) to connect to.
+ *
+ * See ../src/serfs_proto.h for the protocol.
+ */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "amigaterm_crc.h"
+#include "serfs_proto.h"
+
+/* Unix time of the AmigaDOS epoch, 1 Jan 1978 */
+#define AMIGA_EPOCH 252460800L
+
+/* Give up on a frame that stops part way through after this long */
+#define FRAME_TIMEOUT_MS 2000
+
+static const char *root;
+static int verbose;
+static int line_fd = -1;
+
+static unsigned char rx[SERFS_MAXPAYLOAD + 2];
+static unsigned char reply[SERFS_HDRLEN + SERFS_MAXPAYLOAD + 2];
+static int reply_len;
+static int last_seq = -1, last_type = -1;
+
+static speed_t
+baud_speed(long baud)
+{
+  switch (baud) {
+  case 1200: return B1200;
+  case 2400: return B2400;
+  case 4800: return B4800;
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  default: return 0;
+  }
+}
+
+static int
+line_raw(int fd, long baud)
+{
+  struct termios t;
+  speed_t speed = baud_speed(baud);
+
+  if (speed == 0) {
+    fprintf(stderr, "serfsd: unsupported baud rate %ld\n", baud);
+    return -1;
+  }
+  if (tcgetattr(fd, &t) < 0)
+    return -1;
+  cfmakeraw(&t);
+  t.c_cflag |= CLOCAL | CREAD;
+  cfsetispeed(&t, speed);
+  cfsetospeed(&t, speed);
+  return tcsetattr(fd, TCSANOW, &t);
+}
+
+static int
+line_open_pty(void)
+{
+  int fd, slave;
+  char *name;
+
+  if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) < 0 ||
+      unlockpt(fd) < 0 || (name = ptsname(fd)) == NULL)
+    return -1;
+
+  /*
+   * The slave end has the line discipline; make it raw, and hold it
+   * open so the master doesn't see a hangup between connections.
+   */
+  if ((slave = open(name, O_RDWR | O_NOCTTY)) < 0)
+    return -1;
+  if (line_raw(slave, 9600) < 0)
+    return -1;
+  printf("%s\n", name);
+  fflush(stdout);
+  return fd;
+}
+
+/*
+ * Read exactly len bytes; -1 if they don't turn up in time (or at
+ * all, with a timeout of -1.)
+ */
+static int
+line_read(unsigned char *buf, int len, int timeout_ms)
+{
+  struct pollfd pfd;
+  int got = 0, n;
+
+  while (got < len) {
+    pfd.fd = line_fd;
+    pfd.events = POLLIN;
+    n = poll(&pfd, 1, timeout_ms);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    n = read(line_fd, buf + got, len - got);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (n <= 0)
+      return -1;
+    got += n;
+  }
+  return 0;
+}
+
+static void
+line_write(const unsigned char *buf, int len)
+{
+  int n;
+
+  while (len > 0) {
+    n = write(line_fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("serfsd: write");
+      exit(1);
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+static int
+serfs_errno(int e)
+{
+  switch (e) {
+  case ENOENT: return SERFS_ENOENT;
+  case EEXIST: return SERFS_EEXIST;
+  case ENOTDIR: return SERFS_ENOTDIR;
+  case EISDIR: return SERFS_EISDIR;
+  case ENOTEMPTY: return SERFS_ENOTEMPTY;
+  case ENOSPC:
+  case EDQUOT: return SERFS_ENOSPC;
+  case EACCES:
+  case EPERM:
+  case EROFS: return SERFS_EACCES;
+  case EINVAL:
+  case ENAMETOOLONG: return SERFS_EINVAL;
+  default: return SERFS_EIO;
+  }
+}
+
+/*
+ * Map a request path onto the host, matching each component without
+ * regard to case.  With create set the last one needn't exist yet.
+ */
+static int
+resolve(const char *path, char *out, size_t outlen, int create)
+{
+  char comp[SERFS_NAMEMAX + 1];
+  const char *p = path, *e;
+  struct dirent *de;
+  struct stat st;
+  size_t len, n;
+  DIR *dir;
+  int found;
+
+  if (snprintf(out, outlen, "%s", root) >= (int) outlen)
+    return SERFS_EINVAL;
+
+  while (*p != '\0') {
+    e = strchr(p, '/');
+    n = (e == NULL) ? strlen(p) : (size_t) (e - p);
+    if (n == 0 || n > SERFS_NAMEMAX)
+      return SERFS_EINVAL;
+    memcpy(comp, p, n);
+    comp[n] = '\0';
+    if (strcmp(comp, ".") == 0 || strcmp(comp, "..") == 0 ||
+        strchr(comp, ':') != NULL)
+      return SERFS_EINVAL;
+
+    if (stat(out, &st) < 0)
+      return serfs_errno(errno);
+    if (!S_ISDIR(st.st_mode))
+      return SERFS_ENOTDIR;
+
+    len = strlen(out);
+    if (len + 1 + n + 1 > outlen)
+      return SERFS_EINVAL;
+    out[len] = '/';
+    strcpy(out + len + 1, comp);
+
+    if (lstat(out, &st) < 0) {
+      /* Not there as given; try it in any case */
+      out[len] = '\0';
+      found = 0;
+      if ((dir = opendir(out)) != NULL) {
+        while ((de = readdir(dir)) != NULL) {
+          if (strcasecmp(de->d_name, comp) == 0) {
+            strcpy(comp, de->d_name);
+            found = 1;
+            break;
+          }
+        }
+        closedir(dir);
+      }
+      out[len] = '/';
+      strcpy(out + len + 1, comp);
+      if (!found && !(create && e == NULL))
+        return SERFS_ENOENT;
+    }
+    p = (e == NULL) ? p + n : e + 1;
+  }
+  return SERFS_OK;
+}
+
+/*
+ * Append an attr for file (named name) at p; returns its length, or
+ * 0 for something that can't be shown (devices, sockets...)
+ */
+static int
+attr_encode(unsigned char *p, const char *file, const char *name)
+{
+  struct stat st;
+  struct tm tm;
+  time_t t;
+  long secs;
+  int nlen = strlen(name);
+
+  if (stat(file, &st) < 0 || nlen > SERFS_NAMEMAX)
+    return 0;
+  if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+    return 0;
+
+  /* AmigaDOS dates are local time */
+  t = st.st_mtime;
+  localtime_r(&t, &tm);
+  secs = (long) (t + tm.tm_gmtoff) - AMIGA_EPOCH;
+  if (secs < 0)
+    secs = 0;
+
+  p[0] = S_ISDIR(st.st_mode) ? SERFS_T_DIR : SERFS_T_FILE;
+  SERFS_PUT32(p + 1, S_ISDIR(st.st_mode) ? 0 : (unsigned long) st.st_size);
+  SERFS_PUT32(p + 5, secs / 86400);
+  SERFS_PUT32(p + 9, (secs % 86400) / 60);
+  SERFS_PUT32(p + 13, (secs % 60) * 50);
+  p[SERFS_ATTRLEN - 1] = nlen;
+  memcpy(p + SERFS_ATTRLEN, name, nlen);
+  return SERFS_ATTRLEN + nlen;
+}
+
+static const char *
+leaf(const char *path)
+{
+  const char *p = strrchr(path, '/');
+
+  return (p == NULL) ? path : p + 1;
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+  return strcasecmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int
+do_list(const char *path, unsigned long index, unsigned char *out)
+{
+  char file[PATH_MAX], entry[PATH_MAX + SERFS_NAMEMAX + 2];
+  char **names = NULL;
+  struct dirent *de;
+  struct stat st;
+  size_t count = 0, max = 0, i;
+  int err, len = 2, n;
+  DIR *dir;
+
+  if ((err = resolve(path, file, sizeof(file), 0)) != SERFS_OK)
+    return -err;
+  if ((dir = opendir(file)) == NULL)
+    return -serfs_errno(errno);
+
+  while ((de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+        strlen(de->d_name) > SERFS_NAMEMAX || strchr(de->d_name, ':'))
+      continue;
+    /*
+     * Leave out what attr_encode() can't show (FIFOs, sockets,
+     * broken links) here, so they don't take up an index.
+     */
+    if (snprintf(entry, sizeof(entry), "%s/%s", file, de->d_name) >=
+        (int) sizeof(entry) || stat(entry, &st) < 0 ||
+        (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)))
+      continue;
+    if (count == max) {
+      max = max ? max * 2 : 64;
+      names = realloc(names, max * sizeof(*names));
+    }
+    names[count++] = strdup(de->d_name);
+  }
+  closedir(dir);
+
+  /* The handler pages through by index, so keep the order steady */
+  qsort(names, count, sizeof(*names), name_cmp);
+
+  out[1] = 0;
+  for (i = index; i < count; i++) {
+    if (len + SERFS_ATTRLEN + SERFS_NAMEMAX > SERFS_MAXDATA) {
+      out[1] = 1;
+      break;
+    }
+    snprintf(entry, sizeof(entry), "%s/%s", file, names[i]);
+    n = attr_encode(out + len, entry, names[i]);
+    len += n;
+  }
+  for (i = 0; i < count; i++)
+    free(names[i]);
+  free(names);
+  return len;
+}
+
+/*
+ * Carry out a request; builds the reply payload in out and returns
+ * its length.
+ */
+static int
+handle(int type, const unsigned char *p, int len, unsigned char *out)
+{
+  char file[PATH_MAX], file2[PATH_MAX];
+  const char *path, *path2;
+  struct stat st, st2;
+  unsigned long off, count;
+  int plen, fd, err, n;
+  ssize_t r;
+
+  out[0] = SERFS_OK;
+
+  switch (type) {
+  case SERFS_HELLO:
+    out[1] = SERFS_VERSION;
+    return 2;
+
+  case SERFS_STAT:
+  case SERFS_CREATE:
+  case SERFS_DELETE:
+  case SERFS_MKDIR:
+    if (len < 1 || memchr(p, '\0', len) == NULL)
+      break;
+    path = (const char *) p;
+    if (verbose)
+      fprintf(stderr, "%d %s\n", type, path);
+    err = resolve(path, file, sizeof(file), type != SERFS_STAT &&
+        type != SERFS_DELETE);
+    if (err != SERFS_OK) {
+      out[0] = err;
+      return 1;
+    }
+
+    if (type == SERFS_CREATE) {
+      if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        out[0] = serfs_errno(errno);
+        return 1;
+      }
+      close(fd);
+    } else if (type == SERFS_MKDIR) {
+      if (mkdir(file, 0755) < 0) {
+        out[0] = serfs_errno(errno);
+        return 1;
+      }
+    } else if (type == SERFS_DELETE) {
+      if (lstat(file, &st) == 0 && S_ISDIR(st.st_mode))
+        n = rmdir(file);
+      else
+        n = unlink(file);
+      if (n < 0)
+        out[0] = serfs_errno(errno == EEXIST ? ENOTEMPTY : errno);
+      return 1;
+    }
+
+    n = attr_encode(out + 1, file, path[0] ? leaf(file) : "");
+    if (n == 0)
+      out[0] = SERFS_ENOENT;
+    return 1 + n;
+
+  case SERFS_LIST:
+    if (len < 5 || memchr(p + 4, '\0', len - 4) == NULL)
+      break;
+    if (verbose)
+      fprintf(stderr, "LIST %s\n", (const char *) p + 4);
+    n = do_list((const char *) p + 4, SERFS_GET32(p), out);
+    if (n < 0) {
+      out[0] = -n;
+      return 1;
+    }
+    return n;
+
+  case SERFS_READ:
+    if (len < 9 || memchr(p + 8, '\0', len - 8) == NULL)
+      break;
+    off = SERFS_GET32(p);
+    count = SERFS_GET32(p + 4);
+    if (count > SERFS_MAXDATA)
+      count = SERFS_MAXDATA;
+    if (verbose)
+      fprintf(stderr, "READ %s %lu+%lu\n", (const char *) p + 8, off, count);
+    if ((err = resolve((const char *) p + 8, file, sizeof(file), 0)) !=
+        SERFS_OK) {
+      out[0] = err;
+      return 1;
+    }
+    if ((fd = open(file, O_RDONLY)) < 0) {
+      out[0] = serfs_errno(errno);
+      return 1;
+    }
+    r = pread(fd, out + 1, count, off);
+    close(fd);
+    if (r < 0) {
+      out[0] = serfs_errno(errno);
+      return 1;
+    }
+    return 1 + r;
+
+  case SERFS_WRITE:
+    if (len < 5 || memchr(p + 4, '\0', len - 4) == NULL)
+      break;
+    off = SERFS_GET32(p);
+    path = (const char *) p + 4;
+    plen = strlen(path) + 1;
+    count = len - 4 - plen;
+    if (verbose)
+      fprintf(stderr, "WRITE %s %lu+%lu\n", path, off, count);
+    if ((err = resolve(path, file, sizeof(file), 0)) != SERFS_OK) {
+      out[0] = err;
+      return 1;
+    }
+    if ((fd = open(file, O_WRONLY)) < 0) {
+      out[0] = serfs_errno(errno);
+      return 1;
+    }
+    r = pwrite(fd, p + 4 + plen, count, off);
+    if (r >= 0 && (unsigned long) r != count)
+      errno = ENOSPC;
+    if (r < 0 || (unsigned long) r != count)
+      out[0] = serfs_errno(errno);
+    close(fd);
+    return 1;
+
+  case SERFS_RENAME:
+    path = (const char *) p;
+    if (len < 2 || memchr(p, '\0', len) == NULL)
+      break;
+    plen = strlen(path) + 1;
+    path2 = path + plen;
+    if (plen >= len || memchr(path2, '\0', len - plen) == NULL)
+      break;
+    if (verbose)
+      fprintf(stderr, "RENAME %s %s\n", path, path2);
+    if ((err = resolve(path, file, sizeof(file), 0)) != SERFS_OK ||
+        (err = resolve(path2, file2, sizeof(file2), 1)) != SERFS_OK) {
+      out[0] = err;
+      return 1;
+    }
+    /* Renaming over something else isn't allowed; changing case is */
+    if (lstat(file2, &st2) == 0 && (lstat(file, &st) < 0 ||
+        st.st_ino != st2.st_ino || st.st_dev != st2.st_dev)) {
+      out[0] = SERFS_EEXIST;
+      return 1;
+    }
+    /* The new name as given, not as some existing file has it */
+    strcpy((char *) leaf(file2), leaf(path2));
+    if (rename(file, file2) < 0)
+      out[0] = serfs_errno(errno);
+    return 1;
+  }
+
+  out[0] = SERFS_EINVAL;
+  return 1;
+}
+
+static void
+send_reply(int type, int seq, const unsigned char *payload, int len)
+{
+  unsigned short crc;
+
+  reply[0] = SERFS_SYNC;
+  reply[1] = type | SERFS_REPLY;
+  reply[2] = seq;
+  SERFS_PUT16(reply + 3, len);
+  if (payload != reply + SERFS_HDRLEN)
+    memmove(reply + SERFS_HDRLEN, payload, len);
+  crc = crc16_update(0, reply + 1, SERFS_HDRLEN - 1 + len);
+  SERFS_PUT16(reply + SERFS_HDRLEN + len, crc);
+  reply_len = SERFS_HDRLEN + len + 2;
+  line_write(reply, reply_len);
+}
+
+static void
+serve(void)
+{
+  unsigned char hdr[SERFS_HDRLEN];
+  unsigned short crc;
+  int len, n;
+
+  for (;;) {
+    if (line_read(hdr, 1, -1) < 0) {
+      fprintf(stderr, "serfsd: line closed\n");
+      return;
+    }
+    if (hdr[0] != SERFS_SYNC)
+      continue;
+    if (line_read(hdr + 1, SERFS_HDRLEN - 1, FRAME_TIMEOUT_MS) < 0)
+      continue;
+    len = SERFS_GET16(hdr + 3);
+    if (len > SERFS_MAXPAYLOAD)
+      continue;
+    if (line_read(rx, len + 2, FRAME_TIMEOUT_MS) < 0)
+      continue;
+    crc = crc16_update(0, hdr + 1, SERFS_HDRLEN - 1);
+    crc = crc16_update(crc, rx, len);
+    if (crc != SERFS_GET16(rx + len)) {
+      if (verbose)
+        fprintf(stderr, "bad frame\n");
+      continue;
+    }
+
+    /* A resend: the reply went astray, not the request */
+    if (hdr[1] == last_type && hdr[2] == last_seq &&
+        hdr[1] != SERFS_HELLO) {
+      if (verbose)
+        fprintf(stderr, "resend %d\n", last_seq);
+      line_write(reply, reply_len);
+      continue;
+    }
+
+    n = handle(hdr[1], rx, len, reply + SERFS_HDRLEN);
+    send_reply(hdr[1], hdr[2], reply + SERFS_HDRLEN, n);
+    last_type = hdr[1];
+    last_seq = hdr[2];
+  }
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr,
+      "usage: serfsd [-v] [-b baud] (-l device | -p) directory\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *device = NULL;
+  long baud = 9600;
+  int pty = 0, c;
+
+  while ((c = getopt(argc, argv, "b:l:pv")) != -1) {
+    switch (c) {
+    case 'b':
+      baud = atol(optarg);
+      break;
+    case 'l':
+      device = optarg;
+      break;
+    case 'p':
+      pty = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1 || (device == NULL) == (pty == 0))
+    usage();
+  root = argv[optind];
+
+  if (pty)
+    line_fd = line_open_pty();
+  else if ((line_fd = open(device, O_RDWR | O_NOCTTY)) >= 0 &&
+      line_raw(line_fd, baud) < 0)
+    line_fd = -1;
+  if (line_fd < 0) {
+    perror("serfsd");
+    return 1;
+  }
+
+  serve();
+  return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * serfs - a filing system handler for a directory served by a host
+ * over a serial line.
+ *
+ * This follows the skeleton in lib/testlib: no startup code, SysBase
+ * picked up from location 4, and DEBUG builds talk through KPrintF.
+ * It's started by Mount (GlobVec = -1) as a plain C process and gets
+ * its startup packet on the process message port.  See the README
+ * for a mountlist entry.
+ */
+#include <proto/exec.h>
+#include <proto/dos.h>
+#include <exec/memory.h>
+#include <dos/dosextens.h>
+#include <dos/filehandler.h>
+#include <devices/timer.h>
+#include <clib/alib_protos.h>
+#include <string.h>
+#include <stdbool.h>
+
+#if DEBUG
+#include <clib/debug_protos.h>
+#endif
+
+#include "serfs_proto.h"
+#include "serfs_link.h"
+#include "serfs_cache.h"
+#include "serfs_packet.h"
+
+#define SERFS_VOLNAME "Host"
+#define SERFS_DEFAULT_BAUD 9600
+
+/* Dirty blocks go to the server after this long without a packet */
+#define SERFS_IDLE_MS 1000
+
+struct ExecBase *SysBase;
+struct DosLibrary *DOSBase;
+
+static struct MsgPort *idle_port;
+static struct timerequest *idle_req;
+static bool idle_open, idle_pending;
+
+static int serfs_main(void);
+
+int __attribute__((no_reorder)) _start()
+{
+  return serfs_main();
+}
+
+static struct DosPacket *
+packet_get(struct MsgPort *port)
+{
+  struct Message *msg = GetMsg(port);
+
+  return (msg == NULL) ? NULL : (struct DosPacket *) msg->mn_Node.ln_Name;
+}
+
+static bool
+idle_init(void)
+{
+  idle_port = CreatePort(NULL, 0);
+  if (idle_port == NULL)
+    return false;
+  idle_req = (struct timerequest *) CreateExtIO(idle_port,
+      sizeof(struct timerequest));
+  if (idle_req == NULL)
+    return false;
+  if (OpenDevice((CONST_STRPTR) TIMERNAME, UNIT_VBLANK,
+      (struct IORequest *) idle_req, 0))
+    return false;
+  idle_open = true;
+  return true;
+}
+
+static void
+idle_close(void)
+{
+  if (idle_pending) {
+    AbortIO((struct IORequest *) idle_req);
+    WaitIO((struct IORequest *) idle_req);
+  }
+  if (idle_open)
+    CloseDevice((struct IORequest *) idle_req);
+  if (idle_req != NULL)
+    DeleteExtIO((struct IORequest *) idle_req);
+  if (idle_port != NULL)
+    DeletePort(idle_port);
+}
+
+static void
+idle_start(void)
+{
+  idle_req->tr_node.io_Command = TR_ADDREQUEST;
+  idle_req->tr_time.tv_secs = SERFS_IDLE_MS / 1000;
+  idle_req->tr_time.tv_micro = (SERFS_IDLE_MS % 1000) * 1000;
+  SendIO((struct IORequest *) idle_req);
+  idle_pending = true;
+}
+
+/*
+ * Put our volume on the DOS device list so it shows up as "Host:".
+ */
+static bool
+volume_add(void)
+{
+  struct RootNode *root = (struct RootNode *) DOSBase->dl_Root;
+  struct DosInfo *di = BADDR(root->rn_Info);
+  struct DeviceList *vol;
+  UBYTE *name;
+
+  vol = AllocMem(sizeof(struct DeviceList) + sizeof(SERFS_VOLNAME) + 1,
+      MEMF_PUBLIC | MEMF_CLEAR);
+  if (vol == NULL)
+    return false;
+
+  /* The BSTR name goes straight after it; it's longword aligned */
+  name = (UBYTE *) (vol + 1);
+  name[0] = sizeof(SERFS_VOLNAME) - 1;
+  memcpy(name + 1, SERFS_VOLNAME, sizeof(SERFS_VOLNAME) - 1);
+
+  vol->dl_Type = DLT_VOLUME;
+  vol->dl_Task = serfs_port;
+  vol->dl_DiskType = ID_DOS_DISK;
+  vol->dl_Name = MKBADDR(name);
+  DateStamp(&vol->dl_VolumeDate);
+
+  Forbid();
+  vol->dl_Next = di->di_DevInfo;
+  di->di_DevInfo = MKBADDR(vol);
+  Permit();
+
+  serfs_volume = vol;
+  return true;
+}
+
+static void
+volume_remove(void)
+{
+  struct RootNode *root = (struct RootNode *) DOSBase->dl_Root;
+  struct DosInfo *di = BADDR(root->rn_Info);
+  BPTR *link;
+
+  if (serfs_volume == NULL)
+    return;
+
+  Forbid();
+  for (link = &di->di_DevInfo; *link != 0;
+      link = &((struct DeviceList *) BADDR(*link))->dl_Next) {
+    if (BADDR(*link) == serfs_volume) {
+      *link = serfs_volume->dl_Next;
+      break;
+    }
+  }
+  Permit();
+
+  FreeMem(serfs_volume, sizeof(struct DeviceList) +
+      sizeof(SERFS_VOLNAME) + 1);
+  serfs_volume = NULL;
+}
+
+static int
+serfs_main(void)
+{
+  struct Process *proc;
+  struct DosPacket *pkt;
+  struct DeviceNode *dn;
+  struct FileSysStartupMsg *fssm;
+  struct DosEnvec *de;
+  unsigned long baud = SERFS_DEFAULT_BAUD;
+  int buffers = 0;
+  char device[32];
+  UBYTE *bdev;
+  unsigned int len;
+  unsigned char hello[2];
+  bool running = true;
+
+  /* !!! required !!! save a pointer to exec */
+  SysBase = *(struct ExecBase **)4UL;
+
+  proc = (struct Process *) FindTask(NULL);
+  serfs_port = &proc->pr_MsgPort;
+
+  /* The first packet tells us which device node we're running for */
+  WaitPort(serfs_port);
+  pkt = packet_get(serfs_port);
+
+  DOSBase = (struct DosLibrary *) OpenLibrary((CONST_STRPTR) "dos.library",
+      0);
+  if (DOSBase == NULL) {
+    serfs_reply(pkt, DOSFALSE, ERROR_NO_FREE_STORE);
+    return 0;
+  }
+
+  dn = BADDR(pkt->dp_Arg3);
+  fssm = BADDR(pkt->dp_Arg2);
+  de = BADDR(fssm->fssm_Environ);
+  if (de->de_TableSize >= DE_NUMBUFFERS)
+    buffers = de->de_NumBuffers;
+  if ((de->de_TableSize >= DE_BAUD) && (de->de_Baud != 0))
+    baud = de->de_Baud;
+  bdev = BADDR(fssm->fssm_Device);
+  len = (bdev[0] < sizeof(device)) ? bdev[0] : sizeof(device) - 1;
+  memcpy(device, bdev + 1, len);
+  device[len] = '\0';
+  serfs_unit = fssm->fssm_Unit;
+
+#if DEBUG
+  KPrintF((CONST_STRPTR) "serfs: %s unit %ld at %ld\n", device,
+      serfs_unit, baud);
+#endif
+
+  /* Flags = 1 in the mountlist turns on RTS/CTS */
+  if ((serfs_link_open(device, serfs_unit, baud, fssm->fssm_Flags & 1) ==
+      false) || (serfs_cache_init(buffers) == false) ||
+      (idle_init() == false) || (volume_add() == false)) {
+    serfs_reply(pkt, DOSFALSE, ERROR_NO_FREE_STORE);
+    goto done;
+  }
+  dn->dn_Task = serfs_port;
+
+  /* The server doesn't have to be there yet */
+  hello[0] = SERFS_VERSION;
+  serfs_call(SERFS_HELLO, hello, 1, hello, sizeof(hello));
+
+  serfs_reply(pkt, DOSTRUE, 0);
+
+  while (running) {
+    Wait((1L << serfs_port->mp_SigBit) | (1L << idle_port->mp_SigBit));
+
+    if (idle_pending && CheckIO((struct IORequest *) idle_req)) {
+      WaitIO((struct IORequest *) idle_req);
+      idle_pending = false;
+      serfs_flush(NULL);
+    }
+
+    while (running && ((pkt = packet_get(serfs_port)) != NULL))
+      running = serfs_packet(pkt);
+
+    if (running && serfs_dirty() && (idle_pending == false))
+      idle_start();
+  }
+
+  dn->dn_Task = NULL;
+
+done:
+  volume_remove();
+  idle_close();
+  serfs_cache_free();
+  serfs_link_close();
+
+  /*
+   * Reply to ACTION_DIE last, under Forbid() so we're gone before
+   * anyone can unload us.
+   */
+  Forbid();
+  if (running == false)
+    serfs_reply(pkt, DOSTRUE, 0);
+  CloseLibrary((struct Library *) DOSBase);
+  return 0;
+}
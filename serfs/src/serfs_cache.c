@@ -0,0 +1,876 @@
+/*
+ * The handler's cache of the server's files.
+ *
+ * Every file or directory the handler has looked at gets a node,
+ * keyed by path (compared without regard to case.)  A node keeps
+ * the object's attributes and, for a directory, its listing; a
+ * name looked up in a directory whose listing is here is answered
+ * from that, found or not, without asking the server.
+ *
+ * File data lives in a pool of SERFS_BLKSIZE blocks, recycled least
+ * recently used first.  A miss reads ahead: a reader which keeps
+ * missing on the block after the last fetch gets twice as many
+ * blocks each time, up to what fits in one reply.  Writes only go
+ * into the blocks; dirty blocks go to the server (runs of them in
+ * one request) when they're needed for something else, when the
+ * file is closed or flushed, or when the handler is idle.
+ *
+ * Nothing is revalidated against the server, so this assumes the
+ * served directory isn't changed behind the handler's back (see
+ * serfs_drop().)
+ */
+#include "exec/memory.h"          // for MEMF_CLEAR, MEMF_PUBLIC
+#include "proto/exec.h"           // for AllocMem, FreeMem
+#include "exec/types.h"           // for FALSE, TRUE, UBYTE, CONST_STRPTR
+#include <stddef.h>               // for NULL
+#include <string.h>               // for memcpy, strcpy, strlen, strrchr
+#include <stdbool.h>
+
+#include "serfs_proto.h"
+#include "serfs_link.h"
+#include "serfs_cache.h"
+
+#define SERFS_NODES 32
+#define SERFS_BLKSIZE 1024
+#define SERFS_MIN_BLOCKS 8
+#define SERFS_RA_MAX (SERFS_MAXDATA / SERFS_BLKSIZE)
+
+struct serfs_block {
+  struct serfs_node *node;    /* NULL if free */
+  unsigned long blk;
+  int len;                    /* bytes of the file in here */
+  int dlo, dhi;               /* dirty range; dlo == dhi if clean */
+  unsigned long lru;
+  unsigned char *data;
+};
+
+static struct serfs_node cache_nodes[SERFS_NODES];
+static struct serfs_block *cache_blocks;
+static unsigned char *cache_data;
+static int cache_nblocks;
+static unsigned long cache_clock;
+
+static unsigned char cache_req[SERFS_MAXPAYLOAD];
+static unsigned char cache_rep[SERFS_MAXPAYLOAD];
+
+static int node_flush(struct serfs_node *n);
+
+/* ------------------------------------------------------------------ */
+
+static int
+lower(int c)
+{
+  return ((c >= 'A') && (c <= 'Z')) ? (c + 'a' - 'A') : c;
+}
+
+static bool
+name_eq(const char *a, const char *b)
+{
+  while (*a && (lower(*a) == lower(*b))) {
+    a++;
+    b++;
+  }
+  return (*a == *b) || (lower(*a) == lower(*b));
+}
+
+static const char *
+path_leaf(const char *path)
+{
+  const char *p = strrchr(path, '/');
+
+  return (p == NULL) ? path : p + 1;
+}
+
+static void
+path_parent(const char *path, char *parent)
+{
+  const char *leaf = path_leaf(path);
+  int len = (leaf == path) ? 0 : (leaf - path - 1);
+
+  memcpy(parent, path, len);
+  parent[len] = '\0';
+}
+
+/*
+ * Does path lie at or below dir?
+ */
+static bool
+path_under(const char *path, const char *dir)
+{
+  int len = strlen(dir);
+  char c;
+
+  if ((int) strlen(path) < len)
+    return false;
+  c = path[len];
+  if ((c != '\0') && (c != '/'))
+    return false;
+  while (len-- > 0)
+    if (lower(path[len]) != lower(dir[len]))
+      return false;
+  return true;
+}
+
+/*
+ * Do a request built in cache_req; returns the status, with the
+ * rest of the reply (past the status byte) in cache_rep + 1.
+ */
+static int
+cache_call(int type, int reqlen, int *replen)
+{
+  int len = serfs_call(type, cache_req, reqlen, cache_rep, sizeof(cache_rep));
+
+  if (len < 1)
+    return SERFS_EIO;
+  if (replen != NULL)
+    *replen = len - 1;
+  return cache_rep[0];
+}
+
+static int
+put_path(unsigned char *p, const char *path)
+{
+  int len = strlen(path) + 1;
+
+  memcpy(p, path, len);
+  return len;
+}
+
+static int
+attr_decode(const unsigned char *p, int len, struct serfs_attr *a)
+{
+  int nlen;
+
+  if (len < SERFS_ATTRLEN)
+    return -1;
+  nlen = p[SERFS_ATTRLEN - 1];
+  if ((nlen > SERFS_NAMEMAX) || (len < SERFS_ATTRLEN + nlen))
+    return -1;
+  a->type = p[0];
+  a->size = SERFS_GET32(p + 1);
+  a->days = SERFS_GET32(p + 5);
+  a->mins = SERFS_GET32(p + 9);
+  a->ticks = SERFS_GET32(p + 13);
+  memcpy(a->name, p + SERFS_ATTRLEN, nlen);
+  a->name[nlen] = '\0';
+  return SERFS_ATTRLEN + nlen;
+}
+
+/* ------------------------------------------------------------------ */
+
+bool
+serfs_cache_init(int nblocks)
+{
+  int i;
+
+  if (nblocks < SERFS_MIN_BLOCKS)
+    nblocks = SERFS_MIN_BLOCKS;
+
+  cache_blocks = AllocMem(nblocks * sizeof(struct serfs_block),
+      MEMF_PUBLIC | MEMF_CLEAR);
+  cache_data = AllocMem(nblocks * SERFS_BLKSIZE, MEMF_PUBLIC);
+  if ((cache_blocks == NULL) || (cache_data == NULL)) {
+    serfs_cache_free();
+    return false;
+  }
+  cache_nblocks = nblocks;
+  for (i = 0; i < nblocks; i++)
+    cache_blocks[i].data = cache_data + i * SERFS_BLKSIZE;
+  return true;
+}
+
+static void
+dir_free(struct serfs_node *n)
+{
+  if (n->dir != NULL)
+    FreeMem(n->dir, n->dir_max * sizeof(struct serfs_attr));
+  n->dir = NULL;
+  n->dir_count = n->dir_max = 0;
+}
+
+void
+serfs_cache_free(void)
+{
+  int i;
+
+  for (i = 0; i < SERFS_NODES; i++)
+    dir_free(&cache_nodes[i]);
+  if (cache_blocks != NULL)
+    FreeMem(cache_blocks, cache_nblocks * sizeof(struct serfs_block));
+  if (cache_data != NULL)
+    FreeMem(cache_data, cache_nblocks * SERFS_BLKSIZE);
+  cache_blocks = NULL;
+  cache_data = NULL;
+  cache_nblocks = 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Blocks */
+
+static struct serfs_block *
+block_find(struct serfs_node *n, unsigned long blk)
+{
+  int i;
+
+  for (i = 0; i < cache_nblocks; i++) {
+    if ((cache_blocks[i].node == n) && (cache_blocks[i].blk == blk)) {
+      cache_blocks[i].lru = ++cache_clock;
+      return &cache_blocks[i];
+    }
+  }
+  return NULL;
+}
+
+static struct serfs_block *
+block_alloc(struct serfs_node *n, unsigned long blk)
+{
+  struct serfs_block *b = NULL;
+  int i;
+
+  for (i = 0; i < cache_nblocks; i++) {
+    if (cache_blocks[i].node == NULL) {
+      b = &cache_blocks[i];
+      break;
+    }
+    if ((b == NULL) || (cache_blocks[i].lru < b->lru))
+      b = &cache_blocks[i];
+  }
+
+  /* Write behind catches up when its blocks are wanted back */
+  if ((b->node != NULL) && (b->dlo != b->dhi))
+    node_flush(b->node);
+
+  b->node = n;
+  b->blk = blk;
+  b->len = 0;
+  b->dlo = b->dhi = 0;
+  b->lru = ++cache_clock;
+  return b;
+}
+
+static void
+blocks_drop(struct serfs_node *n)
+{
+  int i;
+
+  for (i = 0; i < cache_nblocks; i++)
+    if (cache_blocks[i].node == n)
+      cache_blocks[i].node = NULL;
+}
+
+static bool
+node_dirty(struct serfs_node *n)
+{
+  int i;
+
+  for (i = 0; i < cache_nblocks; i++)
+    if ((cache_blocks[i].node == n) &&
+        (cache_blocks[i].dlo != cache_blocks[i].dhi))
+      return true;
+  return false;
+}
+
+bool
+serfs_dirty(void)
+{
+  int i;
+
+  for (i = 0; i < cache_nblocks; i++)
+    if ((cache_blocks[i].node != NULL) &&
+        (cache_blocks[i].dlo != cache_blocks[i].dhi))
+      return true;
+  return false;
+}
+
+/* ------------------------------------------------------------------ */
+/* Nodes and directory listings */
+
+static struct serfs_node *
+node_find(const char *path)
+{
+  int i;
+
+  for (i = 0; i < SERFS_NODES; i++)
+    if (cache_nodes[i].used && name_eq(cache_nodes[i].path, path))
+      return &cache_nodes[i];
+  return NULL;
+}
+
+static void
+node_forget(struct serfs_node *n)
+{
+  blocks_drop(n);
+  dir_free(n);
+  n->used = false;
+}
+
+static struct serfs_node *
+node_new(const char *path)
+{
+  struct serfs_node *n = NULL;
+  int i;
+
+  if (strlen(path) >= SERFS_PATHMAX)
+    return NULL;
+
+  for (i = 0; i < SERFS_NODES; i++) {
+    if (cache_nodes[i].used == false) {
+      n = &cache_nodes[i];
+      break;
+    }
+    if ((cache_nodes[i].refs == 0) && ((n == NULL) ||
+        (cache_nodes[i].lru < n->lru)))
+      n = &cache_nodes[i];
+  }
+  if (n == NULL)
+    return NULL;
+
+  if (n->used) {
+    node_flush(n);
+    node_forget(n);
+  }
+  memset(n, 0, sizeof(*n));
+  n->used = true;
+  strcpy(n->path, path);
+  n->lru = ++cache_clock;
+  n->ra_blocks = 1;
+  return n;
+}
+
+static struct serfs_node *
+dir_node(const char *path)
+{
+  char parent[SERFS_PATHMAX];
+  struct serfs_node *d;
+
+  path_parent(path, parent);
+  d = node_find(parent);
+  return ((d != NULL) && (d->dir != NULL)) ? d : NULL;
+}
+
+static struct serfs_attr *
+dir_lookup(struct serfs_node *d, const char *name)
+{
+  int i;
+
+  for (i = 0; i < d->dir_count; i++)
+    if (name_eq(d->dir[i].name, name))
+      return &d->dir[i];
+  return NULL;
+}
+
+static bool
+dir_grow(struct serfs_node *d)
+{
+  struct serfs_attr *dir;
+  int max = (d->dir_max == 0) ? 16 : d->dir_max * 2;
+
+  dir = AllocMem(max * sizeof(struct serfs_attr), MEMF_PUBLIC);
+  if (dir == NULL)
+    return false;
+  if (d->dir != NULL) {
+    memcpy(dir, d->dir, d->dir_count * sizeof(struct serfs_attr));
+    FreeMem(d->dir, d->dir_max * sizeof(struct serfs_attr));
+  }
+  d->dir = dir;
+  d->dir_max = max;
+  return true;
+}
+
+/*
+ * Keep a cached listing in step with a change made through us.
+ */
+static void
+dir_set(const char *path, const struct serfs_attr *a)
+{
+  struct serfs_node *d = dir_node(path);
+  struct serfs_attr *e;
+
+  if (d == NULL)
+    return;
+  if ((e = dir_lookup(d, path_leaf(path))) == NULL) {
+    if ((d->dir_count == d->dir_max) && (dir_grow(d) == false)) {
+      /* Fetch it again next time rather than have it wrong */
+      dir_free(d);
+      return;
+    }
+    e = &d->dir[d->dir_count++];
+  }
+  *e = *a;
+}
+
+static void
+dir_remove(const char *path)
+{
+  struct serfs_node *d = dir_node(path);
+  struct serfs_attr *e;
+
+  if ((d == NULL) || ((e = dir_lookup(d, path_leaf(path))) == NULL))
+    return;
+  *e = d->dir[--d->dir_count];
+}
+
+int
+serfs_list(struct serfs_node *n)
+{
+  unsigned long index = 0;
+  int err, len, off, used;
+  bool more = true;
+
+  if (n->dir != NULL)
+    return SERFS_OK;
+  if (n->attr.type != SERFS_T_DIR)
+    return SERFS_ENOTDIR;
+
+  while (more) {
+    SERFS_PUT32(cache_req, index);
+    len = 4 + put_path(cache_req + 4, n->path);
+    if ((err = cache_call(SERFS_LIST, len, &len)) != SERFS_OK)
+      goto error;
+    if (len < 1) {
+      err = SERFS_EIO;
+      goto error;
+    }
+    more = cache_rep[1];
+    for (off = 1; off < len; off += used) {
+      if ((n->dir_count == n->dir_max) && (dir_grow(n) == false)) {
+        err = SERFS_ENOMEM;
+        goto error;
+      }
+      used = attr_decode(cache_rep + 1 + off, len - off,
+          &n->dir[n->dir_count]);
+      if (used < 0) {
+        err = SERFS_EIO;
+        goto error;
+      }
+      n->dir_count++;
+      index++;
+    }
+  }
+
+  /* An empty directory still needs something to show it's listed */
+  if ((n->dir == NULL) && (dir_grow(n) == false))
+    return SERFS_ENOMEM;
+  return SERFS_OK;
+
+error:
+  dir_free(n);
+  return err;
+}
+
+static int
+lookup(const char *path, struct serfs_attr *a)
+{
+  struct serfs_node *d;
+  struct serfs_attr *e;
+  int err, len;
+
+  if ((path[0] != '\0') && ((d = dir_node(path)) != NULL)) {
+    if ((e = dir_lookup(d, path_leaf(path))) == NULL)
+      return SERFS_ENOENT;
+    *a = *e;
+    return SERFS_OK;
+  }
+
+  len = put_path(cache_req, path);
+  if ((err = cache_call(SERFS_STAT, len, &len)) != SERFS_OK)
+    return err;
+  if (attr_decode(cache_rep + 1, len, a) < 0)
+    return SERFS_EIO;
+  return SERFS_OK;
+}
+
+int
+serfs_get(const char *path, struct serfs_node **np)
+{
+  struct serfs_node *n = node_find(path);
+  struct serfs_attr a;
+  int err;
+
+  if (n == NULL) {
+    if ((err = lookup(path, &a)) != SERFS_OK)
+      return err;
+    if ((n = node_new(path)) == NULL)
+      return SERFS_ENOMEM;
+    n->attr = a;
+  }
+  n->refs++;
+  n->lru = ++cache_clock;
+  *np = n;
+  return SERFS_OK;
+}
+
+void
+serfs_put(struct serfs_node *n)
+{
+  if (n->refs > 0)
+    n->refs--;
+}
+
+/*
+ * CREATE or MKDIR, which both reply with the new object's attr.
+ */
+static int
+make(int type, const char *path, struct serfs_node **np)
+{
+  struct serfs_node *n = node_find(path);
+  struct serfs_attr a;
+  int err, len;
+
+  len = put_path(cache_req, path);
+  if ((err = cache_call(type, len, &len)) != SERFS_OK)
+    return err;
+  if (attr_decode(cache_rep + 1, len, &a) < 0)
+    return SERFS_EIO;
+
+  if (n != NULL) {
+    /* It's been emptied; anything we had is stale */
+    blocks_drop(n);
+    dir_free(n);
+  } else if ((n = node_new(path)) == NULL)
+    return SERFS_ENOMEM;
+
+  n->attr = a;
+  n->ra_next = 0;
+  n->ra_blocks = 1;
+  n->werr = 0;
+  n->refs++;
+  dir_set(path, &a);
+  *np = n;
+  return SERFS_OK;
+}
+
+int
+serfs_create(const char *path, struct serfs_node **np)
+{
+  return make(SERFS_CREATE, path, np);
+}
+
+int
+serfs_mkdir(const char *path, struct serfs_node **np)
+{
+  return make(SERFS_MKDIR, path, np);
+}
+
+int
+serfs_delete(const char *path)
+{
+  struct serfs_node *n = node_find(path);
+  int err;
+
+  if ((n != NULL) && (n->refs > 0))
+    return SERFS_EBUSY;
+
+  if ((err = cache_call(SERFS_DELETE, put_path(cache_req, path), NULL)) !=
+      SERFS_OK)
+    return err;
+  if (n != NULL)
+    node_forget(n);
+  dir_remove(path);
+  return SERFS_OK;
+}
+
+int
+serfs_rename(const char *from, const char *to)
+{
+  int flen = strlen(from), tlen = strlen(to);
+  struct serfs_node *n;
+  struct serfs_attr a;
+  bool have_attr = false;
+  int err, len, i;
+
+  /* Anything still to be written has to go under the old name */
+  serfs_flush(NULL);
+
+  len = put_path(cache_req, from);
+  len += put_path(cache_req + len, to);
+  if ((err = cache_call(SERFS_RENAME, len, NULL)) != SERFS_OK)
+    return err;
+
+  if ((n = node_find(from)) != NULL) {
+    a = n->attr;
+    have_attr = true;
+  } else if ((n = dir_node(from)) != NULL) {
+    struct serfs_attr *e = dir_lookup(n, path_leaf(from));
+
+    if (e != NULL) {
+      a = *e;
+      have_attr = true;
+    }
+  }
+  dir_remove(from);
+
+  /* Whatever we thought was at the new name is gone */
+  if (((n = node_find(to)) != NULL) && (n->refs == 0))
+    node_forget(n);
+
+  /*
+   * Nodes at or below the old name follow it if something still
+   * refers to them, and are forgotten otherwise.
+   */
+  for (i = 0; i < SERFS_NODES; i++) {
+    n = &cache_nodes[i];
+    if ((n->used == false) || (path_under(n->path, from) == false))
+      continue;
+    if ((n->refs == 0) ||
+        ((int) strlen(n->path) - flen + tlen >= SERFS_PATHMAX)) {
+      node_flush(n);
+      node_forget(n);
+      continue;
+    }
+    memmove(n->path + tlen, n->path + flen, strlen(n->path) - flen + 1);
+    memcpy(n->path, to, tlen);
+  }
+  if ((n = node_find(to)) != NULL)
+    strcpy(n->attr.name, path_leaf(to));
+
+  if (have_attr) {
+    strcpy(a.name, path_leaf(to));
+    dir_set(to, &a);
+  } else if ((n = dir_node(to)) != NULL)
+    dir_free(n);
+  return SERFS_OK;
+}
+
+/* ------------------------------------------------------------------ */
+/* File data */
+
+/*
+ * Read count blocks from blk on into the cache.
+ */
+static int
+fetch(struct serfs_node *n, unsigned long blk, int count)
+{
+  struct serfs_block *b;
+  int err, len, off, i;
+
+  SERFS_PUT32(cache_req, blk * SERFS_BLKSIZE);
+  SERFS_PUT32(cache_req + 4, (unsigned long) count * SERFS_BLKSIZE);
+  len = 8 + put_path(cache_req + 8, n->path);
+  if ((err = cache_call(SERFS_READ, len, &len)) != SERFS_OK)
+    return err;
+
+  for (off = 0, i = 0; (off < len) && (i < count); i++) {
+    if ((b = block_find(n, blk + i)) != NULL) {
+      /* Never overwrite data we haven't written back yet */
+      off += SERFS_BLKSIZE;
+      continue;
+    }
+    b = block_alloc(n, blk + i);
+    b->len = (len - off > SERFS_BLKSIZE) ? SERFS_BLKSIZE : len - off;
+    memcpy(b->data, cache_rep + 1 + off, b->len);
+    off += b->len;
+  }
+  return SERFS_OK;
+}
+
+/*
+ * Fetch blk for a reader, with read ahead if it's been reading
+ * sequentially.
+ */
+static int
+fetch_ahead(struct serfs_node *n, unsigned long blk)
+{
+  unsigned long last = (n->attr.size + SERFS_BLKSIZE - 1) / SERFS_BLKSIZE;
+  int count, err;
+
+  if ((blk == n->ra_next) && (n->ra_blocks < SERFS_RA_MAX))
+    n->ra_blocks *= 2;
+  else if (blk != n->ra_next)
+    n->ra_blocks = 1;
+
+  /* Stop at the end of the file or at a block we already have */
+  for (count = 1; (count < n->ra_blocks) && (blk + count < last); count++)
+    if (block_find(n, blk + count) != NULL)
+      break;
+
+  if ((err = fetch(n, blk, count)) == SERFS_OK)
+    n->ra_next = blk + count;
+  return err;
+}
+
+long
+serfs_read(struct serfs_node *n, unsigned long off, unsigned char *buf,
+    long len, int *err)
+{
+  struct serfs_block *b;
+  unsigned long blk;
+  long done = 0;
+  int boff, count;
+
+  *err = SERFS_OK;
+  if (off >= n->attr.size)
+    return 0;
+  if (len > (long) (n->attr.size - off))
+    len = n->attr.size - off;
+
+  while (done < len) {
+    blk = (off + done) / SERFS_BLKSIZE;
+    boff = (off + done) % SERFS_BLKSIZE;
+    if ((b = block_find(n, blk)) == NULL) {
+      if ((*err = fetch_ahead(n, blk)) != SERFS_OK)
+        return -1;
+      if ((b = block_find(n, blk)) == NULL)
+        break;
+    }
+    count = b->len - boff;
+    if (count > len - done)
+      count = len - done;
+    /* The file's shorter on the server than we thought */
+    if (count <= 0)
+      break;
+    memcpy(buf + done, b->data + boff, count);
+    done += count;
+  }
+  return done;
+}
+
+long
+serfs_write(struct serfs_node *n, unsigned long off,
+    const unsigned char *buf, long len, int *err)
+{
+  struct serfs_block *b;
+  unsigned long blk, start;
+  long done = 0, have;
+  int boff, count;
+
+  *err = SERFS_OK;
+  while (done < len) {
+    blk = (off + done) / SERFS_BLKSIZE;
+    boff = (off + done) % SERFS_BLKSIZE;
+    count = SERFS_BLKSIZE - boff;
+    if (count > len - done)
+      count = len - done;
+
+    if ((b = block_find(n, blk)) == NULL) {
+      start = blk * SERFS_BLKSIZE;
+      have = (n->attr.size > start) ? (long) (n->attr.size - start) : 0;
+      if (have > SERFS_BLKSIZE)
+        have = SERFS_BLKSIZE;
+
+      /* Only part of the file's data here is being replaced */
+      if ((have > 0) && ((boff > 0) || (count < have))) {
+        if ((*err = fetch(n, blk, 1)) != SERFS_OK)
+          return -1;
+        b = block_find(n, blk);
+      }
+      if (b == NULL)
+        b = block_alloc(n, blk);
+    }
+
+    memcpy(b->data + boff, buf + done, count);
+    if (b->dlo == b->dhi) {
+      b->dlo = boff;
+      b->dhi = boff + count;
+    } else {
+      if (boff < b->dlo)
+        b->dlo = boff;
+      if (boff + count > b->dhi)
+        b->dhi = boff + count;
+    }
+    if (boff + count > b->len)
+      b->len = boff + count;
+    done += count;
+  }
+
+  if (off + done > n->attr.size)
+    n->attr.size = off + done;
+  return done;
+}
+
+/*
+ * Write back a node's dirty blocks, lowest first, with runs of
+ * them joined up into one request.
+ */
+static int
+node_flush(struct serfs_node *n)
+{
+  struct serfs_block *b, *first;
+  unsigned long next;
+  int i, hdr, len, err;
+  bool run;
+
+  for (;;) {
+    first = NULL;
+    for (i = 0; i < cache_nblocks; i++) {
+      b = &cache_blocks[i];
+      if ((b->node == n) && (b->dlo != b->dhi) &&
+          ((first == NULL) || (b->blk < first->blk)))
+        first = b;
+    }
+    if (first == NULL)
+      break;
+
+    SERFS_PUT32(cache_req, first->blk * SERFS_BLKSIZE + first->dlo);
+    hdr = 4 + put_path(cache_req + 4, n->path);
+    len = first->dhi - first->dlo;
+    memcpy(cache_req + hdr, first->data + first->dlo, len);
+    run = (first->dhi == SERFS_BLKSIZE);
+    next = first->blk + 1;
+    first->dlo = first->dhi = 0;
+
+    /* Join on the following blocks while the dirty data runs on */
+    while (run && ((b = block_find(n, next)) != NULL) && (b->dlo == 0) &&
+        (b->dhi > 0) && (len + b->dhi <= SERFS_MAXDATA)) {
+      memcpy(cache_req + hdr + len, b->data, b->dhi);
+      len += b->dhi;
+      run = (b->dhi == SERFS_BLKSIZE);
+      b->dlo = b->dhi = 0;
+      next++;
+    }
+
+    if ((err = cache_call(SERFS_WRITE, hdr + len, NULL)) != SERFS_OK)
+      n->werr = err;
+  }
+
+  if (n->attr.type == SERFS_T_FILE)
+    dir_set(n->path, &n->attr);
+  return n->werr;
+}
+
+/*
+ * Write back n's dirty blocks (or everyone's, for NULL.)  Returns
+ * the first write error since the last flush.
+ */
+int
+serfs_flush(struct serfs_node *n)
+{
+  int err = SERFS_OK, i;
+
+  for (i = 0; i < SERFS_NODES; i++) {
+    if ((cache_nodes[i].used == false) ||
+        ((n != NULL) && (n != &cache_nodes[i])))
+      continue;
+    if (node_dirty(&cache_nodes[i]))
+      node_flush(&cache_nodes[i]);
+    if ((n != NULL) && (cache_nodes[i].werr != SERFS_OK)) {
+      err = cache_nodes[i].werr;
+      cache_nodes[i].werr = SERFS_OK;
+    }
+  }
+  return err;
+}
+
+/*
+ * Forget everything we know, for when the served directory's been
+ * changed on the host.
+ */
+void
+serfs_drop(void)
+{
+  struct serfs_node *n;
+  int i;
+
+  serfs_flush(NULL);
+  for (i = 0; i < SERFS_NODES; i++) {
+    n = &cache_nodes[i];
+    if (n->used == false)
+      continue;
+    if (n->refs == 0)
+      node_forget(n);
+    else {
+      blocks_drop(n);
+      dir_free(n);
+    }
+  }
+}
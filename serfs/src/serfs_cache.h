@@ -0,0 +1,59 @@
+#ifndef __SERFS_CACHE_H__
+#define __SERFS_CACHE_H__
+
+#include <stdbool.h>
+
+#include "serfs_proto.h"
+
+/* Errors which never go over the wire */
+#define SERFS_ENOMEM 64
+#define SERFS_EBUSY 65
+
+struct serfs_attr {
+  int type;                   /* SERFS_T_DIR or SERFS_T_FILE */
+  unsigned long size;
+  long days, mins, ticks;
+  char name[SERFS_NAMEMAX + 1];
+};
+
+/* A file or directory on the server we know about */
+struct serfs_node {
+  bool used;
+  char path[SERFS_PATHMAX];
+  struct serfs_attr attr;
+  int refs;                   /* locks and open files */
+  unsigned long lru;
+
+  /* The directory listing, once it's been fetched */
+  struct serfs_attr *dir;
+  int dir_count, dir_max;
+
+  /* Read ahead: the block a sequential reader misses on next */
+  unsigned long ra_next;
+  int ra_blocks;
+
+  int werr;                   /* a write behind failed */
+};
+
+extern bool serfs_cache_init(int nblocks);
+extern void serfs_cache_free(void);
+
+/* These return SERFS_OK or the error */
+extern int serfs_get(const char *path, struct serfs_node **np);
+extern void serfs_put(struct serfs_node *n);
+extern int serfs_list(struct serfs_node *n);
+extern int serfs_create(const char *path, struct serfs_node **np);
+extern int serfs_mkdir(const char *path, struct serfs_node **np);
+extern int serfs_delete(const char *path);
+extern int serfs_rename(const char *from, const char *to);
+
+extern long serfs_read(struct serfs_node *n, unsigned long off,
+    unsigned char *buf, long len, int *err);
+extern long serfs_write(struct serfs_node *n, unsigned long off,
+    const unsigned char *buf, long len, int *err);
+
+extern int serfs_flush(struct serfs_node *n);
+extern bool serfs_dirty(void);
+extern void serfs_drop(void);
+
+#endif
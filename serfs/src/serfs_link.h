@@ -0,0 +1,22 @@
+#ifndef __SERFS_LINK_H__
+#define __SERFS_LINK_H__
+
+#include <stdbool.h>
+
+/* The line to the server (serfs_serial.c) */
+extern bool serfs_link_open(const char *device, unsigned long unit,
+    unsigned long baud, bool hwflow);
+extern void serfs_link_close(void);
+extern void serfs_link_write(const unsigned char *buf, int len);
+extern bool serfs_link_read(unsigned char *buf, int len);
+extern void serfs_link_purge(void);
+
+/*
+ * Do a request and wait for the reply (serfs_rpc.c.)  Returns the
+ * reply payload length, which is at least 1 (the status byte), or
+ * -1 if the server couldn't be reached.
+ */
+extern int serfs_call(int type, const unsigned char *req, int reqlen,
+    unsigned char *rep, int repmax);
+
+#endif
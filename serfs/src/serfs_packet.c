@@ -0,0 +1,548 @@
+/*
+ * The AmigaDOS side: turning packets into cache operations.
+ *
+ * A lock's fl_Key points at its cache node, and a file handle's
+ * fh_Args at a struct serfs_file which does; either holds a
+ * reference on the node while it's open.  The zero lock is the top
+ * of the served directory.
+ */
+#include "dos/dos.h"              // for BPTR, DOSTRUE, ERROR_*
+#include "dos/dosextens.h"        // for DosPacket, FileLock, FileHandle
+#include "exec/memory.h"          // for MEMF_CLEAR, MEMF_PUBLIC
+#include "proto/exec.h"           // for AllocMem, FreeMem, PutMsg
+#include "exec/types.h"           // for FALSE, TRUE, UBYTE, CONST_STRPTR
+#include <stddef.h>               // for NULL
+#include <string.h>               // for memcpy, strcpy, strlen
+#include <stdbool.h>
+
+#include "serfs_proto.h"
+#include "serfs_cache.h"
+#include "serfs_packet.h"
+
+struct serfs_file {
+  struct serfs_node *node;
+  unsigned long pos;
+};
+
+struct MsgPort *serfs_port;
+struct DeviceList *serfs_volume;
+unsigned long serfs_unit;
+
+/* Locks and files handed out */
+static int packet_open;
+
+void
+serfs_reply(struct DosPacket *pkt, LONG res1, LONG res2)
+{
+  struct MsgPort *port = pkt->dp_Port;
+  struct Message *msg = pkt->dp_Link;
+
+  pkt->dp_Res1 = res1;
+  pkt->dp_Res2 = res2;
+  pkt->dp_Port = serfs_port;
+  msg->mn_Node.ln_Name = (char *) pkt;
+  PutMsg(port, msg);
+}
+
+static LONG
+dos_error(int err)
+{
+  switch (err) {
+  case SERFS_ENOENT:
+    return ERROR_OBJECT_NOT_FOUND;
+  case SERFS_EEXIST:
+    return ERROR_OBJECT_EXISTS;
+  case SERFS_ENOTDIR:
+  case SERFS_EISDIR:
+    return ERROR_OBJECT_WRONG_TYPE;
+  case SERFS_ENOTEMPTY:
+    return ERROR_DIRECTORY_NOT_EMPTY;
+  case SERFS_ENOSPC:
+    return ERROR_DISK_FULL;
+  case SERFS_EACCES:
+    return ERROR_WRITE_PROTECTED;
+  case SERFS_EINVAL:
+    return ERROR_INVALID_COMPONENT_NAME;
+  case SERFS_ENOMEM:
+    return ERROR_NO_FREE_STORE;
+  case SERFS_EBUSY:
+    return ERROR_OBJECT_IN_USE;
+  default:
+    /* Can't reach the server */
+    return ERROR_NO_DISK;
+  }
+}
+
+static const char *
+lock_path(BPTR lock)
+{
+  struct FileLock *fl = BADDR(lock);
+
+  return (fl == NULL) ? "" : ((struct serfs_node *) fl->fl_Key)->path;
+}
+
+/*
+ * Work out the server path for name relative to lock.  A leading
+ * "device:" goes back to the top and each empty component ("/" at
+ * the start, or "//") goes up one.
+ */
+static LONG
+path_build(BPTR lock, BSTR bname, char *path)
+{
+  const UBYTE *name = BADDR(bname);
+  int len = (name == NULL) ? 0 : name[0], i, start, plen;
+  const char *s = (const char *) name + 1;
+
+  for (i = 0; i < len; i++) {
+    if (s[i] == ':') {
+      s += i + 1;
+      len -= i + 1;
+      lock = 0;
+      break;
+    }
+  }
+
+  strcpy(path, lock_path(lock));
+  plen = strlen(path);
+
+  for (start = i = 0; i <= len; i++) {
+    if ((i < len) && (s[i] != '/'))
+      continue;
+    if (i == start) {
+      /* Up to the parent, unless this is just the trailing slash */
+      if (i == len)
+        break;
+      if (plen == 0)
+        return ERROR_OBJECT_NOT_FOUND;
+      while ((plen > 0) && (path[plen - 1] != '/'))
+        plen--;
+      if (plen > 0)
+        plen--;
+    } else {
+      if ((i - start > SERFS_NAMEMAX) ||
+          (plen + 1 + (i - start) >= SERFS_PATHMAX))
+        return ERROR_INVALID_COMPONENT_NAME;
+      if (plen > 0)
+        path[plen++] = '/';
+      memcpy(path + plen, s + start, i - start);
+      plen += i - start;
+    }
+    path[plen] = '\0';
+    start = i + 1;
+  }
+  return 0;
+}
+
+static BPTR
+lock_new(struct serfs_node *n, LONG access)
+{
+  struct FileLock *fl;
+
+  fl = AllocMem(sizeof(struct FileLock), MEMF_PUBLIC | MEMF_CLEAR);
+  if (fl == NULL) {
+    serfs_put(n);
+    return 0;
+  }
+  fl->fl_Key = (LONG) n;
+  fl->fl_Access = access;
+  fl->fl_Task = serfs_port;
+  fl->fl_Volume = MKBADDR(serfs_volume);
+  packet_open++;
+  return MKBADDR(fl);
+}
+
+static void
+lock_free(BPTR lock)
+{
+  struct FileLock *fl = BADDR(lock);
+
+  if (fl == NULL)
+    return;
+  serfs_put((struct serfs_node *) fl->fl_Key);
+  FreeMem(fl, sizeof(struct FileLock));
+  packet_open--;
+}
+
+/*
+ * Get the node for lock (which for the zero lock means asking
+ * for the top); drop it again with serfs_put().
+ */
+static int
+lock_get(BPTR lock, struct serfs_node **np)
+{
+  struct FileLock *fl = BADDR(lock);
+
+  if (fl == NULL)
+    return serfs_get("", np);
+  *np = (struct serfs_node *) fl->fl_Key;
+  (*np)->refs++;
+  return SERFS_OK;
+}
+
+static void
+fib_fill(struct FileInfoBlock *fib, const struct serfs_attr *a, bool root)
+{
+  const char *name = a->name;
+  int len;
+
+  if (root)
+    name = (const char *) BADDR(serfs_volume->dl_Name) + 1;
+  len = strlen(name);
+  if (len > SERFS_NAMEMAX)
+    len = SERFS_NAMEMAX;
+
+  fib->fib_DirEntryType = root ? ST_ROOT :
+      ((a->type == SERFS_T_DIR) ? ST_USERDIR : ST_FILE);
+  fib->fib_EntryType = fib->fib_DirEntryType;
+  fib->fib_FileName[0] = len;
+  memcpy(fib->fib_FileName + 1, name, len);
+  fib->fib_FileName[len + 1] = '\0';
+  fib->fib_Protection = 0;
+  fib->fib_Size = (a->type == SERFS_T_DIR) ? 0 : a->size;
+  fib->fib_NumBlocks = (fib->fib_Size + 511) / 512;
+  fib->fib_Date.ds_Days = a->days;
+  fib->fib_Date.ds_Minute = a->mins;
+  fib->fib_Date.ds_Tick = a->ticks;
+  fib->fib_Comment[0] = 0;
+}
+
+/*
+ * fib_DiskKey is the index of the next entry.  If the entry handed
+ * out last has moved (or been deleted, eg by "Delete #?") carry on
+ * from wherever that leaves us.
+ */
+static LONG
+examine_next(struct serfs_node *d, struct FileInfoBlock *fib)
+{
+  long key = fib->fib_DiskKey;
+  char last[SERFS_NAMEMAX + 1];
+  int len, i, err;
+
+  if (d->attr.type != SERFS_T_DIR)
+    return ERROR_OBJECT_WRONG_TYPE;
+  if ((err = serfs_list(d)) != SERFS_OK)
+    return dos_error(err);
+
+  if (key > 0) {
+    len = (UBYTE) fib->fib_FileName[0];
+    if (len > SERFS_NAMEMAX)
+      len = SERFS_NAMEMAX;
+    memcpy(last, fib->fib_FileName + 1, len);
+    last[len] = '\0';
+
+    if ((key > d->dir_count) || strcmp(d->dir[key - 1].name, last)) {
+      for (i = 0; i < d->dir_count; i++)
+        if (strcmp(d->dir[i].name, last) == 0)
+          break;
+      key = (i < d->dir_count) ? i + 1 : key - 1;
+    }
+  }
+
+  if (key >= d->dir_count)
+    return ERROR_NO_MORE_ENTRIES;
+  fib_fill(fib, &d->dir[key], false);
+  fib->fib_DiskKey = key + 1;
+  return 0;
+}
+
+static void
+info_fill(struct InfoData *id)
+{
+  memset(id, 0, sizeof(*id));
+  id->id_UnitNumber = serfs_unit;
+  id->id_DiskState = ID_VALIDATED;
+  /* The host's free space isn't known; don't show the volume as full */
+  id->id_NumBlocks = 0x100000;
+  id->id_NumBlocksUsed = 0;
+  id->id_BytesPerBlock = 512;
+  id->id_DiskType = ID_DOS_DISK;
+  id->id_VolumeNode = MKBADDR(serfs_volume);
+  id->id_InUse = (packet_open > 0) ? DOSTRUE : 0;
+}
+
+static void
+do_open(struct DosPacket *pkt)
+{
+  struct FileHandle *fh = BADDR(pkt->dp_Arg1);
+  char path[SERFS_PATHMAX];
+  struct serfs_file *f;
+  struct serfs_node *n;
+  LONG err;
+
+  if ((err = path_build(pkt->dp_Arg2, pkt->dp_Arg3, path)) != 0) {
+    serfs_reply(pkt, DOSFALSE, err);
+    return;
+  }
+
+  f = AllocMem(sizeof(*f), MEMF_PUBLIC | MEMF_CLEAR);
+  if (f == NULL) {
+    serfs_reply(pkt, DOSFALSE, ERROR_NO_FREE_STORE);
+    return;
+  }
+
+  switch (pkt->dp_Type) {
+  case ACTION_FINDINPUT:
+    err = serfs_get(path, &n);
+    break;
+  case ACTION_FINDUPDATE:
+    err = serfs_get(path, &n);
+    if (err == SERFS_ENOENT)
+      err = serfs_create(path, &n);
+    break;
+  default:
+    if ((serfs_get(path, &n) == SERFS_OK)) {
+      err = (n->refs > 1) ? SERFS_EBUSY : SERFS_OK;
+      serfs_put(n);
+      if (err != SERFS_OK)
+        break;
+    }
+    err = serfs_create(path, &n);
+    break;
+  }
+  if ((err == SERFS_OK) && (n->attr.type != SERFS_T_FILE)) {
+    serfs_put(n);
+    err = SERFS_EISDIR;
+  }
+  if (err != SERFS_OK) {
+    FreeMem(f, sizeof(*f));
+    serfs_reply(pkt, DOSFALSE, dos_error(err));
+    return;
+  }
+
+  f->node = n;
+  fh->fh_Args = (LONG) f;
+  packet_open++;
+  serfs_reply(pkt, DOSTRUE, 0);
+}
+
+static void
+do_seek(struct DosPacket *pkt)
+{
+  struct serfs_file *f = (struct serfs_file *) pkt->dp_Arg1;
+  long pos, old = f->pos;
+
+  switch (pkt->dp_Arg3) {
+  case OFFSET_BEGINNING:
+    pos = pkt->dp_Arg2;
+    break;
+  case OFFSET_END:
+    pos = f->node->attr.size + pkt->dp_Arg2;
+    break;
+  default:
+    pos = f->pos + pkt->dp_Arg2;
+    break;
+  }
+  if ((pos < 0) || (pos > (long) f->node->attr.size)) {
+    serfs_reply(pkt, -1, ERROR_SEEK_ERROR);
+    return;
+  }
+  f->pos = pos;
+  serfs_reply(pkt, old, 0);
+}
+
+/*
+ * Handle a packet.  Returns false once the handler's been told to
+ * go away.
+ */
+bool
+serfs_packet(struct DosPacket *pkt)
+{
+  char path[SERFS_PATHMAX], path2[SERFS_PATHMAX];
+  struct serfs_file *f;
+  struct serfs_node *n;
+  long len;
+  LONG err;
+  int e;
+
+  switch (pkt->dp_Type) {
+  case ACTION_LOCATE_OBJECT:
+    if ((err = path_build(pkt->dp_Arg1, pkt->dp_Arg2, path)) != 0)
+      break;
+    if ((e = serfs_get(path, &n)) != SERFS_OK) {
+      err = dos_error(e);
+      break;
+    }
+    serfs_reply(pkt, lock_new(n, pkt->dp_Arg3), ERROR_NO_FREE_STORE);
+    return true;
+
+  case ACTION_FREE_LOCK:
+    lock_free(pkt->dp_Arg1);
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_COPY_DIR:
+    if ((e = lock_get(pkt->dp_Arg1, &n)) != SERFS_OK) {
+      err = dos_error(e);
+      break;
+    }
+    serfs_reply(pkt, lock_new(n, SHARED_LOCK), ERROR_NO_FREE_STORE);
+    return true;
+
+  case ACTION_PARENT:
+    strcpy(path, lock_path(pkt->dp_Arg1));
+    if (path[0] == '\0') {
+      serfs_reply(pkt, 0, 0);
+      return true;
+    }
+    len = strlen(path);
+    while ((len > 0) && (path[len - 1] != '/'))
+      len--;
+    path[(len > 0) ? len - 1 : 0] = '\0';
+    if ((e = serfs_get(path, &n)) != SERFS_OK) {
+      err = dos_error(e);
+      break;
+    }
+    serfs_reply(pkt, lock_new(n, SHARED_LOCK), ERROR_NO_FREE_STORE);
+    return true;
+
+  case ACTION_SAME_LOCK:
+    serfs_reply(pkt, (strcmp(lock_path(pkt->dp_Arg1),
+        lock_path(pkt->dp_Arg2)) == 0) ? LOCK_SAME : LOCK_DIFFERENT, 0);
+    return true;
+
+  case ACTION_EXAMINE_OBJECT:
+    if ((e = lock_get(pkt->dp_Arg1, &n)) != SERFS_OK) {
+      err = dos_error(e);
+      break;
+    }
+    fib_fill(BADDR(pkt->dp_Arg2), &n->attr, n->path[0] == '\0');
+    ((struct FileInfoBlock *) BADDR(pkt->dp_Arg2))->fib_DiskKey = 0;
+    serfs_put(n);
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_EXAMINE_NEXT:
+    if ((e = lock_get(pkt->dp_Arg1, &n)) != SERFS_OK) {
+      err = dos_error(e);
+      break;
+    }
+    err = examine_next(n, BADDR(pkt->dp_Arg2));
+    serfs_put(n);
+    if (err != 0)
+      break;
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_FINDINPUT:
+  case ACTION_FINDOUTPUT:
+  case ACTION_FINDUPDATE:
+    do_open(pkt);
+    return true;
+
+  case ACTION_READ:
+    f = (struct serfs_file *) pkt->dp_Arg1;
+    len = serfs_read(f->node, f->pos, (unsigned char *) pkt->dp_Arg2,
+        pkt->dp_Arg3, &e);
+    if (len < 0) {
+      serfs_reply(pkt, -1, dos_error(e));
+      return true;
+    }
+    f->pos += len;
+    serfs_reply(pkt, len, 0);
+    return true;
+
+  case ACTION_WRITE:
+    f = (struct serfs_file *) pkt->dp_Arg1;
+    len = serfs_write(f->node, f->pos, (unsigned char *) pkt->dp_Arg2,
+        pkt->dp_Arg3, &e);
+    if (len < 0) {
+      serfs_reply(pkt, -1, dos_error(e));
+      return true;
+    }
+    f->pos += len;
+    serfs_reply(pkt, len, 0);
+    return true;
+
+  case ACTION_SEEK:
+    do_seek(pkt);
+    return true;
+
+  case ACTION_END:
+    f = (struct serfs_file *) pkt->dp_Arg1;
+    /* A write behind that failed gets reported here */
+    e = serfs_flush(f->node);
+    serfs_put(f->node);
+    FreeMem(f, sizeof(*f));
+    packet_open--;
+    serfs_reply(pkt, (e == SERFS_OK) ? DOSTRUE : DOSFALSE,
+        (e == SERFS_OK) ? 0 : dos_error(e));
+    return true;
+
+  case ACTION_DELETE_OBJECT:
+    if ((err = path_build(pkt->dp_Arg1, pkt->dp_Arg2, path)) != 0)
+      break;
+    if ((e = serfs_delete(path)) != SERFS_OK) {
+      err = dos_error(e);
+      break;
+    }
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_RENAME_OBJECT:
+    if (((err = path_build(pkt->dp_Arg1, pkt->dp_Arg2, path)) != 0) ||
+        ((err = path_build(pkt->dp_Arg3, pkt->dp_Arg4, path2)) != 0))
+      break;
+    if ((e = serfs_rename(path, path2)) != SERFS_OK) {
+      err = dos_error(e);
+      break;
+    }
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_CREATE_DIR:
+    if ((err = path_build(pkt->dp_Arg1, pkt->dp_Arg2, path)) != 0)
+      break;
+    if ((e = serfs_mkdir(path, &n)) != SERFS_OK) {
+      err = dos_error(e);
+      break;
+    }
+    serfs_reply(pkt, lock_new(n, EXCLUSIVE_LOCK), ERROR_NO_FREE_STORE);
+    return true;
+
+  case ACTION_DISK_INFO:
+    info_fill(BADDR(pkt->dp_Arg1));
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_INFO:
+    info_fill(BADDR(pkt->dp_Arg2));
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_CURRENT_VOLUME:
+    serfs_reply(pkt, MKBADDR(serfs_volume), 0);
+    return true;
+
+  case ACTION_IS_FILESYSTEM:
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_FLUSH:
+    serfs_flush(NULL);
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_INHIBIT:
+    /* DiskChange; the host side may have changed, so start over */
+    if (pkt->dp_Arg1 != DOSFALSE)
+      serfs_drop();
+    serfs_reply(pkt, DOSTRUE, 0);
+    return true;
+
+  case ACTION_DIE:
+    if (packet_open > 0) {
+      err = ERROR_OBJECT_IN_USE;
+      break;
+    }
+    serfs_flush(NULL);
+    /* The caller replies once everything's been shut down */
+    return false;
+
+  default:
+    err = ERROR_ACTION_NOT_KNOWN;
+    break;
+  }
+
+  serfs_reply(pkt, DOSFALSE, err);
+  return true;
+}
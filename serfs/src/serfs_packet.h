@@ -0,0 +1,13 @@
+#ifndef __SERFS_PACKET_H__
+#define __SERFS_PACKET_H__
+
+#include <stdbool.h>
+
+extern struct MsgPort *serfs_port;
+extern struct DeviceList *serfs_volume;
+extern unsigned long serfs_unit;
+
+extern void serfs_reply(struct DosPacket *pkt, LONG res1, LONG res2);
+extern bool serfs_packet(struct DosPacket *pkt);
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef __SERFS_PROTO_H__
+#define __SERFS_PROTO_H__
+
+/*
+ * The serfs wire protocol, shared by the Amiga handler and the host
+ * server.
+ *
+ * The handler sends a request and waits for its reply; there's only
+ * ever one outstanding.  Each is a frame:
+ *
+ *   SERFS_SYNC, type, seq, payload length (2, big endian), payload,
+ *   CRC-16 of type .. payload (hi, lo)
+ *
+ * A reply has the request's type | SERFS_REPLY and the same seq,
+ * and its payload starts with a status byte.  The handler resends
+ * a request (with the same seq) if the reply doesn't turn up or is
+ * damaged; the server keeps its last reply and sends that again
+ * rather than redoing a request with the seq it just handled.
+ *
+ * Paths are relative to the directory being served, '/' separated,
+ * NUL terminated; "" is the top.  The server matches names without
+ * regard to case, as AmigaDOS does.  All numbers are big endian.
+ *
+ *   HELLO   version (1)             -> status, version (1)
+ *   STAT    path                    -> status, attr
+ *   LIST    index (4), path         -> status, more (1), attr ...
+ *   READ    offset (4), len (4), path -> status, data
+ *   WRITE   offset (4), path, data  -> status
+ *   CREATE  path                    -> status, attr (the file is emptied)
+ *   DELETE  path                    -> status
+ *   RENAME  old path, new path      -> status
+ *   MKDIR   path                    -> status, attr
+ *
+ * An attr is type (1), size (4), then the date as AmigaDOS days,
+ * minutes and ticks (4 each), the name length (1) and the name.
+ * LIST returns as many entries from index on as fit in a reply.
+ */
+
+#define SERFS_VERSION 1
+
+#define SERFS_SYNC 0xa5
+#define SERFS_HDRLEN 5
+#define SERFS_MAXDATA 4096
+#define SERFS_MAXPAYLOAD (SERFS_MAXDATA + SERFS_PATHMAX + 8)
+#define SERFS_PATHMAX 256
+#define SERFS_NAMEMAX 30
+
+#define SERFS_HELLO 1
+#define SERFS_STAT 2
+#define SERFS_LIST 3
+#define SERFS_READ 4
+#define SERFS_WRITE 5
+#define SERFS_CREATE 6
+#define SERFS_DELETE 7
+#define SERFS_RENAME 8
+#define SERFS_MKDIR 9
+#define SERFS_REPLY 0x80
+
+#define SERFS_OK 0
+#define SERFS_ENOENT 1
+#define SERFS_EEXIST 2
+#define SERFS_ENOTDIR 3
+#define SERFS_EISDIR 4
+#define SERFS_ENOTEMPTY 5
+#define SERFS_ENOSPC 6
+#define SERFS_EACCES 7
+#define SERFS_EIO 8
+#define SERFS_EINVAL 9
+
+#define SERFS_T_DIR 1
+#define SERFS_T_FILE 2
+
+/* attr, less the name */
+#define SERFS_ATTRLEN 18
+
+#define SERFS_PUT16(p, v) \
+  do { (p)[0] = (unsigned char) ((v) >> 8); \
+       (p)[1] = (unsigned char) (v); } while (0)
+#define SERFS_PUT32(p, v) \
+  do { (p)[0] = (unsigned char) ((v) >> 24); \
+       (p)[1] = (unsigned char) ((v) >> 16); \
+       (p)[2] = (unsigned char) ((v) >> 8); \
+       (p)[3] = (unsigned char) (v); } while (0)
+#define SERFS_GET16(p) \
+  (((unsigned int) (p)[0] << 8) | (p)[1])
+#define SERFS_GET32(p) \
+  (((unsigned long) (p)[0] << 24) | ((unsigned long) (p)[1] << 16) | \
+   ((unsigned long) (p)[2] << 8) | (p)[3])
+
+#endif
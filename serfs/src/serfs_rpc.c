@@ -0,0 +1,84 @@
+/*
+ * Requests to the server: framing, checking and retries.  See
+ * serfs_proto.h for the frame layout.
+ */
+#include <string.h>               // for memcpy
+#include <stdbool.h>
+
+#include "amigaterm_crc.h"
+#include "serfs_proto.h"
+#include "serfs_link.h"
+
+/* Resends before giving up on the server */
+#define SERFS_RETRIES 4
+
+static unsigned char rpc_seq;
+static unsigned char rpc_tx[SERFS_HDRLEN + SERFS_MAXPAYLOAD + 2];
+static unsigned char rpc_rx[SERFS_MAXPAYLOAD + 2];
+
+/*
+ * Wait for the reply to the current request.  Stale replies (to an
+ * earlier try of the same or a previous request) are skipped.
+ */
+static int
+rpc_recv(int type, unsigned char *rep, int repmax)
+{
+  unsigned char hdr[SERFS_HDRLEN];
+  unsigned short crc;
+  int len;
+
+  for (;;) {
+    do {
+      if (serfs_link_read(hdr, 1) == false)
+        return -1;
+    } while (hdr[0] != SERFS_SYNC);
+
+    if (serfs_link_read(hdr + 1, SERFS_HDRLEN - 1) == false)
+      return -1;
+    len = SERFS_GET16(hdr + 3);
+    if (len > SERFS_MAXPAYLOAD)
+      return -1;
+    if (serfs_link_read(rpc_rx, len + 2) == false)
+      return -1;
+
+    crc = crc16_update(0, hdr + 1, SERFS_HDRLEN - 1);
+    crc = crc16_update(crc, rpc_rx, len);
+    if (crc != SERFS_GET16(rpc_rx + len))
+      return -1;
+
+    if ((hdr[1] == (type | SERFS_REPLY)) && (hdr[2] == rpc_seq))
+      break;
+  }
+
+  if ((len < 1) || (len > repmax))
+    return -1;
+  memcpy(rep, rpc_rx, len);
+  return len;
+}
+
+int
+serfs_call(int type, const unsigned char *req, int reqlen,
+    unsigned char *rep, int repmax)
+{
+  unsigned short crc;
+  int tries, len;
+
+  rpc_seq++;
+  rpc_tx[0] = SERFS_SYNC;
+  rpc_tx[1] = type;
+  rpc_tx[2] = rpc_seq;
+  SERFS_PUT16(rpc_tx + 3, reqlen);
+  memcpy(rpc_tx + SERFS_HDRLEN, req, reqlen);
+  crc = crc16_update(0, rpc_tx + 1, SERFS_HDRLEN - 1 + reqlen);
+  SERFS_PUT16(rpc_tx + SERFS_HDRLEN + reqlen, crc);
+
+  for (tries = 0; tries < SERFS_RETRIES; tries++) {
+    serfs_link_write(rpc_tx, SERFS_HDRLEN + reqlen + 2);
+    len = rpc_recv(type, rep, repmax);
+    if (len > 0)
+      return len;
+    /* Drop whatever's left of a damaged reply before trying again */
+    serfs_link_purge();
+  }
+  return -1;
+}
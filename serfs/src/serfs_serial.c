@@ -0,0 +1,147 @@
+/*
+ * The serial line to the server, and the timer for read timeouts.
+ */
+#include "exec/io.h"              // for IOStdReq, CMD_READ, CMD_WRITE
+#include "exec/ports.h"           // for Message, MsgPort
+#include "proto/exec.h"           // for DoIO, SendIO, WaitIO, AbortIO
+#include "clib/alib_protos.h"     // for CreatePort, CreateExtIO
+#include "devices/serial.h"       // for IOExtSer, SERF_SHARED, SERF_XDISA...
+#include "devices/timer.h"        // for timerequest, TR_ADDREQUEST
+#include "exec/types.h"           // for FALSE, TRUE, UBYTE, CONST_STRPTR
+#include <stddef.h>               // for NULL
+#include <stdbool.h>
+
+#include "serfs_link.h"
+
+/*
+ * How long the server gets to start replying, on top of the time
+ * the bytes take on the wire.
+ */
+#define SERFS_REPLY_MS 2000
+
+static struct MsgPort *ser_port;
+static struct IOExtSer *ser_req;
+static struct MsgPort *ser_timer_port;
+static struct timerequest *ser_timer;
+static bool ser_open, ser_timer_open;
+static unsigned long ser_baud;
+
+bool
+serfs_link_open(const char *device, unsigned long unit, unsigned long baud,
+    bool hwflow)
+{
+  ser_port = CreatePort(NULL, 0);
+  ser_timer_port = CreatePort(NULL, 0);
+  if ((ser_port == NULL) || (ser_timer_port == NULL))
+    goto error;
+
+  ser_req = (struct IOExtSer *) CreateExtIO(ser_port,
+      sizeof(struct IOExtSer));
+  ser_timer = (struct timerequest *) CreateExtIO(ser_timer_port,
+      sizeof(struct timerequest));
+  if ((ser_req == NULL) || (ser_timer == NULL))
+    goto error;
+
+  ser_req->io_SerFlags = SERF_XDISABLED;
+  if (hwflow)
+    ser_req->io_SerFlags |= SERF_7WIRE;
+  if (OpenDevice((CONST_STRPTR) device, unit, (struct IORequest *) ser_req,
+      0))
+    goto error;
+  ser_open = true;
+
+  if (OpenDevice((CONST_STRPTR) TIMERNAME, UNIT_VBLANK,
+      (struct IORequest *) ser_timer, 0))
+    goto error;
+  ser_timer_open = true;
+
+  ser_baud = baud;
+  ser_req->io_Baud = baud;
+  ser_req->io_ReadLen = 8;
+  ser_req->io_WriteLen = 8;
+  ser_req->io_StopBits = 1;
+  ser_req->io_RBufLen = 8192;
+  ser_req->IOSer.io_Command = SDCMD_SETPARAMS;
+  if (DoIO((struct IORequest *) ser_req))
+    goto error;
+  return true;
+
+error:
+  serfs_link_close();
+  return false;
+}
+
+void
+serfs_link_close(void)
+{
+  if (ser_timer_open)
+    CloseDevice((struct IORequest *) ser_timer);
+  if (ser_open)
+    CloseDevice((struct IORequest *) ser_req);
+  if (ser_timer != NULL)
+    DeleteExtIO((struct IORequest *) ser_timer);
+  if (ser_req != NULL)
+    DeleteExtIO((struct IORequest *) ser_req);
+  if (ser_timer_port != NULL)
+    DeletePort(ser_timer_port);
+  if (ser_port != NULL)
+    DeletePort(ser_port);
+  ser_timer_open = ser_open = false;
+  ser_timer = NULL;
+  ser_req = NULL;
+  ser_timer_port = ser_port = NULL;
+}
+
+void
+serfs_link_write(const unsigned char *buf, int len)
+{
+  ser_req->IOSer.io_Command = CMD_WRITE;
+  ser_req->IOSer.io_Data = (APTR) buf;
+  ser_req->IOSer.io_Length = len;
+  DoIO((struct IORequest *) ser_req);
+}
+
+/*
+ * Read exactly len bytes; false if they don't all turn up in time.
+ */
+bool
+serfs_link_read(unsigned char *buf, int len)
+{
+  unsigned long ms;
+  ULONG sigs;
+
+  ms = SERFS_REPLY_MS + ((unsigned long) len * 10 * 1000) / ser_baud;
+
+  ser_req->IOSer.io_Command = CMD_READ;
+  ser_req->IOSer.io_Data = (APTR) buf;
+  ser_req->IOSer.io_Length = len;
+  ser_req->IOSer.io_Flags = 0;
+  SendIO((struct IORequest *) ser_req);
+
+  ser_timer->tr_node.io_Command = TR_ADDREQUEST;
+  ser_timer->tr_time.tv_secs = ms / 1000;
+  ser_timer->tr_time.tv_micro = (ms % 1000) * 1000;
+  SendIO((struct IORequest *) ser_timer);
+
+  sigs = (1L << ser_port->mp_SigBit) | (1L << ser_timer_port->mp_SigBit);
+  while ((CheckIO((struct IORequest *) ser_req) == NULL) &&
+      (CheckIO((struct IORequest *) ser_timer) == NULL))
+    Wait(sigs);
+
+  if (CheckIO((struct IORequest *) ser_req) == NULL)
+    AbortIO((struct IORequest *) ser_req);
+  if (CheckIO((struct IORequest *) ser_timer) == NULL)
+    AbortIO((struct IORequest *) ser_timer);
+  WaitIO((struct IORequest *) ser_timer);
+  WaitIO((struct IORequest *) ser_req);
+
+  return ((ser_req->IOSer.io_Error == 0) &&
+      (ser_req->IOSer.io_Actual == (ULONG) len));
+}
+
+void
+serfs_link_purge(void)
+{
+  ser_req->IOSer.io_Command = CMD_CLEAR;
+  DoIO((struct IORequest *) ser_req);
+}